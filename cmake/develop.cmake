@@ -59,10 +59,17 @@ if(ENABLE_METRIC_JSON)
     message(STATUS "Enable serialize metric to json")
 endif()
 
+option(ENABLE_ALLOC_PROFILE "Count allocations per request phase and route" OFF)
+if(ENABLE_ALLOC_PROFILE)
+    add_definitions(-DCINATRA_ALLOC_PROFILE)
+    message(STATUS "Enable allocation profiler")
+endif()
+
 set(CMAKE_MODULE_PATH "${CMAKE_CURRENT_SOURCE_DIR}/cmake;${CMAKE_MODULE_PATH}")
 
 SET(ENABLE_GZIP OFF)
 SET(ENABLE_BROTLI OFF)
+option(ENABLE_ZSTD "Enable zstd content-encoding" OFF)
 
 if (ENABLE_SSL)
 	add_definitions(-DCINATRA_ENABLE_SSL)
@@ -110,5 +117,13 @@ if (ENABLE_BROTLI)
 	endif (Brotli_FOUND)
 endif(ENABLE_BROTLI)
 
+if (ENABLE_ZSTD)
+	find_package(Zstd REQUIRED)
+	if (ZSTD_FOUND)
+		message(STATUS "Zstd found")
+		add_definitions(-DCINATRA_ENABLE_ZSTD)
+	endif (ZSTD_FOUND)
+endif(ENABLE_ZSTD)
+
 
 add_definitions(-DCORO_HTTP_PRINT_REQ_HEAD)
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cinatra/zstd_codec.hpp"
+#include "cmdline/cmdline.h"
+
+namespace fs = std::filesystem;
+
+// every file is a sample, or every line of a file if by_line is set(e.g. a
+// log which records one json body per line).
+bool load_samples(const fs::path& path, bool by_line,
+                  std::vector<std::string>& samples) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    std::cerr << "open file " << path << " failed\n";
+    return false;
+  }
+
+  if (by_line) {
+    std::string line;
+    while (std::getline(file, line)) {
+      if (!line.empty()) {
+        samples.push_back(std::move(line));
+      }
+    }
+  }
+  else {
+    std::stringstream ss;
+    ss << file.rdbuf();
+    samples.push_back(ss.str());
+  }
+  return true;
+}
+
+/*
+ * eg: -o api.dict -s 65536 ./captured_bodies/
+ */
+int main(int argc, char* argv[]) {
+  cmdline::parser parser;
+  parser.add<std::string>("output", 'o', "output dictionary file", false,
+                          "cinatra.dict");
+  parser.add<size_t>("size", 's', "max size of the dictionary in bytes", false,
+                     112640);
+  parser.add("lines", 'l', "every line of a sample file is a sample");
+  parser.footer("sample files or directories...");
+  parser.parse_check(argc, argv);
+
+  if (parser.rest().empty()) {
+    std::cerr << "lack of samples\n" << parser.usage();
+    return 1;
+  }
+
+  bool by_line = parser.exist("lines");
+  std::vector<std::string> samples;
+  size_t total_size = 0;
+  for (auto& arg : parser.rest()) {
+    std::error_code ec;
+    if (fs::is_directory(arg, ec)) {
+      for (auto& entry : fs::recursive_directory_iterator(arg, ec)) {
+        if (entry.is_regular_file() &&
+            !load_samples(entry.path(), by_line, samples)) {
+          return 1;
+        }
+      }
+    }
+    else if (!load_samples(arg, by_line, samples)) {
+      return 1;
+    }
+  }
+
+  for (auto& sample : samples) {
+    total_size += sample.size();
+  }
+  std::cout << "loaded " << samples.size() << " samples, " << total_size
+            << " bytes\n";
+
+  std::string dict;
+  if (!cinatra::zstd_codec::train_dictionary(samples, dict,
+                                              parser.get<size_t>("size"))) {
+    std::cerr << "train dictionary failed, try more samples or a smaller "
+                 "dictionary size\n";
+    return 1;
+  }
+
+  auto output = parser.get<std::string>("output");
+  std::ofstream out(output, std::ios::binary);
+  if (!out.write(dict.data(), dict.size())) {
+    std::cerr << "write " << output << " failed\n";
+    return 1;
+  }
+
+  std::cout << "dictionary " << output << ", id "
+            << ZDICT_getDictID(dict.data(), dict.size()) << ", "
+            << dict.size() << " bytes\n";
+  return 0;
+}
@@ -222,8 +222,8 @@ async_simple::coro::Lazy<void> static_file_server() {
   std::string files_root_path = "";  // current path
   server.set_static_res_dir(
       virtual_path,
-      files_root_path);  // set this before server start, if you add new files,
-                         // you need restart the server.
+      files_root_path);  // set this before server start, files are looked
+                         // up per request, new files are served at once.
   server.async_start();
   std::this_thread::sleep_for(300ms);  // wait for server start
 
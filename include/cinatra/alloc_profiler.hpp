@@ -0,0 +1,384 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+// with CINATRA_ALLOC_PROFILE (cmake -DENABLE_ALLOC_PROFILE=ON) every
+// allocation is counted for the phase of the request the thread is in and
+// for the route of the request. one translation unit of the program defines
+// CINATRA_ALLOC_PROFILE_IMPL before it includes this file, it gets the
+// counting operator new and delete.
+//
+// a connection marks its phases on its io thread, a coroutine which resumes
+// there after another connection ran is counted in the phase that connection
+// left. the numbers are exact for one connection per io thread, which is
+// what benchmarks and tests use.
+
+namespace cinatra {
+enum class alloc_phase : uint8_t {
+  none,
+  read,
+  parse,
+  route,
+  handler,
+  build_response,
+  write,
+  count,
+};
+
+inline constexpr std::string_view alloc_phase_name(alloc_phase phase) {
+  constexpr std::array<std::string_view, size_t(alloc_phase::count)> names = {
+      "none",    "read",           "parse", "route",
+      "handler", "build_response", "write"};
+  return names[size_t(phase)];
+}
+
+struct alloc_counts {
+  uint64_t allocs = 0;
+  uint64_t bytes = 0;
+};
+
+// the counts of every phase at one time, the difference of two snapshots is
+// what happened between them.
+struct alloc_snapshot {
+  std::array<alloc_counts, size_t(alloc_phase::count)> phases{};
+
+  const alloc_counts &operator[](alloc_phase phase) const {
+    return phases[size_t(phase)];
+  }
+
+  alloc_snapshot operator-(const alloc_snapshot &other) const {
+    alloc_snapshot diff;
+    for (size_t i = 0; i < phases.size(); i++) {
+      diff.phases[i].allocs = phases[i].allocs - other.phases[i].allocs;
+      diff.phases[i].bytes = phases[i].bytes - other.phases[i].bytes;
+    }
+    return diff;
+  }
+};
+
+namespace detail {
+struct alloc_counters {
+  std::array<std::atomic<uint64_t>, size_t(alloc_phase::count)> allocs{};
+  std::array<std::atomic<uint64_t>, size_t(alloc_phase::count)> bytes{};
+
+  void add(alloc_phase phase, size_t size) {
+    allocs[size_t(phase)].fetch_add(1, std::memory_order_relaxed);
+    bytes[size_t(phase)].fetch_add(size, std::memory_order_relaxed);
+  }
+
+  alloc_snapshot snapshot() const {
+    alloc_snapshot snap;
+    for (size_t i = 0; i < snap.phases.size(); i++) {
+      snap.phases[i].allocs = allocs[i].load(std::memory_order_relaxed);
+      snap.phases[i].bytes = bytes[i].load(std::memory_order_relaxed);
+    }
+    return snap;
+  }
+
+  void reset() {
+    for (size_t i = 0; i < allocs.size(); i++) {
+      allocs[i].store(0, std::memory_order_relaxed);
+      bytes[i].store(0, std::memory_order_relaxed);
+    }
+  }
+};
+}  // namespace detail
+
+class alloc_profiler {
+ public:
+  // a pattern route is counted for its pattern, not its urls. the routes
+  // after the first max_routes are counted together.
+  static constexpr size_t max_routes = 1024;
+  static constexpr std::string_view other_route = "other";
+
+  static constexpr bool enabled() {
+#ifdef CINATRA_ALLOC_PROFILE
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // called by the allocation hook.
+  static void on_alloc(size_t size) {
+    if (in_profiler_) {
+      return;
+    }
+    thread_allocs_++;
+    thread_bytes_ += size;
+    total_.add(phase_, size);
+    if (route_ != nullptr) {
+      route_->add(phase_, size);
+    }
+  }
+
+  static void enter(alloc_phase phase) { phase_ = phase; }
+
+  static alloc_phase phase() { return phase_; }
+
+  // count the allocations of this thread for the route key from now on, for
+  // no route if it is empty.
+  static void set_route(std::string_view key) {
+    if (key.empty()) {
+      route_ = nullptr;
+      return;
+    }
+    in_profiler_ = true;
+    {
+      std::lock_guard lock(mtx_);
+      auto it = routes_.find(key);
+      if (it == routes_.end()) {
+        if (routes_.size() >= max_routes) {
+          key = other_route;
+        }
+        it = routes_.try_emplace(std::string(key)).first;
+      }
+      route_ = &it->second;
+    }
+    in_profiler_ = false;
+  }
+
+  // the request is done, the thread belongs to no request until the next one.
+  static void leave() {
+    phase_ = alloc_phase::none;
+    route_ = nullptr;
+  }
+
+  static alloc_snapshot snapshot() { return total_.snapshot(); }
+
+  static alloc_snapshot route_snapshot(std::string_view key) {
+    std::lock_guard lock(mtx_);
+    auto it = routes_.find(key);
+    if (it == routes_.end()) {
+      return {};
+    }
+    return it->second.snapshot();
+  }
+
+  static uint64_t thread_allocs() { return thread_allocs_; }
+
+  static uint64_t thread_bytes() { return thread_bytes_; }
+
+  // the counters of the routes stay, a thread may still point at them.
+  static void reset() {
+    total_.reset();
+    std::lock_guard lock(mtx_);
+    for (auto &[_, route] : routes_) {
+      route.reset();
+    }
+  }
+
+  // the counts in the prometheus text format.
+  static std::string to_string() {
+    std::string str;
+    if (!enabled()) {
+      str.append("# allocation profiling is not enabled, build with ")
+          .append("CINATRA_ALLOC_PROFILE\n");
+      return str;
+    }
+    str.append("# TYPE cinatra_allocs counter\n");
+    str.append("# TYPE cinatra_alloc_bytes counter\n");
+    append_counts(str, {}, total_.snapshot());
+    std::lock_guard lock(mtx_);
+    for (auto &[key, route] : routes_) {
+      append_counts(str, key, route.snapshot());
+    }
+    return str;
+  }
+
+ private:
+  static void append_counts(std::string &str, std::string_view route,
+                            const alloc_snapshot &snap) {
+    for (size_t i = 0; i < snap.phases.size(); i++) {
+      if (snap.phases[i].allocs == 0) {
+        continue;
+      }
+      std::string labels = "{";
+      if (!route.empty()) {
+        labels.append("route=\"").append(route).append("\",");
+      }
+      labels.append("phase=\"")
+          .append(alloc_phase_name(alloc_phase(i)))
+          .append("\"}");
+      str.append("cinatra_allocs")
+          .append(labels)
+          .append(" ")
+          .append(std::to_string(snap.phases[i].allocs))
+          .append("\n");
+      str.append("cinatra_alloc_bytes")
+          .append(labels)
+          .append(" ")
+          .append(std::to_string(snap.phases[i].bytes))
+          .append("\n");
+    }
+  }
+
+  inline static thread_local alloc_phase phase_ = alloc_phase::none;
+  inline static thread_local detail::alloc_counters *route_ = nullptr;
+  inline static thread_local bool in_profiler_ = false;
+  inline static thread_local uint64_t thread_allocs_ = 0;
+  inline static thread_local uint64_t thread_bytes_ = 0;
+  inline static detail::alloc_counters total_;
+  inline static std::mutex mtx_;
+  inline static std::map<std::string, detail::alloc_counters, std::less<>>
+      routes_;
+};
+
+// counts the allocations of the current thread since it was made, for
+// asserting that a code path doesn't allocate.
+class alloc_counter {
+ public:
+  alloc_counter()
+      : allocs_(alloc_profiler::thread_allocs()),
+        bytes_(alloc_profiler::thread_bytes()) {}
+
+  uint64_t allocs() const { return alloc_profiler::thread_allocs() - allocs_; }
+
+  uint64_t bytes() const { return alloc_profiler::thread_bytes() - bytes_; }
+
+ private:
+  uint64_t allocs_;
+  uint64_t bytes_;
+};
+
+// enters a phase and goes back to the previous one at the end of the scope.
+class alloc_phase_scope {
+ public:
+  explicit alloc_phase_scope(alloc_phase phase)
+      : prev_(alloc_profiler::phase()) {
+    alloc_profiler::enter(phase);
+  }
+
+  alloc_phase_scope(const alloc_phase_scope &) = delete;
+  alloc_phase_scope &operator=(const alloc_phase_scope &) = delete;
+
+  ~alloc_phase_scope() { alloc_profiler::enter(prev_); }
+
+ private:
+  alloc_phase prev_;
+};
+}  // namespace cinatra
+
+#ifdef CINATRA_ALLOC_PROFILE
+#define CINATRA_ALLOC_PHASE(phase) \
+  cinatra::alloc_profiler::enter(cinatra::alloc_phase::phase)
+#define CINATRA_ALLOC_PHASE_SCOPE(phase) \
+  cinatra::alloc_phase_scope alloc_phase_scope_(cinatra::alloc_phase::phase)
+#define CINATRA_ALLOC_ROUTE(key) cinatra::alloc_profiler::set_route(key)
+#define CINATRA_ALLOC_LEAVE() cinatra::alloc_profiler::leave()
+#else
+#define CINATRA_ALLOC_PHASE(phase) (void)0
+#define CINATRA_ALLOC_PHASE_SCOPE(phase) (void)0
+#define CINATRA_ALLOC_ROUTE(key) (void)0
+#define CINATRA_ALLOC_LEAVE() (void)0
+#endif
+
+#if defined(CINATRA_ALLOC_PROFILE) && defined(CINATRA_ALLOC_PROFILE_IMPL)
+#include <cstdlib>
+#include <new>
+
+namespace cinatra::detail {
+inline void *profiled_malloc(std::size_t size) noexcept {
+  alloc_profiler::on_alloc(size);
+  return std::malloc(size == 0 ? 1 : size);
+}
+
+inline void *profiled_aligned_malloc(std::size_t size,
+                                     std::align_val_t al) noexcept {
+  alloc_profiler::on_alloc(size);
+  size_t align = std::max(static_cast<size_t>(al), sizeof(void *));
+#if defined(_WIN32)
+  return _aligned_malloc(size == 0 ? 1 : size, align);
+#else
+  void *ptr = nullptr;
+  if (posix_memalign(&ptr, align, size == 0 ? 1 : size) != 0) {
+    return nullptr;
+  }
+  return ptr;
+#endif
+}
+
+inline void profiled_aligned_free(void *ptr) noexcept {
+#if defined(_WIN32)
+  _aligned_free(ptr);
+#else
+  std::free(ptr);
+#endif
+}
+}  // namespace cinatra::detail
+
+void *operator new(std::size_t size) {
+  if (void *ptr = cinatra::detail::profiled_malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) {
+  if (void *ptr = cinatra::detail::profiled_malloc(size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return cinatra::detail::profiled_malloc(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return cinatra::detail::profiled_malloc(size);
+}
+
+void *operator new(std::size_t size, std::align_val_t al) {
+  if (void *ptr = cinatra::detail::profiled_aligned_malloc(size, al)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size, std::align_val_t al) {
+  if (void *ptr = cinatra::detail::profiled_aligned_malloc(size, al)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+  cinatra::detail::profiled_aligned_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  cinatra::detail::profiled_aligned_free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+  cinatra::detail::profiled_aligned_free(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+  cinatra::detail::profiled_aligned_free(ptr);
+}
+#endif
@@ -3,7 +3,6 @@
 #include <brotli/encode.h>
 
 #include <array>
-#include <sstream>
 #include <string>
 #include <string_view>
 
@@ -11,32 +10,80 @@ namespace cinatra::br_codec {
 
 #define BROTLI_BUFFER_SIZE 1024
 
-inline bool brotli_compress(std::string_view input, std::string &output) {
-  auto instance = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
-  std::array<uint8_t, BROTLI_BUFFER_SIZE> buffer;
-  std::stringstream result;
-
-  size_t available_in = input.size(), available_out = buffer.size();
-  const uint8_t *next_in = reinterpret_cast<const uint8_t *>(input.data());
-  uint8_t *next_out = buffer.data();
-
-  do {
-    int ret = BrotliEncoderCompressStream(instance, BROTLI_OPERATION_FINISH,
-                                          &available_in, &next_in,
-                                          &available_out, &next_out, nullptr);
-    if (!ret)
-      return false;
-    result.write(reinterpret_cast<const char *>(buffer.data()),
-                 buffer.size() - available_out);
-    available_out = buffer.size();
-    next_out = buffer.data();
-  } while (!(available_in == 0 && BrotliEncoderIsFinished(instance)));
+inline bool brotli_compress(std::string_view input, std::string &output,
+                            int quality = BROTLI_DEFAULT_QUALITY) {
+  size_t encoded_size = BrotliEncoderMaxCompressedSize(input.size());
+  if (encoded_size == 0) {
+    return false;
+  }
 
-  BrotliEncoderDestroyInstance(instance);
-  output = result.str();
+  output.resize(encoded_size);
+  if (!BrotliEncoderCompress(quality, BROTLI_DEFAULT_WINDOW,
+                             BROTLI_DEFAULT_MODE, input.size(),
+                             reinterpret_cast<const uint8_t *>(input.data()),
+                             &encoded_size,
+                             reinterpret_cast<uint8_t *>(output.data()))) {
+    output.clear();
+    return false;
+  }
+  output.resize(encoded_size);
   return true;
 }
 
+// Incremental brotli encoder for bodies which are produced piece by piece.
+// Brotli has no equivalent of deflateReset, an encoder instance can't be
+// reused after BROTLI_OPERATION_FINISH, so one instance lives per stream.
+class br_stream {
+ public:
+  br_stream(int quality = BROTLI_DEFAULT_QUALITY)
+      : state_(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr)) {
+    if (state_) {
+      BrotliEncoderSetParameter(state_, BROTLI_PARAM_QUALITY, quality);
+    }
+  }
+
+  ~br_stream() {
+    if (state_) {
+      BrotliEncoderDestroyInstance(state_);
+    }
+  }
+
+  br_stream(const br_stream &) = delete;
+  br_stream &operator=(const br_stream &) = delete;
+
+  bool ok() const { return state_ != nullptr; }
+
+  // @param op - BROTLI_OPERATION_PROCESS, BROTLI_OPERATION_FLUSH or
+  // BROTLI_OPERATION_FINISH
+  bool write(std::string_view input, std::string &output,
+             BrotliEncoderOperation op) {
+    std::array<uint8_t, BROTLI_BUFFER_SIZE> buffer;
+    size_t available_in = input.size();
+    const uint8_t *next_in = reinterpret_cast<const uint8_t *>(input.data());
+    while (true) {
+      size_t available_out = buffer.size();
+      uint8_t *next_out = buffer.data();
+      if (!BrotliEncoderCompressStream(state_, op, &available_in, &next_in,
+                                       &available_out, &next_out, nullptr)) {
+        return false;
+      }
+      output.append(reinterpret_cast<const char *>(buffer.data()),
+                    buffer.size() - available_out);
+
+      bool done = available_in == 0 && !BrotliEncoderHasMoreOutput(state_);
+      if (op == BROTLI_OPERATION_FINISH) {
+        done = done && BrotliEncoderIsFinished(state_);
+      }
+      if (done) {
+        return true;
+      }
+    }
+  }
+
+ private:
+  BrotliEncoderState *state_;
+};
+
 inline bool brotli_decompress(std::string_view input,
                               std::string &decompressed) {
   if (input.size() == 0)
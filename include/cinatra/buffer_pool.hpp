@@ -0,0 +1,188 @@
+#pragma once
+#include <asio/streambuf.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <vector>
+
+namespace cinatra {
+// the memory held by the read buffers of all connections. over the budget
+// the server takes no new work: it stops accepting, leaving the new
+// connections in the listen backlog, and answers new requests with 503 before
+// their body is read, until the requests in flight have given buffers back.
+class buffer_usage {
+ public:
+  static void set_budget(size_t bytes) {
+    budget_bytes().store(bytes, std::memory_order_relaxed);
+  }
+
+  static size_t budget() {
+    return budget_bytes().load(std::memory_order_relaxed);
+  }
+
+  static size_t used() { return used_bytes().load(std::memory_order_relaxed); }
+
+  static bool over_budget() { return used() > budget(); }
+
+  static void add(size_t bytes) {
+    used_bytes().fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  static void sub(size_t bytes) {
+    used_bytes().fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  // counts a refusal over the budget. the refusals are logged at most once a
+  // second: returns 0 to skip the log, else the number of refusals since the
+  // last one logged.
+  static size_t count_refusal() {
+    static std::atomic<size_t> refused = 0;
+    static std::atomic<int64_t> last_log = 0;
+    refused.fetch_add(1, std::memory_order_relaxed);
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count();
+    int64_t last = last_log.load(std::memory_order_relaxed);
+    if (last != 0 && now - last < 1000) {
+      return 0;
+    }
+    if (!last_log.compare_exchange_strong(last, now,
+                                          std::memory_order_relaxed)) {
+      return 0;
+    }
+    return refused.exchange(0, std::memory_order_relaxed);
+  }
+
+ private:
+  static std::atomic<size_t> &used_bytes() {
+    static std::atomic<size_t> used = 0;
+    return used;
+  }
+
+  static std::atomic<size_t> &budget_bytes() {
+    static std::atomic<size_t> budget = (std::numeric_limits<size_t>::max)();
+    return budget;
+  }
+};
+
+namespace detail {
+// per-thread free lists of the block sizes 128B to 64KB, larger blocks come
+// from the heap. a thread keeps at most max_cached_bytes of free blocks, the
+// rest goes back to the heap.
+class buffer_slab {
+ public:
+  static constexpr size_t min_block = 128;
+  static constexpr size_t num_classes = 10;
+  static constexpr size_t max_block = min_block << (num_classes - 1);
+  static constexpr size_t max_cached_bytes = 4 * 1024 * 1024;
+
+  static void *allocate(size_t size) {
+    size_t cls = size_class(size);
+    if (cls == num_classes) {
+      return ::operator new(size);
+    }
+    if (state() == 2) {
+      return ::operator new(block_size(cls));
+    }
+
+    auto &slab = local();
+    auto &list = slab.free_[cls];
+    if (!list.empty()) {
+      void *p = list.back();
+      list.pop_back();
+      slab.cached_ -= block_size(cls);
+      return p;
+    }
+    return ::operator new(block_size(cls));
+  }
+
+  static void deallocate(void *p, size_t size) {
+    size_t cls = size_class(size);
+    if (cls == num_classes || state() == 2) {
+      ::operator delete(p);
+      return;
+    }
+
+    auto &slab = local();
+    if (slab.cached_ + block_size(cls) > max_cached_bytes) {
+      ::operator delete(p);
+      return;
+    }
+    slab.free_[cls].push_back(p);
+    slab.cached_ += block_size(cls);
+  }
+
+  static size_t cached_bytes() { return state() == 1 ? local().cached_ : 0; }
+
+  ~buffer_slab() {
+    for (auto &list : free_) {
+      for (void *p : list) {
+        ::operator delete(p);
+      }
+    }
+    state() = 2;
+  }
+
+ private:
+  buffer_slab() { state() = 1; }
+
+  static buffer_slab &local() {
+    thread_local buffer_slab slab;
+    return slab;
+  }
+
+  // 0: not created yet, 1: alive, 2: destroyed at thread exit.
+  static int &state() {
+    thread_local int slab_state = 0;
+    return slab_state;
+  }
+
+  static size_t size_class(size_t size) {
+    if (size > max_block) {
+      return num_classes;
+    }
+    size_t cls = 0;
+    while ((min_block << cls) < size) {
+      cls++;
+    }
+    return cls;
+  }
+
+  static size_t block_size(size_t cls) { return min_block << cls; }
+
+  std::vector<void *> free_[num_classes];
+  size_t cached_ = 0;
+};
+}  // namespace detail
+
+// takes the blocks of a container from the per-thread slab and counts them
+// in buffer_usage.
+template <typename T>
+struct buffer_allocator {
+  using value_type = T;
+
+  buffer_allocator() = default;
+
+  template <typename U>
+  buffer_allocator(const buffer_allocator<U> &) {}
+
+  T *allocate(size_t n) {
+    buffer_usage::add(n * sizeof(T));
+    return static_cast<T *>(detail::buffer_slab::allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t n) {
+    buffer_usage::sub(n * sizeof(T));
+    detail::buffer_slab::deallocate(p, n * sizeof(T));
+  }
+
+  friend bool operator==(const buffer_allocator &, const buffer_allocator &) {
+    return true;
+  }
+};
+
+using pooled_streambuf = asio::basic_streambuf<buffer_allocator<char>>;
+}  // namespace cinatra
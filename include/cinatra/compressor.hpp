@@ -0,0 +1,368 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "define.h"
+#include "http_parser.hpp"
+#ifdef CINATRA_ENABLE_GZIP
+#include "gzip.hpp"
+#endif
+#ifdef CINATRA_ENABLE_BROTLI
+#include "brzip.hpp"
+#endif
+#ifdef CINATRA_ENABLE_ZSTD
+#include "zstd_codec.hpp"
+#endif
+
+namespace cinatra {
+enum class compress_flush {
+  none,   // let the codec buffer, output may be empty
+  sync,   // flush so that the peer can decode everything written so far
+  finish  // write the trailer, the stream can't be written any more
+};
+
+inline constexpr std::string_view encoding_name(content_encoding encoding) {
+  switch (encoding) {
+    case content_encoding::gzip:
+      return "gzip";
+    case content_encoding::deflate:
+      return "deflate";
+    case content_encoding::br:
+      return "br";
+    case content_encoding::zstd:
+      return "zstd";
+    default:
+      return "";
+  }
+}
+
+inline constexpr bool is_encoding_supported(content_encoding encoding) {
+  switch (encoding) {
+#ifdef CINATRA_ENABLE_GZIP
+    case content_encoding::gzip:
+    case content_encoding::deflate:
+      return true;
+#endif
+#ifdef CINATRA_ENABLE_BROTLI
+    case content_encoding::br:
+      return true;
+#endif
+#ifdef CINATRA_ENABLE_ZSTD
+    case content_encoding::zstd:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+// pick the best encoding both sides support from an Accept-Encoding header,
+// "identity" and q-values are not taken into account.
+inline content_encoding negotiate_encoding(std::string_view accept_encoding) {
+  constexpr content_encoding preferred[] = {
+      content_encoding::zstd, content_encoding::br, content_encoding::gzip,
+      content_encoding::deflate};
+  for (auto encoding : preferred) {
+    if (is_encoding_supported(encoding) &&
+        accept_encoding.find(encoding_name(encoding)) !=
+            std::string_view::npos) {
+      return encoding;
+    }
+  }
+  return content_encoding::none;
+}
+
+// decide whether a body is worth compressing.
+struct compress_policy {
+  // bodies smaller than min_size are sent as is.
+  size_t min_size = 0;
+  // content types which are already compressed, matched by prefix.
+  std::vector<std::string> skip_content_types = {
+      "image/",
+      "video/",
+      "audio/",
+      "font/woff",
+      "application/zip",
+      "application/gzip",
+      "application/x-7z-compressed",
+      "application/octet-stream"};
+  int gzip_level = -1;
+#ifdef CINATRA_ENABLE_BROTLI
+  int br_quality = BROTLI_DEFAULT_QUALITY;
+#endif
+#ifdef CINATRA_ENABLE_ZSTD
+  int zstd_level = zstd_codec::default_level;
+  // id of a dictionary registered by zstd_codec::register_dictionary, 0 for
+  // no dictionary. the peer must have registered the same dictionary.
+  uint32_t zstd_dict_id = 0;
+#endif
+
+  // @param size - body size, SIZE_MAX if unknown(chunked)
+  bool should_compress(size_t size, std::string_view content_type) const {
+    if (size < min_size) {
+      return false;
+    }
+
+    for (auto &type : skip_content_types) {
+      if (iequal0(content_type.substr(0, type.size()), type)) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// per-encoding counters, cpu_ns is the time spent inside the codec.
+struct compress_stats {
+  std::atomic<uint64_t> count = 0;
+  std::atomic<uint64_t> skipped = 0;
+  std::atomic<uint64_t> bytes_in = 0;
+  std::atomic<uint64_t> bytes_out = 0;
+  std::atomic<uint64_t> cpu_ns = 0;
+
+  // compressed size / original size
+  double ratio() const {
+    auto in = bytes_in.load(std::memory_order_relaxed);
+    return in == 0 ? 0
+                   : double(bytes_out.load(std::memory_order_relaxed)) / in;
+  }
+
+  void reset() {
+    count = 0;
+    skipped = 0;
+    bytes_in = 0;
+    bytes_out = 0;
+    cpu_ns = 0;
+  }
+};
+
+inline compress_stats &get_compress_stats(content_encoding encoding) {
+  static std::array<compress_stats, size_t(content_encoding::none) + 1> stats;
+  return stats[size_t(encoding)];
+}
+
+namespace detail {
+class compress_timer {
+ public:
+  compress_timer(content_encoding encoding, size_t in_size,
+                 const std::string &out)
+      : stats_(get_compress_stats(encoding)),
+        in_size_(in_size),
+        out_(out),
+        out_size_(out.size()),
+        start_(std::chrono::steady_clock::now()) {}
+
+  // the sizes are counted only for a body which was compressed.
+  void set_ok(bool ok) { ok_ = ok; }
+
+  ~compress_timer() {
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start_);
+    stats_.cpu_ns.fetch_add(elapsed.count(), std::memory_order_relaxed);
+    if (!ok_) {
+      return;
+    }
+    stats_.bytes_in.fetch_add(in_size_, std::memory_order_relaxed);
+    stats_.bytes_out.fetch_add(out_.size() - out_size_,
+                               std::memory_order_relaxed);
+  }
+
+ private:
+  compress_stats &stats_;
+  size_t in_size_;
+  const std::string &out_;
+  size_t out_size_;
+  std::chrono::steady_clock::time_point start_;
+  bool ok_ = false;
+};
+}  // namespace detail
+
+namespace detail {
+inline bool compress_content(content_encoding encoding, std::string_view in,
+                             std::string &out,
+                             const compress_policy *policy) {
+  switch (encoding) {
+#ifdef CINATRA_ENABLE_GZIP
+    case content_encoding::gzip:
+      return gzip_codec::compress(in, out, policy ? policy->gzip_level : -1);
+    case content_encoding::deflate:
+      return gzip_codec::deflate(in, out, policy ? policy->gzip_level : -1);
+#endif
+#ifdef CINATRA_ENABLE_BROTLI
+    case content_encoding::br: {
+      std::string br_str;
+      if (!br_codec::brotli_compress(
+              in, br_str,
+              policy ? policy->br_quality : BROTLI_DEFAULT_QUALITY)) {
+        return false;
+      }
+      out.append(br_str);
+      return true;
+    }
+#endif
+#ifdef CINATRA_ENABLE_ZSTD
+    case content_encoding::zstd:
+      return zstd_codec::compress(
+          in, out, policy ? policy->zstd_level : zstd_codec::default_level,
+          policy ? policy->zstd_dict_id : 0);
+#endif
+    default:
+      return false;
+  }
+}
+}  // namespace detail
+
+// compress an entire body, the result is appended to out.
+inline bool compress_content(content_encoding encoding, std::string_view in,
+                             std::string &out,
+                             const compress_policy *policy = nullptr) {
+  detail::compress_timer timer(encoding, in.size(), out);
+  get_compress_stats(encoding).count.fetch_add(1, std::memory_order_relaxed);
+  bool ok = detail::compress_content(encoding, in, out, policy);
+  timer.set_ok(ok);
+  return ok;
+}
+
+// compress a body which is written piece by piece, e.g. a chunked response.
+// the underlying z_stream/ZSTD_CCtx is taken from a per-thread pool and goes
+// back to it when the compressor is reset or destroyed.
+class stream_compressor {
+ public:
+  bool init(content_encoding encoding,
+            const compress_policy *policy = nullptr) {
+    reset();
+    switch (encoding) {
+#ifdef CINATRA_ENABLE_GZIP
+      case content_encoding::gzip:
+        zstrm_ = gzip_codec::acquire_deflate_stream(
+            windowBits | GZIP_ENCODING, policy ? policy->gzip_level : -1);
+        break;
+      case content_encoding::deflate:
+        zstrm_ = gzip_codec::acquire_deflate_stream(
+            -windowBits, policy ? policy->gzip_level : -1);
+        break;
+#endif
+#ifdef CINATRA_ENABLE_BROTLI
+      case content_encoding::br:
+        brstrm_ = std::make_unique<br_codec::br_stream>(
+            policy ? policy->br_quality : BROTLI_DEFAULT_QUALITY);
+        if (!brstrm_->ok()) {
+          brstrm_ = nullptr;
+        }
+        break;
+#endif
+#ifdef CINATRA_ENABLE_ZSTD
+      case content_encoding::zstd:
+        zstdctx_ = zstd_codec::acquire_cctx(
+            policy ? policy->zstd_level : zstd_codec::default_level,
+            policy ? policy->zstd_dict_id : 0);
+        break;
+#endif
+      default:
+        break;
+    }
+
+    if (!is_active()) {
+      return false;
+    }
+
+    encoding_ = encoding;
+    get_compress_stats(encoding).count.fetch_add(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  bool is_active() const {
+#ifdef CINATRA_ENABLE_GZIP
+    if (zstrm_) {
+      return true;
+    }
+#endif
+#ifdef CINATRA_ENABLE_BROTLI
+    if (brstrm_) {
+      return true;
+    }
+#endif
+#ifdef CINATRA_ENABLE_ZSTD
+    if (zstdctx_) {
+      return true;
+    }
+#endif
+    return false;
+  }
+
+  content_encoding encoding() const { return encoding_; }
+
+  // compressed data is appended to out, it may be empty if flush is none.
+  bool compress(std::string_view data, std::string &out,
+                compress_flush flush = compress_flush::sync) {
+    if (!is_active()) {
+      return false;
+    }
+
+    bool ok = false;
+    {
+      detail::compress_timer timer(encoding_, data.size(), out);
+#ifdef CINATRA_ENABLE_GZIP
+      if (zstrm_) {
+        int mode = flush == compress_flush::none   ? Z_NO_FLUSH
+                   : flush == compress_flush::sync ? Z_SYNC_FLUSH
+                                                   : Z_FINISH;
+        ok = zstrm_->write(data, out, mode);
+      }
+#endif
+#ifdef CINATRA_ENABLE_BROTLI
+      if (brstrm_) {
+        auto op = flush == compress_flush::none   ? BROTLI_OPERATION_PROCESS
+                  : flush == compress_flush::sync ? BROTLI_OPERATION_FLUSH
+                                                  : BROTLI_OPERATION_FINISH;
+        ok = brstrm_->write(data, out, op);
+      }
+#endif
+#ifdef CINATRA_ENABLE_ZSTD
+      if (zstdctx_) {
+        auto mode = flush == compress_flush::none   ? ZSTD_e_continue
+                    : flush == compress_flush::sync ? ZSTD_e_flush
+                                                    : ZSTD_e_end;
+        ok = zstd_codec::compress_stream(zstdctx_.get(), data, out, mode);
+      }
+#endif
+      timer.set_ok(ok);
+    }
+
+    if (!ok || flush == compress_flush::finish) {
+      reset();
+    }
+    return ok;
+  }
+
+  void reset() {
+#ifdef CINATRA_ENABLE_GZIP
+    zstrm_ = nullptr;
+#endif
+#ifdef CINATRA_ENABLE_BROTLI
+    brstrm_ = nullptr;
+#endif
+#ifdef CINATRA_ENABLE_ZSTD
+    zstdctx_ = nullptr;
+#endif
+    encoding_ = content_encoding::none;
+  }
+
+ private:
+  content_encoding encoding_ = content_encoding::none;
+#ifdef CINATRA_ENABLE_GZIP
+  gzip_codec::deflate_stream_ptr zstrm_;
+#endif
+#ifdef CINATRA_ENABLE_BROTLI
+  std::unique_ptr<br_codec::br_stream> brstrm_;
+#endif
+#ifdef CINATRA_ENABLE_ZSTD
+  zstd_codec::cctx_ptr zstdctx_;
+#endif
+};
+}  // namespace cinatra
@@ -25,10 +25,14 @@
 #include "async_simple/coro/Lazy.h"
 #ifdef CINATRA_ENABLE_GZIP
 #include "gzip.hpp"
+#include "ws_deflate.hpp"
 #endif
 #ifdef CINATRA_ENABLE_BROTLI
 #include "brzip.hpp"
 #endif
+#ifdef CINATRA_ENABLE_ZSTD
+#include "zstd_codec.hpp"
+#endif
 #include "cinatra_log_wrapper.hpp"
 #include "http_parser.hpp"
 #include "multipart.hpp"
@@ -319,15 +323,11 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
                                       std::move(ctx));
 
 #ifdef CINATRA_ENABLE_GZIP
+        ws_deflate_ = nullptr;
         if (enable_ws_deflate_) {
           for (auto c : data.resp_headers) {
             if (c.name == "Sec-WebSocket-Extensions") {
-              if (c.value.find("permessage-deflate;") != std::string::npos) {
-                is_server_support_ws_deflate_ = true;
-              }
-              else {
-                is_server_support_ws_deflate_ = false;
-              }
+              ws_deflate_ = permessage_deflate::from_response(c.value);
               break;
             }
           }
@@ -411,8 +411,9 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
   async_simple::coro::Lazy<void> write_ws_frame(std::span<char> msg,
                                                 websocket ws, opcode op,
                                                 resp_data &data,
-                                                bool eof = true) {
-    auto header = ws.encode_frame(msg, op, eof, enable_ws_deflate_);
+                                                bool eof = true,
+                                                bool compressed = false) {
+    auto header = ws.encode_frame(msg, op, eof, compressed);
     std::vector<asio::const_buffer> buffers{
         asio::buffer(header), asio::buffer(msg.data(), msg.size())};
 
@@ -424,18 +425,22 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
   }
 
 #ifdef CINATRA_ENABLE_GZIP
-  void gzip_compress(std::string_view source, std::string &dest_buf,
-                     std::span<char> &span, resp_data &data) {
-    if (enable_ws_deflate_ && is_server_support_ws_deflate_) {
-      if (cinatra::gzip_codec::deflate(source, dest_buf)) {
-        span = dest_buf;
-      }
-      else {
-        CINATRA_LOG_ERROR << "compress data error, data: " << source;
-        data.net_err = std::make_error_code(std::errc::protocol_error);
-        data.status = 404;
-      }
+  // returns true if source is compressed into dest_buf, only data messages
+  // are compressed.
+  bool gzip_compress(std::string_view source, std::string &dest_buf,
+                     std::span<char> &span, opcode op, resp_data &data) {
+    if (!ws_deflate_ || (op != opcode::text && op != opcode::binary) ||
+        !ws_deflate_->need_compress(source.size())) {
+      return false;
+    }
+    if (!ws_deflate_->compress(source, dest_buf)) {
+      CINATRA_LOG_ERROR << "compress data error, data: " << source;
+      data.net_err = std::make_error_code(std::errc::protocol_error);
+      data.status = 404;
+      return false;
     }
+    span = dest_buf;
+    return true;
   }
 #endif
 
@@ -457,30 +462,25 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
     std::span<char> span{};
     if constexpr (is_span_v<Source>) {
       span = {source.data(), source.size()};
+      bool compressed = false;
 #ifdef CINATRA_ENABLE_GZIP
       std::string dest_buf;
-      if (enable_ws_deflate_) {
-        gzip_compress({source.data(), source.size()}, dest_buf, span, data);
-      }
+      compressed = gzip_compress({source.data(), source.size()}, dest_buf,
+                                 span, op, data);
 #endif
-      co_await write_ws_frame(span, ws, op, data, true);
+      co_await write_ws_frame(span, ws, op, data, true, compressed);
     }
     else {
+      // the chunks are the fragments of one message, sent uncompressed.
       while (true) {
         auto result = co_await source();
         span = {result.buf.data(), result.buf.size()};
-#ifdef CINATRA_ENABLE_GZIP
-        std::string dest_buf;
-        if (enable_ws_deflate_) {
-          gzip_compress({result.buf.data(), result.buf.size()}, dest_buf, span,
-                        data);
-        }
-#endif
         co_await write_ws_frame(span, ws, op, data, result.eof);
 
         if (result.eof || data.status == 404) {
           break;
         }
+        op = opcode::cont;
       }
     }
 
@@ -492,6 +492,98 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
     co_return co_await write_websocket(std::move(msg), opcode::close);
   }
 
+  // the next frame as the server sent it, to relay it: a ping is not
+  // answered and nothing is inflated. the frame is a view into the read
+  // buffer, valid until the next read.
+  async_simple::coro::Lazy<std::error_code> read_ws_raw_frame(
+      ws_raw_frame &frame) {
+    std::shared_ptr sock = socket_;
+    bool has_init_ssl = false;
+#ifdef CINATRA_ENABLE_SSL
+    has_init_ssl = has_init_ssl_;
+#endif
+    websocket ws{};
+    if (auto ec = co_await read_ws_frame(sock, ws, has_init_ssl); ec) {
+      co_return ec;
+    }
+
+    auto data_ptr = const_cast<char *>(
+        asio::buffer_cast<const char *>(sock->head_buf_.data()));
+    frame.op = ws.get_opcode();
+    frame.fin = ws.is_fin();
+    frame.compressed = ws.is_compressed();
+    std::memset(frame.mask_key, 0, sizeof(frame.mask_key));
+    frame.header = {data_ptr, ws.header_length()};
+    frame.payload = {data_ptr + ws.header_length(), ws.payload_length()};
+    co_return std::error_code{};
+  }
+
+  // bytes which are encoded already, e.g. frames or a request relayed from
+  // a peer.
+  async_simple::coro::Lazy<std::error_code> write_raw(
+      const std::vector<asio::const_buffer> &buffers) {
+    auto [ec, _] = co_await async_write(buffers);
+    co_return ec;
+  }
+
+  // the head of the response to a request sent with write_raw(), to relay
+  // it: 1xx responses other than 101 are skipped, the body is left to
+  // read_raw_some(). the headers of response_parser() point into the read
+  // buffer, valid until the next read.
+  async_simple::coro::Lazy<std::error_code> read_response_head() {
+    auto guard = timer_guard(this, req_timeout_duration_, "request timer");
+    while (true) {
+      auto [ec, size] = co_await async_read_until(head_buf_, TWO_CRCF);
+      if (ec) {
+        co_return socket_->is_timeout_
+            ? std::make_error_code(std::errc::timed_out)
+            : ec;
+      }
+
+      const char *data_ptr = asio::buffer_cast<const char *>(head_buf_.data());
+      if (parser_.parse_response(data_ptr, size, 0) < 0 ||
+          parser_.body_len() < 0) {
+        head_buf_.consume(head_buf_.size());
+        co_return std::make_error_code(std::errc::protocol_error);
+      }
+      head_buf_.consume(size);
+
+      int status = parser_.status();
+      if (status < 100 || status >= 200 || status == 101) {
+        co_return std::error_code{};
+      }
+    }
+  }
+
+  http_parser &response_parser() { return parser_; }
+
+  // the next bytes of the connection as they are on the wire, what has been
+  // read with the head first.
+  async_simple::coro::Lazy<std::pair<std::error_code, size_t>> read_raw_some(
+      std::span<char> buf) {
+    if (head_buf_.size() > 0) {
+      size_t size = (std::min)(buf.size(), head_buf_.size());
+      const char *data_ptr = asio::buffer_cast<const char *>(head_buf_.data());
+      memcpy(buf.data(), data_ptr, size);
+      head_buf_.consume(size);
+      co_return std::pair{std::error_code{}, size};
+    }
+    co_return co_await async_read_some(asio::buffer(buf.data(), buf.size()));
+  }
+
+  // the bytes read with the head which read_raw_some() hasn't returned yet.
+  size_t buffered_size() { return head_buf_.size(); }
+
+  // null if the connection is encrypted.
+  asio::ip::tcp::socket *plain_socket() {
+#ifdef CINATRA_ENABLE_SSL
+    if (has_init_ssl_) {
+      return nullptr;
+    }
+#endif
+    return &socket_->impl_;
+  }
+
 #ifdef BENCHMARK_TEST
   void set_bench_stop() { stop_bench_ = true; }
 #endif
@@ -1479,6 +1571,8 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
     bool is_timeout_ = false;
     asio::streambuf head_buf_;
     asio::streambuf chunked_buf_;
+    // the websocket frame read last, it is consumed on the next read.
+    size_t ws_consumed_ = 0;
 #ifdef CINATRA_ENABLE_SSL
     std::unique_ptr<asio::ssl::stream<asio::ip::tcp::socket &>> ssl_stream_;
 #endif
@@ -1736,6 +1830,9 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
         else if (parser_.get_header_value("Content-Encoding").find("br") !=
                  std::string_view::npos)
           encoding_type_ = content_encoding::br;
+        else if (parser_.get_header_value("Content-Encoding").find("zstd") !=
+                 std::string_view::npos)
+          encoding_type_ = content_encoding::zstd;
       }
       else {
         encoding_type_ = content_encoding::none;
@@ -1846,48 +1943,38 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
       }
 
       std::string_view reply(data_ptr, content_len);
+      if (uncompress_content(encoding_type_, reply))
+        data.resp_body = uncompressed_str_;
+      else
+        data.resp_body = reply;
+
+      head_buf_.consume(content_len);
+    }
+    data.eof = (head_buf_.size() == 0);
+  }
+
+  // uncompress into uncompressed_str_, return false if the encoding is not
+  // supported or the content is broken.
+  bool uncompress_content(content_encoding encoding, std::string_view content) {
+    uncompressed_str_.clear();
+    switch (encoding) {
 #ifdef CINATRA_ENABLE_GZIP
-      if (encoding_type_ == content_encoding::gzip) {
-        uncompressed_str_.clear();
-        bool r = gzip_codec::uncompress(reply, uncompressed_str_);
-        if (r)
-          data.resp_body = uncompressed_str_;
-        else
-          data.resp_body = reply;
-      }
-      else if (encoding_type_ == content_encoding::deflate) {
-        uncompressed_str_.clear();
-        bool r = gzip_codec::inflate(reply, uncompressed_str_);
-        if (r)
-          data.resp_body = uncompressed_str_;
-        else
-          data.resp_body = reply;
-      }
-#endif
-#if defined(CINATRA_ENABLE_BROTLI) && defined(CINATRA_ENABLE_GZIP)
-      else if (encoding_type_ == content_encoding::br)
-#endif
-#if defined(CINATRA_ENABLE_BROTLI) && !defined(CINATRA_ENABLE_GZIP)
-        if (encoding_type_ == content_encoding::br)
+      case content_encoding::gzip:
+        return gzip_codec::uncompress(content, uncompressed_str_);
+      case content_encoding::deflate:
+        return gzip_codec::inflate(content, uncompressed_str_);
 #endif
 #ifdef CINATRA_ENABLE_BROTLI
-        {
-          uncompressed_str_.clear();
-          bool r = br_codec::brotli_decompress(reply, uncompressed_str_);
-          if (r)
-            data.resp_body = uncompressed_str_;
-          else
-            data.resp_body = reply;
-        }
+      case content_encoding::br:
+        return br_codec::brotli_decompress(content, uncompressed_str_);
 #endif
-#if defined(CINATRA_ENABLE_BROTLI) || defined(CINATRA_ENABLE_GZIP)
-        else
+#ifdef CINATRA_ENABLE_ZSTD
+      case content_encoding::zstd:
+        return zstd_codec::decompress(content, uncompressed_str_);
 #endif
-          data.resp_body = reply;
-
-      head_buf_.consume(content_len);
+      default:
+        return false;
     }
-    data.eof = (head_buf_.size() == 0);
   }
 
   void handle_result(resp_data &data, std::error_code ec, bool is_keep_alive) {
@@ -2142,108 +2229,128 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
     co_return resp_data{{}, 200};
   }
 
-  async_simple::coro::Lazy<resp_data> async_read_ws() {
-    resp_data data{};
-
-    head_buf_.consume(head_buf_.size());
-    std::shared_ptr sock = socket_;
+  // read until the read buffer starts with a whole frame, its header is
+  // parsed into ws. the frame is consumed on the next read.
+  async_simple::coro::Lazy<std::error_code> read_ws_frame(
+      std::shared_ptr<socket_t> sock, websocket &ws, bool has_init_ssl) {
     asio::streambuf &read_buf = sock->head_buf_;
-    bool has_init_ssl = false;
-#ifdef CINATRA_ENABLE_SSL
-    has_init_ssl = has_init_ssl_;
-#endif
-    websocket ws{};
+    if (sock->ws_consumed_ > 0) {
+      read_buf.consume(sock->ws_consumed_);
+      sock->ws_consumed_ = 0;
+    }
     while (true) {
-      if (auto [ec, _] = co_await async_read_ws(
-              sock, read_buf, ws.left_header_len(), has_init_ssl);
-          ec) {
-        if (socket_->is_timeout_) {
-          co_return resp_data{std::make_error_code(std::errc::timed_out), 404};
-        }
-        data.net_err = ec;
-        data.status = 404;
-
-        if (sock->has_closed_) {
-          co_return data;
-        }
-
+      const char *data_ptr = asio::buffer_cast<const char *>(read_buf.data());
+      size_t size = read_buf.size();
+      auto ret = ws.parse_header(data_ptr, size, false);
+      if (ret == ws_header_status::error) {
         close_socket(*sock);
-        co_return data;
+        co_return std::make_error_code(std::errc::protocol_error);
       }
 
-      const char *data_ptr = asio::buffer_cast<const char *>(read_buf.data());
-      auto ret = ws.parse_header(data_ptr, read_buf.size(), false);
-      if (ret == ws_header_status::incomplete) {
-        continue;
+      std::error_code ec;
+      if (ret == ws_header_status::complete) {
+        size_t frame_size = ws.header_length() + ws.payload_length();
+        if (size >= frame_size) {
+          sock->ws_consumed_ = frame_size;
+          co_return std::error_code{};
+        }
+        if (frame_size > ws_read_buffer_size) {
+          std::tie(ec, std::ignore) = co_await async_read_ws(
+              sock, read_buf, frame_size - size, has_init_ssl);
+        }
       }
-      else if (ret == ws_header_status::error) {
-        data.net_err = std::make_error_code(std::errc::protocol_error);
-        data.status = 404;
-        close_socket(*sock);
-        co_return data;
+      if (!ec && read_buf.size() == size) {
+        std::size_t read_size = 0;
+        std::tie(ec, read_size) = co_await async_read_some_ws(
+            sock, read_buf.prepare(ws_read_buffer_size), has_init_ssl);
+        read_buf.commit(read_size);
+      }
+
+      if (ec) {
+        if (socket_->is_timeout_) {
+          co_return std::make_error_code(std::errc::timed_out);
+        }
+        if (!sock->has_closed_) {
+          close_socket(*sock);
+        }
+        co_return ec;
       }
+    }
+  }
 
-      frame_header *header = (frame_header *)data_ptr;
-      bool is_close_frame = header->opcode == opcode::close;
+  // frames are parsed from the read buffer, which is filled with as much as
+  // the socket has. resp_body is a view into it, valid until the next read.
+  async_simple::coro::Lazy<resp_data> async_read_ws() {
+    resp_data data{};
 
-      read_buf.consume(read_buf.size());
+    std::shared_ptr sock = socket_;
+    bool has_init_ssl = false;
+#ifdef CINATRA_ENABLE_SSL
+    has_init_ssl = has_init_ssl_;
+#endif
+    websocket ws{};
+    if (auto ec = co_await read_ws_frame(sock, ws, has_init_ssl); ec) {
+      co_return resp_data{ec, 404};
+    }
 
-      size_t payload_len = ws.payload_length();
+    const char *data_ptr =
+        asio::buffer_cast<const char *>(sock->head_buf_.data());
+    frame_header *header = (frame_header *)data_ptr;
+    bool is_close_frame = header->opcode == opcode::close;
+    bool is_ping_frame = header->opcode == opcode::ping;
 
-      if (auto [ec, size] =
-              co_await async_read_ws(sock, read_buf, payload_len, has_init_ssl);
-          ec) {
-        data.net_err = ec;
+    size_t payload_len = ws.payload_length();
+    data_ptr += ws.header_length();
+#ifdef CINATRA_ENABLE_GZIP
+    if (ws_deflate_ && ws.is_compressed()) {
+      inflate_str_.clear();
+      if (!ws_deflate_->decompress({data_ptr, payload_len}, inflate_str_)) {
+        CINATRA_LOG_ERROR << "uncompuress data error";
         data.status = 404;
-        close_socket(*sock);
+        data.net_err = std::make_error_code(std::errc::protocol_error);
         co_return data;
       }
-
-      data_ptr = asio::buffer_cast<const char *>(read_buf.data());
-#ifdef CINATRA_ENABLE_GZIP
-      if (is_server_support_ws_deflate_ && enable_ws_deflate_) {
-        inflate_str_.clear();
-        if (!cinatra::gzip_codec::inflate({data_ptr, payload_len},
-                                          inflate_str_)) {
-          CINATRA_LOG_ERROR << "uncompuress data error";
-          data.status = 404;
-          data.net_err = std::make_error_code(std::errc::protocol_error);
-          co_return data;
-        }
-        data_ptr = inflate_str_.data();
-        payload_len = inflate_str_.length();
-      }
+      data_ptr = inflate_str_.data();
+      payload_len = inflate_str_.length();
+    }
 #endif
-      if (is_close_frame) {
-        if (payload_len >= 2) {
-          payload_len -= 2;
-          data_ptr += sizeof(uint16_t);
-        }
+    if (is_close_frame) {
+      if (payload_len >= 2) {
+        payload_len -= 2;
+        data_ptr += sizeof(uint16_t);
       }
-      data.status = 200;
-      data.resp_body = {data_ptr, payload_len};
+    }
+    data.status = 200;
+    data.resp_body = {data_ptr, payload_len};
 
-      read_buf.consume(read_buf.size());
+    if (is_ping_frame) {
+      // answered at once, a server with heartbeats closes a silent peer.
+      std::string pong(data_ptr, payload_len);
+      auto span = std::span<char>(pong);
+      auto encode_header = ws.encode_frame(span, opcode::pong, true);
+      std::vector<asio::const_buffer> buffers{asio::buffer(encode_header),
+                                              asio::buffer(pong)};
+      co_await async_write_ws(sock, buffers, has_init_ssl);
+    }
 
-      if (is_close_frame) {
-        std::string reason = "close";
-        auto close_str = ws.format_close_payload(close_code::normal,
-                                                 reason.data(), reason.size());
-        auto span = std::span<char>(close_str);
-        auto encode_header = ws.encode_frame(span, opcode::close, true);
-        std::vector<asio::const_buffer> buffers{asio::buffer(encode_header),
-                                                asio::buffer(reason)};
+    if (is_close_frame) {
+      std::string reason = "close";
+      auto close_str = ws.format_close_payload(close_code::normal,
+                                               reason.data(), reason.size());
+      auto span = std::span<char>(close_str);
+      auto encode_header = ws.encode_frame(span, opcode::close, true);
+      std::vector<asio::const_buffer> buffers{asio::buffer(encode_header),
+                                              asio::buffer(reason)};
 
-        co_await async_write_ws(sock, buffers, has_init_ssl);
+      co_await async_write_ws(sock, buffers, has_init_ssl);
 
-        close_socket(*sock);
+      close_socket(*sock);
 
-        data.net_err = asio::error::eof;
-        data.status = 404;
-        co_return data;
-      }
+      data.net_err = asio::error::eof;
+      data.status = 404;
       co_return data;
     }
+    co_return data;
   }
 
   template <typename AsioBuffer>
@@ -2262,6 +2369,22 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
 #endif
   }
 
+  template <typename AsioBuffer>
+  async_simple::coro::Lazy<std::pair<std::error_code, size_t>>
+  async_read_some_ws(auto sock, AsioBuffer &&buffer,
+                     bool has_init_ssl = false) noexcept {
+#ifdef CINATRA_ENABLE_SSL
+    if (has_init_ssl) {
+      return coro_io::async_read_some(*sock->ssl_stream_, buffer);
+    }
+    else {
+#endif
+      return coro_io::async_read_some(sock->impl_, buffer);
+#ifdef CINATRA_ENABLE_SSL
+    }
+#endif
+  }
+
   template <typename AsioBuffer>
   async_simple::coro::Lazy<std::pair<std::error_code, size_t>> async_write_ws(
       auto sock, AsioBuffer &&buffer, bool has_init_ssl = false) {
@@ -2297,6 +2420,26 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
 #endif
   }
 
+  template <typename AsioBuffer>
+  async_simple::coro::Lazy<std::pair<std::error_code, size_t>> async_read_some(
+      AsioBuffer &&buffer) noexcept {
+#ifdef INJECT_FOR_HTTP_CLIENT_TEST
+    if (read_failed_forever_) {
+      return async_read_failed();
+    }
+#endif
+#ifdef CINATRA_ENABLE_SSL
+    if (has_init_ssl_) {
+      return coro_io::async_read_some(*socket_->ssl_stream_, buffer);
+    }
+    else {
+#endif
+      return coro_io::async_read_some(socket_->impl_, buffer);
+#ifdef CINATRA_ENABLE_SSL
+    }
+#endif
+  }
+
 #ifdef INJECT_FOR_HTTP_CLIENT_TEST
   async_simple::coro::Lazy<std::pair<std::error_code, size_t>>
   async_write_failed() {
@@ -2433,16 +2576,17 @@ class coro_http_client : public std::enable_shared_from_this<coro_http_client> {
   config config_;
 
   bool enable_ws_deflate_ = false;
+  // how much is read from the socket at once, a larger websocket frame is
+  // read as a whole.
+  static constexpr size_t ws_read_buffer_size = 8 * 1024;
 #ifdef CINATRA_ENABLE_GZIP
-  bool is_server_support_ws_deflate_ = false;
+  std::unique_ptr<permessage_deflate> ws_deflate_;
   std::string inflate_str_;
 #endif
   content_encoding encoding_type_ = content_encoding::none;
   int64_t max_http_body_len_ = MAX_HTTP_BODY_SIZE;
 
-#if defined(CINATRA_ENABLE_BROTLI) || defined(CINATRA_ENABLE_GZIP)
   std::string uncompressed_str_;
-#endif
 
 #ifdef BENCHMARK_TEST
   bool stop_bench_ = false;
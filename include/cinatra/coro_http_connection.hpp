@@ -3,12 +3,17 @@
 #include <async_simple/coro/SyncAwait.h>
 
 #include <asio/buffer.hpp>
+#include <deque>
 #include <system_error>
 #include <thread>
 
 #include "asio/dispatch.hpp"
 #include "asio/streambuf.hpp"
+#include "async_simple/coro/FutureAwaiter.h"
 #include "async_simple/coro/Lazy.h"
+#include "alloc_profiler.hpp"
+#include "async_simple/coro/Mutex.h"
+#include "buffer_pool.hpp"
 #include "cinatra/cinatra_log_wrapper.hpp"
 #include "cinatra/response_cv.hpp"
 #include "cookie.hpp"
@@ -16,18 +21,26 @@
 #include "coro_http_router.hpp"
 #include "define.h"
 #include "http_parser.hpp"
+#include "mpsc_queue.hpp"
 #include "multipart.hpp"
 #include "session_manager.hpp"
 #include "sha1.hpp"
 #include "string_resize.hpp"
+#include "upload_spool.hpp"
+#include "utf8_validator.hpp"
 #include "websocket.hpp"
+#include "ws_heartbeat.hpp"
 #ifdef CINATRA_ENABLE_GZIP
 #include "gzip.hpp"
+#include "ws_deflate.hpp"
 #endif
 #include "ylt/coro_io/coro_file.hpp"
 #include "ylt/coro_io/coro_io.hpp"
 
 namespace cinatra {
+class coro_http_connection;
+using ws_heartbeat = basic_ws_heartbeat<coro_http_connection>;
+
 struct websocket_result {
   std::error_code ec;
   ws_frame_type type;
@@ -47,6 +60,7 @@ class coro_http_connection
         request_(parser_, this),
         response_(this) {
     buffers_.reserve(3);
+    request_.set_arena(&response_.get_arena());
   }
 
   ~coro_http_connection() { close(); }
@@ -110,6 +124,14 @@ class coro_http_connection
         has_shake = true;
       }
 #endif
+      CINATRA_ALLOC_PHASE(read);
+      if (release_idle_buffers_ && head_buf_.size() == 0) {
+        if (!co_await wait_request()) {
+          close();
+          break;
+        }
+      }
+
       auto [ec, size] = co_await async_read_until(head_buf_, TWO_CRCF);
       if (ec) {
         if (ec != asio::error::eof) {
@@ -120,6 +142,7 @@ class coro_http_connection
         break;
       }
 
+      CINATRA_ALLOC_PHASE(parse);
       const char *data_ptr = asio::buffer_cast<const char *>(head_buf_.data());
       int head_len = parser_.parse_request(data_ptr, size, 0);
       if (head_len <= 0) {
@@ -131,8 +154,26 @@ class coro_http_connection
         break;
       }
 
-      if (parser_.body_len() > max_http_body_len_ || parser_.body_len() < 0)
-          [[unlikely]] {
+      std::string_view key = {
+          parser_.method().data(),
+          parser_.method().length() + 1 + parser_.url().length()};
+
+      std::string decode_key;
+      if (parser_.url().find('%') != std::string_view::npos) {
+        decode_key = code_utils::url_decode(key);
+        key = decode_key;
+      }
+
+      auto type = request_.get_content_type();
+      // the body of a stream route is left in the socket, the handler pulls
+      // it with read_body_some(), so it is not limited by the max body size.
+      stream_body_ =
+          router_.is_stream_body(key, type == content_type::multipart);
+
+      int64_t route_max_body_len = router_.get_max_body_size(key);
+      if (parser_.body_len() < 0 ||
+          (!stream_body_ && route_max_body_len < 0 &&
+           parser_.body_len() > max_http_body_len_)) [[unlikely]] {
         CINATRA_LOG_ERROR << "invalid http content length: "
                           << parser_.body_len();
         response_.set_status_and_content(status_type::bad_request,
@@ -145,29 +186,66 @@ class coro_http_connection
       head_buf_.consume(size);
       keep_alive_ = check_keep_alive();
 
-      auto type = request_.get_content_type();
+      CINATRA_ALLOC_ROUTE(router_.exact_route(key));
+      CINATRA_ALLOC_PHASE(read);
+      if (buffer_usage::over_budget()) [[unlikely]] {
+        // no new work until the requests in flight give buffers back.
+        if (size_t refused = buffer_usage::count_refusal()) {
+          CINATRA_LOG_WARNING << "buffer usage is over the budget "
+                              << buffer_usage::budget() << ", refused "
+                              << refused << " requests";
+        }
+        response_.set_status_and_content(status_type::service_unavailable,
+                                         "server is busy");
+        response_.set_keepalive(false);
+        co_await reply();
+        close();
+        break;
+      }
+      if (parser_.body_len() > 0 || type == content_type::chunked) {
+        // reject the request from its head, the body is not read.
+        if (!admit_request(key, route_max_body_len)) {
+          response_.set_keepalive(false);
+          co_await reply();
+          close();
+          break;
+        }
+
+        // the client may have sent the body without waiting.
+        if (request_.is_expect_continue() && head_buf_.size() == 0) {
+          constexpr std::string_view continue_resp =
+              "HTTP/1.1 100 Continue\r\n\r\n";
+          auto [ec, _] = co_await async_write(asio::buffer(continue_resp));
+          if (ec) {
+            close();
+            break;
+          }
+        }
+      }
 
-      if (type != content_type::chunked && type != content_type::multipart) {
+      if (stream_body_) {
+        start_stream_body(type == content_type::chunked);
+      }
+      else if (type != content_type::chunked &&
+               type != content_type::multipart) {
         size_t body_len = (size_t)parser_.body_len();
         if (body_len == 0) {
           if (parser_.method() == "GET"sv) {
             if (request_.is_upgrade()) {
-#ifdef CINATRA_ENABLE_GZIP
-              if (request_.is_support_compressed()) {
-                is_client_ws_compressed_ = true;
-              }
-              else {
-                is_client_ws_compressed_ = false;
-              }
-#endif
               // websocket
               build_ws_handshake_head();
+              // before any other thread can post a message.
+              ws_out();
               bool ok = co_await reply(true);  // response ws handshake
               if (!ok) {
                 close();
                 break;
               }
               response_.set_delay(true);
+              if (ws_heartbeat_) {
+                ws_last_seen_ = ws_heartbeat_->now();
+                ws_heartbeat_->add(weak_from_this());
+              }
             }
           }
         }
@@ -198,25 +276,18 @@ class coro_http_connection
         }
       }
 
-      std::string_view key = {
-          parser_.method().data(),
-          parser_.method().length() + 1 + parser_.url().length()};
-
-      std::string decode_key;
-      if (parser_.url().find('%') != std::string_view::npos) {
-        decode_key = code_utils::url_decode(key);
-        key = decode_key;
-      }
-
       if (!body_.empty()) {
         request_.set_body(body_);
       }
 
+      CINATRA_ALLOC_PHASE(route);
       if (auto handler = router_.get_handler(key); handler) {
+        CINATRA_ALLOC_PHASE(handler);
         router_.route(handler, request_, response_, key);
       }
       else {
         if (auto coro_handler = router_.get_coro_handler(key); coro_handler) {
+          CINATRA_ALLOC_PHASE(handler);
           co_await router_.route_coro(coro_handler, request_, response_, key);
         }
         else {
@@ -233,6 +304,7 @@ class coro_http_connection
               router_.get_router_tree()->get(url_path, method_str);
           if (is_exist) {
             if (handler) {
+              CINATRA_ALLOC_PHASE(handler);
               (handler)(request_, response_);
             }
             else {
@@ -249,6 +321,7 @@ class coro_http_connection
 
             if (is_coro_exist) {
               if (coro_handler) {
+                CINATRA_ALLOC_PHASE(handler);
                 co_await coro_handler(request_, response_);
               }
               else {
@@ -266,6 +339,7 @@ class coro_http_connection
                                        std::get<0>(pair))) {
                     auto coro_handler = std::get<1>(pair);
                     if (coro_handler) {
+                      CINATRA_ALLOC_PHASE(handler);
                       co_await coro_handler(request_, response_);
                       is_matched_regex_router = true;
                     }
@@ -282,6 +356,7 @@ class coro_http_connection
                                          std::get<0>(pair))) {
                       auto handler = std::get<1>(pair);
                       if (handler) {
+                        CINATRA_ALLOC_PHASE(handler);
                         (handler)(request_, response_);
                         is_matched_regex_router = true;
                       }
@@ -290,9 +365,16 @@ class coro_http_connection
                 }
               }
               // radix route -> radix coro route -> regex coro -> regex ->
-              // default -> not found
+              // prefix -> default -> not found
               if (!is_matched_regex_router) {
-                if (default_handler_) {
+                if (auto prefix_handler = router_.get_prefix_handler(key);
+                    prefix_handler) {
+                  CINATRA_ALLOC_PHASE(handler);
+                  co_await router_.route_coro(prefix_handler, request_,
+                                              response_, key);
+                }
+                else if (default_handler_) {
+                  CINATRA_ALLOC_PHASE(handler);
                   co_await default_handler_(request_, response_);
                 }
                 else {
@@ -305,6 +387,36 @@ class coro_http_connection
         }
       }
 
+      CINATRA_ALLOC_PHASE(read);
+      if (stream_body_ && !stream_eof_) {
+        // the handler left the body unread. a small rest is discarded to
+        // keep the connection, otherwise the next request can't be found
+        // after it, a larger one closes the connection.
+        size_t discarded = 0;
+        char discard_buf[4096];
+        bool small = stream_chunked_ || stream_remaining_ <= max_discard_size;
+        while (small && !stream_eof_ && discarded <= max_discard_size) {
+          auto result = co_await read_raw_body_some(discard_buf);
+          if (result.ec) {
+            break;
+          }
+          discarded += result.data.size();
+        }
+        if (!stream_eof_) {
+          keep_alive_ = false;
+        }
+      }
+
+      CINATRA_ALLOC_PHASE(build_response);
+      if (response_.has_body_stream()) {
+        handle_session_for_response();
+        if (!co_await write_stream(response_.take_body_stream(),
+                                   response_.body_stream_length(),
+                                   response_.take_body_stream_cancel())) {
+          break;
+        }
+      }
+
       if (!response_.get_delay()) {
         if (head_buf_.size()) {
           if (type == content_type::multipart ||
@@ -358,6 +470,7 @@ class coro_http_connection
 
               coro_http_request req(parser, this);
               coro_http_response resp(this);
+              req.set_arena(&resp.get_arena());
               resp.need_date_head(response_.need_date());
               if (auto handler = router_.get_handler(next_key); handler) {
                 router_.route(handler, req, resp, key);
@@ -375,6 +488,7 @@ class coro_http_connection
               resp.build_resp_str(resp_str_);
             }
 
+            CINATRA_ALLOC_PHASE(write);
             auto [write_ec, _] = co_await async_write(asio::buffer(resp_str_));
             if (write_ec) {
               CINATRA_LOG_ERROR << "async_write error: " << write_ec.message();
@@ -390,11 +504,27 @@ class coro_http_connection
         }
       }
 
+      CINATRA_ALLOC_PHASE(write);
+      if (coalesce_writes_) {
+        co_await flush();
+      }
+
       if (!keep_alive_) {
         // now in io thread, so can close socket immediately.
         close();
       }
 
+      if (stream_body_ || type == content_type::multipart) {
+        stream_body_ = false;
+        if (chunked_buf_.size() > 0) {
+          // a pipelined request read together with the end of the body.
+          const char *data_ptr =
+              asio::buffer_cast<const char *>(chunked_buf_.data());
+          head_buf_.sputn(data_ptr, chunked_buf_.size());
+          chunked_buf_.consume(chunked_buf_.size());
+        }
+      }
+
       response_.clear();
       request_.clear();
       buffers_.clear();
@@ -403,8 +533,11 @@ class coro_http_connection
       multi_buf_ = true;
       if (need_shrink_every_time_) {
         body_.shrink_to_fit();
+        compressed_chunk_.shrink_to_fit();
       }
+      CINATRA_ALLOC_LEAVE();
     }
+    CINATRA_ALLOC_LEAVE();
 
     if (head_buf_.size()) {
       head_buf_.consume(head_buf_.size());
@@ -414,16 +547,22 @@ class coro_http_connection
   async_simple::coro::Lazy<bool> reply(bool need_to_bufffer = true) {
     std::error_code ec;
     size_t size;
+    CINATRA_ALLOC_PHASE_SCOPE(build_response);
+    if (coalesce_writes_ && (ec = co_await flush())) {
+      co_return false;
+    }
     if (multi_buf_) {
       if (need_to_bufffer) {
         response_.to_buffers(buffers_, chunk_size_str_);
       }
+      CINATRA_ALLOC_PHASE(write);
       std::tie(ec, size) = co_await async_write(buffers_);
     }
     else {
       if (need_to_bufffer) {
         response_.build_resp_str(resp_str_);
       }
+      CINATRA_ALLOC_PHASE(write);
       std::tie(ec, size) = co_await async_write(asio::buffer(resp_str_));
     }
 
@@ -433,6 +572,12 @@ class coro_http_connection
       co_return false;
     }
 
+    if (response_.is_file_view_truncated()) {
+      CINATRA_LOG_ERROR << "file truncated while it was sent";
+      close();
+      co_return false;
+    }
+
     co_return true;
   }
 
@@ -467,6 +612,116 @@ class coro_http_connection
     max_http_body_len_ = max_size;
   }
 
+  // more is true if the next piece is ready, the socket is corked then so
+  // the kernel sends full segments across writes.
+  async_simple::coro::Lazy<bool> flush_stream(bool chunked, bool eof,
+                                              bool more) {
+    if (chunked) {
+      to_chunked_buffers(buffers_, chunk_size_str_, stream_out_, eof);
+    }
+    else if (!stream_out_.empty()) {
+      buffers_.push_back(asio::buffer(stream_out_));
+    }
+
+    if (more != stream_corked_) {
+      set_cork(more);
+    }
+    std::error_code ec;
+    if (has_coalesced()) {
+      ec = co_await flush();
+    }
+    if (!ec) {
+      std::tie(ec, std::ignore) = co_await async_write(buffers_);
+    }
+    if (stream_corked_ && !more) {
+      set_cork(false);
+    }
+    buffers_.clear();
+    stream_out_.clear();
+    if (ec) {
+      CINATRA_LOG_ERROR << "async_write error: " << ec.message();
+      close();
+      co_return false;
+    }
+    co_return true;
+  }
+
+  // a direct write must not overtake the coalesced messages before it, they
+  // are flushed first.
+  bool has_coalesced() const {
+    return coalesce_ &&
+           !(coalesce_->out_buf.empty() && coalesce_->out_sending.empty());
+  }
+
+  template <typename Buffers>
+  async_simple::coro::Lazy<std::error_code> write_coalesced(
+      const Buffers &buffers) {
+    if (!coalesce_writes_) {
+      auto [ec, _] = co_await async_write(buffers);
+      co_return ec;
+    }
+    if (coalesce_->ec) {
+      co_return coalesce_->ec;
+    }
+
+    for (auto &buf : buffers) {
+      coalesce_->out_buf.append((const char *)buf.data(), buf.size());
+    }
+    write_stats_.coalesced++;
+    if (coalesce_->out_buf.size() >= coalesce_->max_buffered) {
+      co_return co_await flush();
+    }
+
+    if (!coalesce_->flush_scheduled) {
+      coalesce_->flush_scheduled = true;
+      schedule_flush();
+    }
+    co_return std::error_code{};
+  }
+
+  void schedule_flush() {
+    auto &state = *coalesce_;
+    if (state.flush_delay.count() == 0) {
+      flush_later(shared_from_this()).via(executor_.load()).detach();
+      return;
+    }
+
+    if (!state.timer) {
+      state.timer =
+          std::make_unique<asio::steady_timer>(socket_.get_executor());
+    }
+    state.timer->expires_after(state.flush_delay);
+    state.timer->async_wait(
+        [self = shared_from_this()](const std::error_code &ec) {
+          if (!ec) {
+            flush_later(self).via(self->executor_.load()).detach();
+          }
+        });
+  }
+
+  static async_simple::coro::Lazy<void> flush_later(
+      std::shared_ptr<coro_http_connection> self) {
+    // it was scheduled before the connection moved to another io thread.
+    co_await self->resume_on_io_thread();
+    self->coalesce_->flush_scheduled = false;
+    co_await self->flush();
+  }
+
+  void set_cork(bool on) {
+#if defined(__linux__)
+    using tcp_cork =
+        asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK>;
+    std::error_code ec;
+    socket_.set_option(tcp_cork(on), ec);
+    stream_corked_ = on && !ec;
+#endif
+  }
+
+  void set_admission_check(
+      std::function<bool(coro_http_request &, coro_http_response &)> check) {
+    admission_check_ = std::move(check);
+  }
+
 #ifdef INJECT_FOR_HTTP_SEVER_TEST
   void set_write_failed_forever(bool r) { write_failed_forever_ = r; }
 
@@ -476,7 +731,13 @@ class coro_http_connection
   async_simple::coro::Lazy<bool> write_data(std::string_view message) {
     std::vector<asio::const_buffer> buffers;
     buffers.push_back(asio::buffer(message));
-    auto [ec, _] = co_await async_write(buffers);
+    std::error_code ec;
+    if (has_coalesced()) {
+      ec = co_await flush();
+    }
+    if (!ec) {
+      std::tie(ec, std::ignore) = co_await async_write(buffers);
+    }
     if (ec) {
       CINATRA_LOG_ERROR << "async_write error: " << ec.message();
       close();
@@ -486,17 +747,45 @@ class coro_http_connection
     co_return true;
   }
 
-  async_simple::coro::Lazy<bool> begin_chunked() {
+  // if encoding is not none and the client accepts it, every chunk written
+  // by write_chunked will be compressed incrementally.
+  async_simple::coro::Lazy<bool> begin_chunked(
+      content_encoding encoding = content_encoding::none,
+      std::string_view client_encoding_type = "") {
     response_.set_delay(true);
     response_.set_status(status_type::ok);
+    if (encoding != content_encoding::none) {
+      response_.init_stream_compressor(encoding, client_encoding_type);
+    }
     co_return co_await reply();
   }
 
-  async_simple::coro::Lazy<bool> write_chunked(std::string_view chunked_data,
-                                               bool eof = false) {
+  // flush is only used by a compressed chunked response: compress_flush::none
+  // lets the compressor accumulate small chunks, nothing is sent until it has
+  // produced output.
+  async_simple::coro::Lazy<bool> write_chunked(
+      std::string_view chunked_data, bool eof = false,
+      compress_flush flush = compress_flush::sync) {
     response_.set_delay(true);
     buffers_.clear();
+    if (response_.is_stream_compressed()) {
+      compressed_chunk_.clear();
+      if (!response_.compress_chunk(
+              chunked_data, compressed_chunk_,
+              eof ? compress_flush::finish : flush)) {
+        CINATRA_LOG_ERROR << "compress chunked data error";
+        close();
+        co_return false;
+      }
+      chunked_data = compressed_chunk_;
+      if (chunked_data.empty() && !eof) {
+        co_return true;
+      }
+    }
     to_chunked_buffers(buffers_, chunk_size_str_, chunked_data, eof);
+    if (coalesce_writes_) {
+      co_return !co_await write_coalesced(buffers_);
+    }
     co_return co_await reply(false);
   }
 
@@ -537,8 +826,7 @@ class coro_http_connection
     buffers_.push_back(asio::buffer(part_data));
     buffers_.push_back(asio::buffer(CRCF));
 
-    auto [ec, _] = co_await async_write(buffers_);
-    co_return !ec;
+    co_return !co_await write_coalesced(buffers_);
   }
 
   async_simple::coro::Lazy<bool> end_multipart() {
@@ -546,10 +834,176 @@ class coro_http_connection
     buffers_.clear();
     std::string multipart_end = "--";
     multipart_end.append(response_.get_boundary()).append("--").append(CRCF);
-    auto [ec, _] = co_await async_write(asio::buffer(multipart_end));
-    co_return !ec;
+    buffers_.push_back(asio::buffer(multipart_end));
+    co_return !co_await write_coalesced(buffers_);
   }
 
+  // send the response with a body pulled piece by piece from next(), chunked
+  // or with a Content-Length if content_length is known. the pieces which are
+  // ready without waiting are coalesced into one write of about
+  // stream_coalesce_size_ bytes, what has been collected is sent as soon as
+  // the producer has to wait. at most one piece is produced while a write is
+  // in flight, so a slow client suspends the producer. if the write fails
+  // while a piece is pending, cancel is called and the piece is not waited
+  // for, the producer finishes on its own.
+  async_simple::coro::Lazy<bool> write_stream(
+      std::function<async_simple::coro::Lazy<body_piece_t>()> next,
+      int64_t content_length = -1, std::function<void()> cancel = nullptr) {
+    if (coalesce_writes_ && co_await flush()) {
+      co_return false;
+    }
+    response_.set_delay(true);
+    if (response_.status() == status_type::init ||
+        response_.status() == status_type::not_implemented) {
+      response_.set_status(status_type::ok);
+    }
+    bool chunked = content_length < 0;
+    if (chunked) {
+      response_.set_format_type(format_type::chunked);
+    }
+    else {
+      response_.add_header(std::string("Content-Length"),
+                           std::to_string(content_length));
+      response_.set_content("");
+    }
+
+    // the head goes out with the first piece.
+    buffers_.clear();
+    response_.to_buffers(buffers_, chunk_size_str_);
+    stream_out_.clear();
+
+    // a pending piece can outlive this call, it keeps the producer alive.
+    auto producer = std::make_shared<
+        std::function<async_simple::coro::Lazy<body_piece_t>()>>(
+        std::move(next));
+    int64_t body_size = 0;
+    bool eof = false;
+    while (!eof) {
+      async_simple::Promise<body_piece_t> promise;
+      auto future = promise.getFuture();
+      (*producer)().setEx(executor_.load()).start(
+          [p = std::move(promise), producer](
+              async_simple::Try<body_piece_t> result) mutable {
+            if (result.hasError()) {
+              CINATRA_LOG_ERROR << "body stream failed";
+              body_piece_t piece{};
+              piece.ec = std::make_error_code(std::errc::io_error);
+              p.setValue(std::move(piece));
+            }
+            else {
+              p.setValue(std::move(result).value());
+            }
+          });
+
+      if (!future.hasResult() && !stream_out_.empty()) {
+        if (!co_await flush_stream(chunked, false, false)) {
+          if (cancel) {
+            cancel();
+          }
+          co_return false;
+        }
+      }
+
+      body_piece_t piece = co_await std::move(future);
+      if (piece.ec) {
+        close();
+        co_return false;
+      }
+
+      body_size += piece.data.size();
+      eof = piece.eof;
+      if (!chunked && (body_size > content_length ||
+                       (eof && body_size != content_length))) {
+        CINATRA_LOG_ERROR << "body stream size " << body_size
+                          << " doesn't match the content length "
+                          << content_length;
+        close();
+        co_return false;
+      }
+
+      if (stream_out_.empty()) {
+        stream_out_.swap(piece.data);
+      }
+      else {
+        stream_out_.append(piece.data);
+      }
+
+      if (eof || stream_out_.size() >= stream_coalesce_size_) {
+        if (!co_await flush_stream(chunked, eof, !eof)) {
+          co_return false;
+        }
+      }
+    }
+
+    co_return true;
+  }
+
+  // a synchronous range of pieces, such as an
+  // async_simple::coro::Generator<std::string_view>. all of its pieces are
+  // ready, so they are only coalesced by size.
+  template <typename Range>
+  async_simple::coro::Lazy<bool> write_stream_range(
+      Range &range, int64_t content_length = -1) {
+    auto it = std::ranges::begin(range);
+    auto end = std::ranges::end(range);
+    co_return co_await write_stream(
+        [&it, &end]() -> async_simple::coro::Lazy<body_piece_t> {
+          body_piece_t piece{};
+          if (it == end) {
+            piece.eof = true;
+            co_return piece;
+          }
+          piece.data.assign(std::string_view(*it));
+          ++it;
+          co_return piece;
+        },
+        content_length);
+  }
+
+  void set_stream_coalesce_size(size_t size) { stream_coalesce_size_ = size; }
+
+  // with write coalescing, write_chunked, write_multipart and write_websocket
+  // only add the message to an output buffer, it is written with one writev
+  // in a later turn of the event loop, or flush_delay later, together with
+  // the messages added until then. a full buffer (max_buffered bytes) is
+  // written at once. errors are returned by the next write or flush().
+  void set_write_coalescing(bool r,
+                            std::chrono::microseconds flush_delay = {},
+                            size_t max_buffered = 64 * 1024) {
+    coalesce_writes_ = r;
+    if (r && !coalesce_) {
+      coalesce_ = std::make_unique<coalesce_state>();
+    }
+    if (coalesce_) {
+      coalesce_->flush_delay = flush_delay;
+      coalesce_->max_buffered = max_buffered;
+    }
+  }
+
+  // write the output buffer now, e.g. before the connection is closed by a
+  // websocket handler.
+  async_simple::coro::Lazy<std::error_code> flush() {
+    if (!coalesce_) {
+      co_return std::error_code{};
+    }
+
+    auto &state = *coalesce_;
+    auto lock = co_await state.mtx.coScopedLock();
+    while (!state.out_buf.empty() && !state.ec) {
+      state.out_sending.swap(state.out_buf);
+      auto [ec, _] = co_await async_write(asio::buffer(state.out_sending));
+      state.out_sending.clear();
+      if (ec) {
+        CINATRA_LOG_ERROR << "async_write error: " << ec.message();
+        state.ec = ec;
+        close();
+      }
+    }
+    co_return state.ec;
+  }
+
+  const write_stats &get_write_stats() const { return write_stats_; }
+
   async_simple::coro::Lazy<chunked_result> read_chunked() {
     if (head_buf_.size() > 0) {
       const char *data_ptr = asio::buffer_cast<const char *>(head_buf_.data());
@@ -608,160 +1062,975 @@ class coro_http_connection
     co_return result;
   }
 
-  async_simple::coro::Lazy<std::error_code> write_websocket(
-      std::string_view msg, opcode op = opcode::text, bool eof = true) {
-    std::vector<asio::const_buffer> buffers;
-    std::string_view header;
-#ifdef CINATRA_ENABLE_GZIP
-    std::string dest_buf;
-    if (is_client_ws_compressed_ && msg.size() > 0) {
-      if (!cinatra::gzip_codec::deflate(msg, dest_buf)) {
-        CINATRA_LOG_ERROR << "compress data error, data: " << msg;
-        co_return std::make_error_code(std::errc::protocol_error);
-      }
-
-      header = ws_.encode_ws_header(dest_buf.length(), op, eof, true, false);
-      buffers.push_back(asio::buffer(header));
-      buffers.push_back(asio::buffer(dest_buf));
-    }
-    else {
-#endif
-      header = ws_.encode_ws_header(msg.length(), op, eof, false, false);
-      buffers.push_back(asio::buffer(header));
-      buffers.push_back(asio::buffer(msg));
-#ifdef CINATRA_ENABLE_GZIP
-    }
-#endif
-    auto [ec, sz] = co_await async_write(buffers);
-    co_return ec;
-  }
-
-  async_simple::coro::Lazy<websocket_result> read_websocket() {
-    auto [ec, ws_hd_size] = co_await async_read(head_buf_, SHORT_HEADER);
-    websocket_result result{ec};
-    if (ec) {
-      close();
+  // read the next piece of the body of a stream route into buf, the data of
+  // the result points into buf and eof is set when the whole body has been
+  // read. the socket is only read when the handler asks for more, so a slow
+  // handler slows the sender down. content-length and chunked bodies are
+  // supported, a gzip encoded body is inflated.
+  async_simple::coro::Lazy<chunked_result> read_body_some(
+      std::span<char> buf) {
+    chunked_result result{};
+    if (!stream_body_ || buf.empty()) {
+      result.ec = std::make_error_code(std::errc::invalid_argument);
       co_return result;
     }
 
-    while (true) {
-      const char *data_ptr = asio::buffer_cast<const char *>(head_buf_.data());
-      auto status = ws_.parse_header(data_ptr, ws_.len_bytes());
-      if (status == ws_header_status::complete) {
-        ws_.reset_len_bytes();
-        head_buf_.consume(head_buf_.size());
-        std::span<char> payload{};
-        auto payload_length = ws_.payload_length();
-
-        if (max_part_size_ != 0 && payload_length > max_part_size_) {
-          std::string close_reason = "message_too_big";
-          std::string close_msg = ws_.format_close_payload(
-              close_code::too_big, close_reason.data(), close_reason.size());
-          co_await write_websocket(close_msg, opcode::close);
-          close();
-          result.ec = std::error_code(asio::error::message_size,
-                                      asio::error::get_system_category());
-          break;
+#ifdef CINATRA_ENABLE_GZIP
+    if (body_inflater_) {
+      if (!body_inflater_->ok()) {
+        CINATRA_LOG_ERROR << "init inflate stream failed";
+        result.ec = std::make_error_code(std::errc::not_enough_memory);
+        close();
+        co_return result;
+      }
+      while (true) {
+        if (body_inflater_->finished()) {
+          // skip what follows the gzip stream to reach the end of the body.
+          while (!stream_eof_) {
+            result = co_await read_raw_body_some(inflate_in_buf_);
+            if (result.ec) {
+              co_return result;
+            }
+          }
+          result = {};
+          result.eof = true;
+          co_return result;
         }
 
-        if (payload_length > 0) {
-          detail::resize(body_, payload_length);
-          auto [ec, read_sz] =
-              co_await async_read(asio::buffer(body_), payload_length);
-          if (ec) {
-            close();
-            result.ec = ec;
-            break;
+        if (body_inflater_->pending_input() == 0) {
+          if (stream_eof_) {
+            result.ec = std::make_error_code(std::errc::illegal_byte_sequence);
+            co_return result;
           }
-          payload = body_;
+          auto raw = co_await read_raw_body_some(inflate_in_buf_);
+          if (raw.ec) {
+            co_return raw;
+          }
+          body_inflater_->set_input(raw.data);
         }
 
-        ws_frame_type type = ws_.parse_payload(payload);
+        int64_t n = body_inflater_->read(buf.data(), buf.size());
+        if (n < 0) {
+          CINATRA_LOG_ERROR << "inflate request body failed";
+          result.ec = std::make_error_code(std::errc::illegal_byte_sequence);
+          close();
+          co_return result;
+        }
+        if (n > 0) {
+          result.data = std::string_view(buf.data(), n);
+          co_return result;
+        }
+      }
+    }
+#endif
 
-        switch (type) {
-          case cinatra::ws_frame_type::WS_ERROR_FRAME:
-            close();
-            result.ec = std::make_error_code(std::errc::protocol_error);
-            break;
-          case cinatra::ws_frame_type::WS_OPENING_FRAME:
-            continue;
-          case ws_frame_type::WS_INCOMPLETE_TEXT_FRAME:
-          case ws_frame_type::WS_INCOMPLETE_BINARY_FRAME:
-            result.eof = false;
-            result.data = {payload.data(), payload.size()};
-            break;
-          case cinatra::ws_frame_type::WS_TEXT_FRAME:
-          case cinatra::ws_frame_type::WS_BINARY_FRAME: {
-#ifdef CINATRA_ENABLE_GZIP
-            if (!gzip_compress(payload, result)) {
-              break;
-            }
+    co_return co_await read_raw_body_some(buf);
+  }
+
+  // read the whole body of a stream route. a body larger than the spool
+  // memory threshold is written to a file in the spool dir, on linux a plain
+  // tcp content-length body is spliced from the socket to the file without
+  // passing through user space.
+  async_simple::coro::Lazy<spool_result> spool_body() {
+    if (!stream_body_) {
+      co_return spool_result{std::make_error_code(std::errc::invalid_argument)};
+    }
+
+    body_spooler spooler(spool_dir_, spool_memory_threshold_);
+#ifdef __linux__
+    bool can_splice =
+        !stream_chunked_ && stream_remaining_ > spool_memory_threshold_;
+#ifdef CINATRA_ENABLE_SSL
+    can_splice = can_splice && !use_ssl_;
+#endif
+#ifdef INJECT_FOR_HTTP_SEVER_TEST
+    // splice doesn't go through async_read(), which fails the reads.
+    can_splice = can_splice && !read_failed_forever_;
 #endif
-            result.eof = true;
-            result.data = {payload.data(), payload.size()};
-          } break;
-          case cinatra::ws_frame_type::WS_CLOSE_FRAME: {
 #ifdef CINATRA_ENABLE_GZIP
-            if (!gzip_compress(payload, result)) {
-              break;
-            }
+    can_splice = can_splice && body_inflater_ == nullptr;
 #endif
-            close_frame close_frame =
-                ws_.parse_close_payload(payload.data(), payload.size());
-            result.eof = true;
-            result.data = {close_frame.message, close_frame.length};
-
-            std::string close_msg = ws_.format_close_payload(
-                close_code::normal, close_frame.message, close_frame.length);
-
-            co_await write_websocket(close_msg, opcode::close);
-            close();
-          } break;
-          case cinatra::ws_frame_type::WS_PING_FRAME: {
-            result.data = {payload.data(), payload.size()};
-            auto ec = co_await write_websocket(result.data, opcode::pong);
+    if (can_splice) {
+      if (auto ec = co_await spooler.spill(); ec) {
+        co_return spool_result{ec};
+      }
+      auto &file = spooler.file();
+      auto ec = co_await splice_body(
+          [&](std::string_view data)
+              -> async_simple::coro::Lazy<std::error_code> {
+            auto ec = co_await file.async_write(data);
             if (ec) {
               close();
-              result.ec = ec;
             }
-          } break;
-          case cinatra::ws_frame_type::WS_PONG_FRAME: {
-            result.data = {payload.data(), payload.size()};
-            auto ec = co_await write_websocket(result.data, opcode::ping);
-            result.ec = ec;
-          } break;
-          default:
-            break;
-        }
-
-        result.type = type;
-        co_return result;
+            co_return ec;
+          },
+          [&](size_t size)
+              -> async_simple::coro::Lazy<std::pair<std::error_code, size_t>> {
+            auto result = co_await coro_io::async_splice_to_file(
+                socket_, file.native_handle(), file.size(), size);
+            file.advance(result.second);
+            co_return result;
+          });
+      // invalid_argument: the spool dir can't splice, read the rest below.
+      if (ec && ec != std::errc::invalid_argument) {
+        co_return spool_result{ec};
       }
-      else if (status == ws_header_status::incomplete) {
-        auto [ec, sz] = co_await async_read(head_buf_, ws_.left_header_len());
-        if (ec) {
-          close();
-          result.ec = ec;
+      stream_eof_ = stream_remaining_ == 0;
+    }
+#endif
+
+    if (!stream_eof_) {
+      std::string buf;
+      detail::resize(buf, 64 * 1024);
+      while (true) {
+        auto result = co_await read_body_some(buf);
+        if (result.ec) {
+          co_return spool_result{result.ec};
+        }
+        if (auto ec = co_await spooler.append(result.data); ec) {
+          close();
+          co_return spool_result{ec};
+        }
+        if (result.eof) {
           break;
         }
+      }
+    }
+
+    co_return spooler.finish();
+  }
+
+#ifdef __linux__
+  // move the rest of a content-length body with splice: the bytes read with
+  // the head go to write_buffered first, then splice(size) moves the rest in
+  // slices, so a long upload isn't taken for an idle connection. a splice
+  // error closes the connection, but invalid_argument, the target can't
+  // splice and the caller may read the rest itself.
+  template <typename WriteBuffered, typename Splice>
+  async_simple::coro::Lazy<std::error_code> splice_body(
+      WriteBuffered write_buffered, Splice splice) {
+    size_t buffered = (std::min)(chunked_buf_.size(), stream_remaining_);
+    if (buffered > 0) {
+      const char *data_ptr =
+          asio::buffer_cast<const char *>(chunked_buf_.data());
+      if (auto ec = co_await write_buffered({data_ptr, buffered}); ec) {
+        co_return ec;
+      }
+      chunked_buf_.consume(buffered);
+      stream_remaining_ -= buffered;
+    }
+
+    while (stream_remaining_ > 0) {
+      set_last_time();
+      auto [ec, size] = co_await splice(
+          (std::min)(stream_remaining_, size_t(4 * 1024 * 1024)));
+      stream_remaining_ -= size;
+      if (ec == std::errc::invalid_argument) {
+        co_return ec;
+      }
+      if (ec) {
+        CINATRA_LOG_ERROR << "splice body error: " << ec.message();
+        close();
+        co_return ec;
+      }
+    }
+    co_return std::error_code{};
+  }
+#endif
+
+  // send the rest of the body of a stream route to another peer with the
+  // framing it has, e.g. to proxy it. write sends one piece at a time, so a
+  // slow peer slows the sender down. a chunked body is sent in chunks again
+  // as it arrives, without its trailers. on linux a plain tcp content-length
+  // body is spliced to to_socket if it is given.
+  template <typename Write>
+  async_simple::coro::Lazy<std::error_code> relay_body(
+      Write write, asio::ip::tcp::socket *to_socket = nullptr) {
+    if (!stream_body_) {
+      co_return std::make_error_code(std::errc::invalid_argument);
+    }
+
+    std::vector<asio::const_buffer> buffers;
+#ifdef __linux__
+    bool can_splice = to_socket != nullptr && !stream_chunked_;
+#ifdef CINATRA_ENABLE_SSL
+    can_splice = can_splice && !use_ssl_;
+#endif
+#ifdef INJECT_FOR_HTTP_SEVER_TEST
+    // splice doesn't go through async_read(), which fails the reads.
+    can_splice = can_splice && !read_failed_forever_;
+#endif
+    if (can_splice) {
+      auto ec = co_await splice_body(
+          [&](std::string_view data)
+              -> async_simple::coro::Lazy<std::error_code> {
+            buffers.push_back(asio::buffer(data));
+            co_return co_await write(buffers);
+          },
+          [&](size_t size) {
+            return coro_io::async_splice(socket_, *to_socket, size);
+          });
+      stream_eof_ = !ec;
+      co_return ec;
+    }
+#endif
+
+    std::string buf;
+    detail::resize(buf, 64 * 1024);
+    std::string size_str;
+    while (true) {
+      auto result = co_await read_raw_body_some(buf);
+      if (result.ec) {
+        co_return result.ec;
+      }
+
+      buffers.clear();
+      if (stream_chunked_) {
+        to_chunked_buffers(buffers, size_str, result.data, result.eof);
+      }
+      else if (!result.data.empty()) {
+        buffers.push_back(asio::buffer(result.data));
+      }
+      if (!buffers.empty()) {
+        if (auto ec = co_await write(buffers); ec) {
+          co_return ec;
+        }
+      }
+
+      if (result.eof) {
+        co_return std::error_code{};
+      }
+    }
+  }
+
+  async_simple::coro::Lazy<std::error_code> write_websocket(
+      std::string_view msg, opcode op = opcode::text, bool eof = true) {
+    // the send queue is written by another coroutine.
+    auto lock = co_await ws_out().mtx.coScopedLock();
+    co_await resume_on_io_thread();
+    std::vector<asio::const_buffer> buffers;
+    std::string_view header;
+#ifdef CINATRA_ENABLE_GZIP
+    std::string dest_buf;
+    if (need_ws_compress(msg, op, eof)) {
+      if (!ws_deflate_->compress(msg, dest_buf)) {
+        CINATRA_LOG_ERROR << "compress data error, data: " << msg;
+        co_return std::make_error_code(std::errc::protocol_error);
+      }
+
+      header = ws().encode_ws_header(dest_buf.length(), op, eof, true, false);
+      buffers.push_back(asio::buffer(header));
+      buffers.push_back(asio::buffer(dest_buf));
+    }
+    else {
+#endif
+      header = ws().encode_ws_header(msg.length(), op, eof, false, false);
+      buffers.push_back(asio::buffer(header));
+      buffers.push_back(asio::buffer(msg));
+#ifdef CINATRA_ENABLE_GZIP
+    }
+#endif
+    ws_bytes_.fetch_add(msg.size(), std::memory_order_relaxed);
+    auto ec = co_await write_coalesced(buffers);
+    if (!ec && op == opcode::close && coalesce_writes_) {
+      // the connection is closed next, the close frame must be on the wire.
+      ec = co_await flush();
+    }
+    co_return ec;
+  }
+
+  // queue a websocket message from any thread. the queue is written by the
+  // io thread, as many frames as ws_max_batch with one writev. returns false
+  // if the message is not queued: the connection is closed, or the queue has
+  // reached the high watermark and not yet drained to the low watermark.
+  bool post_websocket(std::string_view msg, opcode op = opcode::text) {
+    if (has_closed_ || !ws_out_) {
+      return false;
+    }
+
+    if (ws_out_->paused) {
+      ws_out_->dropped++;
+      return false;
+    }
+
+    ws_out_frame frame;
+    if (defer_ws_compress(msg, op)) {
+      // compressed by the writer, in the order of the queue.
+      frame.owned.assign(msg);
+      frame.op = op;
+      frame.deferred = true;
+    }
+    else if (!encode_ws_frame(frame.owned, msg, op)) {
+      return false;
+    }
+    push_ws_frame(std::move(frame));
+    return true;
+  }
+
+  // queue a frame encoded by ws_hub. a connection with max_pending frames
+  // queued, or above the high watermark, is slow, the frame is dropped or the
+  // connection is closed. returns false if the frame is not queued.
+  bool send_ws_frame(std::shared_ptr<const std::string> frame,
+                     size_t max_pending, slow_subscriber_policy policy) {
+    if (has_closed_ || !ws_out_) {
+      return false;
+    }
+
+    auto &out = *ws_out_;
+    if (out.depth >= max_pending || out.paused) {
+      if (policy == slow_subscriber_policy::disconnect) {
+        CINATRA_LOG_WARNING << "close slow websocket subscriber, conn id: "
+                            << conn_id_;
+        close();
+      }
+      out.dropped++;
+      return false;
+    }
+
+    push_ws_frame({std::move(frame), {}});
+    return true;
+  }
+
+  // the send queue refuses messages from the time its bytes reach high until
+  // they drain to low, then the writable callback is called on the io thread.
+  void set_ws_send_queue_watermarks(size_t high, size_t low) {
+    ws_high_watermark_ = high;
+    ws_low_watermark_ = (std::min)(low, high);
+  }
+
+  void set_ws_writable_callback(std::function<void()> callback) {
+    ws_out().on_writable = std::move(callback);
+  }
+
+  // false while the send queue refuses messages.
+  bool ws_writable() const { return !ws_out_ || !ws_out_->paused; }
+
+  ws_queue_stats get_ws_queue_stats() const {
+    ws_queue_stats stats;
+    if (ws_out_) {
+      stats.depth = ws_out_->depth;
+      stats.bytes = ws_out_->bytes;
+      stats.sent = ws_out_->sent;
+      stats.dropped = ws_out_->dropped;
+      stats.batches = ws_out_->batches;
+    }
+    return stats;
+  }
+
+  // whether the connection takes a message of size compressed on its own by
+  // gzip_codec::deflate, e.g. the frame ws_hub shares. a connection which
+  // keeps the deflate window compresses every message itself.
+  bool use_shared_ws_deflate(size_t size) const {
+#ifdef CINATRA_ENABLE_GZIP
+    return ws_deflate_ && !ws_deflate_->context_takeover() &&
+           ws_deflate_->deflate_window_bits() == windowBits &&
+           ws_deflate_->need_compress(size);
+#else
+    return false;
+#endif
+  }
+
+  // the heartbeats of the io thread, set by the server, the connection is
+  // added at the websocket handshake.
+  void set_ws_heartbeat(std::shared_ptr<ws_heartbeat> heartbeat) {
+    ws_heartbeat_ = std::move(heartbeat);
+  }
+
+  // the tick of ws_heartbeat the peer was last heard of.
+  uint64_t ws_last_seen() const { return ws_last_seen_; }
+
+  // whether migrate() may move the connection.
+  bool can_migrate() const {
+    if (!ws_out_ || ws_relayed_) {
+      return false;
+    }
+#ifdef CINATRA_ENABLE_SSL
+    if (use_ssl_) {
+      return false;
+    }
+#endif
+    return true;
+  }
+
+  // the websocket bytes read and written, the load the rebalancer compares.
+  uint64_t ws_bytes() const {
+    return ws_bytes_.load(std::memory_order_relaxed);
+  }
+
+  // move the websocket connection to the io thread of executor, any thread.
+  // the move is done by the reader between two reads, its pending read is
+  // cancelled, and the socket is given to the new io_context. the websocket,
+  // compression and queue state stay with the connection, socket completions
+  // resume the handler on the new thread, the flush timer of write coalescing
+  // is made again there. an ssl connection is refused: asio::ssl::stream
+  // binds the timers which order its reads and writes to the old io_context,
+  // and making a new stream for the SSL* drops the tls records buffered in
+  // its bio pair. a relayed one is refused too, its backend stays on the old
+  // thread. heartbeat is the wheel of the new thread. false if the move isn't
+  // started.
+  bool migrate(coro_io::ExecutorWrapper<> *executor,
+               std::shared_ptr<ws_heartbeat> heartbeat = nullptr) {
+#ifdef CINATRA_ENABLE_SSL
+    if (use_ssl_) {
+      CINATRA_LOG_WARNING
+          << "ssl websocket connection can't be moved, conn id: " << conn_id_;
+      return false;
+    }
+#endif
+    if (has_closed_ || !can_migrate() || executor == executor_.load()) {
+      return false;
+    }
+    if (migrating_.exchange(true)) {
+      return false;
+    }
+
+    migrate_heartbeat_ = std::move(heartbeat);
+    migrate_to_.store(executor, std::memory_order_release);
+    executor_.load()->schedule([self = shared_from_this()] {
+      self->interrupt_ws_read();
+    });
+    return true;
+  }
+
+  // the server side permessage-deflate settings, see ws_deflate_options.
+#ifdef CINATRA_ENABLE_GZIP
+  void set_ws_deflate_options(
+      std::shared_ptr<const ws_deflate_options> options) {
+    ws_deflate_options_ = std::move(options);
+  }
+#endif
+
+  // the next message or control frame. the frames are parsed from head_buf_,
+  // which is filled with as much as the socket has, so many small frames are
+  // read with one syscall. a message of one frame which is in the buffer
+  // completely is delivered as a view into it, the fragments of a message are
+  // gathered in body_, the data is valid until the next call. the control
+  // frames between the fragments are returned as they come.
+  async_simple::coro::Lazy<websocket_result> read_websocket() {
+    websocket_result result{};
+    while (true) {
+      std::span<char> payload{};
+      if (auto ec = co_await read_ws_frame(payload); ec) {
+        result.ec = ec;
+        co_return result;
+      }
+
+      if (ws().get_opcode() <= opcode::binary) {
+        if (co_await read_ws_message(payload, result)) {
+          co_return result;
+        }
         continue;
       }
+
+      ws_frame_type type = ws().parse_payload(payload);
+      if (!ws().is_fin()) {
+        // a control frame can't be fragmented.
+        type = ws_frame_type::WS_ERROR_FRAME;
+      }
+
+      switch (type) {
+        case cinatra::ws_frame_type::WS_ERROR_FRAME:
+          close();
+          result.ec = std::make_error_code(std::errc::protocol_error);
+          break;
+        case cinatra::ws_frame_type::WS_CLOSE_FRAME: {
+#ifdef CINATRA_ENABLE_GZIP
+          if (!gzip_compress(payload, result)) {
+            break;
+          }
+#endif
+          close_frame close_frame =
+              ws().parse_close_payload(payload.data(), payload.size());
+          result.eof = true;
+          result.data = {close_frame.message, close_frame.length};
+
+          std::string close_msg = ws().format_close_payload(
+              close_code::normal, close_frame.message, close_frame.length);
+
+          co_await write_websocket(close_msg, opcode::close);
+          close();
+        } break;
+        case cinatra::ws_frame_type::WS_PING_FRAME: {
+          result.data = {payload.data(), payload.size()};
+          auto ec = co_await write_websocket(result.data, opcode::pong);
+          if (ec) {
+            close();
+            result.ec = ec;
+          }
+        } break;
+        case cinatra::ws_frame_type::WS_PONG_FRAME:
+          // not answered, it may be the answer to a heartbeat ping.
+          result.data = {payload.data(), payload.size()};
+          break;
+        default:
+          break;
+      }
+
+      result.type = type;
+      co_return result;
+    }
+  }
+
+  // a data frame, gathered in body_ or given to the stream handler. true if
+  // result is ready: a message, the end of a streamed one or an error.
+  async_simple::coro::Lazy<bool> read_ws_message(std::span<char> payload,
+                                                 websocket_result &result) {
+    auto &ws = this->ws();
+    bool fin = ws.is_fin();
+    bool cont = ws.get_opcode() == opcode::cont;
+    if (cont != ws_msg_started_) {
+      // a continuation out of a message, or a message inside another one.
+      co_await close_websocket(close_code::protocol_error, "unexpected frame");
+      result.ec = std::make_error_code(std::errc::protocol_error);
+      co_return true;
+    }
+
+    if (!cont) {
+      ws_msg_started_ = true;
+      ws_msg_type_ = ws.get_opcode() == opcode::text
+                         ? ws_frame_type::WS_TEXT_FRAME
+                         : ws_frame_type::WS_BINARY_FRAME;
+      ws_msg_compressed_ = ws.is_compressed();
+      ws_msg_first_piece_ = true;
+      ws_utf8_.reset();
+    }
+
+    if (ws_stream_handler_) {
+      size_t offset = 0;
+      while (true) {
+        ws.unmask(payload, offset);
+        offset += payload.size();
+        bool eof = fin && ws_frame_left_ == 0;
+        std::string_view piece(payload.data(), payload.size());
+        if (!piece.empty() || eof) {
+          if (!co_await decode_ws_data(piece, eof, result)) {
+            co_return true;
+          }
+          if (!ws_stream_handler_(ws_msg_type_, piece, eof)) {
+            co_await close_websocket(close_code::policy_error, "");
+            result.ec = std::make_error_code(std::errc::operation_canceled);
+            co_return true;
+          }
+        }
+        if (ws_frame_left_ == 0) {
+          break;
+        }
+        if (auto ec = co_await read_ws_frame_part(payload); ec) {
+          result.ec = ec;
+          co_return true;
+        }
+      }
+      if (!fin) {
+        co_return false;
+      }
+      ws_msg_started_ = false;
+      result.type = ws_msg_type_;
+      result.eof = true;
+      co_return true;
+    }
+
+    ws.unmask(payload, 0);
+    std::string_view msg(payload.data(), payload.size());
+    if (cont || !fin) {
+      if (!ws_payload_in_body_) {
+        if (!cont) {
+          body_.clear();
+        }
+        body_.append(msg);
+      }
+      if (!fin) {
+        co_return false;
+      }
+      msg = body_;
+    }
+
+    ws_msg_started_ = false;
+    if (!co_await decode_ws_data(msg, true, result)) {
+      co_return true;
+    }
+    result.type = ws_msg_type_;
+    result.eof = true;
+    result.data = msg;
+    co_return true;
+  }
+
+  // inflate a piece of the message and check the text is utf-8, false if the
+  // connection is closed for it.
+  async_simple::coro::Lazy<bool> decode_ws_data(std::string_view &data,
+                                                bool eof,
+                                                websocket_result &result) {
+    bool first = ws_msg_first_piece_;
+    ws_msg_first_piece_ = false;
+#ifdef CINATRA_ENABLE_GZIP
+    if (ws_deflate_ && ws_msg_compressed_) {
+      // a streamed message has no limit, but none of its pieces may inflate
+      // past the limit of a message.
+      inflate_str_.clear();
+      if (!ws_deflate_->decompress(data, inflate_str_, first, eof,
+                                   max_message_size_)) {
+        if (ws_inflate_too_big()) {
+          co_await close_websocket(close_code::too_big, "message_too_big");
+          result.ec = std::error_code(asio::error::message_size,
+                                      asio::error::get_system_category());
+          co_return false;
+        }
+        CINATRA_LOG_ERROR << "compress data error";
+        co_await close_websocket(close_code::bad_payload, "");
+        result.ec = std::make_error_code(std::errc::protocol_error);
+        co_return false;
+      }
+      data = inflate_str_;
+    }
+#else
+    (void)first;
+#endif
+    if (ws_msg_type_ == ws_frame_type::WS_TEXT_FRAME &&
+        (!ws_utf8_.update(data) || (eof && !ws_utf8_.finish()))) {
+      co_await close_websocket(close_code::bad_payload, "invalid utf-8");
+      result.ec = std::make_error_code(std::errc::illegal_byte_sequence);
+      co_return false;
+    }
+    co_return true;
+  }
+
+  // the next frame as the peer sent it, to relay it: a control frame is not
+  // answered and the payload is still masked. a compressed message is
+  // inflated, the frames relayed to the backend are not compressed. the
+  // payload is valid until the next read.
+  async_simple::coro::Lazy<std::error_code> read_ws_raw_frame(
+      ws_raw_frame &frame) {
+    ws_relayed_ = true;
+    // a frame larger than the read buffer is read into body_.
+    body_.clear();
+    std::span<char> payload;
+    if (auto ec = co_await read_ws_frame(payload); ec) {
+      co_return ec;
+    }
+
+    auto &ws = this->ws();
+    frame.op = ws.get_opcode();
+    frame.fin = ws.is_fin();
+    frame.compressed = false;
+    std::memcpy(frame.mask_key, ws.mask_key(), sizeof(frame.mask_key));
+    frame.header = {};
+    frame.payload = payload;
+    bool deflate = false;
+#ifdef CINATRA_ENABLE_GZIP
+    deflate = ws_deflate_ != nullptr;
+#endif
+    if (ws.is_compressed() &&
+        (!deflate || frame.op == opcode::cont || frame.op > opcode::binary)) {
+      close();
+      co_return std::make_error_code(std::errc::protocol_error);
+    }
+    if (frame.op == opcode::text || frame.op == opcode::binary) {
+      ws_msg_compressed_ = ws.is_compressed();
+      ws_msg_first_piece_ = true;
+    }
+    if (frame.op > opcode::binary || !ws_msg_compressed_) {
+      co_return std::error_code{};
+    }
+
+#ifdef CINATRA_ENABLE_GZIP
+    ws.unmask(payload, 0);
+    inflate_str_.clear();
+    if (!ws_deflate_->decompress({payload.data(), payload.size()},
+                                 inflate_str_, ws_msg_first_piece_, frame.fin,
+                                 max_message_size_)) {
+      if (ws_inflate_too_big()) {
+        co_await close_websocket(close_code::too_big, "message_too_big");
+        co_return std::error_code(asio::error::message_size,
+                                  asio::error::get_system_category());
+      }
+      close();
+      co_return std::make_error_code(std::errc::protocol_error);
+    }
+    ws_msg_first_piece_ = false;
+    std::memset(frame.mask_key, 0, sizeof(frame.mask_key));
+    frame.payload = inflate_str_;
+#endif
+    co_return std::error_code{};
+  }
+
+  // frames which are encoded already, e.g. relayed from a backend.
+  async_simple::coro::Lazy<std::error_code> write_ws_raw(
+      const std::vector<asio::const_buffer> &buffers) {
+    auto lock = co_await ws_out().mtx.coScopedLock();
+    co_await resume_on_io_thread();
+    co_return co_await write_coalesced(buffers);
+  }
+
+  async_simple::coro::Lazy<void> close_websocket(close_code code,
+                                                 std::string reason) {
+    std::string close_msg =
+        ws().format_close_payload(code, reason.data(), reason.size());
+    co_await write_websocket(close_msg, opcode::close);
+    close();
+  }
+
+  // the next frame, its payload is in head_buf_, or in body_ if it is larger
+  // than ws_read_buffer_size, after the message gathered there if it is a
+  // continuation. a larger data frame which is streamed is delivered as the
+  // part in head_buf_, read_ws_frame_part() reads the rest.
+  async_simple::coro::Lazy<std::error_code> read_ws_frame(
+      std::span<char> &payload) {
+    if (ws_consumed_ > 0) {
+      head_buf_.consume(ws_consumed_);
+      ws_consumed_ = 0;
+    }
+    ws_payload_in_body_ = false;
+
+    while (true) {
+      size_t size = head_buf_.size();
+      auto data_ptr = const_cast<char *>(
+          asio::buffer_cast<const char *>(head_buf_.data()));
+      auto status = ws().parse_header(data_ptr, size);
+      if (status == ws_header_status::error) {
+        close();
+        co_return std::make_error_code(std::errc::protocol_error);
+      }
+
+      if (status == ws_header_status::complete) {
+        size_t header_len = ws().header_length();
+        size_t payload_length = ws().payload_length();
+        auto op = ws().get_opcode();
+        if (op >= opcode::close && (payload_length > 125 || !ws().is_fin())) {
+          // rfc 6455 5.5, a control frame may come between the fragments of
+          // a message, it must not take the large frame path into body_.
+          co_await close_websocket(close_code::protocol_error,
+                                   "invalid control frame");
+          co_return std::make_error_code(std::errc::protocol_error);
+        }
+        bool streamed = ws_stream_handler_ && op <= opcode::binary;
+        uint64_t message_size =
+            payload_length + (op == opcode::cont ? body_.size() : 0);
+        if (!streamed &&
+            ((max_part_size_ != 0 && payload_length > max_part_size_) ||
+             (op <= opcode::binary && max_message_size_ != 0 &&
+              message_size > max_message_size_))) {
+          co_await close_websocket(close_code::too_big, "message_too_big");
+          co_return std::error_code(asio::error::message_size,
+                                    asio::error::get_system_category());
+        }
+
+        if (size - header_len >= payload_length) {
+          payload = {data_ptr + header_len, payload_length};
+          ws_consumed_ = header_len + payload_length;
+          co_return std::error_code{};
+        }
+
+        if (header_len + payload_length > ws_read_buffer_size) {
+          size_t part_size = size - header_len;
+          if (streamed) {
+            payload = {data_ptr + header_len, part_size};
+            ws_consumed_ = size;
+            ws_frame_left_ = payload_length - part_size;
+            co_return std::error_code{};
+          }
+
+          // a large frame is read into body_ without growing the buffer.
+          size_t offset = op == opcode::cont ? body_.size() : 0;
+          detail::resize(body_, offset + payload_length);
+          memcpy(body_.data() + offset, data_ptr + header_len, part_size);
+          head_buf_.consume(size);
+          auto [ec, _] = co_await async_read(
+              asio::buffer(body_.data() + offset + part_size,
+                           payload_length - part_size),
+              payload_length - part_size);
+          if (ec) {
+            close();
+            co_return ec;
+          }
+          ws_received(payload_length - part_size);
+          payload = {body_.data() + offset, payload_length};
+          ws_payload_in_body_ = true;
+          co_return std::error_code{};
+        }
+      }
+
+      if (migrate_to_.load(std::memory_order_acquire)) {
+        co_await migrate_ws();
+      }
+
+      ws_reading_ = true;
+      auto [ec, read_size] =
+          co_await async_read_some(head_buf_.prepare(ws_read_buffer_size));
+      ws_reading_ = false;
+      if (ws_migrate_locked_) {
+        // interrupt_ws_read() cancelled the read, or it was done already.
+        co_await migrate_ws();
+        if (ec == asio::error::operation_aborted) {
+          continue;
+        }
+      }
+      if (ec) {
+        close();
+        co_return ec;
+      }
+      head_buf_.commit(read_size);
+      ws_received(read_size);
+    }
+  }
+
+  void ws_received(size_t size) {
+    ws_bytes_.fetch_add(size, std::memory_order_relaxed);
+    if (ws_heartbeat_) {
+      ws_last_seen_ = ws_heartbeat_->now();
+    }
+  }
+
+  // the reader waits for the socket, the read is cancelled to move the
+  // connection now. a write or flush in flight would be cancelled too, then
+  // it is tried again later.
+  void interrupt_ws_read() {
+    if (!ws_reading_ || ws_migrate_locked_ || has_closed_) {
+      // moved before the next read.
+      return;
+    }
+    bool locked = ws_out_->mtx.tryLock();
+    if (locked && coalesce_ && !coalesce_->mtx.tryLock()) {
+      ws_out_->mtx.unlock();
+      locked = false;
+    }
+    if (!locked) {
+      auto timer = std::make_shared<asio::steady_timer>(
+          socket_.get_executor(), std::chrono::milliseconds(1));
+      timer->async_wait([self = shared_from_this(), timer](auto) {
+        self->interrupt_ws_read();
+      });
+      return;
+    }
+    ws_migrate_locked_ = true;
+    std::error_code ec;
+    socket_.cancel(ec);
+  }
+
+  // a coroutine which waited for the lock of the send queue is resumed on the
+  // thread it was started on, the connection may have moved meanwhile.
+  async_simple::coro::Lazy<void> resume_on_io_thread() {
+    if (!executor_.load()->currentThreadInExecutor()) {
+      co_await coro_io::post([] {}, executor_.load());
+    }
+  }
+
+  // the socket is moved to the io_context of migrate_to_ while no read or
+  // write is pending, then the reader continues on the new io thread.
+  async_simple::coro::Lazy<void> migrate_ws() {
+    if (!ws_migrate_locked_) {
+      co_await ws_out_->mtx.coLock();
+      if (coalesce_) {
+        co_await coalesce_->mtx.coLock();
+      }
+      ws_migrate_locked_ = true;
+    }
+
+    // the flush timer belongs to the old io_context, a flush it was waiting
+    // for is scheduled again on the new one.
+    bool reschedule_flush = false;
+    if (coalesce_ && coalesce_->timer) {
+      reschedule_flush = coalesce_->timer->cancel() > 0;
+      coalesce_->timer = nullptr;
+    }
+
+    auto target = migrate_to_.load(std::memory_order_acquire);
+    std::error_code ec;
+    {
+      // close() may be called from another thread, it closes the socket on
+      // the io thread it finds under the lock.
+      std::lock_guard lock(socket_mtx_);
+      if (has_closed_) {
+        ec = asio::error::bad_descriptor;
+      }
       else {
+        auto protocol = socket_.local_endpoint(ec).protocol();
+        asio::ip::tcp::socket socket(target->get_asio_executor());
+        if (!ec) {
+          auto handle = socket_.release(ec);
+          if (!ec) {
+            socket.assign(protocol, handle, ec);
+          }
+        }
+        if (ec) {
+          CINATRA_LOG_WARNING << "move websocket connection failed, conn id: "
+                              << conn_id_ << ", " << ec.message();
+        }
+        else {
+          socket_ = std::move(socket);
+          executor_ = target;
+        }
+      }
+    }
+
+    auto heartbeat = std::move(migrate_heartbeat_);
+    co_await resume_on_io_thread();
+    if (!ec) {
+      // the wheel of the old thread drops the connection.
+      ws_heartbeat_ = std::move(heartbeat);
+      if (ws_heartbeat_) {
+        ws_last_seen_ = ws_heartbeat_->now();
+        ws_heartbeat_->add(weak_from_this());
+      }
+    }
+
+    if (reschedule_flush) {
+      schedule_flush();
+    }
+
+    ws_migrate_locked_ = false;
+    migrate_to_ = nullptr;
+    migrating_ = false;
+    if (coalesce_) {
+      coalesce_->mtx.unlock();
+    }
+    ws_out_->mtx.unlock();
+    if (ec) {
+      close();
+    }
+  }
+
+  // the next part of a frame which is streamed.
+  async_simple::coro::Lazy<std::error_code> read_ws_frame_part(
+      std::span<char> &payload) {
+    head_buf_.consume(ws_consumed_);
+    ws_consumed_ = 0;
+    if (head_buf_.size() == 0) {
+      auto [ec, read_size] = co_await async_read_some(
+          head_buf_.prepare((std::min)(ws_frame_left_, ws_stream_read_size)));
+      if (ec) {
         close();
-        result.ec = std::make_error_code(std::errc::protocol_error);
-        co_return result;
+        co_return ec;
       }
+      head_buf_.commit(read_size);
+      ws_received(read_size);
     }
 
-    co_return result;
+    size_t size = (std::min)(head_buf_.size(), ws_frame_left_);
+    payload = {const_cast<char *>(
+                   asio::buffer_cast<const char *>(head_buf_.data())),
+               size};
+    ws_consumed_ = size;
+    ws_frame_left_ -= size;
+    co_return std::error_code{};
   }
 
 #ifdef CINATRA_ENABLE_GZIP
+  // whether the last decompress() stopped at max_message_size_.
+  bool ws_inflate_too_big() const {
+    return max_message_size_ != 0 && inflate_str_.size() > max_message_size_;
+  }
+
   bool gzip_compress(std::span<char> &payload, websocket_result &result) {
-    if (is_client_ws_compressed_) {
+    if (ws_deflate_ && ws().is_compressed()) {
       inflate_str_.clear();
-      if (!cinatra::gzip_codec::inflate({payload.data(), payload.size()},
-                                        inflate_str_)) {
+      if (!ws_deflate_->decompress({payload.data(), payload.size()},
+                                   inflate_str_, true, true,
+                                   max_message_size_)) {
+        if (ws_inflate_too_big()) {
+          close();
+          result.ec = std::error_code(asio::error::message_size,
+                                      asio::error::get_system_category());
+          return false;
+        }
         CINATRA_LOG_ERROR << "compress data error";
         result.ec = std::make_error_code(std::errc::protocol_error);
         return false;
@@ -774,19 +2043,50 @@ class coro_http_connection
 
   auto &tcp_socket() { return socket_; }
 
+  // null if the connection is encrypted.
+  asio::ip::tcp::socket *plain_socket() {
+#ifdef CINATRA_ENABLE_SSL
+    if (use_ssl_) {
+      return nullptr;
+    }
+#endif
+    return &socket_;
+  }
+
   void set_quit_callback(std::function<void(const uint64_t &conn_id)> callback,
                          uint64_t conn_id) {
     quit_cb_ = std::move(callback);
     conn_id_ = conn_id;
   }
 
+  // the largest frame, and the largest message gathered from fragments, 0
+  // for no limit. a larger one closes the connection with too_big.
   void set_ws_max_size(uint64_t max_size) { max_part_size_ = max_size; }
 
+  void set_ws_max_message_size(uint64_t max_size) {
+    max_message_size_ = max_size;
+  }
+
+  // stream the data messages instead of gathering them, the handler gets
+  // every piece as it is read, type is the type of the message and eof is
+  // set on its last piece. read_websocket() returns when a message ends,
+  // with empty data. the limits of set_ws_max_size() don't apply to the data
+  // frames then, return false from the handler to close the connection.
+  void set_ws_stream_handler(
+      std::function<bool(ws_frame_type type, std::string_view data, bool eof)>
+          handler) {
+    ws_stream_handler_ = std::move(handler);
+  }
+
   void set_shrink_to_fit(bool r) {
     need_shrink_every_time_ = r;
     response_.set_shrink_to_fit(r);
   }
 
+  void set_compress_policy(std::shared_ptr<compress_policy> policy) {
+    response_.set_compress_policy(std::move(policy));
+  }
+
 #ifdef INJECT_FOR_HTTP_SEVER_TEST
   async_simple::coro::Lazy<std::pair<std::error_code, size_t>>
   async_write_failed() {
@@ -820,25 +2120,50 @@ class coro_http_connection
 #endif
   }
 
+  template <typename AsioBuffer>
+  async_simple::coro::Lazy<std::pair<std::error_code, size_t>> async_read_some(
+      AsioBuffer &&buffer) {
+#ifdef INJECT_FOR_HTTP_SEVER_TEST
+    if (read_failed_forever_) {
+      return async_read_failed();
+    }
+#endif
+    set_last_time();
+#ifdef CINATRA_ENABLE_SSL
+    if (use_ssl_) {
+      return coro_io::async_read_some(*ssl_stream_, buffer);
+    }
+    else {
+#endif
+      return coro_io::async_read_some(socket_, buffer);
+#ifdef CINATRA_ENABLE_SSL
+    }
+#endif
+  }
+
   template <typename AsioBuffer>
   async_simple::coro::Lazy<std::pair<std::error_code, size_t>> async_write(
       AsioBuffer &&buffer) {
 #ifdef INJECT_FOR_HTTP_SEVER_TEST
     if (write_failed_forever_) {
-      return async_write_failed();
+      co_return co_await async_write_failed();
     }
 #endif
     set_last_time();
+    std::pair<std::error_code, size_t> result;
 #ifdef CINATRA_ENABLE_SSL
     if (use_ssl_) {
-      return coro_io::async_write(*ssl_stream_, buffer);
+      result = co_await coro_io::async_write(*ssl_stream_, buffer);
     }
     else {
 #endif
-      return coro_io::async_write(socket_, buffer);
+      result = co_await coro_io::async_write(socket_, buffer);
 #ifdef CINATRA_ENABLE_SSL
     }
 #endif
+    write_stats_.write_calls++;
+    write_stats_.bytes += result.second;
+    co_return result;
   }
 
   template <typename AsioBuffer>
@@ -867,23 +2192,41 @@ class coro_http_connection
     return last_rwtime_;
   }
 
-  auto get_executor() { return executor_; }
+  coro_io::ExecutorWrapper<> *get_executor() { return executor_.load(); }
 
   void close(bool need_cb = true) {
     if (has_closed_) {
       return;
     }
 
-    asio::dispatch(socket_.get_executor(),
-                   [this, need_cb, self = shared_from_this()] {
-                     std::error_code ec;
-                     socket_.shutdown(asio::socket_base::shutdown_both, ec);
-                     socket_.close(ec);
-                     if (need_cb && quit_cb_) {
-                       quit_cb_(conn_id_);
-                     }
-                     has_closed_ = true;
-                   });
+    // called from any thread, the socket may be moved to another io thread
+    // meanwhile, see migrate_ws().
+    asio::any_io_executor executor;
+    {
+      std::lock_guard lock(socket_mtx_);
+      executor = socket_.get_executor();
+    }
+    asio::dispatch(executor, [this, need_cb, executor,
+                              self = shared_from_this()] {
+      {
+        std::unique_lock lock(socket_mtx_);
+        if (has_closed_) {
+          return;
+        }
+        if (socket_.get_executor() != executor) {
+          lock.unlock();
+          close(need_cb);
+          return;
+        }
+        std::error_code ec;
+        socket_.shutdown(asio::socket_base::shutdown_both, ec);
+        socket_.close(ec);
+        has_closed_ = true;
+      }
+      if (need_cb && quit_cb_) {
+        quit_cb_(conn_id_);
+      }
+    });
   }
 
   uint64_t conn_id() const { return conn_id_; }
@@ -892,6 +2235,19 @@ class coro_http_connection
 
   void set_check_timeout(bool r) { checkout_timeout_ = r; }
 
+  // give the read buffers back to the per-thread pool while the connection
+  // waits for its next request, and drop the body and response strings if
+  // they have grown beyond idle_buffer_size.
+  void set_release_idle_buffers(bool r, size_t idle_buffer_size = 4096) {
+    release_idle_buffers_ = r;
+    idle_buffer_size_ = idle_buffer_size;
+  }
+
+  void set_spool(std::string dir, size_t memory_threshold) {
+    spool_dir_ = std::move(dir);
+    spool_memory_threshold_ = memory_threshold;
+  }
+
   void handle_session_for_response() {
     if (request_.has_session()) {
       auto session =
@@ -904,6 +2260,51 @@ class coro_http_connection
   }
 
  private:
+  // the next request hasn't arrived yet, the connection is idle until the
+  // socket becomes readable. false if it is closed.
+  async_simple::coro::Lazy<bool> wait_request() {
+#ifdef CINATRA_ENABLE_SSL
+    // the ssl stream may hold decrypted data the socket doesn't know about.
+    if (use_ssl_) {
+      co_return true;
+    }
+#endif
+    if (available() > 0) {
+      co_return true;
+    }
+
+    release_buffers();
+    auto ec = co_await coro_io::async_wait(socket_,
+                                           asio::ip::tcp::socket::wait_read);
+    co_return !ec;
+  }
+
+  void release_buffers() {
+    parser_.shrink_headers();
+    if (head_buf_.size() == 0) {
+      std::destroy_at(&head_buf_);
+      std::construct_at(&head_buf_);
+    }
+    if (chunked_buf_.size() == 0) {
+      std::destroy_at(&chunked_buf_);
+      std::construct_at(&chunked_buf_);
+    }
+    if (body_.capacity() > idle_buffer_size_) {
+      std::string{}.swap(body_);
+    }
+    if (resp_str_.capacity() > idle_buffer_size_) {
+      std::string{}.swap(resp_str_);
+    }
+    if (response_.get_arena().capacity() > idle_buffer_size_) {
+      response_.get_arena().release();
+    }
+    if (coalesce_ && coalesce_->out_buf.empty() &&
+        coalesce_->out_buf.capacity() > idle_buffer_size_) {
+      std::string{}.swap(coalesce_->out_buf);
+      std::string{}.swap(coalesce_->out_sending);
+    }
+  }
+
   bool check_keep_alive() {
     if (parser_.has_close()) {
       return false;
@@ -911,6 +2312,147 @@ class coro_http_connection
     return true;
   }
 
+  // the checks which only need the head of a request: the max body size of
+  // the route, the admission check of the server and, when the client waits
+  // for 100 Continue, the before aspects of the route.
+  bool admit_request(std::string_view key, int64_t route_max_body_len) {
+    if (route_max_body_len >= 0 && parser_.body_len() > route_max_body_len) {
+      CINATRA_LOG_WARNING << "request body is too large: "
+                          << parser_.body_len();
+      response_.set_status_and_content(status_type::request_entity_too_large,
+                                       "request body is too large");
+      return false;
+    }
+
+    auto status = response_.status();
+    bool ok = !admission_check_ || admission_check_(request_, response_);
+    if (ok && request_.is_expect_continue()) {
+      if (auto checked = router_.check_before(key, request_, response_)) {
+        ok = *checked;
+        request_.set_before_checked(true);
+      }
+    }
+    if (!ok && response_.status() == status) {
+      response_.set_status_and_content(status_type::forbidden,
+                                       "request rejected");
+    }
+    return ok;
+  }
+
+  void start_stream_body(bool chunked) {
+    stream_chunked_ = chunked;
+    stream_chunk_crlf_ = false;
+    stream_remaining_ = chunked ? 0 : (size_t)parser_.body_len();
+    stream_eof_ = !chunked && stream_remaining_ == 0;
+    if (head_buf_.size() > 0) {
+      const char *data_ptr = asio::buffer_cast<const char *>(head_buf_.data());
+      chunked_buf_.sputn(data_ptr, head_buf_.size());
+      head_buf_.consume(head_buf_.size());
+    }
+#ifdef CINATRA_ENABLE_GZIP
+    body_inflater_ = nullptr;
+    if (request_.get_encoding_type() == content_encoding::gzip) {
+      body_inflater_ = std::make_unique<gzip_codec::inflate_stream>();
+      detail::resize(inflate_in_buf_, 16 * 1024);
+    }
+#endif
+  }
+
+  // the body bytes as they are on the wire, without the chunk framing.
+  async_simple::coro::Lazy<chunked_result> read_raw_body_some(
+      std::span<char> buf) {
+    chunked_result result{};
+    if (stream_eof_) {
+      result.eof = true;
+      co_return result;
+    }
+
+    std::error_code ec;
+    size_t size = 0;
+    if (stream_chunked_ && stream_remaining_ == 0) {
+      if (stream_chunk_crlf_) {
+        // the CRLF which ends the data of the previous chunk.
+        std::tie(ec, size) = co_await async_read_until(chunked_buf_, CRCF);
+        if (ec || size != CRCF.size()) {
+          result.ec = ec ? ec : std::make_error_code(std::errc::protocol_error);
+          close();
+          co_return result;
+        }
+        chunked_buf_.consume(size);
+        stream_chunk_crlf_ = false;
+      }
+
+      if (std::tie(ec, size) = co_await async_read_until(chunked_buf_, CRCF);
+          ec) {
+        result.ec = ec;
+        close();
+        co_return result;
+      }
+      const char *data_ptr =
+          asio::buffer_cast<const char *>(chunked_buf_.data());
+      size_t chunk_size = 0;
+      auto [ptr, err] =
+          std::from_chars(data_ptr, data_ptr + size, chunk_size, 16);
+      if (err != std::errc{}) {
+        CINATRA_LOG_ERROR << "bad chunked size";
+        result.ec = std::make_error_code(std::errc::protocol_error);
+        close();
+        co_return result;
+      }
+      chunked_buf_.consume(size);
+
+      if (chunk_size == 0) {
+        // the last chunk, skip the trailers until the empty line.
+        do {
+          if (std::tie(ec, size) =
+                  co_await async_read_until(chunked_buf_, CRCF);
+              ec) {
+            result.ec = ec;
+            close();
+            co_return result;
+          }
+          chunked_buf_.consume(size);
+        } while (size != CRCF.size());
+        stream_eof_ = true;
+        result.eof = true;
+        co_return result;
+      }
+      stream_remaining_ = chunk_size;
+    }
+
+    size_t want = (std::min)(buf.size(), stream_remaining_);
+    if (chunked_buf_.size() > 0) {
+      size = (std::min)(want, chunked_buf_.size());
+      const char *data_ptr =
+          asio::buffer_cast<const char *>(chunked_buf_.data());
+      memcpy(buf.data(), data_ptr, size);
+      chunked_buf_.consume(size);
+    }
+    else {
+      std::tie(ec, size) =
+          co_await async_read_some(asio::buffer(buf.data(), want));
+      if (ec) {
+        CINATRA_LOG_ERROR << "read body error: " << ec.message();
+        result.ec = ec;
+        close();
+        co_return result;
+      }
+    }
+
+    stream_remaining_ -= size;
+    if (stream_remaining_ == 0) {
+      if (stream_chunked_) {
+        stream_chunk_crlf_ = true;
+      }
+      else {
+        stream_eof_ = true;
+        result.eof = true;
+      }
+    }
+    result.data = std::string_view(buf.data(), size);
+    co_return result;
+  }
+
   void build_ws_handshake_head() {
     uint8_t sha1buf[20], key_src[60];
     char accept_key[29];
@@ -932,9 +2474,16 @@ class coro_http_connection
     response_.add_header("Sec-WebSocket-Accept", std::string(accept_key, 28));
     auto protocal_str = request_.get_header_value("sec-websocket-protocol");
 #ifdef CINATRA_ENABLE_GZIP
-    if (is_client_ws_compressed_) {
-      response_.add_header("Sec-WebSocket-Extensions",
-                           "permessage-deflate; client_no_context_takeover");
+    if (auto offers = request_.get_header_value("sec-websocket-extensions");
+        !offers.empty()) {
+      static const ws_deflate_options default_options{};
+      std::string extensions;
+      ws_deflate_ = permessage_deflate::accept(
+          offers, ws_deflate_options_ ? *ws_deflate_options_ : default_options,
+          extensions);
+      if (ws_deflate_) {
+        response_.add_header("Sec-WebSocket-Extensions", extensions);
+      }
     }
 #endif
     if (!protocal_str.empty()) {
@@ -942,6 +2491,169 @@ class coro_http_connection
     }
   }
 
+  // only upgraded connections need the websocket state.
+  websocket &ws() {
+    if (!ws_) {
+      ws_ = std::make_unique<websocket>();
+    }
+    return *ws_;
+  }
+
+  struct ws_out_frame {
+    // a frame shared by the subscribers of ws_hub, or a frame of its own.
+    std::shared_ptr<const std::string> shared;
+    std::string owned;
+    // owned is the message, it is encoded by the writer.
+    bool deferred = false;
+    opcode op = opcode::text;
+
+    std::string_view data() const {
+      return shared ? std::string_view(*shared) : std::string_view(owned);
+    }
+  };
+
+  struct ws_out_state {
+    mpsc_queue<ws_out_frame> frames;
+    std::atomic<size_t> depth = 0;
+    std::atomic<size_t> bytes = 0;
+    std::atomic<uint64_t> sent = 0;
+    std::atomic<uint64_t> dropped = 0;
+    std::atomic<uint64_t> batches = 0;
+    // set at the high watermark, cleared at the low watermark.
+    std::atomic<bool> paused = false;
+    // a coroutine is writing the queue or about to.
+    std::atomic<bool> scheduled = false;
+    std::function<void()> on_writable;
+    // one frame or batch is written at a time.
+    async_simple::coro::Mutex mtx;
+  };
+
+  ws_out_state &ws_out() {
+    if (!ws_out_) {
+      ws_out_ = std::make_unique<ws_out_state>();
+    }
+    return *ws_out_;
+  }
+
+#ifdef CINATRA_ENABLE_GZIP
+  // only whole data messages are compressed.
+  bool need_ws_compress(std::string_view msg, opcode op, bool eof) const {
+    return ws_deflate_ && eof && (op == opcode::text || op == opcode::binary) &&
+           ws_deflate_->need_compress(msg.size());
+  }
+#endif
+
+  // a message which shares the deflate window with the messages before it
+  // can only be compressed by the writer of the queue.
+  bool defer_ws_compress(std::string_view msg, opcode op) const {
+#ifdef CINATRA_ENABLE_GZIP
+    return need_ws_compress(msg, op, true) && ws_deflate_->context_takeover();
+#else
+    return false;
+#endif
+  }
+
+  bool encode_ws_frame(std::string &frame, std::string_view msg, opcode op) {
+    websocket ws;
+#ifdef CINATRA_ENABLE_GZIP
+    if (need_ws_compress(msg, op, true)) {
+      std::string dest_buf;
+      if (!ws_deflate_->compress(msg, dest_buf)) {
+        CINATRA_LOG_ERROR << "compress data error, data: " << msg;
+        return false;
+      }
+      auto header = ws.encode_ws_header(dest_buf.size(), op, true, true, false);
+      frame.reserve(header.size() + dest_buf.size());
+      frame.append(header).append(dest_buf);
+      return true;
+    }
+#endif
+    auto header = ws.encode_ws_header(msg.size(), op, true, false, false);
+    frame.reserve(header.size() + msg.size());
+    frame.append(header).append(msg);
+    return true;
+  }
+
+  void push_ws_frame(ws_out_frame frame) {
+    auto &out = *ws_out_;
+    size_t size = frame.data().size();
+    out.depth++;
+    if (out.bytes.fetch_add(size) + size >= ws_high_watermark_) {
+      out.paused = true;
+    }
+    out.frames.push(std::move(frame));
+    if (!out.scheduled.exchange(true)) {
+      executor_.load()->schedule([self = shared_from_this()] {
+        send_ws_frames(self).via(self->executor_.load()).detach();
+      });
+    }
+  }
+
+  // writes the queue until it is empty, on the io thread.
+  static async_simple::coro::Lazy<void> send_ws_frames(
+      std::shared_ptr<coro_http_connection> self) {
+    auto &out = *self->ws_out_;
+    auto lock = co_await out.mtx.coScopedLock();
+    co_await self->resume_on_io_thread();
+    std::vector<ws_out_frame> sending;
+    std::vector<asio::const_buffer> buffers;
+    while (true) {
+      while (sending.size() < ws_max_batch) {
+        auto frame = out.frames.pop();
+        if (!frame) {
+          break;
+        }
+        sending.push_back(std::move(*frame));
+      }
+
+      if (sending.empty()) {
+        out.scheduled = false;
+        // a producer which pushed before the flag was cleared didn't
+        // schedule a writer.
+        if (out.frames.empty() || out.scheduled.exchange(true)) {
+          break;
+        }
+        continue;
+      }
+
+      size_t bytes = 0;
+      for (auto &frame : sending) {
+        bytes += frame.data().size();
+        if (frame.deferred) {
+          std::string encoded;
+          if (!self->encode_ws_frame(encoded, frame.owned, frame.op)) {
+            self->close();
+          }
+          frame.owned = std::move(encoded);
+        }
+        buffers.push_back(asio::buffer(frame.data()));
+      }
+      if (self->has_closed_) {
+        out.dropped += sending.size();
+      }
+      else if (auto ec = co_await self->write_coalesced(buffers); ec) {
+        out.dropped += sending.size();
+        self->close();
+      }
+      else {
+        out.sent += sending.size();
+        out.batches++;
+        self->ws_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+      }
+      out.depth -= sending.size();
+      size_t left = out.bytes.fetch_sub(bytes) - bytes;
+      sending.clear();
+      buffers.clear();
+
+      if (out.paused && left <= self->ws_low_watermark_) {
+        out.paused = false;
+        if (out.on_writable && !self->has_closed_) {
+          out.on_writable();
+        }
+      }
+    }
+  }
+
   void set_address_impl(std::string &address, bool remote = true) {
     if (has_closed_) {
       return;
@@ -961,12 +2673,16 @@ class coro_http_connection
 
  private:
   friend class multipart_reader_t<coro_http_connection>;
-  coro_io::ExecutorWrapper<> *executor_;
+  // changed by a move to another io thread, see migrate().
+  std::atomic<coro_io::ExecutorWrapper<> *> executor_;
+  // guards socket_ against the move while close() is called from another
+  // thread.
+  std::mutex socket_mtx_;
   asio::ip::tcp::socket socket_;
   coro_http_router &router_;
-  asio::streambuf head_buf_;
+  pooled_streambuf head_buf_;
   std::string body_;
-  asio::streambuf chunked_buf_;
+  pooled_streambuf chunked_buf_;
   http_parser parser_;
   bool keep_alive_;
   coro_http_request request_;
@@ -979,14 +2695,56 @@ class coro_http_connection
   std::atomic<std::chrono::system_clock::time_point> last_rwtime_ =
       std::chrono::system_clock::now();
   uint64_t max_part_size_ = 8 * 1024 * 1024;
+  uint64_t max_message_size_ = 64 * 1024 * 1024;
   std::string resp_str_;
 
 #ifdef CINATRA_ENABLE_GZIP
-  bool is_client_ws_compressed_ = false;
+  std::unique_ptr<permessage_deflate> ws_deflate_;
+  std::shared_ptr<const ws_deflate_options> ws_deflate_options_;
   std::string inflate_str_;
 #endif
 
-  websocket ws_;
+  std::unique_ptr<websocket> ws_;
+  // the frame delivered last, it is consumed from head_buf_ on the next read.
+  size_t ws_consumed_ = 0;
+  // the payload of the frame read last is in body_.
+  bool ws_payload_in_body_ = false;
+  // the payload left of a frame which is streamed.
+  size_t ws_frame_left_ = 0;
+  // the data message being read, its frames are gathered in body_ or given
+  // to ws_stream_handler_.
+  bool ws_msg_started_ = false;
+  bool ws_msg_compressed_ = false;
+  bool ws_msg_first_piece_ = false;
+  ws_frame_type ws_msg_type_ = ws_frame_type::WS_TEXT_FRAME;
+  utf8_validator ws_utf8_;
+  std::function<bool(ws_frame_type, std::string_view, bool)>
+      ws_stream_handler_;
+  // how much is read from the socket at once, a larger frame is read into
+  // body_.
+  static constexpr size_t ws_read_buffer_size = 8 * 1024;
+  // the most of a request body left unread by a stream route which is read
+  // and dropped to keep the connection.
+  static constexpr size_t max_discard_size = 64 * 1024;
+  // how much of a streamed frame is read at once.
+  static constexpr size_t ws_stream_read_size = 64 * 1024;
+  static constexpr size_t ws_max_batch = 64;
+  std::unique_ptr<ws_out_state> ws_out_;
+  size_t ws_high_watermark_ = 4 * 1024 * 1024;
+  size_t ws_low_watermark_ = 1024 * 1024;
+  std::shared_ptr<ws_heartbeat> ws_heartbeat_;
+  uint64_t ws_last_seen_ = 0;
+  std::atomic<uint64_t> ws_bytes_ = 0;
+  // a move to another io thread, see migrate().
+  std::atomic<bool> migrating_ = false;
+  std::atomic<coro_io::ExecutorWrapper<> *> migrate_to_ = nullptr;
+  std::shared_ptr<ws_heartbeat> migrate_heartbeat_;
+  // the frames are relayed to a backend, see read_ws_raw_frame().
+  std::atomic<bool> ws_relayed_ = false;
+  // the reader waits for the socket.
+  bool ws_reading_ = false;
+  // the send queue is locked for the move.
+  bool ws_migrate_locked_ = false;
 #ifdef CINATRA_ENABLE_SSL
   std::unique_ptr<asio::ssl::context> ssl_ctx_ = nullptr;
   std::unique_ptr<asio::ssl::stream<asio::ip::tcp::socket &>> ssl_stream_;
@@ -997,9 +2755,42 @@ class coro_http_connection
   std::function<async_simple::coro::Lazy<void>(coro_http_request &,
                                                coro_http_response &)>
       default_handler_ = nullptr;
+  std::function<bool(coro_http_request &, coro_http_response &)>
+      admission_check_ = nullptr;
   std::string chunk_size_str_;
+  std::string compressed_chunk_;
+  bool release_idle_buffers_ = false;
+  size_t idle_buffer_size_ = 4096;
+  bool coalesce_writes_ = false;
+  // only allocated once write coalescing is enabled.
+  struct coalesce_state {
+    std::chrono::microseconds flush_delay{};
+    size_t max_buffered = 64 * 1024;
+    bool flush_scheduled = false;
+    std::string out_buf;
+    std::string out_sending;
+    std::error_code ec;
+    async_simple::coro::Mutex mtx;
+    std::unique_ptr<asio::steady_timer> timer;
+  };
+  std::unique_ptr<coalesce_state> coalesce_;
+  write_stats write_stats_;
+  std::string stream_out_;
+  size_t stream_coalesce_size_ = 16 * 1024;
+  bool stream_corked_ = false;
+  bool stream_body_ = false;
+  bool stream_chunked_ = false;
+  bool stream_chunk_crlf_ = false;
+  bool stream_eof_ = false;
+  size_t stream_remaining_ = 0;
+#ifdef CINATRA_ENABLE_GZIP
+  std::unique_ptr<gzip_codec::inflate_stream> body_inflater_;
+  std::string inflate_in_buf_;
+#endif
   std::string remote_addr_;
   int64_t max_http_body_len_ = 0;
+  std::string spool_dir_;
+  size_t spool_memory_threshold_ = 64 * 1024;
 #ifdef INJECT_FOR_HTTP_SEVER_TEST
   bool write_failed_forever_ = false;
   bool read_failed_forever_ = false;
@@ -10,6 +10,7 @@
 #include "async_simple/coro/Lazy.h"
 #include "define.h"
 #include "http_parser.hpp"
+#include "request_arena.hpp"
 #include "session.hpp"
 #include "session_manager.hpp"
 #include "utils.hpp"
@@ -154,6 +155,8 @@ class coro_http_request {
         return content_encoding::deflate;
       else if (encoding_type.find("br") != std::string_view::npos)
         return content_encoding::br;
+      else if (encoding_type.find("zstd") != std::string_view::npos)
+        return content_encoding::zstd;
       else
         return content_encoding::none;
     }
@@ -231,6 +234,19 @@ class coro_http_request {
     return true;
   }
 
+  // the client waits for 100 Continue before it sends the body.
+  // an HTTP/1.0 client doesn't know 100 Continue, its Expect is ignored.
+  bool is_expect_continue() {
+    return parser_.minor_version() >= 1 &&
+           iequal0(get_header_value("Expect"), "100-continue");
+  }
+
+  // the before aspects of the route have run when the request was admitted,
+  // before its body was read.
+  void set_before_checked(bool r) { before_checked_ = r; }
+
+  bool is_before_checked() const { return before_checked_; }
+
   bool is_support_compressed() {
     auto extension_str = get_header_value("Sec-WebSocket-Extensions");
     if (extension_str.find("permessage-deflate") != std::string::npos) {
@@ -254,6 +270,17 @@ class coro_http_request {
 
   std::vector<std::string> &get_aspect_data() { return aspect_data_; }
 
+  void set_arena(request_arena *arena) { arena_ = arena; }
+
+  // allocates from the arena of the request, the memory is valid until the
+  // response has been sent.
+  std::pmr::polymorphic_allocator<std::byte> get_allocator() {
+    if (arena_ != nullptr) {
+      return arena_;
+    }
+    return std::pmr::get_default_resource();
+  }
+
   std::unordered_map<std::string_view, std::string_view> get_cookies(
       std::string_view cookie_str) const {
     auto cookies = get_cookies_map(cookie_str);
@@ -289,6 +316,7 @@ class coro_http_request {
   bool has_session() { return !cached_session_id_.empty(); }
   void clear() {
     body_ = {};
+    before_checked_ = false;
     if (!aspect_data_.empty()) {
       aspect_data_.clear();
     }
@@ -305,6 +333,8 @@ class coro_http_request {
   std::string_view body_;
   coro_http_connection *conn_;
   bool is_websocket_ = false;
+  bool before_checked_ = false;
+  request_arena *arena_ = nullptr;
   std::vector<std::string> aspect_data_;
   std::string cached_session_id_;
   std::any user_data_;
@@ -10,25 +10,17 @@
 
 #include "async_simple/coro/Lazy.h"
 #include "async_simple/coro/SyncAwait.h"
+#include "compressor.hpp"
 #include "cookie.hpp"
 #include "define.h"
-#ifdef CINATRA_ENABLE_GZIP
-#include "gzip.hpp"
-#endif
-#ifdef CINATRA_ENABLE_BROTLI
-#include "brzip.hpp"
-#endif
 #include "picohttpparser.h"
+#include "request_arena.hpp"
 #include "response_cv.hpp"
 #include "time_util.hpp"
 #include "utils.hpp"
+#include "ylt/coro_io/mmap_file.hpp"
 
 namespace cinatra {
-struct resp_header {
-  std::string key;
-  std::string value;
-};
-
 struct resp_header_sv {
   std::string_view key;
   std::string_view value;
@@ -67,88 +59,24 @@ class coro_http_response {
       content_encoding encoding = content_encoding::none, bool is_view = true,
       std::string_view client_encoding_type = "") {
     status_ = status;
-#ifdef CINATRA_ENABLE_GZIP
-    if (encoding == content_encoding::gzip) {
-      if (client_encoding_type.empty() ||
-          client_encoding_type.find("gzip") != std::string_view::npos) {
-        std::string encode_str;
-        bool r = gzip_codec::compress(content, encode_str);
-        if (!r) {
-          set_status_and_content(status_type::internal_server_error,
-                                 "gzip compress error");
-        }
-        else {
-          add_header("Content-Encoding", "gzip");
-          set_content(std::move(encode_str));
-        }
+    if (need_compress(encoding, client_encoding_type,
+                      std::string_view(content).size())) {
+      std::string encode_str;
+      bool r = compress_content(encoding, content, encode_str,
+                                compress_policy_.get());
+      if (!r) {
+        set_status_and_content(
+            status_type::internal_server_error,
+            std::string(encoding_name(encoding)).append(" compress error"));
       }
       else {
-        if (is_view) {
-          content_view_ = content;
-        }
-        else {
-          content_ = std::move(content);
-        }
+        add_header("Content-Encoding", std::string(encoding_name(encoding)));
+        set_content(std::move(encode_str));
       }
       has_set_content_ = true;
       return;
     }
 
-    if (encoding == content_encoding::deflate) {
-      if (client_encoding_type.empty() ||
-          client_encoding_type.find("deflate") != std::string_view::npos) {
-        std::string deflate_str;
-        bool r = gzip_codec::deflate(content, deflate_str);
-        if (!r) {
-          set_status_and_content(status_type::internal_server_error,
-                                 "deflate compress error");
-        }
-        else {
-          add_header("Content-Encoding", "deflate");
-          set_content(std::move(deflate_str));
-        }
-      }
-      else {
-        if (is_view) {
-          content_view_ = content;
-        }
-        else {
-          content_ = std::move(content);
-        }
-      }
-      has_set_content_ = true;
-      return;
-    }
-#endif
-
-#ifdef CINATRA_ENABLE_BROTLI
-    if (encoding == content_encoding::br) {
-      if (client_encoding_type.empty() ||
-          client_encoding_type.find("br") != std::string_view::npos) {
-        std::string br_str;
-        bool r = br_codec::brotli_compress(content, br_str);
-        if (!r) {
-          set_status_and_content(status_type::internal_server_error,
-                                 "br compress error");
-        }
-        else {
-          add_header("Content-Encoding", "br");
-          set_content(std::move(br_str));
-        }
-      }
-      else {
-        if (is_view) {
-          content_view_ = content;
-        }
-        else {
-          content_ = std::move(content);
-        }
-      }
-      has_set_content_ = true;
-      return;
-    }
-#endif
-
     if (is_view) {
       content_view_ = content;
     }
@@ -157,6 +85,37 @@ class coro_http_response {
     }
     has_set_content_ = true;
   }
+
+  // send a mapped file as the body without copying it, the mapping is held
+  // until the response has been sent. a compressed encoding reads the
+  // mapping directly.
+  void set_status_and_file_view(
+      status_type status, std::shared_ptr<coro_io::mmap_file_view> view,
+      content_encoding encoding = content_encoding::none,
+      std::string_view client_encoding_type = "") {
+    std::string_view content;
+    if (view) {
+      content = view->view();
+    }
+    file_view_ = std::move(view);
+    set_status_and_content_view(status, content, encoding, true,
+                                client_encoding_type);
+    if (content_view_.empty()) {
+      // compressed into content_, the mapping is not needed any more.
+      bool truncated = is_file_view_truncated();
+      file_view_ = nullptr;
+      if (truncated) {
+        set_status_and_content(status_type::internal_server_error,
+                               "file truncated");
+      }
+    }
+  }
+
+  // the file of the body shrank while it was read, the bytes sent are wrong.
+  bool is_file_view_truncated() const {
+    return file_view_ && file_view_->truncated();
+  }
+
   void set_delay(bool r) { delay_ = r; }
   bool get_delay() const { return delay_; }
   void set_format_type(format_type type) { fmt_type_ = type; }
@@ -169,14 +128,53 @@ class coro_http_response {
   std::string_view content() { return content_; }
   size_t content_size() { return content_.size(); }
 
-  void add_header(auto k, auto v) {
-    resp_headers_.emplace_back(resp_header{std::move(k), std::move(v)});
+  // k and v are copied into the arena of the request.
+  void add_header(std::string_view k, std::string_view v) {
+    resp_headers_.push_back(resp_header_sv{arena_.copy(k), arena_.copy(v)});
   }
 
+  // k and v are not copied, they must stay valid until the response has been
+  // sent: literals or memory from get_allocator().
+  void add_header_view(std::string_view k, std::string_view v) {
+    resp_headers_.push_back(resp_header_sv{k, v});
+  }
+
+  // allocates from the arena of the request, it is reset after the response
+  // has been sent.
+  std::pmr::polymorphic_allocator<std::byte> get_allocator() {
+    return &arena_;
+  }
+
+  request_arena &get_arena() { return arena_; }
+
   void add_header_span(std::span<http_header> resp_headers) {
     resp_header_span_ = resp_headers;
   }
 
+  // the body is pulled from next() piece by piece after the handler returns,
+  // see coro_http_connection::write_stream. it is sent chunked unless
+  // content_length is known. cancel is called if the connection fails while
+  // a piece is pending, to stop a producer which waits for something.
+  void set_body_stream(
+      std::function<async_simple::coro::Lazy<body_piece_t>()> next,
+      int64_t content_length = -1, std::function<void()> cancel = nullptr) {
+    body_stream_ = std::move(next);
+    body_stream_length_ = content_length;
+    body_stream_cancel_ = std::move(cancel);
+  }
+
+  bool has_body_stream() const { return body_stream_ != nullptr; }
+
+  std::function<async_simple::coro::Lazy<body_piece_t>()> take_body_stream() {
+    return std::exchange(body_stream_, nullptr);
+  }
+
+  int64_t body_stream_length() const { return body_stream_length_; }
+
+  std::function<void()> take_body_stream_cancel() {
+    return std::exchange(body_stream_cancel_, nullptr);
+  }
+
   void set_keepalive(bool r) { keepalive_ = r; }
 
   void need_date_head(bool r) { need_date_ = r; }
@@ -211,8 +209,9 @@ class coro_http_response {
       resp_str.append(CINATRA_HOST_SV);
     }
 
+    // a multipart body is written part by part after the head.
     if (content_.empty() && !has_set_content_ &&
-        fmt_type_ != format_type::chunked) {
+        fmt_type_ != format_type::chunked && boundary_.empty()) {
       content_.append(default_status_content(status_));
     }
 
@@ -296,8 +295,9 @@ class coro_http_response {
       buffers.emplace_back(asio::buffer(CINATRA_HOST_SV));
     }
 
+    // a multipart body is written part by part after the head.
     if (content_.empty() && !has_set_content_ &&
-        fmt_type_ != format_type::chunked) {
+        fmt_type_ != format_type::chunked && boundary_.empty()) {
       content_.append(default_status_content(status_));
     }
 
@@ -307,8 +307,7 @@ class coro_http_response {
     else {
       if (!cookies_.empty()) {
         for (auto &[_, cookie] : cookies_) {
-          resp_headers_.emplace_back(
-              resp_header{"Set-Cookie", cookie.to_string()});
+          add_header_view("Set-Cookie", arena_.copy(cookie.to_string()));
         }
       }
 
@@ -369,6 +368,7 @@ class coro_http_response {
     }
 
     resp_headers_.clear();
+    arena_.reset();
     keepalive_ = {};
     delay_ = false;
     status_ = status_type::init;
@@ -379,10 +379,51 @@ class coro_http_response {
     need_date_ = true;
     content_type_ = {};
     content_view_ = {};
+    file_view_ = nullptr;
+    body_stream_ = nullptr;
+    body_stream_length_ = -1;
+    body_stream_cancel_ = nullptr;
+    compressor_.reset();
   }
 
   void set_shrink_to_fit(bool r) { need_shrink_every_time_ = r; }
 
+  void set_compress_policy(std::shared_ptr<compress_policy> policy) {
+    compress_policy_ = std::move(policy);
+  }
+
+  // start compressing the chunks of a chunked response, return false if the
+  // response will be sent uncompressed.
+  bool init_stream_compressor(content_encoding encoding,
+                              std::string_view client_encoding_type = "") {
+    if (!need_compress(encoding, client_encoding_type, SIZE_MAX)) {
+      return false;
+    }
+
+    if (!compressor_.init(encoding, compress_policy_.get())) {
+      return false;
+    }
+
+    add_header("Content-Encoding", std::string(encoding_name(encoding)));
+    return true;
+  }
+
+  bool is_stream_compressed() const { return compressor_.is_active(); }
+
+  bool compress_chunk(std::string_view data, std::string &out,
+                      compress_flush flush) {
+    return compressor_.compress(data, out, flush);
+  }
+
+  std::string_view get_header_value(std::string_view key) const {
+    for (auto &[k, v] : resp_headers_) {
+      if (k == key) {
+        return v;
+      }
+    }
+    return {};
+  }
+
   void add_cookie(const cookie &cookie) {
     cookies_[cookie.get_name()] = cookie;
   }
@@ -395,6 +436,39 @@ class coro_http_response {
   }
 
  private:
+  bool need_compress(content_encoding encoding,
+                     std::string_view client_encoding_type, size_t size) {
+    if (!is_encoding_supported(encoding)) {
+      return false;
+    }
+
+    if (!client_encoding_type.empty() &&
+        client_encoding_type.find(encoding_name(encoding)) ==
+            std::string_view::npos) {
+      return false;
+    }
+
+    if (compress_policy_) {
+      std::string_view type = get_header_value("Content-Type");
+      if (type.empty()) {
+        // the header line of get_content_type<N>(), e.g.
+        // "Content-Type: text/css\r\n".
+        constexpr std::string_view prefix = "Content-Type: ";
+        if (content_type_.starts_with(prefix) &&
+            content_type_.ends_with(CRCF)) {
+          type = content_type_.substr(
+              prefix.size(), content_type_.size() - prefix.size() - CRCF.size());
+        }
+      }
+      if (!compress_policy_->should_compress(size, type)) {
+        get_compress_stats(encoding).skipped.fetch_add(
+            1, std::memory_order_relaxed);
+        return false;
+      }
+    }
+    return true;
+  }
+
   void handle_content(std::vector<asio::const_buffer> &buffers,
                       std::string &size_str, std::string_view content) {
     if (fmt_type_ == format_type::chunked) {
@@ -420,7 +494,8 @@ class coro_http_response {
   std::optional<bool> keepalive_;
   bool delay_;
   char buf_[32];
-  std::vector<resp_header> resp_headers_;
+  request_arena arena_;
+  std::vector<resp_header_sv> resp_headers_;
   std::span<http_header> resp_header_span_;
   coro_http_connection *conn_;
   std::string boundary_;
@@ -430,5 +505,11 @@ class coro_http_response {
   std::unordered_map<std::string, cookie> cookies_;
   std::string_view content_type_;
   std::string_view content_view_;
+  std::shared_ptr<coro_io::mmap_file_view> file_view_;
+  std::shared_ptr<compress_policy> compress_policy_;
+  stream_compressor compressor_;
+  std::function<async_simple::coro::Lazy<body_piece_t>()> body_stream_;
+  int64_t body_stream_length_ = -1;
+  std::function<void()> body_stream_cancel_;
 };
 }  // namespace cinatra
@@ -1,11 +1,17 @@
 #pragma once
 #include <algorithm>
 #include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <regex>
 #include <set>
 #include <string>
 #include <string_view>
+#include <tuple>
 #include <unordered_map>
 
+#include "cinatra/alloc_profiler.hpp"
 #include "cinatra/cinatra_log_wrapper.hpp"
 #include "cinatra/coro_http_request.hpp"
 #include "cinatra/coro_radix_tree.hpp"
@@ -56,23 +62,23 @@ class coro_http_router {
                                                    coro_http_response & resp)>
           http_handler;
       if constexpr (sizeof...(Aspects) > 0) {
-        http_handler = [this, handler = std::move(handler),
-                        ... asps = std::forward<Aspects>(asps)](
+        auto aspects = make_aspects(whole_str, std::forward<Aspects>(asps)...);
+        http_handler = [this, handler = std::move(handler), aspects](
                            coro_http_request& req,
                            coro_http_response& resp) mutable
             -> async_simple::coro::Lazy<void> {
-          bool ok = true;
-          (do_before(asps, req, resp, ok), ...);
-          if (ok) {
+          if (do_befores(*aspects, req, resp)) {
             co_await handler(req, resp);
           }
-          ok = true;
-          (do_after(asps, req, resp, ok), ...);
+          do_afters(*aspects, req, resp);
         };
       }
       else {
         http_handler = std::move(handler);
       }
+      if (whole_str.find_first_of(":{)") != std::string::npos) {
+        profile_route(whole_str, http_handler);
+      }
 
       if (whole_str.find(":") != std::string::npos) {
         std::string method_str(method_name);
@@ -105,22 +111,22 @@ class coro_http_router {
       std::function<void(coro_http_request & req, coro_http_response & resp)>
           http_handler;
       if constexpr (sizeof...(Aspects) > 0) {
-        http_handler = [this, handler = std::move(handler),
-                        ... asps = std::forward<Aspects>(asps)](
+        auto aspects = make_aspects(whole_str, std::forward<Aspects>(asps)...);
+        http_handler = [this, handler = std::move(handler), aspects](
                            coro_http_request& req,
                            coro_http_response& resp) mutable {
-          bool ok = true;
-          (do_before(asps, req, resp, ok), ...);
-          if (ok) {
+          if (do_befores(*aspects, req, resp)) {
             handler(req, resp);
           }
-          ok = true;
-          (do_after(asps, req, resp, ok), ...);
+          do_afters(*aspects, req, resp);
         };
       }
       else {
         http_handler = std::move(handler);
       }
+      if (whole_str.find_first_of(":{)") != std::string::npos) {
+        profile_route(whole_str, http_handler);
+      }
 
       if (whole_str.find(':') != std::string::npos) {
         std::string method_str(method_name);
@@ -148,6 +154,128 @@ class coro_http_router {
     }
   }
 
+  // route every "METHOD prefix..." key which has no other match to handler,
+  // the longest prefix wins. a directory is served by one handler this way.
+  template <http_method method, typename... Aspects>
+  void set_prefix_handler(
+      std::string prefix,
+      std::function<async_simple::coro::Lazy<void>(coro_http_request& req,
+                                                   coro_http_response& resp)>
+          handler,
+      Aspects&&... asps) {
+    constexpr auto method_name = cinatra::method_name(method);
+    std::string whole_str;
+    whole_str.append(method_name).append(" ").append(prefix);
+    for (auto& [key, _] : prefix_handles_) {
+      if (key == whole_str) {
+        CINATRA_LOG_WARNING << prefix << " has already registered.";
+        return;
+      }
+    }
+
+    if constexpr (sizeof...(Aspects) > 0) {
+      handler = [this, handler = std::move(handler),
+                 ... asps = std::forward<Aspects>(asps)](
+                    coro_http_request& req,
+                    coro_http_response& resp) mutable
+          -> async_simple::coro::Lazy<void> {
+        bool ok = true;
+        (do_before(asps, req, resp, ok), ...);
+        if (ok) {
+          co_await handler(req, resp);
+        }
+        ok = true;
+        (do_after(asps, req, resp, ok), ...);
+      };
+    }
+
+    profile_route(whole_str, handler);
+
+    auto it = std::find_if(prefix_handles_.begin(), prefix_handles_.end(),
+                           [&](auto& pair) {
+                             return pair.first.size() < whole_str.size();
+                           });
+    prefix_handles_.emplace(it, std::move(whole_str), std::move(handler));
+  }
+
+  // the allocation profiler counts a request to an exact route for its url
+  // from the start, a request to a pattern route for the pattern from its
+  // handler on, urls don't grow the route counters this way.
+  template <typename Handler>
+  static void profile_route([[maybe_unused]] const std::string& pattern,
+                            [[maybe_unused]] Handler& handler) {
+#ifdef CINATRA_ALLOC_PROFILE
+    using result_t = std::invoke_result_t<Handler&, coro_http_request&,
+                                          coro_http_response&>;
+    if constexpr (std::is_void_v<result_t>) {
+      handler = [pattern, handler = std::move(handler)](
+                    coro_http_request& req, coro_http_response& resp) {
+        CINATRA_ALLOC_ROUTE(pattern);
+        handler(req, resp);
+      };
+    }
+    else {
+      handler = [pattern, handler = std::move(handler)](
+                    coro_http_request& req, coro_http_response& resp)
+          -> async_simple::coro::Lazy<void> {
+        CINATRA_ALLOC_ROUTE(pattern);
+        co_await handler(req, resp);
+      };
+    }
+#endif
+  }
+
+  // the key of an exact route, empty for a url which is not one.
+  std::string_view exact_route(std::string_view key) {
+    if (get_handler(key) || get_coro_handler(key)) {
+      return key;
+    }
+    return {};
+  }
+
+  // the aspects are shared by the handler and the admission check of the
+  // route, which runs their before() when a request expects 100-continue.
+  template <typename... Aspects>
+  auto make_aspects(const std::string& key, Aspects&&... asps) {
+    auto aspects = std::make_shared<std::tuple<std::decay_t<Aspects>...>>(
+        std::forward<Aspects>(asps)...);
+    if constexpr ((has_before_v<std::decay_t<Aspects>> || ...)) {
+      if (key.find_first_of(":{)") == std::string::npos) {
+        before_checks_[key] = [this, aspects](coro_http_request& req,
+                                              coro_http_response& resp) {
+          return do_befores(*aspects, req, resp);
+        };
+      }
+    }
+    return aspects;
+  }
+
+  template <typename Tuple>
+  bool do_befores(Tuple& aspects, coro_http_request& req,
+                  coro_http_response& resp) {
+    if (req.is_before_checked()) {
+      return true;
+    }
+    bool ok = true;
+    std::apply(
+        [&](auto&... asps) {
+          (do_before(asps, req, resp, ok), ...);
+        },
+        aspects);
+    return ok;
+  }
+
+  template <typename Tuple>
+  void do_afters(Tuple& aspects, coro_http_request& req,
+                 coro_http_response& resp) {
+    bool ok = true;
+    std::apply(
+        [&](auto&... asps) {
+          (do_after(asps, req, resp, ok), ...);
+        },
+        aspects);
+  }
+
   template <typename T>
   void do_before(T& aspect, coro_http_request& req, coro_http_response& resp,
                  bool& ok) {
@@ -187,6 +315,78 @@ class coro_http_router {
     return nullptr;
   }
 
+  // run the before aspects of the exact route key, false if one of them
+  // rejects the request. empty if none ran, a route with :params, a regex or
+  // a prefix runs its aspects with the handler.
+  std::optional<bool> check_before(std::string_view key,
+                                   coro_http_request& req,
+                                   coro_http_response& resp) {
+    if (auto it = before_checks_.find(key); it != before_checks_.end()) {
+      return it->second(req, resp);
+    }
+    return std::nullopt;
+  }
+
+  // key is like "POST /upload", it overrides the max body size of the server.
+  // a regex route or a route with :params matches the keys of its requests.
+  void set_max_body_size(std::string key, int64_t max_size) {
+    if (std::regex pattern; route_pattern(key, pattern)) {
+      max_body_size_patterns_.emplace_back(std::move(pattern), max_size);
+    }
+    else {
+      max_body_sizes_[std::move(key)] = max_size;
+    }
+  }
+
+  // -1 if the route has no max body size of its own.
+  int64_t get_max_body_size(std::string_view key) const {
+    if (auto it = max_body_sizes_.find(key); it != max_body_sizes_.end()) {
+      return it->second;
+    }
+    for (auto& [pattern, max_size] : max_body_size_patterns_) {
+      if (std::regex_match(key.begin(), key.end(), pattern)) {
+        return max_size;
+      }
+    }
+    return -1;
+  }
+
+  // key is like "POST /upload", a regex route or a route with :params
+  // matches the keys of its requests. a multipart body is left to the
+  // multipart reader unless with_multipart is set.
+  void set_stream_body(std::string key, bool with_multipart = false) {
+    if (std::regex pattern; route_pattern(key, pattern)) {
+      stream_body_patterns_.emplace_back(std::move(pattern), with_multipart);
+    }
+    else {
+      stream_body_keys_.emplace(std::move(key), with_multipart);
+    }
+  }
+
+  bool is_stream_body(std::string_view key, bool multipart = false) const {
+    if (auto it = stream_body_keys_.find(key); it != stream_body_keys_.end()) {
+      return !multipart || it->second;
+    }
+    for (auto& [pattern, with_multipart] : stream_body_patterns_) {
+      if ((!multipart || with_multipart) &&
+          std::regex_match(key.begin(), key.end(), pattern)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  std::function<async_simple::coro::Lazy<void>(coro_http_request& req,
+                                               coro_http_response& resp)>*
+  get_prefix_handler(std::string_view key) {
+    for (auto& [prefix, handler] : prefix_handles_) {
+      if (key.starts_with(prefix)) {
+        return &handler;
+      }
+    }
+    return nullptr;
+  }
+
   void route(auto handler, auto& req, auto& resp, std::string_view key) {
     try {
       (*handler)(req, resp);
@@ -229,6 +429,44 @@ class coro_http_router {
   const auto& get_regex_handlers() { return regex_handles_; }
 
  private:
+  // "GET /user/:id" -> "GET /user/[^/]+"
+  // the pattern of a regex route or a route with :params, false for an exact
+  // route.
+  static bool route_pattern(std::string key, std::regex& pattern) {
+    if (key.find(':') != std::string::npos) {
+      pattern = std::regex(param_route_pattern(key));
+      return true;
+    }
+    if (key.find("{") != std::string::npos ||
+        key.find(")") != std::string::npos) {
+      if (key.find("{}") != std::string::npos) {
+        replace_all(key, "{}", "([^/]+)");
+      }
+      pattern = std::regex(key);
+      return true;
+    }
+    return false;
+  }
+
+  static std::string param_route_pattern(std::string_view key) {
+    constexpr std::string_view special = ".^$|()[]{}*+?\\";
+    std::string pattern;
+    for (size_t i = 0; i < key.size(); i++) {
+      if (key[i] == ':') {
+        pattern.append("[^/]+");
+        while (i + 1 < key.size() && key[i + 1] != '/') {
+          i++;
+        }
+        continue;
+      }
+      if (special.find(key[i]) != std::string_view::npos) {
+        pattern.push_back('\\');
+      }
+      pattern.push_back(key[i]);
+    }
+    return pattern;
+  }
+
   std::set<std::string> keys_;
   std::unordered_map<
       std::string_view,
@@ -256,5 +494,22 @@ class coro_http_router {
       std::regex, std::function<async_simple::coro::Lazy<void>(
                       coro_http_request& req, coro_http_response& resp)>>>
       coro_regex_handles_;
+
+  // the value tells if a multipart body is streamed too.
+  std::map<std::string, bool, std::less<>> stream_body_keys_;
+  std::vector<std::pair<std::regex, bool>> stream_body_patterns_;
+
+  std::map<std::string,
+           std::function<bool(coro_http_request&, coro_http_response&)>,
+           std::less<>>
+      before_checks_;
+  std::map<std::string, int64_t, std::less<>> max_body_sizes_;
+  std::vector<std::pair<std::regex, int64_t>> max_body_size_patterns_;
+
+  // ordered by prefix length, longest first
+  std::vector<std::pair<
+      std::string, std::function<async_simple::coro::Lazy<void>(
+                       coro_http_request& req, coro_http_response& resp)>>>
+      prefix_handles_;
 };
 }  // namespace cinatra
\ No newline at end of file
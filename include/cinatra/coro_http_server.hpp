@@ -1,16 +1,22 @@
 #pragma once
-
+#include "async_simple/coro/Collect.h"
 #include "cinatra/coro_http_client.hpp"
 #include "cinatra/coro_http_response.hpp"
 #include "cinatra/coro_http_router.hpp"
 #include "cinatra/define.h"
+#include "cinatra/file_meta_cache.hpp"
 #include "cinatra/mime_types.hpp"
 #include "cinatra_log_wrapper.hpp"
 #include "coro_http_connection.hpp"
+#include "http_proxy.hpp"
 #include "ylt/coro_io/coro_file.hpp"
 #include "ylt/coro_io/coro_io.hpp"
 #include "ylt/coro_io/io_context_pool.hpp"
 #include "ylt/coro_io/load_blancer.hpp"
+#include "ylt/coro_io/mmap_file.hpp"
+#include "ws_hub.hpp"
+#include "ws_proxy.hpp"
+#include "ws_rebalance.hpp"
 
 namespace cinatra {
 enum class file_resp_format_type {
@@ -119,9 +125,23 @@ class coro_http_server {
     stop_timer_ = true;
     std::error_code ec;
     check_timer_.cancel(ec);
+    if (rebalance_timer_) {
+      asio::dispatch(rebalance_timer_->get_executor(), [this] {
+        std::error_code ec;
+        rebalance_timer_->cancel(ec);
+      });
+    }
 
     close_acceptor();
 
+    {
+      std::scoped_lock lock(ws_heartbeat_mtx_);
+      for (auto &[_, heartbeat] : ws_heartbeats_) {
+        heartbeat->stop();
+      }
+      ws_heartbeats_.clear();
+    }
+
     // close current connections.
     {
       std::scoped_lock lock(conn_mtx_);
@@ -185,6 +205,29 @@ class coro_http_server {
     }
   }
 
+  // the body of requests to these routes is not read before the handler
+  // runs, the handler reads it piece by piece with
+  // req.get_conn()->read_body_some(). regex routes and routes with :params
+  // are supported too.
+  template <http_method... method>
+  void set_stream_body_route(std::string key) {
+    static_assert(sizeof...(method) >= 1, "must set http_method");
+    (router_.set_stream_body(
+         std::string(method_name(method)).append(" ").append(key)),
+     ...);
+  }
+
+  // requests to these routes with a body larger than max_size are answered
+  // with 413 before the body is read, the global max body size does not
+  // apply to them. regex routes and routes with :params are supported too.
+  template <http_method... method>
+  void set_max_http_body_size(std::string key, int64_t max_size) {
+    static_assert(sizeof...(method) >= 1, "must set http_method");
+    (router_.set_max_body_size(
+         std::string(method_name(method)).append(" ").append(key), max_size),
+     ...);
+  }
+
   template <http_method... method, typename... Aspects>
   void set_http_proxy_handler(std::string url_path,
                               std::vector<std::string_view> hosts,
@@ -201,18 +244,28 @@ class coro_http_server {
             coro_io::load_blancer<coro_http_client>::create(
                 hosts, {.lba = type}, weights));
     auto handler =
-        [this, load_blancer, type](
+        [load_blancer](
             coro_http_request &req,
             coro_http_response &response) -> async_simple::coro::Lazy<void> {
-      co_await load_blancer->send_request(
-          [this, &req, &response](
+      auto ret = co_await load_blancer->send_request(
+          [&req, &response](
               coro_http_client &client,
               std::string_view host) -> async_simple::coro::Lazy<void> {
-            co_await reply(client, host, req, response);
+            http_proxy_session session(req, response, client);
+            co_await session.run(host);
           });
+      if (!ret) {
+        response.set_status_and_content(status_type::bad_gateway,
+                                        "upstream connect failed");
+      }
     };
 
     if constexpr (sizeof...(method) == 0) {
+      set_proxy_stream_body<http_method::GET, http_method::POST,
+                            http_method::DEL, http_method::HEAD,
+                            http_method::PUT, http_method::PATCH,
+                            http_method::CONNECT, http_method::TRACE,
+                            http_method::OPTIONS>(url_path);
       set_http_handler<http_method::GET, http_method::POST, http_method::DEL,
                        http_method::HEAD, http_method::PUT, http_method::PATCH,
                        http_method::CONNECT, http_method::TRACE,
@@ -220,6 +273,7 @@ class coro_http_server {
                                              std::forward<Aspects>(aspects)...);
     }
     else {
+      set_proxy_stream_body<method...>(url_path);
       set_http_handler<method...>(url_path, std::move(handler),
                                   std::forward<Aspects>(aspects)...);
     }
@@ -245,42 +299,21 @@ class coro_http_server {
         url_path,
         [load_blancer](coro_http_request &req, coro_http_response &resp)
             -> async_simple::coro::Lazy<void> {
-          websocket_result result{};
-          while (true) {
-            result = co_await req.get_conn()->read_websocket();
-            if (result.ec) {
-              break;
-            }
-
-            if (result.type == ws_frame_type::WS_CLOSE_FRAME) {
-              CINATRA_LOG_INFO << "close frame";
-              break;
-            }
-
-            auto ret = co_await load_blancer->send_request(
-                [&req, result](coro_http_client &client, std::string_view host)
-                    -> async_simple::coro::Lazy<std::error_code> {
-                  auto r =
-                      co_await client.write_websocket(std::string(result.data));
-                  if (r.net_err) {
-                    co_return r.net_err;
-                  }
-                  auto data = co_await client.read_websocket();
-                  if (data.net_err) {
-                    co_return data.net_err;
-                  }
-                  auto ec = co_await req.get_conn()->write_websocket(
-                      std::string(result.data));
-                  if (ec) {
-                    co_return ec;
-                  }
-                  co_return std::error_code{};
-                });
-            if (!ret.has_value()) {
-              req.get_conn()->close();
-              break;
-            }
+          // the session stays with the backend it is given.
+          auto host = co_await load_blancer->select_host();
+          auto conn = req.get_conn()->shared_from_this();
+          auto backend = std::make_unique<coro_http_client>(
+              conn->get_executor()->get_asio_executor());
+          auto r = co_await backend->connect(std::string(host));
+          if (r.net_err) {
+            CINATRA_LOG_WARNING << "connect websocket backend " << host
+                                << " failed, " << r.net_err.message();
+            co_await conn->close_websocket(close_code::internal_error, "");
+            co_return;
           }
+
+          ws_proxy_session session(std::move(conn), std::move(backend));
+          co_await session.run();
         },
         std::forward<Aspects>(aspects)...);
   }
@@ -318,6 +351,28 @@ class coro_http_server {
 
   void set_transfer_chunked_size(size_t size) { chunked_size_ = size; }
 
+  // static files are sent in blocks between the transfer chunked size and
+  // max_size, the block grows while the peer drains it quickly and shrinks
+  // when writes stall. max_size <= transfer chunked size disables it.
+  void set_max_transfer_chunked_size(size_t max_size) {
+    max_chunked_size_ = max_size;
+  }
+
+  // static files of at least min_size bytes are sent from a memory mapping
+  // shared by all connections, instead of being read into a buffer per
+  // connection. it saves the copy for ssl and compression. the first mapping
+  // installs a process wide SIGBUS handler, see coro_io::mmap_file_view.
+  void set_mmap_file_threshold(size_t min_size) { mmap_threshold_ = min_size; }
+
+  // bodies read with spool_body() of the connection and multipart parts read
+  // with spool_part_body() are written to files in dir, the system temp dir
+  // by default, when they are larger than the spool memory threshold.
+  void set_spool_dir(std::string dir) { spool_dir_ = std::move(dir); }
+
+  void set_spool_memory_threshold(size_t size) {
+    spool_memory_threshold_ = size;
+  }
+
 #ifdef INJECT_FOR_HTTP_SEVER_TEST
   void set_write_failed_forever(bool r) { write_failed_forever_ = r; }
 
@@ -354,219 +409,66 @@ class coro_http_server {
       static_dir_ = fs::absolute(fs::current_path().string()).string();
     }
 
-    files_.clear();
-    std::error_code ec;
-    for (const auto &file :
-         std::filesystem::recursive_directory_iterator(static_dir_, ec)) {
-      if (ec) {
-        continue;
+    std::string prefix = "/";
+    if (std::string_view suffix = uri_suffix; !suffix.empty()) {
+      while (suffix.starts_with('/')) {
+        suffix.remove_prefix(1);
       }
-      if (!file.is_directory()) {
-        files_.push_back(file.path().string());
+      while (suffix.ends_with('/')) {
+        suffix.remove_suffix(1);
       }
-    }
-
-    std::filesystem::path router_path =
-        std::filesystem::path(static_dir_router_path_);
-
-    std::string uri;
-    for (auto &file : files_) {
-      auto relative_path =
-          std::filesystem::path(file.substr(static_dir_.length())).string();
-      if (size_t pos = relative_path.find('\\') != std::string::npos) {
-        replace_all(relative_path, "\\", "/");
+      if (!suffix.empty()) {
+        prefix.append(suffix).append("/");
       }
+    }
 
-      if (static_dir_router_path_.empty()) {
-        uri = relative_path;
-      }
-      else {
-        uri = fs::path("/")
-                  .append(static_dir_router_path_)
-                  .concat(relative_path)
-                  .string();
-      }
+    auto [it, is_new] = static_dir_roots_.try_emplace(prefix);
+    std::vector<std::string> &roots = it->second;
+    if (std::find(roots.begin(), roots.end(), static_dir_) == roots.end()) {
+      roots.push_back(static_dir_);
+    }
+    if (!is_new) {
+      // the handler of the prefix looks into every root of it in order.
+      return;
+    }
 
-      set_http_handler<cinatra::GET>(
-          uri,
-          [this, file_name = file](
-              coro_http_request &req,
-              coro_http_response &resp) -> async_simple::coro::Lazy<void> {
-            std::string_view extension = get_extension(file_name);
-            std::string_view mime = get_mime_type(extension);
-            auto range_str = req.get_header_value("Range");
-
-            if (auto it = static_file_cache_.find(file_name);
-                it != static_file_cache_.end()) {
-              auto range_header = build_range_header(
-                  mime, file_name, std::to_string(fs::file_size(file_name)));
-              resp.set_delay(true);
-              std::string &body = it->second;
-              std::array<asio::const_buffer, 2> arr{asio::buffer(range_header),
-                                                    asio::buffer(body)};
-              co_await req.get_conn()->async_write(arr);
+    router_.set_prefix_handler<cinatra::GET>(
+        prefix,
+        [this, prefix, &roots](
+            coro_http_request &req,
+            coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+          auto meta = find_static_file(req.get_url(), prefix, roots);
+          if (meta == nullptr) {
+            if (default_handler_) {
+              co_await default_handler_(req, resp);
               co_return;
             }
-
-            std::string content;
-            detail::resize(content, chunked_size_);
-
-            coro_io::coro_file in_file{};
-            in_file.open(file_name, std::ios::in);
-            if (!in_file.is_open()) {
 #ifndef NDEBUG
-              resp.set_status_and_content(status_type::not_found,
-                                          file_name + " not found");
+            resp.set_status_and_content(
+                status_type::not_found,
+                std::string(req.get_url()).append(" not found"));
 #else
-              resp.set_status(status_type::not_found);
+            resp.set_status(status_type::not_found);
 #endif
-              co_return;
-            }
+            co_return;
+          }
+          co_await send_static_file(req, resp, *meta);
+        },
+        std::forward<Aspects>(aspects)...);
+  }
 
-            size_t file_size = fs::file_size(file_name);
-
-            if (format_type_ == file_resp_format_type::chunked &&
-                range_str.empty()) {
-              resp.add_header("Content-Type", std::string{mime});
-              resp.set_format_type(format_type::chunked);
-              bool ok;
-              if (ok = co_await resp.get_conn()->begin_chunked(); !ok) {
-                co_return;
-              }
-
-              while (true) {
-                auto [ec, size] =
-                    co_await in_file.async_read(content.data(), content.size());
-                if (ec) {
-                  resp.set_status(status_type::no_content);
-                  co_await resp.get_conn()->reply();
-                  co_return;
-                }
-
-                bool r = co_await resp.get_conn()->write_chunked(
-                    std::string_view(content.data(), size));
-                if (!r) {
-                  co_return;
-                }
-
-                if (in_file.eof()) {
-                  co_await resp.get_conn()->end_chunked();
-                  break;
-                }
-              }
-            }
-            else {
-              auto pos = range_str.find('=');
-              if (pos != std::string_view::npos) {
-                range_str = range_str.substr(pos + 1);
-                bool is_valid = true;
-                auto ranges = parse_ranges(range_str, file_size, is_valid);
-                if (!is_valid) {
-                  resp.set_status(status_type::range_not_satisfiable);
-                  co_return;
-                }
-
-                assert(!ranges.empty());
-
-                if (ranges.size() == 1) {
-                  // single part
-                  auto [start, end] = ranges[0];
-                  in_file.seek(start, std::ios::beg);
-                  size_t part_size = end + 1 - start;
-                  int status = (part_size == file_size) ? 200 : 206;
-                  std::string content_range = "Content-Range: bytes ";
-                  content_range.append(std::to_string(start))
-                      .append("-")
-                      .append(std::to_string(end))
-                      .append("/")
-                      .append(std::to_string(file_size))
-                      .append(CRCF);
-                  auto range_header = build_range_header(
-                      mime, file_name, std::to_string(part_size), status,
-                      content_range);
-                  resp.set_delay(true);
-                  bool r = co_await req.get_conn()->write_data(range_header);
-                  if (!r) {
-                    co_return;
-                  }
-
-                  co_await send_single_part(in_file, content, req, resp,
-                                            part_size);
-                }
-                else {
-                  // multiple ranges
-                  resp.set_delay(true);
-                  std::string file_size_str = std::to_string(file_size);
-                  size_t content_len = 0;
-                  std::vector<std::string> multi_heads = build_part_heads(
-                      ranges, mime, file_size_str, content_len);
-                  auto range_header = build_multiple_range_header(content_len);
-                  bool r = co_await req.get_conn()->write_data(range_header);
-                  if (!r) {
-                    co_return;
-                  }
-
-                  for (int i = 0; i < ranges.size(); i++) {
-                    std::string &part_header = multi_heads[i];
-                    r = co_await req.get_conn()->write_data(part_header);
-                    if (!r) {
-                      co_return;
-                    }
-
-                    auto [start, end] = ranges[i];
-                    bool ok = in_file.seek(start, std::ios::beg);
-                    if (!ok) {
-                      resp.set_status_and_content(status_type::bad_request,
-                                                  "invalid range");
-                      co_await resp.get_conn()->reply();
-                      co_return;
-                    }
-                    size_t part_size = end + 1 - start;
-
-                    std::string_view more = CRCF;
-                    if (i == ranges.size() - 1) {
-                      more = MULTIPART_END;
-                    }
-                    r = co_await send_single_part(in_file, content, req, resp,
-                                                  part_size, more);
-                    if (!r) {
-                      co_return;
-                    }
-                  }
-                }
-                co_return;
-              }
-
-              auto range_header = build_range_header(mime, file_name,
-                                                     std::to_string(file_size));
-              resp.set_delay(true);
-              bool r = co_await req.get_conn()->write_data(range_header);
-              if (!r) {
-                co_return;
-              }
-
-              while (true) {
-                auto [ec, size] =
-                    co_await in_file.async_read(content.data(), content.size());
-                if (ec) {
-                  resp.set_status(status_type::no_content);
-                  co_await resp.get_conn()->reply();
-                  co_return;
-                }
-
-                r = co_await req.get_conn()->write_data(
-                    std::string_view(content.data(), size));
-                if (!r) {
-                  co_return;
-                }
-
-                if (in_file.eof()) {
-                  break;
-                }
-              }
-            }
-          },
-          std::forward<Aspects>(aspects)...);
+  // cache the metadata and the open fds of at most max_files static files,
+  // an entry is checked against the file system again after valid_duration.
+  // 0 disables the cache.
+  void set_static_file_meta_cache(
+      size_t max_files, std::chrono::steady_clock::duration valid_duration =
+                            std::chrono::seconds(1)) {
+    if (max_files == 0) {
+      file_meta_cache_ = nullptr;
+    }
+    else {
+      file_meta_cache_ =
+          std::make_unique<file_meta_cache>(max_files, valid_duration);
     }
   }
 
@@ -581,14 +483,140 @@ class coro_http_server {
     }
   }
 
+  // close the connections idle for longer than the timeout duration, called
+  // by the check timer every check duration, from any thread.
+  void check_timeout() {
+    auto cur_time = std::chrono::system_clock::now();
+
+    {
+      std::scoped_lock lock(conn_mtx_);
+      for (auto it = connections_.begin();
+           it != connections_.end();)  // no "++"!
+      {
+        if (cur_time - it->second->get_last_rwtime() > timeout_duration_) {
+          it->second->close(false);
+          connections_.erase(it++);
+        }
+        else {
+          ++it;
+        }
+      }
+    }
+  }
+
   void set_shrink_to_fit(bool r) { need_shrink_every_time_ = r; }
 
+  // idle connections give their read buffers back to a per-thread pool and
+  // take one again when the next request arrives. see
+  // coro_http_connection::set_release_idle_buffers.
+  void set_release_idle_buffers(bool r) { release_idle_buffers_ = r; }
+
+  // while the read buffers of all connections in the process hold more than
+  // this, no connection is accepted and new requests are answered with 503.
+  // see buffer_usage.
+  void set_buffer_memory_budget(size_t bytes) {
+    buffer_usage::set_budget(bytes);
+  }
+
+  // batch the small writes of write_chunked, write_multipart and
+  // write_websocket into one writev per turn of the event loop, or per
+  // flush_delay if it is set. see coro_http_connection::flush().
+  void set_write_coalescing(bool r,
+                            std::chrono::microseconds flush_delay = {}) {
+    coalesce_writes_ = r;
+    flush_delay_ = flush_delay;
+  }
+
+  // the websocket send queue of a connection refuses messages from the time
+  // it holds high bytes until it drains to low. see
+  // coro_http_connection::post_websocket.
+  void set_ws_send_queue_watermarks(size_t high, size_t low) {
+    ws_high_watermark_ = high;
+    ws_low_watermark_ = low;
+  }
+
+  // ping the websocket connections whose peers are quiet and close the dead
+  // ones, every io thread checks its connections with one timing wheel.
+  void set_ws_heartbeat(ws_heartbeat_options options) {
+    ws_heartbeat_options_ = std::move(options);
+  }
+
+  size_t io_thread_count() const { return pool_ ? pool_->pool_size() : 1; }
+
+  // the executor of an io thread, the target of migrate().
+  coro_io::ExecutorWrapper<> *get_io_executor(size_t index) {
+    return pool_ ? pool_->get_executor(index) : out_executor_.get();
+  }
+
+  // move a websocket connection to the io thread of executor, see
+  // coro_http_connection::migrate().
+  bool migrate(const std::shared_ptr<coro_http_connection> &conn,
+               coro_io::ExecutorWrapper<> *executor) {
+    std::shared_ptr<ws_heartbeat> heartbeat;
+    if (ws_heartbeat_options_) {
+      heartbeat = get_ws_heartbeat(executor);
+    }
+    return conn->migrate(executor, std::move(heartbeat));
+  }
+
+  // compare the websocket bytes of the io threads every period and move
+  // connections from the busiest threads to the idlest ones, see
+  // plan_ws_rebalance(). nothing to do with one io thread.
+  void set_ws_rebalancer(ws_rebalance_options options) {
+    if (!pool_ || pool_->pool_size() < 2) {
+      return;
+    }
+    ws_rebalance_options_ = std::move(options);
+    rebalance_timer_ =
+        std::make_unique<asio::steady_timer>(acceptor_.get_executor());
+    start_rebalance_timer();
+  }
+
+#ifdef CINATRA_ENABLE_GZIP
+  // how permessage-deflate is negotiated and used by websocket connections,
+  // see ws_deflate_options.
+  void set_ws_deflate_options(ws_deflate_options options) {
+    ws_deflate_options_ =
+        std::make_shared<const ws_deflate_options>(std::move(options));
+  }
+#endif
+
+  // skip compressing small or already compressed bodies, see
+  // compress_policy.
+  void set_compress_policy(compress_policy policy) {
+    compress_policy_ = std::make_shared<compress_policy>(std::move(policy));
+  }
+
   void set_default_handler(std::function<async_simple::coro::Lazy<void>(
                                coro_http_request &, coro_http_response &)>
                                handler) {
     default_handler_ = std::move(handler);
   }
 
+  // called with the head of every request which has a body, before the body
+  // is read. return false to reject it, the response is sent as it is or
+  // with 403 if the status has not been set.
+  void set_admission_check(
+      std::function<bool(coro_http_request &, coro_http_response &)> check) {
+    admission_check_ = std::move(check);
+  }
+
+  // serve the allocation profile at url_path, ?reset=1 clears the counters
+  // after they have been reported. it needs a build with
+  // CINATRA_ALLOC_PROFILE, see alloc_profiler.hpp.
+  void set_alloc_profile_handler(std::string url_path = "/alloc_profile") {
+    set_http_handler<cinatra::GET>(
+        std::move(url_path),
+        [](coro_http_request &req, coro_http_response &resp) {
+          resp.add_header("Content-Type", "text/plain; version=0.0.4");
+          resp.set_status_and_content(status_type::ok,
+                                      alloc_profiler::to_string());
+          if (req.get_query_value("reset") == "1") {
+            alloc_profiler::reset();
+          }
+        });
+  }
+
   size_t connection_count() {
     std::scoped_lock lock(conn_mtx_);
     return connections_.size();
@@ -659,6 +687,13 @@ class coro_http_server {
 
   async_simple::coro::Lazy<std::error_code> accept() {
     for (;;) {
+      if (buffer_usage::over_budget()) [[unlikely]] {
+        if (!co_await pause_accept()) {
+          acceptor_close_waiter_.set_value();
+          co_return asio::error::operation_aborted;
+        }
+      }
+
       coro_io::ExecutorWrapper<> *executor;
       if (out_ctx_ == nullptr) {
         executor = pool_->get_executor();
@@ -689,15 +724,40 @@ class coro_http_server {
         conn->tcp_socket().set_option(asio::ip::tcp::no_delay(true));
       }
       conn->set_max_http_body_size(max_http_body_len_);
+      conn->set_spool(spool_dir_, spool_memory_threshold_);
       if (need_shrink_every_time_) {
         conn->set_shrink_to_fit(true);
       }
       if (need_check_) {
         conn->set_check_timeout(true);
       }
+      if (coalesce_writes_) {
+        conn->set_write_coalescing(true, flush_delay_);
+      }
+      if (ws_high_watermark_ > 0) {
+        conn->set_ws_send_queue_watermarks(ws_high_watermark_,
+                                           ws_low_watermark_);
+      }
+      if (release_idle_buffers_) {
+        conn->set_release_idle_buffers(true);
+      }
+      if (compress_policy_) {
+        conn->set_compress_policy(compress_policy_);
+      }
+#ifdef CINATRA_ENABLE_GZIP
+      if (ws_deflate_options_) {
+        conn->set_ws_deflate_options(ws_deflate_options_);
+      }
+#endif
+      if (ws_heartbeat_options_) {
+        conn->set_ws_heartbeat(get_ws_heartbeat(executor));
+      }
       if (default_handler_) {
         conn->set_default_handler(default_handler_);
       }
+      if (admission_check_) {
+        conn->set_admission_check(admission_check_);
+      }
 
 #ifdef INJECT_FOR_HTTP_SEVER_TEST
       if (write_failed_forever_) {
@@ -731,14 +791,95 @@ class coro_http_server {
     }
   }
 
+  // the wheel of the io thread of executor.
+  std::shared_ptr<ws_heartbeat> get_ws_heartbeat(
+      coro_io::ExecutorWrapper<> *executor) {
+    std::scoped_lock lock(ws_heartbeat_mtx_);
+    auto asio_executor = executor->get_asio_executor();
+    auto &heartbeat = ws_heartbeats_[&asio_executor.context()];
+    if (!heartbeat) {
+      heartbeat = std::make_shared<ws_heartbeat>(asio_executor,
+                                                 *ws_heartbeat_options_);
+    }
+    return heartbeat;
+  }
+
+  void start_rebalance_timer() {
+    rebalance_timer_->expires_after(ws_rebalance_options_.period);
+    rebalance_timer_->async_wait([this](auto ec) {
+      if (ec || stop_timer_) {
+        return;
+      }
+      rebalance_ws();
+      start_rebalance_timer();
+    });
+  }
+
+  void rebalance_ws() {
+    std::vector<std::shared_ptr<coro_http_connection>> conns;
+    std::vector<ws_conn_load> loads;
+    std::unordered_map<uint64_t, uint64_t> marks;
+    {
+      std::scoped_lock lock(conn_mtx_);
+      for (auto &[id, conn] : connections_) {
+        uint64_t bytes = conn->ws_bytes();
+        if (bytes == 0 || !conn->can_migrate()) {
+          continue;
+        }
+        marks.emplace(id, bytes);
+        auto it = ws_bytes_marks_.find(id);
+        uint64_t load = bytes - (it == ws_bytes_marks_.end() ? 0 : it->second);
+        size_t thread = 0;
+        while (thread < pool_->pool_size() &&
+               pool_->get_executor(thread) != conn->get_executor()) {
+          thread++;
+        }
+        if (thread < pool_->pool_size()) {
+          conns.push_back(conn);
+          loads.push_back({thread, load});
+        }
+      }
+    }
+    ws_bytes_marks_ = std::move(marks);
+
+    auto moves =
+        plan_ws_rebalance(loads, pool_->pool_size(), ws_rebalance_options_);
+    for (auto &move : moves) {
+      if (migrate(conns[move.conn], pool_->get_executor(move.to))) {
+        CINATRA_LOG_DEBUG << "move websocket connection "
+                          << conns[move.conn]->conn_id() << " to io thread "
+                          << move.to;
+      }
+    }
+  }
+
   async_simple::coro::Lazy<void> start_one(
       std::shared_ptr<coro_http_connection> conn) noexcept {
     co_await conn->start();
   }
 
+  // over the buffer budget no connection is accepted, the new ones wait in
+  // the listen backlog until the requests in flight give buffers back.
+  // returns false if the acceptor is closed meanwhile.
+  async_simple::coro::Lazy<bool> pause_accept() {
+    CINATRA_LOG_WARNING << "buffer usage " << buffer_usage::used()
+                        << " is over the budget " << buffer_usage::budget()
+                        << ", pause accepting";
+    while (buffer_usage::over_budget()) {
+      accept_pause_timer_.expires_after(std::chrono::milliseconds(10));
+      if (!co_await accept_pause_timer_.async_await() ||
+          !acceptor_.is_open()) {
+        co_return false;
+      }
+    }
+    CINATRA_LOG_INFO << "buffer usage is under the budget, resume accepting";
+    co_return true;
+  }
+
   void close_acceptor() {
     asio::dispatch(acceptor_.get_executor(), [this]() {
       asio::error_code ec;
+      accept_pause_timer_.cancel(ec);
       acceptor_.cancel(ec);
       acceptor_.close(ec);
     });
@@ -757,27 +898,6 @@ class coro_http_server {
     });
   }
 
-  void check_timeout() {
-    auto cur_time = std::chrono::system_clock::now();
-
-    std::unordered_map<uint64_t, std::shared_ptr<coro_http_connection>> conns;
-
-    {
-      std::scoped_lock lock(conn_mtx_);
-      for (auto it = connections_.begin();
-           it != connections_.end();)  // no "++"!
-      {
-        if (cur_time - it->second->get_last_rwtime() > timeout_duration_) {
-          it->second->close(false);
-          connections_.erase(it++);
-        }
-        else {
-          ++it;
-        }
-      }
-    }
-  }
-
   std::string build_multiple_range_header(size_t content_len) {
     std::string header_str = "HTTP/1.1 206 Partial Content\r\n";
     header_str.append("Content-Length: ");
@@ -811,6 +931,218 @@ class coro_http_server {
     return multi_heads;
   }
 
+  // map the url below prefix to a file in one of roots. the url is checked
+  // segment by segment, a path which would leave the root is not resolved.
+  std::shared_ptr<const file_meta> find_static_file(
+      std::string_view url, std::string_view prefix,
+      const std::vector<std::string> &roots) {
+    std::string decoded;
+    if (url.find('%') != std::string_view::npos) {
+      decoded = code_utils::url_decode(url);
+      url = decoded;
+    }
+    if (!url.starts_with(prefix)) {
+      return nullptr;
+    }
+    url.remove_prefix(prefix.size());
+
+#ifdef ASIO_WINDOWS
+    constexpr std::string_view invalid_chars("\\:\0", 3);
+#else
+    constexpr std::string_view invalid_chars("\0", 1);
+#endif
+    std::string relative_path;
+    bool first = true;
+    while (!url.empty()) {
+      size_t pos = url.find('/');
+      std::string_view segment = url.substr(0, pos);
+      url = (pos == std::string_view::npos) ? std::string_view{}
+                                            : url.substr(pos + 1);
+      if (segment.empty() || segment == ".") {
+        continue;
+      }
+      if (segment == ".." ||
+          segment.find_first_of(invalid_chars) != std::string_view::npos) {
+        return nullptr;
+      }
+      if (first && prefix == "/" &&
+          !static_root_names_.contains(segment, roots)) {
+        // not below the roots, an unmatched url costs no file system call.
+        return nullptr;
+      }
+      first = false;
+      if (!relative_path.empty()) {
+        relative_path.push_back('/');
+      }
+      relative_path.append(segment);
+    }
+    if (relative_path.empty()) {
+      return nullptr;
+    }
+
+    for (auto &root : roots) {
+      std::string file_name =
+          fs::path(root).append(relative_path).make_preferred().string();
+      auto meta = file_meta_cache_
+                      ? file_meta_cache_->get(file_name, root)
+                      : file_meta_cache::load(file_name, false, root);
+      if (meta) {
+        return meta;
+      }
+    }
+    return nullptr;
+  }
+
+  async_simple::coro::Lazy<void> send_static_file(coro_http_request &req,
+                                                  coro_http_response &resp,
+                                                  const file_meta &meta) {
+    const std::string &file_name = meta.path;
+    std::string_view mime = meta.mime;
+    auto range_str = req.get_header_value("Range");
+
+    if (auto it = static_file_cache_.find(file_name);
+        it != static_file_cache_.end()) {
+      auto range_header =
+          build_range_header(mime, file_name, std::to_string(meta.size));
+      resp.set_delay(true);
+      std::string &body = it->second;
+      std::array<asio::const_buffer, 2> arr{asio::buffer(range_header),
+                                            asio::buffer(body)};
+      co_await req.get_conn()->async_write(arr);
+      co_return;
+    }
+
+    // a large file is sent from a mapping shared by all of its readers,
+    // without copying it into a read buffer first.
+    std::shared_ptr<coro_io::mmap_file_view> view;
+    if (meta.size >= mmap_threshold_) {
+      view = coro_io::get_mmap_file(file_name);
+    }
+
+    coro_io::random_coro_file in_file{};
+    if (view == nullptr) {
+      if (meta.fd) {
+        in_file.attach(meta.fd, file_name);
+      }
+      else {
+        in_file.open(file_name, std::ios::in);
+      }
+      if (!in_file.is_open()) {
+#ifndef NDEBUG
+        resp.set_status_and_content(status_type::not_found,
+                                    file_name + " not found");
+#else
+        resp.set_status(status_type::not_found);
+#endif
+        co_return;
+      }
+    }
+
+    size_t file_size = view ? view->size() : meta.size;
+    auto send_range = [&](uint64_t offset, size_t size, bool chunked,
+                          std::string_view more = "") {
+      if (view) {
+        return send_mapped_blocks(*view, offset, size, resp, chunked, more);
+      }
+      return send_file_blocks(in_file, offset, size, resp, chunked, more);
+    };
+
+    if (format_type_ == file_resp_format_type::chunked && range_str.empty()) {
+      resp.add_header("Content-Type", std::string{mime});
+      resp.set_format_type(format_type::chunked);
+      bool ok;
+      if (ok = co_await resp.get_conn()->begin_chunked(); !ok) {
+        co_return;
+      }
+
+      if (co_await send_range(0, file_size, true)) {
+        co_await resp.get_conn()->end_chunked();
+      }
+    }
+    else {
+      auto pos = range_str.find('=');
+      if (pos != std::string_view::npos) {
+        range_str = range_str.substr(pos + 1);
+        bool is_valid = true;
+        auto ranges = parse_ranges(range_str, file_size, is_valid);
+        if (!is_valid) {
+          resp.set_status(status_type::range_not_satisfiable);
+          co_return;
+        }
+
+        assert(!ranges.empty());
+
+        if (ranges.size() == 1) {
+          // single part
+          auto [start, end] = ranges[0];
+          size_t part_size = end + 1 - start;
+          int status = (part_size == file_size) ? 200 : 206;
+          std::string content_range = "Content-Range: bytes ";
+          content_range.append(std::to_string(start))
+              .append("-")
+              .append(std::to_string(end))
+              .append("/")
+              .append(std::to_string(file_size))
+              .append(CRCF);
+          auto range_header = build_range_header(
+              mime, file_name, std::to_string(part_size), status,
+              content_range);
+          resp.set_delay(true);
+          bool r = co_await req.get_conn()->write_data(range_header);
+          if (!r) {
+            co_return;
+          }
+
+          co_await send_range(start, part_size, false);
+        }
+        else {
+          // multiple ranges
+          resp.set_delay(true);
+          std::string file_size_str = std::to_string(file_size);
+          size_t content_len = 0;
+          std::vector<std::string> multi_heads =
+              build_part_heads(ranges, mime, file_size_str, content_len);
+          auto range_header = build_multiple_range_header(content_len);
+          bool r = co_await req.get_conn()->write_data(range_header);
+          if (!r) {
+            co_return;
+          }
+
+          for (int i = 0; i < ranges.size(); i++) {
+            std::string &part_header = multi_heads[i];
+            r = co_await req.get_conn()->write_data(part_header);
+            if (!r) {
+              co_return;
+            }
+
+            auto [start, end] = ranges[i];
+            size_t part_size = end + 1 - start;
+
+            std::string_view more = CRCF;
+            if (i == ranges.size() - 1) {
+              more = MULTIPART_END;
+            }
+            r = co_await send_range(start, part_size, false, more);
+            if (!r) {
+              co_return;
+            }
+          }
+        }
+        co_return;
+      }
+
+      auto range_header =
+          build_range_header(mime, file_name, std::to_string(file_size));
+      resp.set_delay(true);
+      bool r = co_await req.get_conn()->write_data(range_header);
+      if (!r) {
+        co_return;
+      }
+
+      co_await send_range(0, file_size, false);
+    }
+  }
+
   std::string build_range_header(std::string_view mime,
                                  std::string_view filename,
                                  std::string_view file_size_str,
@@ -835,116 +1167,151 @@ class coro_http_server {
     return header_str;
   }
 
-  async_simple::coro::Lazy<bool> send_single_part(auto &in_file, auto &content,
-                                                  auto &req, auto &resp,
-                                                  size_t part_size,
-                                                  std::string_view more = "") {
-    while (true) {
-      size_t read_size = (std::min)(part_size, chunked_size_);
-      if (read_size == 0) {
-        break;
-      }
-      auto [ec, size] = co_await in_file.async_read(content.data(), read_size);
-      if (ec) {
-        resp.set_status(status_type::no_content);
-        co_await resp.get_conn()->reply();
-        co_return false;
-      }
+  async_simple::coro::Lazy<bool> write_file_block(coro_http_connection *conn,
+                                                  bool chunked,
+                                                  std::string_view data,
+                                                  std::string_view more) {
+    if (chunked) {
+      co_return co_await conn->write_chunked(data);
+    }
+    if (more.empty()) {
+      co_return co_await conn->write_data(data);
+    }
+    std::array<asio::const_buffer, 2> arr{asio::buffer(data),
+                                          asio::buffer(more)};
+    auto [ec, _] = co_await conn->async_write(arr);
+    co_return !ec;
+  }
 
-      part_size -= read_size;
+  // send [offset, offset + size) of the file as the body or as chunks. while a
+  // block is being written the next one is read into the other buffer, so the
+  // disk and the socket work at the same time. more is written after the last
+  // block.
+  async_simple::coro::Lazy<bool> send_file_blocks(
+      coro_io::random_coro_file &in_file, uint64_t offset, size_t size,
+      coro_http_response &resp, bool chunked, std::string_view more = "") {
+    auto conn = resp.get_conn();
+    if (size == 0) {
+      co_return more.empty() ||
+          co_await write_file_block(conn, chunked, {}, more);
+    }
 
-      bool r = true;
-      if (more.empty()) {
-        r = co_await req.get_conn()->write_data(
-            std::string_view(content.data(), size));
-      }
-      else {
-        std::array<asio::const_buffer, 2> arr{
-            asio::buffer(content.data(), size), asio::buffer(more)};
-        auto [ec, _] = co_await req.get_conn()->async_write(arr);
-        if (ec) {
-          r = false;
-        }
+    size_t block_size = chunked_size_;
+    size_t max_block_size = (std::max)(chunked_size_, max_chunked_size_);
+    uint64_t end = offset + size;
+    // the kernel reads ahead more aggressively for a sequential file, and
+    // the willneed window is kept a few blocks in front of the reader.
+    in_file.advise(offset, size, coro_io::file_advice::sequential);
+    uint64_t advised_end = offset;
+    auto read_ahead = [&] {
+      if (advised_end < end && advised_end < offset + 2 * max_block_size) {
+        uint64_t len = (std::min)(end - advised_end, 4 * max_block_size);
+        in_file.advise(advised_end, len, coro_io::file_advice::willneed);
+        advised_end += len;
       }
+    };
 
-      if (!r) {
+    std::array<std::string, 2> buffers;
+    size_t cur = 0;
+    size_t read_size = (std::min)(size, block_size);
+    read_ahead();
+    detail::resize(buffers[cur], read_size);
+    auto [ec, len] =
+        co_await in_file.async_read_at(offset, buffers[cur].data(), read_size);
+
+    while (true) {
+      if (ec || len == 0) {
+        // read error or the file has been truncated, the header has been
+        // sent already, so the only thing to do is closing the connection.
+        CINATRA_LOG_ERROR << "read file " << in_file.file_path()
+                          << " failed: " << ec.message();
+        conn->close();
         co_return false;
       }
-    }
-
-    co_return true;
-  }
 
-  template <class T, class Pred>
-  size_t erase_if(std::span<T> &sp, Pred p) {
-    auto it = std::remove_if(sp.begin(), sp.end(), p);
-    size_t count = sp.end() - it;
-    sp = std::span<T>(sp.data(), sp.data() + count);
-    return count;
-  }
-
-  int remove_result_headers(resp_data &result, std::string_view value) {
-    bool r = false;
-    return erase_if(result.resp_headers, [&](http_header &header) {
-      if (r) {
-        return false;
+      offset += len;
+      std::string_view data(buffers[cur].data(), len);
+      if (offset == end) {
+        co_return co_await write_file_block(conn, chunked, data, more);
       }
 
-      r = (header.value.find(value) != std::string_view::npos);
-
-      return r;
-    });
-  }
+      read_ahead();
+      size_t next = cur ^ 1;
+      read_size = (std::min<uint64_t>)(end - offset, block_size);
+      detail::resize(buffers[next], read_size);
+      auto start = std::chrono::steady_clock::now();
+      std::chrono::steady_clock::duration write_time{};
+      auto timed_write = [&]() -> async_simple::coro::Lazy<bool> {
+        bool r = co_await write_file_block(conn, chunked, data, "");
+        write_time = std::chrono::steady_clock::now() - start;
+        co_return r;
+      };
+      auto [read_result, write_result] =
+          co_await async_simple::coro::collectAll(
+              in_file.async_read_at(offset, buffers[next].data(), read_size),
+              timed_write());
+      if (!write_result.value()) {
+        co_return false;
+      }
+      std::tie(ec, len) = read_result.value();
+      cur = next;
 
-  void handle_response_header(resp_data &result, std::string &length) {
-    int r = remove_result_headers(result, "chunked");
-    if (r == 0) {
-      r = remove_result_headers(result, "multipart/form-data");
-      if (r) {
-        length = std::to_string(result.resp_body.size());
-        for (auto &[key, val] : result.resp_headers) {
-          if (key == "Content-Length") {
-            val = length;
-            break;
-          }
-        }
+      // the socket takes a block at once: send more per write. writes stall:
+      // hold less memory for the slow peer.
+      if (write_time < std::chrono::milliseconds(1)) {
+        block_size = (std::min)(block_size * 2, max_block_size);
+      }
+      else if (write_time > std::chrono::milliseconds(50)) {
+        block_size = (std::max)(block_size / 2, chunked_size_);
       }
     }
   }
 
-  async_simple::coro::Lazy<void> reply(coro_http_client &client,
-                                       std::string_view host,
-                                       coro_http_request &req,
-                                       coro_http_response &response) {
-    uri_t uri;
-    std::string proxy_host;
-
-    if (host.find("//") == std::string_view::npos) {
-      proxy_host.append("http://").append(host);
-      uri.parse_from(proxy_host.data());
-    }
-    else {
-      uri.parse_from(host.data());
+  // the blocks of a mapped file are slices of the mapping. the file is
+  // checked before every block, a truncated file closes the connection.
+  async_simple::coro::Lazy<bool> send_mapped_blocks(
+      coro_io::mmap_file_view &view, uint64_t offset, size_t size,
+      coro_http_response &resp, bool chunked, std::string_view more) {
+    auto conn = resp.get_conn();
+    if (size == 0) {
+      co_return more.empty() ||
+          co_await write_file_block(conn, chunked, {}, more);
     }
-    std::unordered_map<std::string, std::string> req_headers;
-    for (auto &[k, v] : req.get_headers()) {
-      req_headers.emplace(k, v);
-    }
-    req_headers["Host"] = uri.host;
 
-    auto ctx = req_context<std::string_view>{.content = req.get_body()};
-    auto result = co_await client.async_request(
-        req.full_url(), method_type(req.get_method()), std::move(ctx),
-        std::move(req_headers));
+    size_t block_size = (std::max)(chunked_size_, max_chunked_size_);
+    uint64_t end = offset + size;
+    view.advise(offset, size, coro_io::file_advice::sequential);
+    while (offset < end) {
+      size_t len = (std::min<uint64_t>)(end - offset, block_size);
+      if (!view.is_intact()) {
+        CINATRA_LOG_ERROR << "file " << view.path() << " has been truncated";
+        conn->close();
+        co_return false;
+      }
 
-    std::string length;
-    handle_response_header(result, length);
-    response.add_header_span(result.resp_headers);
+      view.advise(offset + len, block_size, coro_io::file_advice::willneed);
+      bool r = co_await write_file_block(conn, chunked, view.view(offset, len),
+                                         offset + len == end ? more : "");
+      if (!r) {
+        co_return false;
+      }
+      if (view.truncated()) {
+        CINATRA_LOG_ERROR << "file " << view.path() << " has been truncated";
+        conn->close();
+        co_return false;
+      }
+      offset += len;
+    }
+    co_return true;
+  }
 
-    response.set_status_and_content_view(
-        static_cast<status_type>(result.status), result.resp_body);
-    co_await response.get_conn()->reply();
-    response.set_delay(true);
+  // the bodies of a proxy route are relayed as they arrive, whatever their
+  // content type.
+  template <http_method... method>
+  void set_proxy_stream_body(const std::string &url_path) {
+    (router_.set_stream_body(
+         std::string(method_name(method)).append(" ").append(url_path), true),
+     ...);
   }
 
   void init_address(std::string address) {
@@ -979,6 +1346,7 @@ class coro_http_server {
   std::string address_;
   std::error_code errc_ = {};
   asio::ip::tcp::acceptor acceptor_;
+  coro_io::period_timer accept_pause_timer_{acceptor_.get_executor()};
   std::thread thd_;
   std::promise<void> acceptor_close_waiter_;
   bool no_delay_ = true;
@@ -996,8 +1364,13 @@ class coro_http_server {
 
   std::string static_dir_router_path_ = "";
   std::string static_dir_ = "";
-  std::vector<std::string> files_;
+  // url prefix -> directories served under it
+  std::unordered_map<std::string, std::vector<std::string>> static_dir_roots_;
+  static_root_names static_root_names_;
+  std::unique_ptr<file_meta_cache> file_meta_cache_;
   size_t chunked_size_ = 1024 * 10;
+  size_t max_chunked_size_ = 1024 * 1024;
+  size_t mmap_threshold_ = SIZE_MAX;
 
   std::unordered_map<std::string, std::string> static_file_cache_;
   file_resp_format_type format_type_ = file_resp_format_type::range;
@@ -1009,10 +1382,31 @@ class coro_http_server {
 #endif
   coro_http_router router_;
   bool need_shrink_every_time_ = false;
+  bool coalesce_writes_ = false;
+  std::chrono::microseconds flush_delay_{};
+  size_t ws_high_watermark_ = 0;
+  size_t ws_low_watermark_ = 0;
+  bool release_idle_buffers_ = false;
+  std::shared_ptr<compress_policy> compress_policy_;
+#ifdef CINATRA_ENABLE_GZIP
+  std::shared_ptr<const ws_deflate_options> ws_deflate_options_;
+#endif
+  std::optional<ws_heartbeat_options> ws_heartbeat_options_;
+  std::mutex ws_heartbeat_mtx_;
+  std::unordered_map<asio::io_context *, std::shared_ptr<ws_heartbeat>>
+      ws_heartbeats_;
+  ws_rebalance_options ws_rebalance_options_;
+  std::unique_ptr<asio::steady_timer> rebalance_timer_;
+  // the ws_bytes() of the connections at the last rebalance.
+  std::unordered_map<uint64_t, uint64_t> ws_bytes_marks_;
   std::function<async_simple::coro::Lazy<void>(coro_http_request &,
                                                coro_http_response &)>
       default_handler_ = nullptr;
+  std::function<bool(coro_http_request &, coro_http_response &)>
+      admission_check_ = nullptr;
   int64_t max_http_body_len_ = MAX_HTTP_BODY_SIZE;
+  std::string spool_dir_;
+  size_t spool_memory_threshold_ = 64 * 1024;
 #ifdef INJECT_FOR_HTTP_SEVER_TEST
   bool write_failed_forever_ = false;
   bool read_failed_forever_ = false;
@@ -19,7 +19,7 @@ enum class http_method {
   OPTIONS,
   DEL,
 };
-enum class content_encoding { gzip, deflate, br, none };
+enum class content_encoding { gzip, deflate, br, zstd, none };
 constexpr inline auto GET = http_method::GET;
 constexpr inline auto POST = http_method::POST;
 constexpr inline auto DEL = http_method::DEL;
@@ -122,8 +122,56 @@ struct chunked_result {
 
 struct part_head_t {
   std::error_code ec;
-  std::string name;
-  std::string filename;
+  std::string name{};
+  std::string filename{};
+};
+
+// a piece of the body of a multipart part.
+struct part_chunk_t {
+  std::error_code ec;
+  std::string_view data;
+  bool part_end = false;  // the last piece of the part
+  bool eof = false;       // the last piece of the last part
+};
+
+// a spooled request body or multipart part. it is kept in data unless it is
+// larger than the spool memory threshold, then it has been written to the
+// file at path, which belongs to the handler from now on.
+struct spool_result {
+  std::error_code ec;
+  bool eof = false;  // the last part of a multipart body
+  bool in_memory = true;
+  std::string data{};
+  std::string path{};
+  size_t size = 0;
+};
+
+// a piece of a streamed response body. eof ends the stream, a producer which
+// failed sets ec and the connection is closed.
+struct body_piece_t {
+  std::error_code ec;
+  std::string data;
+  bool eof = false;
+};
+
+// written by a connection. with write coalescing, coalesced counts the
+// messages which have been added to the output buffer instead of being
+// written on their own.
+struct write_stats {
+  uint64_t bytes = 0;
+  uint64_t write_calls = 0;
+  uint64_t coalesced = 0;
+};
+
+// the websocket send queue of a connection. depth and bytes are queued now,
+// dropped counts the messages which were refused or could not be written,
+// batches the writes of the queue.
+struct ws_queue_stats {
+  size_t depth = 0;
+  size_t bytes = 0;
+  uint64_t sent = 0;
+  uint64_t dropped = 0;
+  uint64_t batches = 0;
 };
 
 enum resp_content_type {
@@ -0,0 +1,207 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "cinatra/mime_types.hpp"
+#include "cinatra/utils.hpp"
+#include "ylt/coro_io/coro_file.hpp"
+
+namespace cinatra {
+struct file_meta {
+  std::string path;
+  std::shared_ptr<int> fd;  // opened for pread, null if not cached
+  size_t size = 0;
+  std::filesystem::file_time_type mtime;
+  std::string_view mime;
+};
+
+// a bounded lru cache of static file metadata and open fds, it saves the
+// stat and open calls of hot files. an entry older than valid_duration is
+// checked against the file system again before it is used, so replaced and
+// removed files are noticed. misses are never cached, new files are served
+// at once.
+class file_meta_cache {
+ public:
+  file_meta_cache(size_t max_entries,
+                  std::chrono::steady_clock::duration valid_duration)
+      : max_entries_(max_entries), valid_duration_(valid_duration) {}
+
+  // stat a regular file, nullptr if it doesn't exist, or if root is given
+  // and a symlink takes the path out of it. the fd is only opened when
+  // need_fd is true.
+  static std::shared_ptr<const file_meta> load(const std::string &path,
+                                               bool need_fd,
+                                               std::string_view root = {}) {
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(path, ec)) {
+      return nullptr;
+    }
+    if (!root.empty() && !is_within(path, root)) {
+      return nullptr;
+    }
+    auto meta = std::make_shared<file_meta>();
+    meta->size = std::filesystem::file_size(path, ec);
+    if (ec) {
+      return nullptr;
+    }
+    meta->mtime = std::filesystem::last_write_time(path, ec);
+    if (ec) {
+      return nullptr;
+    }
+    if (need_fd) {
+      coro_io::basic_random_coro_file<coro_io::execution_type::thread_pool>
+          file;
+      if (!file.open(path, std::ios::in)) {
+        return nullptr;
+      }
+      meta->fd = file.get_pread_file();
+    }
+    meta->path = path;
+    meta->mime = get_mime_type(get_extension(meta->path));
+    return meta;
+  }
+
+  std::shared_ptr<const file_meta> get(const std::string &path,
+                                       std::string_view root = {}) {
+    auto now = std::chrono::steady_clock::now();
+    std::shared_ptr<const file_meta> cached;
+    {
+      std::scoped_lock lock(mtx_);
+      if (auto it = map_.find(path); it != map_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        if (now - it->second->checked < valid_duration_) {
+          return it->second->meta;
+        }
+        cached = it->second->meta;
+      }
+    }
+
+    std::shared_ptr<const file_meta> meta;
+    if (cached && is_unchanged(*cached)) {
+      meta = cached;
+    }
+    else {
+      meta = load(path, true, root);
+    }
+
+    std::scoped_lock lock(mtx_);
+    auto it = map_.find(path);
+    if (meta == nullptr) {
+      if (it != map_.end()) {
+        lru_.erase(it->second);
+        map_.erase(it);
+      }
+      return nullptr;
+    }
+
+    if (it != map_.end()) {
+      it->second->meta = meta;
+      it->second->checked = now;
+      return meta;
+    }
+
+    lru_.push_front(entry{path, meta, now});
+    map_.emplace(path, lru_.begin());
+    while (lru_.size() > max_entries_) {
+      map_.erase(lru_.back().path);
+      lru_.pop_back();
+    }
+    return meta;
+  }
+
+  size_t size() {
+    std::scoped_lock lock(mtx_);
+    return lru_.size();
+  }
+
+  void clear() {
+    std::scoped_lock lock(mtx_);
+    map_.clear();
+    lru_.clear();
+  }
+
+ private:
+  struct entry {
+    std::string path;
+    std::shared_ptr<const file_meta> meta;
+    std::chrono::steady_clock::time_point checked;
+  };
+
+  static bool is_within(const std::string &path, std::string_view root) {
+    std::error_code ec;
+    auto real_root = std::filesystem::canonical(root, ec);
+    if (ec) {
+      return false;
+    }
+    auto real_path = std::filesystem::canonical(path, ec);
+    if (ec) {
+      return false;
+    }
+    auto [it, _] = std::mismatch(real_root.begin(), real_root.end(),
+                                 real_path.begin(), real_path.end());
+    return it == real_root.end();
+  }
+
+  static bool is_unchanged(const file_meta &meta) {
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(meta.path, ec);
+    if (ec || mtime != meta.mtime) {
+      return false;
+    }
+    auto size = std::filesystem::file_size(meta.path, ec);
+    return !ec && size == meta.size;
+  }
+
+  size_t max_entries_;
+  std::chrono::steady_clock::duration valid_duration_;
+  std::mutex mtx_;
+  std::list<entry> lru_;
+  std::unordered_map<std::string, std::list<entry>::iterator> map_;
+};
+
+// the names at the top of the roots of the "/" prefix. that prefix matches
+// every url, an url whose first segment is none of these names is not looked
+// up in the file system. the roots are listed again at most once per
+// refresh_interval, a new top level file or directory is served after that.
+class static_root_names {
+ public:
+  explicit static_root_names(
+      std::chrono::steady_clock::duration refresh_interval =
+          std::chrono::seconds(1))
+      : refresh_interval_(refresh_interval) {}
+
+  bool contains(std::string_view name, const std::vector<std::string> &roots) {
+    auto now = std::chrono::steady_clock::now();
+    std::scoped_lock lock(mtx_);
+    if (!listed_ || now - listed_time_ >= refresh_interval_) {
+      names_.clear();
+      for (auto &root : roots) {
+        std::error_code ec;
+        std::filesystem::directory_iterator it(root, ec), end;
+        for (; !ec && it != end; it.increment(ec)) {
+          names_.insert(it->path().filename().string());
+        }
+      }
+      listed_ = true;
+      listed_time_ = now;
+    }
+    return names_.find(name) != names_.end();
+  }
+
+ private:
+  std::chrono::steady_clock::duration refresh_interval_;
+  std::mutex mtx_;
+  std::set<std::string, std::less<>> names_;
+  std::chrono::steady_clock::time_point listed_time_;
+  bool listed_ = false;
+};
+}  // namespace cinatra
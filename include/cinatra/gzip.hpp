@@ -1,7 +1,11 @@
 #pragma once
 #include <zlib.h>
 
+#include <fstream>
+#include <memory>
+#include <string>
 #include <string_view>
+#include <vector>
 namespace cinatra::gzip_codec {
 // from https://github.com/chafey/GZipCodec
 
@@ -9,6 +13,188 @@ namespace cinatra::gzip_codec {
 #define windowBits 15
 #define GZIP_ENCODING 16
 
+// A z_stream which outlives a single message. deflateReset() drops the state
+// of the previous message but keeps the window and hash tables allocated, so
+// reusing a stream avoids a deflateInit2/deflateEnd pair per body.
+class deflate_stream {
+ public:
+  deflate_stream(int window_bits, int level = Z_DEFAULT_COMPRESSION,
+                 int mem_level = 8)
+      : window_bits_(window_bits), level_(level) {
+    strm_.zalloc = Z_NULL;
+    strm_.zfree = Z_NULL;
+    strm_.opaque = Z_NULL;
+    ok_ = deflateInit2(&strm_, level, Z_DEFLATED, window_bits, mem_level,
+                       Z_DEFAULT_STRATEGY) == Z_OK;
+  }
+
+  ~deflate_stream() {
+    if (ok_) {
+      deflateEnd(&strm_);
+    }
+  }
+
+  deflate_stream(const deflate_stream &) = delete;
+  deflate_stream &operator=(const deflate_stream &) = delete;
+
+  bool ok() const { return ok_; }
+
+  int window_bits() const { return window_bits_; }
+
+  bool reset(int level) {
+    if (!ok_ || deflateReset(&strm_) != Z_OK) {
+      return false;
+    }
+    if (level != level_) {
+      if (deflateParams(&strm_, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+      }
+      level_ = level;
+    }
+    return true;
+  }
+
+  // @param flush - Z_NO_FLUSH, Z_SYNC_FLUSH or Z_FINISH
+  bool write(std::string_view data, std::string &out, int flush) {
+    unsigned char buf[CHUNK];
+    strm_.next_in = (unsigned char *)data.data();
+    strm_.avail_in = (uInt)data.length();
+    do {
+      strm_.avail_out = CHUNK;
+      strm_.next_out = buf;
+      if (::deflate(&strm_, flush) == Z_STREAM_ERROR) {
+        return false;
+      }
+      out.append((char *)buf, CHUNK - strm_.avail_out);
+    } while (strm_.avail_out == 0);
+    return true;
+  }
+
+ private:
+  z_stream strm_;
+  int window_bits_;
+  int level_;
+  bool ok_ = false;
+};
+
+// inflates a stream which arrives piece by piece into caller buffers, the
+// window_bits select gzip (16 + 15), zlib (15) or raw (-15) data.
+class inflate_stream {
+ public:
+  explicit inflate_stream(int window_bits = GZIP_ENCODING + windowBits) {
+    strm_.zalloc = Z_NULL;
+    strm_.zfree = Z_NULL;
+    strm_.opaque = Z_NULL;
+    strm_.next_in = Z_NULL;
+    strm_.avail_in = 0;
+    ok_ = inflateInit2(&strm_, window_bits) == Z_OK;
+  }
+
+  ~inflate_stream() {
+    if (ok_) {
+      inflateEnd(&strm_);
+    }
+  }
+
+  inflate_stream(const inflate_stream &) = delete;
+  inflate_stream &operator=(const inflate_stream &) = delete;
+
+  bool ok() const { return ok_; }
+
+  // the data must stay valid until it has been consumed.
+  void set_input(std::string_view data) {
+    strm_.next_in = (unsigned char *)data.data();
+    strm_.avail_in = (uInt)data.size();
+  }
+
+  size_t pending_input() const { return strm_.avail_in; }
+
+  bool finished() const { return finished_; }
+
+  // start a new stream, the window is dropped.
+  bool reset() {
+    finished_ = false;
+    return ok_ && inflateReset(&strm_) == Z_OK;
+  }
+
+  // inflate the pending input into [out, out + size), return the size
+  // written or -1 on corrupt data.
+  int64_t read(char *out, size_t size) {
+    if (!ok_) {
+      return -1;
+    }
+    if (finished_) {
+      return 0;
+    }
+    strm_.next_out = (unsigned char *)out;
+    strm_.avail_out = (uInt)size;
+    int ret = ::inflate(&strm_, Z_NO_FLUSH);
+    if (ret == Z_STREAM_END) {
+      finished_ = true;
+    }
+    else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      return -1;
+    }
+    return size - strm_.avail_out;
+  }
+
+ private:
+  z_stream strm_;
+  bool ok_ = false;
+  bool finished_ = false;
+};
+
+namespace detail {
+inline constexpr size_t max_pooled_streams = 16;
+
+inline std::vector<std::unique_ptr<deflate_stream>> &deflate_stream_pool(
+    int window_bits) {
+  thread_local std::vector<std::unique_ptr<deflate_stream>> gzip_pool;
+  thread_local std::vector<std::unique_ptr<deflate_stream>> raw_pool;
+  return window_bits > 0 ? gzip_pool : raw_pool;
+}
+}  // namespace detail
+
+// return the stream to the pool of the thread which releases it.
+struct deflate_stream_releaser {
+  void operator()(deflate_stream *strm) const {
+    auto &pool = detail::deflate_stream_pool(strm->window_bits());
+    if (pool.size() < detail::max_pooled_streams) {
+      pool.emplace_back(strm);
+    }
+    else {
+      delete strm;
+    }
+  }
+};
+
+using deflate_stream_ptr =
+    std::unique_ptr<deflate_stream, deflate_stream_releaser>;
+
+// @param window_bits - windowBits | GZIP_ENCODING for gzip, -windowBits for
+// raw deflate
+inline deflate_stream_ptr acquire_deflate_stream(
+    int window_bits, int level = Z_DEFAULT_COMPRESSION) {
+  auto &pool = detail::deflate_stream_pool(window_bits);
+  std::unique_ptr<deflate_stream> strm;
+  while (!pool.empty() && strm == nullptr) {
+    strm = std::move(pool.back());
+    pool.pop_back();
+    if (strm->window_bits() != window_bits || !strm->reset(level)) {
+      strm = nullptr;
+    }
+  }
+
+  if (strm == nullptr) {
+    strm = std::make_unique<deflate_stream>(window_bits, level);
+    if (!strm->ok()) {
+      return nullptr;
+    }
+  }
+
+  return deflate_stream_ptr(strm.release());
+}
+
 // GZip Compression
 // @param data - the data to compress (does not have to be string, can be binary
 // data)
@@ -18,31 +204,11 @@ namespace cinatra::gzip_codec {
 // @return - true on success, false on failure
 inline bool compress(std::string_view data, std::string &compressed_data,
                      int level = -1) {
-  unsigned char out[CHUNK];
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  if (deflateInit2(&strm, level, Z_DEFLATED, windowBits | GZIP_ENCODING, 8,
-                   Z_DEFAULT_STRATEGY) != Z_OK) {
-    return false;
-  }
-  strm.next_in = (unsigned char *)data.data();
-  strm.avail_in = (uInt)data.length();
-  do {
-    int have;
-    strm.avail_out = CHUNK;
-    strm.next_out = out;
-    if (deflate(&strm, Z_FINISH) == Z_STREAM_ERROR) {
-      return false;
-    }
-    have = CHUNK - strm.avail_out;
-    compressed_data.append((char *)out, have);
-  } while (strm.avail_out == 0);
-  if (deflateEnd(&strm) != Z_OK) {
+  auto strm = acquire_deflate_stream(windowBits | GZIP_ENCODING, level);
+  if (strm == nullptr) {
     return false;
   }
-  return true;
+  return strm->write(data, compressed_data, Z_FINISH);
 }
 
 // GZip Decompression
@@ -217,86 +383,23 @@ inline bool inflate(std::string_view str_src, std::string &str_dest) {
   return err == Z_OK;
 }
 
-inline bool deflate(std::string_view str_src, std::string &str_dest) {
-  int err = Z_DATA_ERROR;
-  // Create stream
-  z_stream zs = {0};
-  // Set output data streams, do this here to avoid overwriting on recursive
-  // calls
-  const int OUTPUT_BUF_SIZE = 8192;
-  Bytef bytes_out[OUTPUT_BUF_SIZE] = {0};
-
-  // Initialise the z_stream
-  err = ::deflateInit2(&zs, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
-  if (err != Z_OK) {
+// @param level - as the one of compress, 1 for the websocket messages.
+inline bool deflate(std::string_view str_src, std::string &str_dest,
+                    int level = 1) {
+  auto strm = acquire_deflate_stream(-windowBits, level);
+  if (strm == nullptr) {
     return false;
   }
-  // Use whatever input is provided
-  zs.next_in = (Bytef *)(str_src.data());
-  zs.avail_in = str_src.length();
-
-  do {
-    try {
-      // Initialise stream values
-      // zs->zalloc = (alloc_func)0;
-      // zs->zfree = (free_func)0;
-      // zs->opaque = (voidpf)0;
-
-      zs.next_out = bytes_out;
-      zs.avail_out = OUTPUT_BUF_SIZE;
-
-      // Try to unzip the data
-      err = ::deflate(&zs, Z_SYNC_FLUSH);
-
-      // Is zip finished reading all currently available input and writing all
-      // generated output
-      if (err == Z_STREAM_END) {
-        // Finish up
-        [[maybe_unused]] int kerr = ::deflateEnd(&zs);
-
-        // Got a good result, set the size to the amount unzipped in this call
-        // (including all recursive calls)
-
-        str_dest.append((const char *)bytes_out,
-                        OUTPUT_BUF_SIZE - zs.avail_out);
-        return true;
-      }
-      else if ((err == Z_OK) && (zs.avail_out == 0) && (zs.avail_in != 0)) {
-        // Output array was not big enough, call recursively until there is
-        // enough space
-
-        str_dest.append((const char *)bytes_out,
-                        OUTPUT_BUF_SIZE - zs.avail_out);
-
-        continue;
-      }
-      else if ((err == Z_OK) && (zs.avail_in == 0)) {
-        // All available input has been processed, everything ok.
-        // Set the size to the amount unzipped in this call (including all
-        // recursive calls)
-        str_dest.append((const char *)bytes_out,
-                        OUTPUT_BUF_SIZE - zs.avail_out);
-
-        [[maybe_unused]] int kerr = ::deflateEnd(&zs);
-
-        break;
-      }
-      else {
-        return false;
-      }
-    } catch (...) {
-      return false;
-    }
-  } while (true);
-
-  if (err == Z_OK) {
-    // subtract 4 to remove the extra 00 00 ff ff added to the end of the deflat
-    // function
-    str_dest = str_dest.substr(0, str_dest.length() - 4);
-    return true;
+  size_t old_size = str_dest.size();
+  if (!strm->write(str_src, str_dest, Z_SYNC_FLUSH) ||
+      str_dest.size() < old_size + 4) {
+    return false;
   }
 
-  return false;
+  // subtract 4 to remove the extra 00 00 ff ff added to the end of the deflat
+  // function
+  str_dest.resize(str_dest.size() - 4);
+  return true;
 }
 
 }  // namespace cinatra::gzip_codec
\ No newline at end of file
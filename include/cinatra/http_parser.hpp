@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <array>
 #include <cctype>
+#include <memory>
 #include <span>
 #include <string>
 #include <string_view>
@@ -19,6 +20,12 @@ using namespace std::string_view_literals;
 #define CINATRA_MAX_HTTP_HEADER_FIELD_SIZE 100
 #endif
 
+// the headers of most requests fit in the parser, more of them, up to
+// CINATRA_MAX_HTTP_HEADER_FIELD_SIZE, are parsed into a heap array.
+#ifndef CINATRA_INLINE_HTTP_HEADER_SIZE
+#define CINATRA_INLINE_HTTP_HEADER_SIZE 16
+#endif
+
 namespace cinatra {
 inline bool iequal0(std::string_view a, std::string_view b) {
   return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](char a, char b) {
@@ -44,14 +51,20 @@ class http_parser {
   }
 
   int parse_response(const char *data, size_t size, int last_len) {
-    int minor_version;
-
-    num_headers_ = CINATRA_MAX_HTTP_HEADER_FIELD_SIZE;
     const char *msg;
     size_t msg_len;
-    header_len_ = cinatra::detail::phr_parse_response(
-        data, size, &minor_version, &status_, &msg, &msg_len, headers_.data(),
-        &num_headers_, last_len);
+    while (true) {
+      num_headers_ = header_capacity();
+      header_len_ = cinatra::detail::phr_parse_response(
+          data, size, &minor_version_, &status_, &msg, &msg_len, headers(),
+          &num_headers_, last_len);
+      if (header_len_ == -1 && num_headers_ == header_capacity() &&
+          grow_headers()) {
+        last_len = 0;
+        continue;
+      }
+      break;
+    }
     msg_ = {msg, msg_len};
     parse_body_len();
     if (header_len_ < 0) [[unlikely]] {
@@ -64,20 +77,25 @@ class http_parser {
   }
 
   int parse_request(const char *data, size_t size, int last_len) {
-    int minor_version;
-
-    num_headers_ = CINATRA_MAX_HTTP_HEADER_FIELD_SIZE;
-
     const char *method;
     size_t method_len;
     const char *url;
     size_t url_len;
 
     bool has_query{};
-    header_len_ = detail::phr_parse_request(
-        data, size, &method, &method_len, &url, &url_len, &minor_version,
-        headers_.data(), &num_headers_, last_len, has_connection_, has_close_,
-        has_upgrade_, has_query);
+    while (true) {
+      num_headers_ = header_capacity();
+      header_len_ = detail::phr_parse_request(
+          data, size, &method, &method_len, &url, &url_len, &minor_version_,
+          headers(), &num_headers_, last_len, has_connection_, has_close_,
+          has_upgrade_, has_query);
+      if (header_len_ == -1 && num_headers_ == header_capacity() &&
+          grow_headers()) {
+        last_len = 0;
+        continue;
+      }
+      break;
+    }
 
     if (header_len_ < 0) [[unlikely]] {
       CINATRA_LOG_WARNING << "parse http head failed";
@@ -111,6 +129,9 @@ class http_parser {
     return header_len_;
   }
 
+  // 1 for HTTP/1.1, 0 for HTTP/1.0.
+  int minor_version() const { return minor_version_; }
+
   bool has_connection() { return has_connection_; }
 
   bool has_close() { return has_close_; }
@@ -118,9 +139,10 @@ class http_parser {
   bool has_upgrade() { return has_upgrade_; }
 
   std::string_view get_header_value(std::string_view key) const {
+    auto hdrs = headers();
     for (size_t i = 0; i < num_headers_; i++) {
-      if (iequal0(headers_[i].name, key))
-        return headers_[i].value;
+      if (iequal0(hdrs[i].name, key))
+        return hdrs[i].value;
     }
     return {};
   }
@@ -211,8 +233,14 @@ class http_parser {
 
   std::string_view url() const { return url_; }
 
-  std::span<http_header> get_headers() {
-    return {headers_.data(), num_headers_};
+  std::span<http_header> get_headers() { return {headers(), num_headers_}; }
+
+  // drop the heap array of a request with many headers.
+  void shrink_headers() {
+    if (more_headers_) {
+      more_headers_.reset();
+      num_headers_ = 0;
+    }
   }
 
   void parse_query(std::string_view str) {
@@ -241,6 +269,33 @@ class http_parser {
   }
 
  private:
+  static constexpr size_t inline_header_size =
+      (std::min)(CINATRA_INLINE_HTTP_HEADER_SIZE,
+                 CINATRA_MAX_HTTP_HEADER_FIELD_SIZE);
+
+  http_header *headers() {
+    return more_headers_ ? more_headers_.get() : inline_headers_.data();
+  }
+
+  const http_header *headers() const {
+    return more_headers_ ? more_headers_.get() : inline_headers_.data();
+  }
+
+  size_t header_capacity() const {
+    return more_headers_ ? CINATRA_MAX_HTTP_HEADER_FIELD_SIZE
+                         : inline_header_size;
+  }
+
+  bool grow_headers() {
+    if (more_headers_ ||
+        inline_header_size == CINATRA_MAX_HTTP_HEADER_FIELD_SIZE) {
+      return false;
+    }
+    more_headers_ =
+        std::make_unique<http_header[]>(CINATRA_MAX_HTTP_HEADER_FIELD_SIZE);
+    return true;
+  }
+
   void output_error() {
     CINATRA_LOG_ERROR << "the field of http head is out of max limit "
                       << CINATRA_MAX_HTTP_HEADER_FIELD_SIZE
@@ -250,6 +305,7 @@ class http_parser {
 
  private:
   int status_ = 0;
+  int minor_version_ = 1;
   std::string_view msg_;
   size_t num_headers_ = 0;
   int header_len_ = 0;
@@ -257,7 +313,8 @@ class http_parser {
   bool has_connection_{};
   bool has_close_{};
   bool has_upgrade_{};
-  std::array<http_header, CINATRA_MAX_HTTP_HEADER_FIELD_SIZE> headers_;
+  std::array<http_header, inline_header_size> inline_headers_;
+  std::unique_ptr<http_header[]> more_headers_;
   std::string_view method_;
   std::string_view url_;
   std::string_view full_url_;
@@ -0,0 +1,500 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "async_simple/coro/Lazy.h"
+#include "coro_http_client.hpp"
+#include "coro_http_connection.hpp"
+#include "coro_http_request.hpp"
+#include "coro_http_response.hpp"
+#include "ylt/coro_io/coro_io.hpp"
+
+namespace cinatra {
+namespace detail {
+// where a chunked body ends in the bytes relayed, they are looked at once
+// and not kept. the data of a chunk can be skipped without being seen.
+class chunked_tracker {
+ public:
+  // the number of bytes of data which belong to the body.
+  size_t feed(std::string_view data) {
+    size_t i = 0;
+    while (i < data.size() && state_ != state::done &&
+           state_ != state::failed) {
+      char c = data[i];
+      switch (state_) {
+        case state::size:
+          if (int v = hex_value(c); v >= 0) {
+            if (remaining_ >> 59) {
+              state_ = state::failed;
+              break;
+            }
+            remaining_ = remaining_ * 16 + v;
+            digits_++;
+            i++;
+          }
+          else if (digits_ == 0) {
+            state_ = state::failed;
+          }
+          else {
+            // the extensions and the CRLF.
+            state_ = state::size_line;
+          }
+          break;
+        case state::size_line:
+          if (c == '\n') {
+            state_ = remaining_ == 0 ? state::trailer_start : state::data;
+          }
+          i++;
+          break;
+        case state::data: {
+          size_t n = (std::min)(remaining_, data.size() - i);
+          skip_data(n);
+          i += n;
+          break;
+        }
+        case state::data_end:
+          if (c == '\n') {
+            state_ = state::size;
+            digits_ = 0;
+          }
+          else if (c != '\r') {
+            state_ = state::failed;
+          }
+          i++;
+          break;
+        case state::trailer_start:
+          if (c == '\n') {
+            state_ = state::done;
+          }
+          else if (c != '\r') {
+            state_ = state::trailer;
+          }
+          i++;
+          break;
+        case state::trailer:
+          if (c == '\n') {
+            state_ = state::trailer_start;
+          }
+          i++;
+          break;
+        default:
+          break;
+      }
+    }
+    return i;
+  }
+
+  // the data of the current chunk which hasn't been seen.
+  size_t data_left() const { return state_ == state::data ? remaining_ : 0; }
+
+  void skip_data(size_t n) {
+    remaining_ -= n;
+    if (remaining_ == 0) {
+      state_ = state::data_end;
+    }
+  }
+
+  bool done() const { return state_ == state::done; }
+
+  bool failed() const { return state_ == state::failed; }
+
+ private:
+  static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+      return c - 'A' + 10;
+    }
+    return -1;
+  }
+
+  enum class state {
+    size,
+    size_line,
+    data,
+    data_end,
+    trailer_start,
+    trailer,
+    done,
+    failed
+  };
+  state state_ = state::size;
+  size_t remaining_ = 0;
+  size_t digits_ = 0;
+};
+
+// where a multipart body without a length ends, the close delimiter may be
+// split between the pieces relayed.
+class delimiter_finder {
+ public:
+  explicit delimiter_finder(std::string delim) : delim_(std::move(delim)) {}
+
+  // the number of bytes of data which belong to the body.
+  size_t feed(std::string_view data) {
+    if (!tail_.empty()) {
+      std::string joint = tail_;
+      joint.append(data.substr(0, delim_.size() - 1));
+      if (auto pos = joint.find(delim_); pos != std::string::npos) {
+        found_ = true;
+        return pos + delim_.size() - tail_.size();
+      }
+    }
+    if (auto pos = data.find(delim_); pos != std::string_view::npos) {
+      found_ = true;
+      return pos + delim_.size();
+    }
+
+    tail_.append(data.substr(data.size() - (std::min)(data.size(),
+                                                      delim_.size() - 1)));
+    if (tail_.size() >= delim_.size()) {
+      tail_.erase(0, tail_.size() - (delim_.size() - 1));
+    }
+    return data.size();
+  }
+
+  bool found() const { return found_; }
+
+ private:
+  std::string delim_;
+  std::string tail_;
+  bool found_ = false;
+};
+
+// the headers which only concern one connection, they are not relayed.
+inline bool is_hop_by_hop_header(std::string_view name) {
+  for (auto hop : {"Connection"sv, "Keep-Alive"sv, "Proxy-Connection"sv,
+                   "TE"sv, "Trailer"sv, "Upgrade"sv}) {
+    if (iequal0(name, hop)) {
+      return true;
+    }
+  }
+  return false;
+}
+}  // namespace detail
+
+// an http request relayed to an upstream server and the response relayed
+// back. the bodies are streamed: a piece is read when the last one has been
+// written, so a proxied request holds a buffer of its own at most and a slow
+// side slows the other one down through tcp. the framing of the bodies is
+// kept, chunked stays chunked and content-length bodies keep the length, on
+// linux they are spliced from socket to socket when both are plain tcp. the
+// request is sent before the response is read, as http/1.1 does.
+class http_proxy_session {
+ public:
+  // the route of the request must be a stream route, the upstream is a
+  // client connected to host or closed.
+  http_proxy_session(coro_http_request &req, coro_http_response &resp,
+                     coro_http_client &upstream)
+      : req_(req),
+        resp_(resp),
+        conn_(resp.get_conn()),
+        upstream_(upstream) {}
+
+  async_simple::coro::Lazy<void> run(std::string_view host) {
+    if (auto ec = co_await send_request(host); ec) {
+      CINATRA_LOG_WARNING << "send upstream request error: " << ec.message();
+      co_await close_upstream();
+      resp_.set_status_and_content(status_type::bad_gateway,
+                                   "upstream request failed");
+      co_return;
+    }
+
+    if (auto ec = co_await upstream_.read_response_head(); ec) {
+      CINATRA_LOG_WARNING << "read upstream response error: " << ec.message();
+      co_await close_upstream();
+      resp_.set_status_and_content(status_type::bad_gateway,
+                                   "upstream response failed");
+      co_return;
+    }
+
+    resp_.set_delay(true);
+    bool ok = co_await relay_response();
+    if (!ok || !upstream_keep_alive_ || upstream_.buffered_size() > 0) {
+      co_await close_upstream();
+    }
+    if (!ok || !keep_alive_) {
+      conn_->close();
+    }
+    co_await conn_->resume_on_io_thread();
+  }
+
+ private:
+  bool client_keep_alive() const {
+    return !iequal0(req_.get_header_value("Connection"), "close");
+  }
+
+  async_simple::coro::Lazy<std::error_code> send_request(
+      std::string_view host) {
+    // host may not be null terminated.
+    std::string proxy_host;
+    if (host.find("//") == std::string_view::npos) {
+      proxy_host.append("http://");
+    }
+    proxy_host.append(host);
+    uri_t uri;
+    if (!uri.parse_from(proxy_host.data()) || uri.host.empty()) {
+      CINATRA_LOG_WARNING << "bad upstream host: " << proxy_host;
+      co_return std::make_error_code(std::errc::invalid_argument);
+    }
+
+    std::string head;
+    head.append(req_.get_method())
+        .append(" ")
+        .append(req_.full_url())
+        .append(" HTTP/1.1\r\n");
+    for (auto &[name, value] : req_.get_headers()) {
+      // the server has answered 100-continue already.
+      if (detail::is_hop_by_hop_header(name) || iequal0(name, "Host") ||
+          iequal0(name, "Expect")) {
+        continue;
+      }
+      head.append(name).append(": ").append(value).append(CRCF);
+    }
+    head.append("Host: ").append(uri.host);
+    if (!uri.port.empty()) {
+      head.append(":").append(uri.port);
+    }
+    head.append(CRCF).append(client_keep_alive()
+                                 ? "Connection: keep-alive\r\n\r\n"
+                                 : "Connection: close\r\n\r\n");
+
+    // a pooled connection may have been closed by the upstream while it was
+    // idle, the head is sent once more on a new one.
+    std::vector<asio::const_buffer> buffers{asio::buffer(head)};
+    std::error_code ec;
+    for (int i = 0; i < 2; i++) {
+      if (i > 0 || upstream_.buffered_size() > 0) {
+        co_await close_upstream();
+      }
+      if (upstream_.has_closed()) {
+        auto data = co_await upstream_.connect(std::string(host));
+        if (data.net_err) {
+          CINATRA_LOG_WARNING << "connect upstream " << host
+                              << " error: " << data.net_err.message();
+          co_return data.net_err;
+        }
+      }
+      if (ec = co_await upstream_.write_raw(buffers); !ec) {
+        break;
+      }
+    }
+    if (ec) {
+      co_return ec;
+    }
+
+    co_return co_await conn_->relay_body(
+        [this](const std::vector<asio::const_buffer> &buffers) {
+          return upstream_.write_raw(buffers);
+        },
+        upstream_.plain_socket());
+  }
+
+  // close() of the client is posted when it is called off its io thread, the
+  // pool must see the client closed before it is collected or reused.
+  async_simple::coro::Lazy<void> close_upstream() {
+    auto &executor = upstream_.get_executor();
+    if (!executor.currentThreadInExecutor()) {
+      co_await coro_io::post([] {}, &executor);
+    }
+    upstream_.close();
+  }
+
+  enum class framing { none, length, chunked, delimiter, close };
+
+  async_simple::coro::Lazy<bool> relay_response() {
+    auto &parser = upstream_.response_parser();
+    int status = parser.status();
+    framing type = framing::close;
+    if (req_.get_method() == "HEAD"sv || status < 200 || status == 204 ||
+        status == 304) {
+      type = framing::none;
+    }
+    else if (parser.is_chunked()) {
+      type = framing::chunked;
+    }
+    else if (parser.is_multipart() && !parser.get_boundary().empty()) {
+      // as the client reads it, a length of the head is not the one of the
+      // parts.
+      type = framing::delimiter;
+    }
+    else if (!parser.get_header_value("Content-Length").empty()) {
+      type = framing::length;
+    }
+
+    // some upstreams send the body of a HEAD too, what comes after the head
+    // is not known, the connection is not reused. nor is it when the request
+    // asked the upstream to close it.
+    upstream_keep_alive_ = type != framing::close && parser.keep_alive() &&
+                           req_.get_method() != "HEAD"sv && client_keep_alive();
+    keep_alive_ = type != framing::close && client_keep_alive();
+
+    std::string head = "HTTP/1.1 ";
+    head.append(std::to_string(status))
+        .append(" ")
+        .append(parser.msg())
+        .append(CRCF);
+    for (auto &[name, value] : parser.get_headers()) {
+      if (detail::is_hop_by_hop_header(name) ||
+          (type == framing::delimiter && iequal0(name, "Content-Length"))) {
+        continue;
+      }
+      head.append(name).append(": ").append(value).append(CRCF);
+    }
+    head.append(keep_alive_ ? "Connection: keep-alive\r\n\r\n"
+                            : "Connection: close\r\n\r\n");
+
+    // the views of the parser are gone with the next read.
+    std::string delim;
+    if (type == framing::delimiter) {
+      delim.append("--").append(parser.get_boundary()).append("--\r\n");
+    }
+    if (auto [ec, _] = co_await conn_->async_write(asio::buffer(head)); ec) {
+      co_return false;
+    }
+
+    switch (type) {
+      case framing::none:
+        co_return true;
+      case framing::chunked:
+        co_return co_await relay_chunked();
+      case framing::delimiter:
+        co_return co_await relay_until(detail::delimiter_finder(delim));
+      case framing::length:
+        co_return co_await relay_length(parser.body_len(), false);
+      default:
+        co_return co_await relay_length(SIZE_MAX, true);
+    }
+  }
+
+  // length bytes, or all of them until the upstream closes.
+  async_simple::coro::Lazy<bool> relay_length(size_t length,
+                                              bool until_close) {
+    while (length > 0) {
+      if (upstream_.buffered_size() == 0 && can_splice()) {
+        // in slices, so a long download isn't taken for an idle connection.
+        conn_->set_last_time();
+        auto [ec, size] = co_await coro_io::async_splice(
+            *upstream_.plain_socket(), *conn_->plain_socket(),
+            (std::min)(length, size_t(4 * 1024 * 1024)));
+        length -= until_close ? 0 : size;
+        if (ec) {
+          co_return until_close && ec == asio::error::eof;
+        }
+        continue;
+      }
+
+      auto [ec, size] = co_await read_upstream();
+      if (ec) {
+        co_return until_close && ec == asio::error::eof;
+      }
+      size_t n = (std::min)(size, length);
+      length -= until_close ? 0 : n;
+      if (!co_await write_downstream(n, size)) {
+        co_return false;
+      }
+    }
+    co_return true;
+  }
+
+  async_simple::coro::Lazy<bool> relay_chunked() {
+    detail::chunked_tracker tracker;
+    while (!tracker.done()) {
+      size_t data_left = tracker.data_left();
+      if (data_left >= splice_min_size && upstream_.buffered_size() == 0 &&
+          can_splice()) {
+        conn_->set_last_time();
+        auto [ec, size] = co_await coro_io::async_splice(
+            *upstream_.plain_socket(), *conn_->plain_socket(),
+            (std::min)(data_left, size_t(4 * 1024 * 1024)));
+        tracker.skip_data(size);
+        if (ec) {
+          co_return false;
+        }
+        continue;
+      }
+
+      auto [ec, size] = co_await read_upstream();
+      if (ec) {
+        co_return false;
+      }
+      size_t n = tracker.feed({buf_.data(), size});
+      if (tracker.failed()) {
+        CINATRA_LOG_WARNING << "bad chunked upstream response";
+        co_return false;
+      }
+      if (!co_await write_downstream(n, size)) {
+        co_return false;
+      }
+    }
+    co_return true;
+  }
+
+  template <typename Finder>
+  async_simple::coro::Lazy<bool> relay_until(Finder finder) {
+    while (!finder.found()) {
+      auto [ec, size] = co_await read_upstream();
+      if (ec) {
+        co_return false;
+      }
+      if (!co_await write_downstream(finder.feed({buf_.data(), size}),
+                                     size)) {
+        co_return false;
+      }
+    }
+    co_return true;
+  }
+
+  async_simple::coro::Lazy<std::pair<std::error_code, size_t>>
+  read_upstream() {
+    if (buf_.empty()) {
+      detail::resize(buf_, 64 * 1024);
+    }
+    auto result = co_await upstream_.read_raw_some(buf_);
+    if (result.first && result.first != asio::error::eof) {
+      CINATRA_LOG_WARNING << "read upstream body error: "
+                          << result.first.message();
+    }
+    co_return result;
+  }
+
+  // the first size bytes of the read ones, the rest follows the body, the
+  // upstream connection can't be used again.
+  async_simple::coro::Lazy<bool> write_downstream(size_t size, size_t read) {
+    if (size < read) {
+      upstream_keep_alive_ = false;
+    }
+    if (size == 0) {
+      co_return true;
+    }
+    auto [ec, _] = co_await conn_->async_write(asio::buffer(buf_.data(), size));
+    co_return !ec;
+  }
+
+  bool can_splice() {
+#if defined(__linux__)
+    return upstream_.plain_socket() != nullptr &&
+           conn_->plain_socket() != nullptr;
+#else
+    return false;
+#endif
+  }
+
+  // smaller chunks are read, the chunk heads around them too.
+  static constexpr size_t splice_min_size = 16 * 1024;
+
+  coro_http_request &req_;
+  coro_http_response &resp_;
+  coro_http_connection *conn_;
+  coro_http_client &upstream_;
+  std::string buf_;
+  bool keep_alive_ = true;
+  bool upstream_keep_alive_ = true;
+};
+}  // namespace cinatra
@@ -0,0 +1,63 @@
+#pragma once
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace cinatra {
+// a lock-free queue with many producers and one consumer, an intrusive list
+// where producers swap themselves in at the head and the consumer follows the
+// next pointers from the tail. push never blocks, a push which is halfway
+// done is invisible to pop until the producer links it, so pop may see the
+// queue empty while a push is in flight.
+template <typename T>
+class mpsc_queue {
+ public:
+  mpsc_queue() : head_(&stub_), tail_(&stub_) {}
+
+  mpsc_queue(const mpsc_queue &) = delete;
+  mpsc_queue &operator=(const mpsc_queue &) = delete;
+
+  ~mpsc_queue() {
+    while (pop()) {
+    }
+    if (tail_ != &stub_) {
+      delete tail_;
+    }
+  }
+
+  // any thread.
+  void push(T value) {
+    auto n = new node{{}, std::move(value)};
+    node *prev = head_.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n);
+  }
+
+  // the consumer thread only.
+  std::optional<T> pop() {
+    node *next = tail_->next.load();
+    if (next == nullptr) {
+      return std::nullopt;
+    }
+    std::optional<T> value(std::move(next->value));
+    if (tail_ != &stub_) {
+      delete tail_;
+    }
+    // next is the new stub, its value has been moved out.
+    tail_ = next;
+    return value;
+  }
+
+  // the consumer thread only, false while a push is in flight.
+  bool empty() const { return tail_->next.load() == nullptr; }
+
+ private:
+  struct node {
+    std::atomic<node *> next{nullptr};
+    T value;
+  };
+
+  node stub_{};
+  std::atomic<node *> head_;
+  node *tail_;
+};
+}  // namespace cinatra
@@ -1,8 +1,137 @@
 #pragma once
+#include <array>
+#include <cstring>
+
 #include "define.h"
+#include "http_parser.hpp"
+#include "upload_spool.hpp"
+
+#if defined(CINATRA_SSE) || defined(CINATRA_AVX2)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
 
 namespace cinatra {
+namespace detail {
+// finds the delimiter of multipart parts. with CINATRA_SSE or CINATRA_AVX2
+// the candidates are the positions where both the first and the last byte
+// of the delimiter match, found a block at a time, then verified with
+// memcmp. otherwise and for the tail of the data it is boyer-moore-horspool.
+class boundary_finder {
+ public:
+  void init(std::string_view needle) {
+    needle_ = needle;
+    size_t n = needle_.size();
+    shift_.fill(static_cast<uint32_t>(n));
+    for (size_t i = 0; i + 1 < n; i++) {
+      shift_[static_cast<unsigned char>(needle_[i])] =
+          static_cast<uint32_t>(n - 1 - i);
+    }
+  }
 
+  std::string_view needle() const { return needle_; }
+
+  // the position of the first match in data, npos if there is none.
+  size_t find(std::string_view data) const {
+    size_t n = needle_.size();
+    if (n == 0 || data.size() < n) {
+      return std::string_view::npos;
+    }
+
+    size_t i = 0;
+#if defined(CINATRA_AVX2)
+    i = find_blocks<32>(data);
+#elif defined(CINATRA_SSE)
+    i = find_blocks<16>(data);
+#endif
+    if (is_match_at(data, i)) {
+      return i;
+    }
+    return find_bmh(data, i);
+  }
+
+ private:
+  bool is_match_at(std::string_view data, size_t i) const {
+    return i + needle_.size() <= data.size() &&
+           std::memcmp(data.data() + i, needle_.data(), needle_.size()) == 0;
+  }
+
+  size_t find_bmh(std::string_view data, size_t i) const {
+    size_t n = needle_.size();
+    const char last = needle_[n - 1];
+    while (i + n <= data.size()) {
+      unsigned char c = data[i + n - 1];
+      if (c == static_cast<unsigned char>(last) &&
+          std::memcmp(data.data() + i, needle_.data(), n - 1) == 0) {
+        return i;
+      }
+      i += shift_[c];
+    }
+    return std::string_view::npos;
+  }
+
+#if defined(CINATRA_SSE) || defined(CINATRA_AVX2)
+  static uint32_t lowest_bit(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+  }
+
+  // the first match of the blocks which fit into data, or where the scalar
+  // search has to go on.
+  template <size_t block>
+  size_t find_blocks(std::string_view data) const {
+    size_t n = needle_.size();
+    const char *ptr = data.data();
+    size_t i = 0;
+#if defined(CINATRA_AVX2)
+    const __m256i first = _mm256_set1_epi8(needle_[0]);
+    const __m256i last = _mm256_set1_epi8(needle_[n - 1]);
+#else
+    const __m128i first = _mm_set1_epi8(needle_[0]);
+    const __m128i last = _mm_set1_epi8(needle_[n - 1]);
+#endif
+    for (; i + n - 1 + block <= data.size(); i += block) {
+#if defined(CINATRA_AVX2)
+      __m256i head = _mm256_loadu_si256((const __m256i *)(ptr + i));
+      __m256i tail = _mm256_loadu_si256((const __m256i *)(ptr + i + n - 1));
+      uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(
+          _mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+                           _mm256_cmpeq_epi8(tail, last))));
+#else
+      __m128i head = _mm_loadu_si128((const __m128i *)(ptr + i));
+      __m128i tail = _mm_loadu_si128((const __m128i *)(ptr + i + n - 1));
+      uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_and_si128(
+          _mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last))));
+#endif
+      while (mask != 0) {
+        size_t pos = i + lowest_bit(mask);
+        if (std::memcmp(ptr + pos + 1, needle_.data() + 1, n - 2) == 0) {
+          return pos;
+        }
+        mask &= mask - 1;
+      }
+    }
+    return i;
+  }
+#endif
+
+  std::string needle_;
+  std::array<uint32_t, 256> shift_{};
+};
+}  // namespace detail
+
+// reads a multipart body part by part. it is a state machine over a window
+// of the connection's buffer: part data is handed out as soon as it can't be
+// the beginning of a delimiter, so a part never has to fit into memory, and
+// every byte of a part is searched once.
 template <typename T>
 class multipart_reader_t {
  public:
@@ -17,106 +146,363 @@ class multipart_reader_t {
       co_return part_head_t{std::make_error_code(std::errc::protocol_error)};
     }
 
-    if (head_buf_.size() > 0) {
-      const char *data_ptr = asio::buffer_cast<const char *>(head_buf_.data());
-      chunked_buf_.sputn(data_ptr, head_buf_.size());
-      head_buf_.consume(head_buf_.size());
+    if (state_ == state::start) {
+      if (head_buf_.size() > 0) {
+        const char *data_ptr =
+            asio::buffer_cast<const char *>(head_buf_.data());
+        chunked_buf_.sputn(data_ptr, head_buf_.size());
+        head_buf_.consume(head_buf_.size());
+      }
+      std::string delimiter = "\r\n--";
+      delimiter.append(boundary);
+      finder_.init(delimiter);
+
+      if (auto ec = co_await read_first_boundary(); ec) {
+        co_return part_head_t{ec};
+      }
+    }
+    else if (state_ == state::body) {
+      // the body of the previous part has not been read, skip it.
+      while (true) {
+        auto chunk = co_await read_part_body_some();
+        if (chunk.ec) {
+          co_return part_head_t{chunk.ec};
+        }
+        if (chunk.part_end) {
+          break;
+        }
+      }
+    }
+
+    if (state_ != state::head) {
+      co_return part_head_t{std::make_error_code(std::errc::no_message)};
     }
 
     part_head_t result{};
-    std::error_code ec{};
-    size_t size;
+    size_t searched = 0;
+    while (true) {
+      std::string_view data = window();
+      size_t pos = data.find('\n', searched);
+      if (pos == std::string_view::npos) {
+        searched = data.size();
+        if (data.size() > max_part_head_size) {
+          CINATRA_LOG_ERROR << "multipart part head is too large";
+          conn_->close();
+          co_return part_head_t{
+              std::make_error_code(std::errc::protocol_error)};
+        }
+        if (auto ec = co_await read_more(); ec) {
+          co_return part_head_t{ec};
+        }
+        continue;
+      }
 
-    auto get_part_name = [](std::string_view data, std::string_view name,
-                            size_t start) {
-      start += name.length();
-      size_t end = data.find("\"", start);
-      return data.substr(start, end - start);
-    };
+      std::string_view line = data.substr(0, pos);
+      if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+      }
+      if (line.empty()) {
+        chunked_buf_.consume(pos + 1);
+        break;
+      }
+      parse_head_line(line, result);
+      chunked_buf_.consume(pos + 1);
+      searched = 0;
+    }
 
-    constexpr std::string_view name = "name=\"";
-    constexpr std::string_view filename = "filename=\"";
+    state_ = state::body;
+    co_return result;
+  }
+
+  // the next piece of the body of the current part. part_end is set with the
+  // last piece of the part and eof with the last piece of the body. data is
+  // valid until the next read.
+  async_simple::coro::Lazy<part_chunk_t> read_part_body_some() {
+    part_chunk_t result{};
+    if (state_ != state::body) {
+      result.ec = std::make_error_code(std::errc::protocol_error);
+      co_return result;
+    }
 
+    size_t n = finder_.needle().size();
     while (true) {
-      if (std::tie(ec, size) =
-              co_await conn_->async_read_until(chunked_buf_, CRCF);
-          ec) {
-        result.ec = ec;
-        conn_->close();
+      std::string_view data = window();
+      size_t pos = finder_.find(data);
+      if (pos != std::string_view::npos) {
+        size_t tail_size = 0;
+        auto tail = parse_tail(data.substr(pos + n), tail_size);
+        if (tail == tail_kind::more) {
+          // the delimiter has been found, what follows it has not arrived.
+          if (pos > 0) {
+            result.data = data.substr(0, pos);
+            chunked_buf_.consume(pos);
+            co_return result;
+          }
+          if (auto ec = co_await read_more(); ec) {
+            result.ec = ec;
+            co_return result;
+          }
+          continue;
+        }
+
+        if (tail == tail_kind::bad) {
+          CINATRA_LOG_ERROR << "bad multipart delimiter";
+          result.ec = std::make_error_code(std::errc::protocol_error);
+          conn_->close();
+          co_return result;
+        }
+
+        result.data = data.substr(0, pos);
+        result.part_end = true;
+        chunked_buf_.consume(pos + n + tail_size);
+        if (tail == tail_kind::close) {
+          // the CRLF after the close delimiter, if it is already here.
+          if (window().starts_with(CRCF)) {
+            chunked_buf_.consume(CRCF.size());
+          }
+          result.eof = true;
+          state_ = state::end;
+        }
+        else {
+          state_ = state::head;
+        }
         co_return result;
       }
 
-      const char *data_ptr =
-          asio::buffer_cast<const char *>(chunked_buf_.data());
-      chunked_buf_.consume(size);
-      if (*data_ptr == '-') {
-        continue;
+      // everything but what could be the beginning of the delimiter.
+      if (data.size() >= n) {
+        size_t size = data.size() - n + 1;
+        result.data = data.substr(0, size);
+        chunked_buf_.consume(size);
+        co_return result;
       }
-      std::string_view data{data_ptr, size};
-      if (size == 2) {  // got the head end: \r\n\r\n
-        break;
+
+      if (auto ec = co_await read_more(); ec) {
+        result.ec = ec;
+        co_return result;
       }
+    }
+  }
 
-      if (size_t pos = data.find("name"); pos != std::string_view::npos) {
-        result.name = get_part_name(data, name, pos);
+  // the whole body of the current part. the delimiter is the one of
+  // read_part_head(), boundary is kept for the callers.
+  async_simple::coro::Lazy<chunked_result> read_part_body(
+      [[maybe_unused]] std::string_view boundary) {
+    chunked_result result{};
+    part_body_.clear();
+    while (true) {
+      auto chunk = co_await read_part_body_some();
+      if (chunk.ec) {
+        result.ec = chunk.ec;
+        co_return result;
+      }
 
-        if (size_t pos = data.find("filename"); pos != std::string_view::npos) {
-          result.filename = get_part_name(data, filename, pos);
+      if (chunk.part_end) {
+        if (part_body_.empty()) {
+          // the part came in one piece, no need to copy it.
+          result.data = chunk.data;
         }
-        continue;
+        else {
+          part_body_.append(chunk.data);
+          result.data = part_body_;
+        }
+        result.eof = chunk.eof;
+        co_return result;
       }
+      part_body_.append(chunk.data);
     }
+  }
 
-    co_return result;
+  // read the body of the current part into memory, or into a spool file
+  // once it is larger than the spool memory threshold of the server.
+  async_simple::coro::Lazy<spool_result> spool_part_body(
+      [[maybe_unused]] std::string_view boundary) {
+    body_spooler spooler(conn_->spool_dir_, conn_->spool_memory_threshold_);
+    while (true) {
+      auto chunk = co_await read_part_body_some();
+      if (chunk.ec) {
+        co_return spool_result{chunk.ec};
+      }
+      if (auto ec = co_await spooler.append(chunk.data); ec) {
+        conn_->close();
+        co_return spool_result{ec};
+      }
+
+      if (chunk.part_end) {
+        auto result = spooler.finish();
+        result.eof = chunk.eof;
+        co_return result;
+      }
+    }
   }
 
-  async_simple::coro::Lazy<chunked_result> read_part_body(
-      std::string_view boundary) {
-    chunked_result result{};
-    std::error_code ec{};
-    size_t size = 0;
+ private:
+  enum class state { start, head, body, end };
+  // what follows a delimiter.
+  enum class tail_kind { more, next, close, bad };
+
+  static constexpr size_t read_size = 32 * 1024;
+  static constexpr size_t max_part_head_size = 16 * 1024;
+
+  std::string_view window() const {
+    return {asio::buffer_cast<const char *>(chunked_buf_.data()),
+            chunked_buf_.size()};
+  }
 
-    if (std::tie(ec, size) =
-            co_await conn_->async_read_until(chunked_buf_, boundary);
-        ec) {
-      result.ec = ec;
+  async_simple::coro::Lazy<std::error_code> read_more() {
+    auto [ec, size] =
+        co_await conn_->async_read_some(chunked_buf_.prepare(read_size));
+    if (ec) {
       conn_->close();
-      co_return result;
+      co_return ec;
     }
+    chunked_buf_.commit(size);
+    co_return std::error_code{};
+  }
 
-    const char *data_ptr = asio::buffer_cast<const char *>(chunked_buf_.data());
-    chunked_buf_.consume(size);
-    result.data = std::string_view{
-        data_ptr, size - boundary.size() - 4};  //-- boundary \r\n
+  // "--" after a close delimiter, otherwise the transport padding (LWSP) and
+  // CRLF, size is the size of it.
+  static tail_kind parse_tail(std::string_view rest, size_t &size) {
+    if (rest.size() < 2) {
+      return tail_kind::more;
+    }
+    if (rest.starts_with("--")) {
+      size = 2;
+      return tail_kind::close;
+    }
+    size_t i = rest.find_first_not_of(" \t");
+    if (i == std::string_view::npos || rest.size() < i + 2) {
+      return rest.size() > max_part_head_size ? tail_kind::bad
+                                              : tail_kind::more;
+    }
+    if (rest.substr(i, 2) != CRCF) {
+      return tail_kind::bad;
+    }
+    size = i + 2;
+    return tail_kind::next;
+  }
 
-    if (std::tie(ec, size) =
-            co_await conn_->async_read_until(chunked_buf_, CRCF);
-        ec) {
-      result = {};
-      result.ec = ec;
-      conn_->close();
-      co_return result;
+  // skip the preamble and the first delimiter. the delimiter is at the start
+  // of the body, or after a CRLF of the preamble.
+  async_simple::coro::Lazy<std::error_code> read_first_boundary() {
+    std::string_view first = finder_.needle().substr(CRCF.size());
+    bool at_start = true;
+    while (true) {
+      std::string_view data = window();
+      size_t pos = std::string_view::npos;
+      size_t size = 0;
+      if (at_start && data.size() < first.size() && first.starts_with(data)) {
+        if (auto ec = co_await read_more(); ec) {
+          co_return ec;
+        }
+        continue;
+      }
+      if (at_start && data.starts_with(first)) {
+        pos = 0;
+        size = first.size();
+      }
+      else {
+        at_start = false;
+        pos = finder_.find(data);
+        size = finder_.needle().size();
+      }
+
+      if (pos != std::string_view::npos) {
+        size_t tail_size = 0;
+        auto tail = parse_tail(data.substr(pos + size), tail_size);
+        if (tail == tail_kind::next) {
+          chunked_buf_.consume(pos + size + tail_size);
+          state_ = state::head;
+          co_return std::error_code{};
+        }
+        if (tail == tail_kind::close) {
+          chunked_buf_.consume(pos + size + tail_size);
+          state_ = state::end;
+          co_return std::make_error_code(std::errc::no_message);
+        }
+        if (tail == tail_kind::bad) {
+          state_ = state::end;
+          conn_->close();
+          co_return std::make_error_code(std::errc::protocol_error);
+        }
+      }
+      else if (data.size() > max_part_head_size) {
+        // drop the preamble, keep what could be the beginning of the
+        // delimiter.
+        chunked_buf_.consume(data.size() - finder_.needle().size() + 1);
+      }
+      if (auto ec = co_await read_more(); ec) {
+        co_return ec;
+      }
+    }
+  }
+
+  // Content-Disposition: form-data; name="field"; filename="a.txt"
+  static void parse_head_line(std::string_view line, part_head_t &head) {
+    size_t colon = line.find(':');
+    if (colon == std::string_view::npos ||
+        !iequal0(trim(line.substr(0, colon)), "content-disposition")) {
+      return;
     }
 
-    data_ptr = asio::buffer_cast<const char *>(chunked_buf_.data());
-    std::string data{data_ptr, size};
-    if (size > 2) {
-      constexpr std::string_view complete_flag = "--\r\n";
-      if (data == complete_flag) {
-        result.eof = true;
+    std::string_view params = line.substr(colon + 1);
+    size_t i = 0;
+    while (i < params.size()) {
+      size_t key_end = params.find_first_of("=;", i);
+      if (key_end == std::string_view::npos || params[key_end] == ';') {
+        i = key_end == std::string_view::npos ? params.size() : key_end + 1;
+        continue;
+      }
+      std::string_view key = trim(params.substr(i, key_end - i));
+
+      i = key_end + 1;
+      while (i < params.size() && params[i] == ' ') {
+        i++;
+      }
+      std::string_view value;
+      if (i < params.size() && params[i] == '"') {
+        // a quoted value can contain ';'.
+        size_t quote = params.find('"', i + 1);
+        if (quote == std::string_view::npos) {
+          quote = params.size();
+        }
+        value = params.substr(i + 1, quote - i - 1);
+        i = params.find(';', quote);
+      }
+      else {
+        size_t value_end = params.find(';', i);
+        value = trim(params.substr(i, value_end - i));
+        i = value_end;
+      }
+      i = i == std::string_view::npos ? params.size() : i + 1;
+
+      if (iequal0(key, "name")) {
+        head.name = std::string{value};
+      }
+      else if (iequal0(key, "filename")) {
+        head.filename = std::string{value};
       }
     }
+  }
 
-    chunked_buf_.consume(size);
-    co_return result;
+  static std::string_view trim(std::string_view str) {
+    while (!str.empty() && (str.front() == ' ' || str.front() == '\t')) {
+      str.remove_prefix(1);
+    }
+    while (!str.empty() && (str.back() == ' ' || str.back() == '\t')) {
+      str.remove_suffix(1);
+    }
+    return str;
   }
 
- private:
   T *conn_;
-  asio::streambuf &head_buf_;
-  asio::streambuf &chunked_buf_;
+  std::remove_reference_t<decltype(T::head_buf_)> &head_buf_;
+  std::remove_reference_t<decltype(T::chunked_buf_)> &chunked_buf_;
+  state state_ = state::start;
+  detail::boundary_finder finder_;
+  std::string part_body_;
 };
 
 template <typename T>
 multipart_reader_t(T *con) -> multipart_reader_t<T>;
-}  // namespace cinatra
\ No newline at end of file
+}  // namespace cinatra
@@ -0,0 +1,119 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <string_view>
+
+namespace cinatra {
+// a monotonic arena for the data of one request, it is reset after the
+// response has been sent. the memory stays with the connection, a request
+// which fits in what the previous ones needed doesn't allocate at all. if a
+// request needed more than one block, the next one gets a single block of
+// the whole size.
+class request_arena : public std::pmr::memory_resource {
+ public:
+  explicit request_arena(
+      size_t initial_size = 1024,
+      std::pmr::memory_resource *upstream = std::pmr::new_delete_resource())
+      : upstream_(upstream),
+        initial_size_(initial_size),
+        next_size_(initial_size) {}
+
+  request_arena(const request_arena &) = delete;
+  request_arena &operator=(const request_arena &) = delete;
+
+  ~request_arena() { release(); }
+
+  // copy str into the arena.
+  std::string_view copy(std::string_view str) {
+    if (str.empty()) {
+      return {};
+    }
+    auto p = static_cast<char *>(allocate(str.size(), 1));
+    std::memcpy(p, str.data(), str.size());
+    return {p, str.size()};
+  }
+
+  void reset() {
+    if (head_ == nullptr) {
+      return;
+    }
+    if (head_->next != nullptr) {
+      size_t total = total_;
+      release();
+      next_size_ = total;
+      return;
+    }
+    cur_ = reinterpret_cast<char *>(head_ + 1);
+    left_ = head_->size - sizeof(block);
+  }
+
+  // give all memory back to the upstream resource.
+  void release() {
+    while (head_ != nullptr) {
+      block *next = head_->next;
+      upstream_->deallocate(head_, head_->size, alignof(std::max_align_t));
+      head_ = next;
+    }
+    cur_ = nullptr;
+    left_ = 0;
+    total_ = 0;
+    next_size_ = initial_size_;
+  }
+
+  size_t capacity() const { return total_; }
+
+  // the blocks taken from the upstream resource so far.
+  size_t upstream_allocations() const { return upstream_allocations_; }
+
+ private:
+  struct alignas(std::max_align_t) block {
+    block *next;
+    size_t size;
+  };
+
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    void *p = cur_;
+    if (p != nullptr && std::align(alignment, bytes, p, left_)) {
+      cur_ = static_cast<char *>(p) + bytes;
+      left_ -= bytes;
+      return p;
+    }
+
+    size_t size = (std::max)(next_size_, sizeof(block) + bytes + alignment);
+    auto b = static_cast<block *>(
+        upstream_->allocate(size, alignof(std::max_align_t)));
+    b->next = head_;
+    b->size = size;
+    head_ = b;
+    total_ += size;
+    next_size_ = size * 2;
+    upstream_allocations_++;
+
+    p = b + 1;
+    left_ = size - sizeof(block);
+    std::align(alignment, bytes, p, left_);
+    cur_ = static_cast<char *>(p) + bytes;
+    left_ -= bytes;
+    return p;
+  }
+
+  void do_deallocate(void *, size_t, size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource &other)
+      const noexcept override {
+    return this == &other;
+  }
+
+  std::pmr::memory_resource *upstream_;
+  size_t initial_size_;
+  size_t next_size_;
+  block *head_ = nullptr;
+  char *cur_ = nullptr;
+  size_t left_ = 0;
+  size_t total_ = 0;
+  size_t upstream_allocations_ = 0;
+};
+}  // namespace cinatra
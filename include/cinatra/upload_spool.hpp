@@ -0,0 +1,219 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include "async_simple/coro/Lazy.h"
+#include "cinatra/cinatra_log_wrapper.hpp"
+#include "cinatra/define.h"
+#include "ylt/coro_io/coro_io.hpp"
+#if defined(ASIO_WINDOWS)
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace cinatra {
+// a new file in the spool dir, it is removed again unless it has been
+// released to the handler.
+class spool_file {
+ public:
+  spool_file() = default;
+  spool_file(const spool_file &) = delete;
+  spool_file &operator=(const spool_file &) = delete;
+
+  ~spool_file() {
+    close();
+    if (!path_.empty() && !released_) {
+      std::error_code ec;
+      std::filesystem::remove(path_, ec);
+    }
+  }
+
+  bool create(const std::string &dir) {
+    static std::atomic<uint64_t> seq = 0;
+    std::error_code ec;
+    std::filesystem::path spool_dir =
+        dir.empty() ? std::filesystem::temp_directory_path(ec)
+                    : std::filesystem::path(dir);
+    if (ec) {
+      return false;
+    }
+
+    auto now = std::chrono::system_clock::now().time_since_epoch().count();
+    for (int i = 0; i < 16; i++) {
+      std::string name = "cinatra_spool_";
+      name.append(std::to_string(now))
+          .append("_")
+          .append(std::to_string(++seq));
+      auto path = (spool_dir / name).string();
+#if defined(ASIO_WINDOWS)
+      if (std::filesystem::exists(path, ec)) {
+        continue;
+      }
+      file_.open(path, std::ios::binary | std::ios::out);
+      if (!file_.is_open()) {
+        return false;
+      }
+#else
+      fd_ = ::open(path.data(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+      if (fd_ < 0) {
+        if (errno == EEXIST) {
+          continue;
+        }
+        return false;
+      }
+#endif
+      path_ = std::move(path);
+      return true;
+    }
+    return false;
+  }
+
+  bool is_open() const {
+#if defined(ASIO_WINDOWS)
+    return file_.is_open();
+#else
+    return fd_ >= 0;
+#endif
+  }
+
+  // append data to the file.
+  std::error_code write(std::string_view data) {
+#if defined(ASIO_WINDOWS)
+    file_.write(data.data(), data.size());
+    if (!file_) {
+      return std::make_error_code(std::errc::io_error);
+    }
+    size_ += data.size();
+#else
+    while (!data.empty()) {
+      ssize_t n = ::pwrite(fd_, data.data(), data.size(), size_);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return std::error_code(errno, std::system_category());
+      }
+      data.remove_prefix(n);
+      size_ += n;
+    }
+#endif
+    return {};
+  }
+
+  // append data on the blocking executor of coro_io, the io thread doesn't
+  // wait for the disk.
+  async_simple::coro::Lazy<std::error_code> async_write(std::string_view data) {
+    auto result = co_await coro_io::post([this, data] { return write(data); });
+    if (result.hasError()) {
+      co_return std::make_error_code(std::errc::io_error);
+    }
+    co_return result.value();
+  }
+
+#if !defined(ASIO_WINDOWS)
+  int native_handle() const { return fd_; }
+#endif
+
+  // size bytes have been written to the end of the file through its handle.
+  void advance(size_t size) { size_ += size; }
+
+  size_t size() const { return size_; }
+
+  const std::string &path() const { return path_; }
+
+  // close the file and leave it to the handler.
+  void release() {
+    close();
+    released_ = true;
+  }
+
+ private:
+  void close() {
+#if defined(ASIO_WINDOWS)
+    if (file_.is_open()) {
+      file_.close();
+    }
+#else
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+#endif
+  }
+
+#if defined(ASIO_WINDOWS)
+  std::ofstream file_;
+#else
+  int fd_ = -1;
+#endif
+  std::string path_;
+  size_t size_ = 0;
+  bool released_ = false;
+};
+
+// collects a body piece by piece, it stays in memory while it isn't larger
+// than memory_threshold and moves to a spool file in dir once it is.
+class body_spooler {
+ public:
+  body_spooler(std::string_view dir, size_t memory_threshold)
+      : dir_(dir), memory_threshold_(memory_threshold) {}
+
+  async_simple::coro::Lazy<std::error_code> append(std::string_view data) {
+    if (!file_.is_open() && data_.size() + data.size() > memory_threshold_) {
+      if (auto ec = co_await spill(); ec) {
+        co_return ec;
+      }
+    }
+    if (file_.is_open()) {
+      co_return co_await file_.async_write(data);
+    }
+    data_.append(data);
+    co_return std::error_code{};
+  }
+
+  // move to the spool file now, the body is known to be too large.
+  async_simple::coro::Lazy<std::error_code> spill() {
+    if (file_.is_open()) {
+      co_return std::error_code{};
+    }
+    if (!file_.create(dir_)) {
+      CINATRA_LOG_ERROR << "create spool file in " << dir_ << " failed";
+      co_return std::make_error_code(std::errc::io_error);
+    }
+    auto ec = co_await file_.async_write(data_);
+    std::string{}.swap(data_);
+    co_return ec;
+  }
+
+  bool in_memory() const { return !file_.is_open(); }
+
+  spool_file &file() { return file_; }
+
+  spool_result finish() {
+    spool_result result{};
+    if (file_.is_open()) {
+      result.in_memory = false;
+      result.size = file_.size();
+      result.path = file_.path();
+      file_.release();
+    }
+    else {
+      result.size = data_.size();
+      result.data = std::move(data_);
+    }
+    return result;
+  }
+
+ private:
+  std::string dir_;
+  size_t memory_threshold_;
+  std::string data_;
+  spool_file file_;
+};
+}  // namespace cinatra
@@ -0,0 +1,159 @@
+#pragma once
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CINATRA_UTF8_SSE2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define CINATRA_UTF8_NEON
+#endif
+
+namespace cinatra {
+namespace detail {
+// the position of the first byte from i which is not ascii, 16 bytes are
+// checked at a time.
+inline size_t skip_ascii(const uint8_t *s, size_t i, size_t n) {
+#if defined(CINATRA_UTF8_SSE2)
+  for (; i + 32 <= n; i += 32) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + i + 16));
+    if (_mm_movemask_epi8(_mm_or_si128(a, b)) != 0) {
+      break;
+    }
+  }
+  for (; i + 16 <= n; i += 16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (mask != 0) {
+      return i + std::countr_zero(unsigned(mask));
+    }
+  }
+#elif defined(CINATRA_UTF8_NEON)
+  for (; i + 16 <= n; i += 16) {
+    if (vmaxvq_u8(vld1q_u8(s + i)) >= 0x80) {
+      break;
+    }
+  }
+#endif
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, s + i, 8);
+    if (word & 0x8080808080808080ull) {
+      break;
+    }
+  }
+  while (i < n && s[i] < 0x80) {
+    i++;
+  }
+  return i;
+}
+
+// the length of the multi-byte sequence at s, 0 if it is invalid, -1 if the
+// n bytes are the valid start of a longer one.
+inline int utf8_sequence(const uint8_t *s, size_t n) {
+  uint8_t lo = 0x80, hi = 0xbf;
+  size_t len;
+  if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+    len = 2;
+  }
+  else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+    len = 3;
+    // no overlong forms and no surrogates.
+    lo = s[0] == 0xe0 ? 0xa0 : lo;
+    hi = s[0] == 0xed ? 0x9f : hi;
+  }
+  else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+    len = 4;
+    // no overlong forms and nothing above U+10FFFF.
+    lo = s[0] == 0xf0 ? 0x90 : lo;
+    hi = s[0] == 0xf4 ? 0x8f : hi;
+  }
+  else {
+    return 0;
+  }
+
+  size_t size = n < len ? n : len;
+  if (size > 1 && (s[1] < lo || s[1] > hi)) {
+    return 0;
+  }
+  for (size_t i = 2; i < size; i++) {
+    if ((s[i] & 0xc0) != 0x80) {
+      return 0;
+    }
+  }
+  return size < len ? -1 : int(len);
+}
+}  // namespace detail
+
+// validates a text message piece by piece, a character may be split between
+// pieces. runs of ascii are skipped with simd, only the other characters are
+// checked one by one.
+class utf8_validator {
+ public:
+  void reset() {
+    pending_size_ = 0;
+    valid_ = true;
+  }
+
+  // false as soon as the text is invalid.
+  bool update(std::string_view piece) {
+    if (!valid_) {
+      return false;
+    }
+
+    auto s = (const uint8_t *)piece.data();
+    size_t n = piece.size();
+    size_t i = 0;
+    // the rest of the character the last piece ended in.
+    while (pending_size_ > 0 && i < n) {
+      pending_[pending_size_++] = s[i++];
+      int len = detail::utf8_sequence(pending_, pending_size_);
+      if (len == 0) {
+        return valid_ = false;
+      }
+      if (len > 0) {
+        pending_size_ = 0;
+      }
+    }
+
+    while (i < n) {
+      i = detail::skip_ascii(s, i, n);
+      if (i == n) {
+        break;
+      }
+      int len = detail::utf8_sequence(s + i, n - i);
+      if (len == 0) {
+        return valid_ = false;
+      }
+      if (len < 0) {
+        pending_size_ = n - i;
+        std::memcpy(pending_, s + i, pending_size_);
+        break;
+      }
+      i += len;
+    }
+    return true;
+  }
+
+  // the end of the text, false if it is invalid or ends inside a character.
+  bool finish() {
+    valid_ = valid_ && pending_size_ == 0;
+    pending_size_ = 0;
+    return valid_;
+  }
+
+ private:
+  uint8_t pending_[4];
+  size_t pending_size_ = 0;
+  bool valid_ = true;
+};
+
+inline bool validate_utf8(std::string_view str) {
+  utf8_validator validator;
+  return validator.update(str) && validator.finish();
+}
+}  // namespace cinatra
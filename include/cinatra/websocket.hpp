@@ -1,6 +1,7 @@
 #pragma once
 #include "utils.hpp"
 #include "ws_define.h"
+#include "ws_mask.hpp"
 
 namespace cinatra {
 enum ws_header_status {
@@ -8,6 +9,18 @@ enum ws_header_status {
   complete = 0,
   incomplete = -2,
 };
+
+// a frame as it is on the wire, to relay it without decoding the message.
+struct ws_raw_frame {
+  opcode op = opcode::text;
+  bool fin = true;
+  bool compressed = false;
+  // all zero if the payload is not masked.
+  uint8_t mask_key[4] = {};
+  // empty if the header is not in front of the payload any more.
+  std::string_view header;
+  std::span<char> payload;
+};
 class websocket {
  public:
   void sec_ws_key(std::string_view sec_key) { sec_ws_key_ = sec_key; }
@@ -45,74 +58,88 @@ class websocket {
   Payload length:  7 bits, 7+16 bits, or 7+64 bits
   Masking-key:  0 or 4 bytes
   */
+  // buf may hold more than the header, a header which is not in buf
+  // completely is incomplete, left_header_len() is how much of it is missing.
   ws_header_status parse_header(const char *buf, size_t size,
                                 bool is_server = true) {
     const unsigned char *inp = (const unsigned char *)(buf);
+    if (size < 2) {
+      left_header_len_ = 2 - size;
+      return ws_header_status::incomplete;
+    }
 
     msg_opcode_ = inp[0] & 0x0F;
     msg_fin_ = (inp[0] >> 7) & 0x01;
+    msg_rsv1_ = (inp[0] >> 6) & 0x01;
     unsigned char msg_masked = (inp[1] >> 7) & 0x01;
 
     int pos = 2;
     int length_field = inp[1] & (~0x80);
 
-    left_header_len_ = 0;
     if (length_field <= 125) {
       len_bytes_ = SHORT_HEADER;
-      payload_length_ = length_field;
-      left_header_len_ =
-          is_server ? SHORT_HEADER - size : CLIENT_SHORT_HEADER - size;
-      if (left_header_len_ > 0) {
-        // The frame length field or mask field was not received completely
-        return ws_header_status::incomplete;
-      }
+      header_len_ =
+          is_server ? size_t(SHORT_HEADER) : size_t(CLIENT_SHORT_HEADER);
     }
     else if (length_field == 126)  // msglen is 16bit!
     {
       len_bytes_ = MEDIUM_HEADER;
-      left_header_len_ =
-          is_server ? MEDIUM_HEADER - size : CLIENT_MEDIUM_HEADER - size;
-      if (left_header_len_ > 0) {
-        // The frame length field or mask field was not received completely
-        return ws_header_status::incomplete;
-      }
-      payload_length_ = ntohs(*(uint16_t *)&inp[2]);  // (inp[2] << 8) + inp[3];
-      pos += 2;
+      header_len_ =
+          is_server ? size_t(MEDIUM_HEADER) : size_t(CLIENT_MEDIUM_HEADER);
     }
     else if (length_field == 127)  // msglen is 64bit!
     {
       len_bytes_ = LONG_HEADER;
-      left_header_len_ =
-          is_server ? LONG_HEADER - size : CLIENT_LONG_HEADER - size;
-      if (left_header_len_ > 0) {
-        // The frame length field or mask field was not received completely
-        return ws_header_status::incomplete;
-      }
-      payload_length_ = (size_t)be64toh(*(uint64_t *)&inp[2]);
-      pos += 8;
+      header_len_ =
+          is_server ? size_t(LONG_HEADER) : size_t(CLIENT_LONG_HEADER);
     }
     else {
       len_bytes_ = INVALID_HEADER;
       return ws_header_status::error;
     }
 
+    left_header_len_ = size < header_len_ ? header_len_ - size : 0;
+    if (left_header_len_ > 0) {
+      // The frame length field or mask field was not received completely
+      return ws_header_status::incomplete;
+    }
+
+    if (length_field <= 125) {
+      payload_length_ = length_field;
+    }
+    else if (length_field == 126) {
+      uint16_t len;
+      std::memcpy(&len, inp + 2, 2);
+      payload_length_ = ntohs(len);
+      pos += 2;
+    }
+    else {
+      uint64_t len;
+      std::memcpy(&len, inp + 2, 8);
+      payload_length_ = (size_t)be64toh(len);
+      pos += 8;
+    }
+
     if (msg_masked) {
       std::memcpy(mask_key_, inp + pos, 4);
     }
+    else {
+      std::memset(mask_key_, 0, 4);
+    }
 
-    return left_header_len_ == 0 ? ws_header_status::complete
-                                 : ws_header_status::incomplete;
+    return ws_header_status::complete;
   }
 
+  // the length of the header which has been parsed.
+  size_t header_length() const { return header_len_; }
+
   int len_bytes() const { return len_bytes_; }
   void reset_len_bytes() { len_bytes_ = SHORT_HEADER; }
 
   ws_frame_type parse_payload(std::span<char> buf) {
     // unmask data:
     if (*(uint32_t *)mask_key_ != 0) {
-      for (size_t i = 0; i < payload_length_; i++) {
-        buf[i] = buf[i] ^ mask_key_[i % 4];
-      }
+      detail::ws_mask(buf.data(), payload_length_, mask_key_);
     }
 
     if (msg_opcode_ == 0x0)
@@ -170,7 +197,7 @@ class websocket {
     if (is_client) {
       if (size > 0) {
         // generate mask key.
-        uint32_t random = (uint32_t)rand();
+        uint32_t random = detail::ws_random_mask();
         memcpy(mask_key_, &random, 4);
       }
 
@@ -184,9 +211,7 @@ class websocket {
   }
 
   void encode_ws_payload(std::span<char> &data) {
-    for (int i = 0; i < data.size(); ++i) {
-      data[i] ^= mask_key_[i % 4];
-    }
+    detail::ws_mask(data.data(), data.size(), mask_key_);
   }
 
   std::string_view encode_frame(std::span<char> &data, opcode op, bool eof,
@@ -232,6 +257,21 @@ class websocket {
 
   opcode get_opcode() { return (opcode)msg_opcode_; }
 
+  // the rsv1 bit of permessage-deflate.
+  bool is_compressed() const { return msg_rsv1_; }
+
+  bool is_fin() const { return msg_fin_; }
+
+  // the key of the header parsed or encoded last.
+  const uint8_t *mask_key() const { return mask_key_; }
+
+  // unmask a part of the payload, offset is its position in the payload.
+  void unmask(std::span<char> data, size_t offset) {
+    if (*(uint32_t *)mask_key_ != 0) {
+      detail::ws_mask(data.data(), data.size(), mask_key_, offset);
+    }
+  }
+
  private:
   size_t encode_header(size_t length, opcode code, bool is_compressed = false) {
     size_t header_length;
@@ -271,6 +311,8 @@ class websocket {
   uint8_t mask_key_[4] = {};
   unsigned char msg_opcode_ = 0;
   unsigned char msg_fin_ = 0;
+  unsigned char msg_rsv1_ = 0;
+  size_t header_len_ = 0;
 
   char msg_header_[14];
   ws_head_len len_bytes_ = SHORT_HEADER;
@@ -193,6 +193,14 @@ enum ws_send_state {
   SND_COMPRESSED = 64
 };
 
+// what a broadcast does with a subscriber which doesn't keep up.
+enum class slow_subscriber_policy {
+  // the message is not sent to it.
+  drop,
+  // the connection is closed.
+  disconnect,
+};
+
 struct frame_header {
   uint8_t opcode : 4;
   uint8_t rsv3 : 1;
@@ -0,0 +1,359 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "gzip.hpp"
+#include "utils.hpp"
+
+namespace cinatra {
+// the server side settings of permessage-deflate (rfc 7692).
+struct ws_deflate_options {
+  // keep the window between the messages, similar messages compress much
+  // better, but every connection keeps its own deflate and inflate stream.
+  bool context_takeover = true;
+  // 9 to 15, the largest window of the server and, if the client allows it
+  // to be limited, of the client.
+  int max_window_bits = 15;
+  // 1 to 9, the size of the deflate hash table.
+  int mem_level = 8;
+  int level = 1;
+  // the memory of the streams kept by all connections of the process, the
+  // connections beyond it negotiate no context takeover.
+  size_t memory_limit = 64 * 1024 * 1024;
+  // smaller messages are sent uncompressed.
+  size_t min_size = 0;
+};
+
+// the parameters of one extension offer or response.
+struct ws_deflate_params {
+  bool server_no_context_takeover = false;
+  bool client_no_context_takeover = false;
+  // 0 if the parameter is not there.
+  int server_max_window_bits = 0;
+  bool has_client_max_window_bits = false;
+  int client_max_window_bits = 0;
+};
+
+namespace detail {
+inline std::atomic<size_t> &ws_deflate_memory() {
+  static std::atomic<size_t> used = 0;
+  return used;
+}
+
+inline bool reserve_ws_deflate_memory(size_t size, size_t limit) {
+  auto &used = ws_deflate_memory();
+  size_t cur = used.load(std::memory_order_relaxed);
+  do {
+    if (cur + size > limit) {
+      return false;
+    }
+  } while (!used.compare_exchange_weak(cur, cur + size,
+                                       std::memory_order_relaxed));
+  return true;
+}
+
+// the estimates of zlib.h.
+inline size_t deflate_memory(int window_bits, int mem_level) {
+  return (size_t(1) << (window_bits + 2)) + (size_t(1) << (mem_level + 9));
+}
+
+inline size_t inflate_memory(int window_bits) {
+  return (size_t(1) << window_bits) + 7 * 1024;
+}
+
+inline bool parse_window_bits(std::string_view value, int &bits) {
+  if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+    value = value.substr(1, value.size() - 2);
+  }
+  auto [ptr, ec] =
+      std::from_chars(value.data(), value.data() + value.size(), bits);
+  return ec == std::errc{} && ptr == value.data() + value.size() &&
+         bits >= 8 && bits <= 15;
+}
+
+// a message is inflated with a stream of this thread when the window is not
+// kept, it is reset before every message.
+inline gzip_codec::inflate_stream &thread_ws_inflate_stream() {
+  thread_local gzip_codec::inflate_stream strm(-windowBits);
+  return strm;
+}
+}  // namespace detail
+
+// parse one "permessage-deflate; ..." offer or response, false if it is
+// another extension or has an unknown, repeated or invalid parameter.
+inline bool parse_ws_deflate_params(std::string_view str,
+                                    ws_deflate_params &params) {
+  auto tokens = split_sv(str, ";");
+  if (tokens.empty() || trim_sv(tokens[0]) != "permessage-deflate") {
+    return false;
+  }
+
+  params = {};
+  bool seen[4] = {};
+  for (size_t i = 1; i < tokens.size(); i++) {
+    auto token = trim_sv(tokens[i]);
+    std::string_view name = token, value;
+    bool has_value = false;
+    if (auto pos = token.find('='); pos != std::string_view::npos) {
+      name = trim_sv(token.substr(0, pos));
+      value = trim_sv(token.substr(pos + 1));
+      has_value = true;
+    }
+
+    int index;
+    if (name == "server_no_context_takeover" && !has_value) {
+      index = 0;
+      params.server_no_context_takeover = true;
+    }
+    else if (name == "client_no_context_takeover" && !has_value) {
+      index = 1;
+      params.client_no_context_takeover = true;
+    }
+    else if (name == "server_max_window_bits") {
+      index = 2;
+      if (!has_value ||
+          !detail::parse_window_bits(value, params.server_max_window_bits)) {
+        return false;
+      }
+    }
+    else if (name == "client_max_window_bits") {
+      index = 3;
+      params.has_client_max_window_bits = true;
+      if (has_value &&
+          !detail::parse_window_bits(value, params.client_max_window_bits)) {
+        return false;
+      }
+    }
+    else {
+      return false;
+    }
+
+    if (seen[index]) {
+      return false;
+    }
+    seen[index] = true;
+  }
+  return true;
+}
+
+// the compression of one websocket connection. a stream which keeps its
+// window (context takeover) belongs to the connection, otherwise the
+// streams of the thread are reset and used for one message.
+class permessage_deflate {
+ public:
+  permessage_deflate(int deflate_bits, bool deflate_takeover,
+                     int inflate_bits, bool inflate_takeover, int level = 1,
+                     int mem_level = 8, size_t min_size = 0,
+                     size_t reserved = 0)
+      : deflate_bits_(deflate_bits),
+        level_(level),
+        min_size_(min_size),
+        reserved_(reserved) {
+    if (deflate_takeover) {
+      deflate_ = std::make_unique<gzip_codec::deflate_stream>(
+          -deflate_bits, level, mem_level);
+    }
+    if (inflate_takeover) {
+      inflate_ = std::make_unique<gzip_codec::inflate_stream>(-inflate_bits);
+    }
+  }
+
+  ~permessage_deflate() {
+    if (reserved_ > 0) {
+      detail::ws_deflate_memory().fetch_sub(reserved_,
+                                            std::memory_order_relaxed);
+    }
+  }
+
+  permessage_deflate(const permessage_deflate &) = delete;
+  permessage_deflate &operator=(const permessage_deflate &) = delete;
+
+  // the server side, null if no offer of the client is acceptable. the
+  // offers are tried in order, response is the Sec-WebSocket-Extensions
+  // value for the accepted one.
+  static std::unique_ptr<permessage_deflate> accept(
+      std::string_view offers, const ws_deflate_options &options,
+      std::string &response) {
+    int max_bits = std::clamp(options.max_window_bits, 9, 15);
+    int mem_level = std::clamp(options.mem_level, 1, 9);
+    for (auto offer : split_sv(offers, ",")) {
+      ws_deflate_params params;
+      if (!parse_ws_deflate_params(offer, params)) {
+        continue;
+      }
+
+      // zlib can't deflate with a 256 byte window.
+      int server_bits = (std::min)(
+          max_bits,
+          params.server_max_window_bits ? params.server_max_window_bits : 15);
+      if (server_bits < 9) {
+        continue;
+      }
+
+      // the window of the client can only be limited if it offers that.
+      int client_bits = 15;
+      if (params.has_client_max_window_bits) {
+        client_bits = (std::min)(max_bits, params.client_max_window_bits
+                                               ? params.client_max_window_bits
+                                               : 15);
+      }
+
+      size_t reserved = 0;
+      bool server_takeover =
+          options.context_takeover && !params.server_no_context_takeover;
+      if (server_takeover) {
+        size_t size = detail::deflate_memory(server_bits, mem_level);
+        server_takeover =
+            detail::reserve_ws_deflate_memory(size, options.memory_limit);
+        reserved += server_takeover ? size : 0;
+      }
+      bool client_takeover =
+          options.context_takeover && !params.client_no_context_takeover;
+      if (client_takeover) {
+        size_t size = detail::inflate_memory(client_bits);
+        client_takeover =
+            detail::reserve_ws_deflate_memory(size, options.memory_limit);
+        reserved += client_takeover ? size : 0;
+      }
+
+      response = "permessage-deflate";
+      if (!server_takeover) {
+        response.append("; server_no_context_takeover");
+      }
+      if (!client_takeover) {
+        response.append("; client_no_context_takeover");
+      }
+      if (params.server_max_window_bits || server_bits < 15) {
+        response.append("; server_max_window_bits=")
+            .append(std::to_string(server_bits));
+      }
+      if (params.has_client_max_window_bits && client_bits < 15) {
+        response.append("; client_max_window_bits=")
+            .append(std::to_string(client_bits));
+      }
+
+      return std::make_unique<permessage_deflate>(
+          server_bits, server_takeover, client_bits, client_takeover,
+          options.level, mem_level, options.min_size, reserved);
+    }
+    return nullptr;
+  }
+
+  // the client side, from the Sec-WebSocket-Extensions of the response.
+  static std::unique_ptr<permessage_deflate> from_response(
+      std::string_view response) {
+    ws_deflate_params params;
+    if (!parse_ws_deflate_params(response, params)) {
+      return nullptr;
+    }
+    int client_bits =
+        params.client_max_window_bits ? params.client_max_window_bits : 15;
+    if (client_bits < 9) {
+      return nullptr;
+    }
+    return std::make_unique<permessage_deflate>(
+        client_bits, !params.client_no_context_takeover, 15,
+        !params.server_no_context_takeover);
+  }
+
+  bool need_compress(size_t size) const {
+    return size > 0 && size >= min_size_;
+  }
+
+  // whether the messages sent share a window, then they must be compressed
+  // in the order they are sent.
+  bool context_takeover() const { return deflate_ != nullptr; }
+
+  int deflate_window_bits() const { return deflate_bits_; }
+
+  // append the compressed message to out.
+  bool compress(std::string_view msg, std::string &out) {
+    size_t old_size = out.size();
+    bool ok;
+    if (deflate_) {
+      ok = deflate_->write(msg, out, Z_SYNC_FLUSH);
+    }
+    else {
+      auto strm = gzip_codec::acquire_deflate_stream(-deflate_bits_, level_);
+      ok = strm != nullptr && strm->write(msg, out, Z_SYNC_FLUSH);
+    }
+    if (!ok || out.size() < old_size + 4) {
+      return false;
+    }
+    // the 00 00 ff ff of the sync flush is left out.
+    out.resize(out.size() - 4);
+    return true;
+  }
+
+  // append the inflated message to out, or a piece of it, first and fin tell
+  // where the piece is in the message. inflating stops once out is larger
+  // than max_size, if it is not 0, and false is returned with out larger
+  // than max_size then, a small message can't inflate without bound.
+  bool decompress(std::string_view payload, std::string &out,
+                  bool first = true, bool fin = true, size_t max_size = 0) {
+    static constexpr char tail[4] = {0x00, 0x00, char(0xff), char(0xff)};
+    gzip_codec::inflate_stream *strm = inflate_.get();
+    if (!strm) {
+      if (first && fin) {
+        strm = &detail::thread_ws_inflate_stream();
+      }
+      else {
+        // the pieces of a message are read at different times, the stream of
+        // the thread may be used by other connections in between.
+        if (!message_inflate_) {
+          message_inflate_ =
+              std::make_unique<gzip_codec::inflate_stream>(-windowBits);
+        }
+        strm = message_inflate_.get();
+      }
+      if (first) {
+        strm->reset();
+      }
+    }
+    if (!inflate_input(*strm, payload, out, max_size) ||
+        (fin && !inflate_input(*strm, {tail, sizeof(tail)}, out, max_size))) {
+      strm->reset();
+      return false;
+    }
+    if (fin && strm->finished()) {
+      // the peer ended the stream with a final block.
+      strm->reset();
+    }
+    return true;
+  }
+
+ private:
+  static bool inflate_input(gzip_codec::inflate_stream &strm,
+                            std::string_view input, std::string &out,
+                            size_t max_size) {
+    char buf[CHUNK];
+    strm.set_input(input);
+    while (true) {
+      int64_t size = strm.read(buf, sizeof(buf));
+      if (size < 0) {
+        return false;
+      }
+      out.append(buf, size);
+      if (max_size != 0 && out.size() > max_size) {
+        return false;
+      }
+      if (size == 0 ||
+          (size < int64_t(sizeof(buf)) && strm.pending_input() == 0)) {
+        return true;
+      }
+    }
+  }
+
+  std::unique_ptr<gzip_codec::deflate_stream> deflate_;
+  std::unique_ptr<gzip_codec::inflate_stream> inflate_;
+  std::unique_ptr<gzip_codec::inflate_stream> message_inflate_;
+  int deflate_bits_;
+  int level_;
+  size_t min_size_;
+  size_t reserved_;
+};
+}  // namespace cinatra
@@ -0,0 +1,131 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "asio/dispatch.hpp"
+#include "asio/io_context.hpp"
+#include "asio/steady_timer.hpp"
+#include "cinatra/cinatra_log_wrapper.hpp"
+#include "ws_define.h"
+
+namespace cinatra {
+struct ws_heartbeat_options {
+  // a connection whose peer has sent nothing for interval is pinged.
+  std::chrono::steady_clock::duration interval = std::chrono::seconds(30);
+  // and closed if the peer sends nothing for timeout.
+  std::chrono::steady_clock::duration timeout = std::chrono::seconds(90);
+  // the resolution of the times above.
+  std::chrono::steady_clock::duration tick = std::chrono::seconds(1);
+};
+
+// the heartbeats of the websocket connections of one io thread, a timing
+// wheel. a connection sits in the slot of the tick it is checked next, every
+// tick checks one slot, so the thread has one timer and a connection costs a
+// slot move per interval. the time is counted in ticks, the connection keeps
+// the tick its peer was last heard of, see coro_http_connection.
+template <typename Conn>
+class basic_ws_heartbeat
+    : public std::enable_shared_from_this<basic_ws_heartbeat<Conn>> {
+ public:
+  basic_ws_heartbeat(asio::io_context::executor_type executor,
+                     const ws_heartbeat_options &options)
+      : timer_(executor),
+        tick_((std::max)(options.tick,
+                         std::chrono::steady_clock::duration(
+                             std::chrono::milliseconds(1)))),
+        interval_(to_ticks(options.interval)),
+        timeout_(to_ticks(options.timeout)),
+        slots_((std::max)(interval_, timeout_) + 1) {}
+
+  // the io thread only.
+  uint64_t now() const { return now_; }
+
+  // the io thread only, the connection is checked until it is closed.
+  void add(std::weak_ptr<Conn> conn) {
+    insert(std::move(conn), interval_);
+    if (size_++ == 0 && !stopped_) {
+      start_timer();
+    }
+  }
+
+  size_t size() const { return size_; }
+
+  // any thread.
+  void stop() {
+    asio::dispatch(timer_.get_executor(), [self = this->shared_from_this()] {
+      self->stopped_ = true;
+      std::error_code ec;
+      self->timer_.cancel(ec);
+    });
+  }
+
+ private:
+  // rounded up, at least one.
+  uint64_t to_ticks(std::chrono::steady_clock::duration duration) const {
+    uint64_t ticks = (duration + tick_ - std::chrono::nanoseconds(1)) / tick_;
+    return (std::max)(ticks, uint64_t(1));
+  }
+
+  void insert(std::weak_ptr<Conn> conn, uint64_t after) {
+    slots_[(now_ + after) % slots_.size()].push_back(std::move(conn));
+  }
+
+  void start_timer() {
+    timer_.expires_after(tick_);
+    timer_.async_wait([self = this->shared_from_this()](auto ec) {
+      if (ec || self->stopped_) {
+        return;
+      }
+      self->on_tick();
+      if (self->size_ > 0) {
+        self->start_timer();
+      }
+    });
+  }
+
+  void on_tick() {
+    now_++;
+    std::swap(slots_[now_ % slots_.size()], due_);
+    for (auto &weak : due_) {
+      auto conn = weak.lock();
+      if (!conn || conn->has_closed() ||
+          conn->get_executor()->get_asio_executor() != timer_.get_executor()) {
+        // closed, or moved to another io thread.
+        size_--;
+        continue;
+      }
+
+      uint64_t idle = now_ - conn->ws_last_seen();
+      if (idle >= timeout_) {
+        CINATRA_LOG_INFO << "close dead websocket peer, conn id: "
+                         << conn->conn_id();
+        conn->close();
+        size_--;
+        continue;
+      }
+
+      uint64_t next = interval_ - idle;
+      if (idle >= interval_) {
+        conn->post_websocket({}, opcode::ping);
+        next = interval_;
+      }
+      insert(std::move(weak), (std::min)(next, timeout_ - idle));
+    }
+    due_.clear();
+  }
+
+  asio::steady_timer timer_;
+  std::chrono::steady_clock::duration tick_;
+  uint64_t interval_;
+  uint64_t timeout_;
+  std::vector<std::vector<std::weak_ptr<Conn>>> slots_;
+  // the slot being checked.
+  std::vector<std::weak_ptr<Conn>> due_;
+  uint64_t now_ = 0;
+  size_t size_ = 0;
+  bool stopped_ = false;
+};
+}  // namespace cinatra
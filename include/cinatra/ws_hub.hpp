@@ -0,0 +1,239 @@
+#pragma once
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "coro_http_connection.hpp"
+#include "websocket.hpp"
+#include "ws_define.h"
+
+namespace cinatra {
+namespace detail {
+// a published message, encoded once and shared by all the subscribers.
+struct ws_hub_frame {
+  std::string plain;
+  size_t header_len = 0;
+#ifdef CINATRA_ENABLE_GZIP
+  opcode msg_op;
+  bool compressible = false;
+  std::once_flag once;
+  std::string compressed;
+#endif
+
+  ws_hub_frame(std::string_view msg, opcode op) {
+    websocket ws;
+    auto header = ws.encode_ws_header(msg.size(), op, true, false, false);
+    header_len = header.size();
+    plain.reserve(header.size() + msg.size());
+    plain.append(header).append(msg);
+#ifdef CINATRA_ENABLE_GZIP
+    msg_op = op;
+    compressible =
+        !msg.empty() && (op == opcode::text || op == opcode::binary);
+#endif
+  }
+
+  size_t msg_size() const { return plain.size() - header_len; }
+
+  // the frame for a connection, the compressed one is made by the first
+  // connection which takes it, see use_shared_ws_deflate().
+  static std::shared_ptr<const std::string> get(
+      const std::shared_ptr<ws_hub_frame> &self, bool compressed) {
+#ifdef CINATRA_ENABLE_GZIP
+    if (compressed && self->compressible) {
+      std::call_once(self->once, [&self] { self->compress(); });
+      if (!self->compressed.empty()) {
+        return {self, &self->compressed};
+      }
+    }
+#endif
+    return {self, &self->plain};
+  }
+
+#ifdef CINATRA_ENABLE_GZIP
+  void compress() {
+    std::string_view msg(plain.data() + header_len, plain.size() - header_len);
+    std::string dest_buf;
+    if (!cinatra::gzip_codec::deflate(msg, dest_buf)) {
+      // the subscribers get the plain frame.
+      CINATRA_LOG_ERROR << "compress data error, data: " << msg;
+      return;
+    }
+    websocket ws;
+    auto header = ws.encode_ws_header(dest_buf.size(), msg_op, true, true,
+                                         false);
+    compressed.reserve(header.size() + dest_buf.size());
+    compressed.append(header).append(dest_buf);
+  }
+#endif
+};
+}  // namespace detail
+
+// publish/subscribe for websocket connections. a message is encoded once and
+// posted once to every io thread which has subscribers of the topic, the io
+// thread queues the shared frame on its connections. a subscriber with
+// max_pending frames queued is handled by the slow_subscriber_policy.
+class ws_hub {
+ public:
+  explicit ws_hub(slow_subscriber_policy policy = slow_subscriber_policy::drop,
+                  size_t max_pending = 1024)
+      : policy_(policy),
+        max_pending_(max_pending),
+        registry_(std::make_shared<registry_t>()) {}
+
+  // usually called by the websocket handler, closed connections are removed
+  // from the topic by the next publish.
+  void subscribe(std::string_view topic, coro_http_connection *conn) {
+    auto group = registry_->get_group(topic, conn->get_executor(), true);
+    group->executor->schedule([registry = registry_, group,
+                               weak = std::weak_ptr(conn->shared_from_this())] {
+      {
+        std::lock_guard lock(registry->mtx);
+        group->subscribing--;
+      }
+      group->conns.push_back(weak);
+    });
+  }
+
+  void unsubscribe(std::string_view topic, coro_http_connection *conn) {
+    auto group = registry_->get_group(topic, conn->get_executor(), false);
+    if (!group) {
+      return;
+    }
+    group->executor->schedule([registry = registry_, group, conn] {
+      std::erase_if(group->conns, [conn](auto &weak) {
+        auto ptr = weak.lock();
+        return !ptr || ptr.get() == conn;
+      });
+      registry->remove_if_empty(group);
+    });
+  }
+
+  // returns the number of io threads the message is posted to.
+  size_t publish(std::string_view topic, std::string_view msg,
+                 opcode op = opcode::text) {
+    std::vector<std::shared_ptr<group_t>> groups;
+    {
+      std::lock_guard lock(registry_->mtx);
+      auto it = registry_->topics.find(topic);
+      if (it == registry_->topics.end()) {
+        return 0;
+      }
+      groups = it->second;
+    }
+
+    if (groups.empty()) {
+      return 0;
+    }
+
+    auto frame = std::make_shared<detail::ws_hub_frame>(msg, op);
+    for (auto &group : groups) {
+      group->executor->schedule([registry = registry_, group, frame,
+                                 policy = policy_,
+                                 max_pending = max_pending_] {
+        auto &conns = group->conns;
+        for (size_t i = 0; i < conns.size();) {
+          auto conn = conns[i].lock();
+          if (!conn || conn->has_closed()) {
+            conns[i] = std::move(conns.back());
+            conns.pop_back();
+            continue;
+          }
+          conn->send_ws_frame(
+              detail::ws_hub_frame::get(
+                  frame, conn->use_shared_ws_deflate(frame->msg_size())),
+              max_pending, policy);
+          i++;
+        }
+        registry->remove_if_empty(group);
+      });
+    }
+    return groups.size();
+  }
+
+  // the number of topics which have subscribers.
+  size_t topic_count() {
+    std::lock_guard lock(registry_->mtx);
+    return registry_->topics.size();
+  }
+
+ private:
+  // the subscribers of a topic on one io thread, conns is only used on that
+  // thread. subscribing counts the subscribe() calls whose connection is not
+  // in conns yet, it is guarded by the mutex of the registry.
+  struct group_t {
+    std::string topic;
+    coro_io::ExecutorWrapper<> *executor;
+    std::vector<std::weak_ptr<coro_http_connection>> conns;
+    size_t subscribing = 0;
+  };
+
+  // shared with the posted tasks, a task may run after the hub is gone.
+  struct registry_t {
+    std::mutex mtx;
+    std::map<std::string, std::vector<std::shared_ptr<group_t>>, std::less<>>
+        topics;
+
+    std::shared_ptr<group_t> get_group(std::string_view topic,
+                                       coro_io::ExecutorWrapper<> *executor,
+                                       bool create) {
+      std::lock_guard lock(mtx);
+      auto it = topics.find(topic);
+      if (it == topics.end()) {
+        if (!create) {
+          return nullptr;
+        }
+        it = topics.try_emplace(std::string(topic)).first;
+      }
+
+      auto &groups = it->second;
+      auto group_it =
+          std::find_if(groups.begin(), groups.end(), [executor](auto &group) {
+            return group->executor == executor;
+          });
+      std::shared_ptr<group_t> group;
+      if (group_it != groups.end()) {
+        group = *group_it;
+      }
+      else if (create) {
+        group = std::make_shared<group_t>();
+        group->topic = it->first;
+        group->executor = executor;
+        groups.push_back(group);
+      }
+      if (group && create) {
+        group->subscribing++;
+      }
+      return group;
+    }
+
+    // called on the io thread of the group, a group without subscribers is
+    // dropped and so is a topic without groups.
+    void remove_if_empty(const std::shared_ptr<group_t> &group) {
+      if (!group->conns.empty()) {
+        return;
+      }
+      std::lock_guard lock(mtx);
+      if (group->subscribing > 0) {
+        return;
+      }
+      auto it = topics.find(group->topic);
+      if (it == topics.end()) {
+        return;
+      }
+      std::erase(it->second, group);
+      if (it->second.empty()) {
+        topics.erase(it);
+      }
+    }
+  };
+
+  slow_subscriber_policy policy_;
+  size_t max_pending_;
+  std::shared_ptr<registry_t> registry_;
+};
+}  // namespace cinatra
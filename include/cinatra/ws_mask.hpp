@@ -0,0 +1,224 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <random>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define CINATRA_WS_MASK_SSE2
+#if defined(__GNUC__) || defined(__clang__)
+#define CINATRA_WS_MASK_AVX2
+#endif
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define CINATRA_WS_MASK_NEON
+#endif
+
+namespace cinatra::detail {
+// the mask key repeated over 8 bytes, starting at byte offset % 4 of the key.
+inline uint64_t ws_mask_pattern(const uint8_t key[4], size_t offset) {
+  uint8_t bytes[8];
+  for (size_t i = 0; i < 8; i++) {
+    bytes[i] = key[(offset + i) % 4];
+  }
+  uint64_t pattern;
+  std::memcpy(&pattern, bytes, 8);
+  return pattern;
+}
+
+inline void ws_mask_tail(char *data, size_t size, uint64_t pattern) {
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    word ^= pattern;
+    std::memcpy(data + i, &word, 8);
+  }
+  uint8_t bytes[8];
+  std::memcpy(bytes, &pattern, 8);
+  for (size_t j = 0; i < size; i++, j++) {
+    data[i] ^= bytes[j];
+  }
+}
+
+inline void ws_mask_scalar(char *data, size_t size, uint64_t pattern) {
+  ws_mask_tail(data, size, pattern);
+}
+
+#ifdef CINATRA_WS_MASK_SSE2
+inline void ws_mask_sse2(char *data, size_t size, uint64_t pattern) {
+  __m128i m = _mm_set1_epi64x((long long)pattern);
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    auto p = (__m128i *)(data + i);
+    __m128i a = _mm_loadu_si128(p);
+    __m128i b = _mm_loadu_si128(p + 1);
+    __m128i c = _mm_loadu_si128(p + 2);
+    __m128i d = _mm_loadu_si128(p + 3);
+    _mm_storeu_si128(p, _mm_xor_si128(a, m));
+    _mm_storeu_si128(p + 1, _mm_xor_si128(b, m));
+    _mm_storeu_si128(p + 2, _mm_xor_si128(c, m));
+    _mm_storeu_si128(p + 3, _mm_xor_si128(d, m));
+  }
+  for (; i + 16 <= size; i += 16) {
+    auto p = (__m128i *)(data + i);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), m));
+  }
+  ws_mask_tail(data + i, size - i, pattern);
+}
+#endif
+
+#ifdef CINATRA_WS_MASK_AVX2
+__attribute__((target("avx2"))) inline void ws_mask_avx2(char *data,
+                                                         size_t size,
+                                                         uint64_t pattern) {
+  __m256i m = _mm256_set1_epi64x((long long)pattern);
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    auto p = (__m256i *)(data + i);
+    __m256i a = _mm256_loadu_si256(p);
+    __m256i b = _mm256_loadu_si256(p + 1);
+    _mm256_storeu_si256(p, _mm256_xor_si256(a, m));
+    _mm256_storeu_si256(p + 1, _mm256_xor_si256(b, m));
+  }
+  for (; i + 32 <= size; i += 32) {
+    auto p = (__m256i *)(data + i);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), m));
+  }
+  ws_mask_sse2(data + i, size - i, pattern);
+}
+#endif
+
+#ifdef CINATRA_WS_MASK_NEON
+inline void ws_mask_neon(char *data, size_t size, uint64_t pattern) {
+  uint8x16_t m = vreinterpretq_u8_u64(vdupq_n_u64(pattern));
+  size_t i = 0;
+  for (; i + 64 <= size; i += 64) {
+    auto p = (uint8_t *)(data + i);
+    uint8x16_t a = vld1q_u8(p);
+    uint8x16_t b = vld1q_u8(p + 16);
+    uint8x16_t c = vld1q_u8(p + 32);
+    uint8x16_t d = vld1q_u8(p + 48);
+    vst1q_u8(p, veorq_u8(a, m));
+    vst1q_u8(p + 16, veorq_u8(b, m));
+    vst1q_u8(p + 32, veorq_u8(c, m));
+    vst1q_u8(p + 48, veorq_u8(d, m));
+  }
+  for (; i + 16 <= size; i += 16) {
+    auto p = (uint8_t *)(data + i);
+    vst1q_u8(p, veorq_u8(vld1q_u8(p), m));
+  }
+  ws_mask_tail(data + i, size - i, pattern);
+}
+#endif
+
+using ws_mask_func = void (*)(char *, size_t, uint64_t);
+
+inline ws_mask_func select_ws_mask() {
+#ifdef CINATRA_WS_MASK_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    return ws_mask_avx2;
+  }
+#endif
+#if defined(CINATRA_WS_MASK_SSE2)
+  return ws_mask_sse2;
+#elif defined(CINATRA_WS_MASK_NEON)
+  return ws_mask_neon;
+#else
+  return ws_mask_scalar;
+#endif
+}
+
+// xor data with the mask key, offset is the position of data in the payload,
+// so a payload can be masked piece by piece.
+inline void ws_mask(char *data, size_t size, const uint8_t key[4],
+                    size_t offset = 0) {
+  if (size < 16) {
+    ws_mask_tail(data, size, ws_mask_pattern(key, offset));
+    return;
+  }
+  // chosen once for the cpu the program runs on.
+  static const ws_mask_func impl = select_ws_mask();
+  impl(data, size, ws_mask_pattern(key, offset));
+}
+
+// change the mask of data from key from to key to with one pass, the keys
+// are combined.
+inline void ws_remask(char *data, size_t size, const uint8_t from[4],
+                      const uint8_t to[4]) {
+  uint8_t key[4];
+  for (size_t i = 0; i < 4; i++) {
+    key[i] = from[i] ^ to[i];
+  }
+  ws_mask(data, size, key);
+}
+
+// chacha20 keyed from std::random_device, one per thread, so mask keys are
+// unpredictable and no lock is taken for them.
+class ws_mask_rng {
+ public:
+  ws_mask_rng() {
+    std::random_device rd;
+    state_ = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    for (size_t i = 4; i < 16; i++) {
+      state_[i] = rd();
+    }
+    state_[12] = 0;
+  }
+
+  uint32_t operator()() {
+    if (pos_ == block_.size()) {
+      refill();
+    }
+    return block_[pos_++];
+  }
+
+ private:
+  static uint32_t rotl(uint32_t v, int n) { return (v << n) | (v >> (32 - n)); }
+
+  static void quarter_round(uint32_t &a, uint32_t &b, uint32_t &c,
+                            uint32_t &d) {
+    a += b;
+    d = rotl(d ^ a, 16);
+    c += d;
+    b = rotl(b ^ c, 12);
+    a += b;
+    d = rotl(d ^ a, 8);
+    c += d;
+    b = rotl(b ^ c, 7);
+  }
+
+  void refill() {
+    auto &x = block_;
+    x = state_;
+    for (int i = 0; i < 10; i++) {
+      quarter_round(x[0], x[4], x[8], x[12]);
+      quarter_round(x[1], x[5], x[9], x[13]);
+      quarter_round(x[2], x[6], x[10], x[14]);
+      quarter_round(x[3], x[7], x[11], x[15]);
+      quarter_round(x[0], x[5], x[10], x[15]);
+      quarter_round(x[1], x[6], x[11], x[12]);
+      quarter_round(x[2], x[7], x[8], x[13]);
+      quarter_round(x[3], x[4], x[9], x[14]);
+    }
+    for (size_t i = 0; i < x.size(); i++) {
+      x[i] += state_[i];
+    }
+    if (++state_[12] == 0) {
+      state_[13]++;
+    }
+    pos_ = 0;
+  }
+
+  std::array<uint32_t, 16> state_;
+  std::array<uint32_t, 16> block_{};
+  size_t pos_ = block_.size();
+};
+
+inline uint32_t ws_random_mask() {
+  thread_local ws_mask_rng rng;
+  return rng();
+}
+}  // namespace cinatra::detail
@@ -0,0 +1,101 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+#include "async_simple/coro/Collect.h"
+#include "async_simple/coro/Lazy.h"
+#include "coro_http_client.hpp"
+#include "coro_http_connection.hpp"
+#include "websocket.hpp"
+
+namespace cinatra {
+// a websocket session relayed between a peer of the server and a backend, in
+// both directions at once. the frames are relayed as they are read, messages
+// are not gathered or decoded: a frame of the peer gets the mask of the
+// proxy with one pass over its payload, a frame of the backend is written
+// unchanged. the next frame is read when the last one is written, so a slow
+// reader on one side slows down the writer on the other one through tcp.
+// ping, pong and close are relayed too, the proxy answers none of them, the
+// session ends when the close handshake is done or either side is gone.
+class ws_proxy_session {
+ public:
+  // the backend is connected already, on the io thread of the connection.
+  ws_proxy_session(std::shared_ptr<coro_http_connection> conn,
+                   std::unique_ptr<coro_http_client> backend)
+      : conn_(std::move(conn)), backend_(std::move(backend)) {}
+
+  async_simple::coro::Lazy<void> run() {
+    co_await async_simple::coro::collectAll(to_backend(), to_peer());
+  }
+
+ private:
+  async_simple::coro::Lazy<void> to_backend() {
+    ws_raw_frame frame;
+    websocket ws;
+    std::vector<asio::const_buffer> buffers;
+    while (true) {
+      if (co_await conn_->read_ws_raw_frame(frame)) {
+        break;
+      }
+
+      auto header = ws.encode_ws_header(frame.payload.size(), frame.op,
+                                        frame.fin, false, true);
+      detail::ws_remask(frame.payload.data(), frame.payload.size(),
+                        frame.mask_key, ws.mask_key());
+      buffers = {asio::buffer(header),
+                 asio::buffer(frame.payload.data(), frame.payload.size())};
+      if (co_await backend_->write_raw(buffers)) {
+        break;
+      }
+
+      if (frame.op == opcode::close) {
+        peer_closed_ = true;
+        if (backend_closed_) {
+          break;
+        }
+        // the backend answers the close.
+        co_return;
+      }
+    }
+    finish();
+  }
+
+  async_simple::coro::Lazy<void> to_peer() {
+    ws_raw_frame frame;
+    std::vector<asio::const_buffer> buffers;
+    while (true) {
+      if (co_await backend_->read_ws_raw_frame(frame)) {
+        break;
+      }
+
+      buffers = {asio::buffer(frame.header),
+                 asio::buffer(frame.payload.data(), frame.payload.size())};
+      if (co_await conn_->write_ws_raw(buffers)) {
+        break;
+      }
+
+      if (frame.op == opcode::close) {
+        backend_closed_ = true;
+        if (peer_closed_) {
+          break;
+        }
+        // the peer answers the close.
+        co_return;
+      }
+    }
+    finish();
+  }
+
+  // the pending read of the other direction fails.
+  void finish() {
+    conn_->close();
+    backend_->close();
+  }
+
+  std::shared_ptr<coro_http_connection> conn_;
+  std::unique_ptr<coro_http_client> backend_;
+  // the close frames relayed.
+  bool peer_closed_ = false;
+  bool backend_closed_ = false;
+};
+}  // namespace cinatra
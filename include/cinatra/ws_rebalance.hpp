@@ -0,0 +1,86 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cinatra {
+struct ws_rebalance_options {
+  // how often the loads of the io threads are compared.
+  std::chrono::steady_clock::duration period = std::chrono::seconds(5);
+  // connections are moved from a thread whose load is this much above the
+  // average.
+  double threshold = 0.25;
+  // the most connections moved in a period.
+  size_t max_moves = 16;
+};
+
+// the bytes a websocket connection has read and written in the last period.
+struct ws_conn_load {
+  size_t thread;
+  uint64_t load;
+};
+
+struct ws_move {
+  // the index in the loads.
+  size_t conn;
+  size_t to;
+};
+
+// the moves which take the busiest threads towards the average. a
+// connection is moved from the busiest thread to the idlest one if that
+// narrows the gap between them, the busiest one that does is chosen.
+inline std::vector<ws_move> plan_ws_rebalance(
+    const std::vector<ws_conn_load> &conns, size_t threads,
+    const ws_rebalance_options &options) {
+  std::vector<ws_move> moves;
+  if (threads < 2 || conns.empty()) {
+    return moves;
+  }
+
+  std::vector<uint64_t> loads(threads);
+  std::vector<std::vector<size_t>> by_thread(threads);
+  uint64_t total = 0;
+  for (size_t i = 0; i < conns.size(); i++) {
+    loads[conns[i].thread] += conns[i].load;
+    by_thread[conns[i].thread].push_back(i);
+    total += conns[i].load;
+  }
+  double limit = double(total) / threads * (1 + options.threshold);
+
+  while (moves.size() < options.max_moves) {
+    size_t hot = 0, cold = 0;
+    for (size_t i = 1; i < threads; i++) {
+      hot = loads[i] > loads[hot] ? i : hot;
+      cold = loads[i] < loads[cold] ? i : cold;
+    }
+    if (double(loads[hot]) <= limit) {
+      break;
+    }
+
+    uint64_t gap = loads[hot] - loads[cold];
+    auto &candidates = by_thread[hot];
+    size_t best = candidates.size();
+    for (size_t i = 0; i < candidates.size(); i++) {
+      uint64_t load = conns[candidates[i]].load;
+      if (load > 0 && load < gap &&
+          (best == candidates.size() ||
+           load > conns[candidates[best]].load)) {
+        best = i;
+      }
+    }
+    if (best == candidates.size()) {
+      break;
+    }
+
+    size_t conn = candidates[best];
+    candidates[best] = candidates.back();
+    candidates.pop_back();
+    loads[hot] -= conns[conn].load;
+    loads[cold] += conns[conn].load;
+    by_thread[cold].push_back(conn);
+    moves.push_back({conn, cold});
+  }
+  return moves;
+}
+}  // namespace cinatra
@@ -98,6 +98,9 @@ enum flags {
 #endif  // defined(ASIO_WINDOWS)
 };
 
+// access pattern hints, see posix_fadvise.
+enum class file_advice { normal, sequential, random, willneed, dontneed };
+
 constexpr inline flags to_flags(std::ios::ios_base::openmode mode) {
   flags access = flags::read_write;
 
@@ -421,6 +424,17 @@ class basic_random_coro_file {
     }
   }
 
+  // read through an fd opened elsewhere, the fd is shared and closed with its
+  // last owner.
+  bool attach(std::shared_ptr<int> fd, std::string_view filepath) {
+    if (fd == nullptr) {
+      return false;
+    }
+    file_path_ = std::string{filepath};
+    prw_random_file_ = std::move(fd);
+    return true;
+  }
+
   async_simple::coro::Lazy<std::pair<std::error_code, size_t>> async_read_at(
       uint64_t offset, char *buf, size_t size) {
     if constexpr (execute_type == execution_type::thread_pool) {
@@ -428,6 +442,9 @@ class basic_random_coro_file {
     }
     else {
 #if defined(ENABLE_FILE_IO_URING) || defined(ASIO_WINDOWS)
+      if (async_random_file_ == nullptr && prw_random_file_ != nullptr) {
+        co_return co_await async_pread(offset, buf, size);
+      }
       if (async_random_file_ == nullptr) {
         co_return std::make_pair(
             std::make_error_code(std::errc::invalid_argument), 0);
@@ -476,6 +493,38 @@ class basic_random_coro_file {
 
   std::shared_ptr<int> get_pread_file() { return prw_random_file_; }
 
+  // tell the kernel how [offset, offset + len) will be read, len 0 means to
+  // the end of the file. only the pread file supports it, return false if the
+  // hint is not applied.
+  bool advise(uint64_t offset, uint64_t len, file_advice advice) {
+#if defined(__linux__)
+    if (prw_random_file_ == nullptr) {
+      return false;
+    }
+
+    int flag = POSIX_FADV_NORMAL;
+    switch (advice) {
+      case file_advice::sequential:
+        flag = POSIX_FADV_SEQUENTIAL;
+        break;
+      case file_advice::random:
+        flag = POSIX_FADV_RANDOM;
+        break;
+      case file_advice::willneed:
+        flag = POSIX_FADV_WILLNEED;
+        break;
+      case file_advice::dontneed:
+        flag = POSIX_FADV_DONTNEED;
+        break;
+      default:
+        break;
+    }
+    return ::posix_fadvise(*prw_random_file_, offset, len, flag) == 0;
+#else
+    return false;
+#endif
+  }
+
   bool is_open() {
 #if defined(ENABLE_FILE_IO_URING) || defined(ASIO_WINDOWS)
     if (async_random_file_ && async_random_file_->is_open()) {
@@ -43,7 +43,9 @@
 #include "../util/type_traits.h"
 #endif
 #ifdef __linux__
+#include <fcntl.h>
 #include <sys/sendfile.h>
+#include <unistd.h>
 #endif
 
 namespace coro_io {
@@ -257,6 +259,17 @@ inline async_simple::coro::Lazy<std::error_code> async_connect(
   });
 }
 
+template <typename Socket>
+inline async_simple::coro::Lazy<std::error_code> async_wait(
+    Socket &socket, typename Socket::wait_type type) noexcept {
+  callback_awaitor<std::error_code> awaitor;
+  co_return co_await awaitor.await_resume([&](auto handler) {
+    socket.async_wait(type, [&, handler](const auto &ec) {
+      handler.set_value_then_resume(ec);
+    });
+  });
+}
+
 template <typename Socket>
 inline async_simple::coro::Lazy<void> async_close(Socket &socket) noexcept {
   callback_awaitor<void> awaitor;
@@ -586,5 +599,190 @@ async_sendfile(asio::ip::tcp::socket &socket, int fd, off_t offset,
   }
   co_return std::pair{ec, size - least_bytes};
 }
+
+// write the in_pipe bytes of the pipe to fd at offset, it blocks on the disk.
+// if the file system of fd can't splice, the pipe is saved with read and
+// pwrite and it returns invalid_argument.
+inline std::error_code splice_pipe_to_file(int pipe_fd, int fd, off_t &offset,
+                                           size_t &in_pipe) {
+  while (in_pipe > 0) {
+    ssize_t m =
+        ::splice(pipe_fd, nullptr, fd, &offset, in_pipe, SPLICE_F_MOVE);
+    if (m < 0 && errno == EINTR) {
+      continue;
+    }
+    if (m < 0 && errno == EINVAL) {
+      char buf[4096];
+      while (in_pipe > 0) {
+        ssize_t r = ::read(pipe_fd, buf, std::min(sizeof(buf), in_pipe));
+        if (r <= 0 || ::pwrite(fd, buf, r, offset) != r) {
+          return std::make_error_code(std::errc::io_error);
+        }
+        offset += r;
+        in_pipe -= r;
+      }
+      return std::make_error_code(std::errc::invalid_argument);
+    }
+    if (m <= 0) {
+      return m < 0 ? std::error_code(errno, std::system_category())
+                   : std::make_error_code(std::errc::io_error);
+    }
+    in_pipe -= m;
+  }
+  return {};
+}
+
+// move size bytes from the socket to fd at offset through a pipe, the data
+// never gets copied to user space. only the socket side runs on the io
+// thread, the pipe is written to the file on the blocking executor whenever
+// the socket has nothing more or the pipe is full. if the file system of fd
+// can't splice, it stops with invalid_argument after saving what is in the
+// pipe, the caller can read the rest of the data itself.
+inline async_simple::coro::Lazy<std::pair<std::error_code, std::size_t>>
+async_splice_to_file(asio::ip::tcp::socket &socket, int fd, off_t offset,
+                     size_t size) noexcept {
+  std::error_code ec;
+  if (!socket.native_non_blocking()) {
+    socket.native_non_blocking(true, ec);
+    if (ec) {
+      co_return std::pair{ec, 0};
+    }
+  }
+
+  int pipe_fds[2];
+  if (::pipe2(pipe_fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+    co_return std::pair{std::error_code(errno, std::system_category()), 0};
+  }
+  // a larger pipe takes fewer trips to the blocking executor.
+  ::fcntl(pipe_fds[1], F_SETPIPE_SZ, 1024 * 1024);
+  int pipe_size = ::fcntl(pipe_fds[1], F_GETPIPE_SZ);
+  size_t capacity = pipe_size > 0 ? pipe_size : 65536;
+
+  // not read from the socket yet, and in the pipe but not in the file yet.
+  size_t unread = size;
+  size_t in_pipe = 0;
+  while (unread > 0 || in_pipe > 0) {
+    if (unread > 0 && in_pipe < capacity) {
+      ssize_t n = ::splice(socket.native_handle(), nullptr, pipe_fds[1],
+                           nullptr, std::min(capacity - in_pipe, unread),
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0 && errno == EINTR) [[unlikely]] {
+        continue;
+      }
+      if (n > 0) {
+        unread -= n;
+        in_pipe += n;
+        continue;
+      }
+      if (n == 0) {
+        ec = asio::error::eof;
+        break;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        ec = std::error_code(errno, std::system_category());
+        break;
+      }
+      if (in_pipe == 0) {
+        if (ec = co_await async_wait(socket, asio::ip::tcp::socket::wait_read);
+            ec) {
+          break;
+        }
+        continue;
+      }
+      // the socket is drained for now, or the pipe is full.
+    }
+
+    auto result = co_await post(
+        [&] { return splice_pipe_to_file(pipe_fds[0], fd, offset, in_pipe); });
+    ec = result.hasError() ? std::make_error_code(std::errc::io_error)
+                           : result.value();
+    if (ec) {
+      break;
+    }
+  }
+
+  ::close(pipe_fds[0]);
+  ::close(pipe_fds[1]);
+  // the bytes left in the pipe are lost.
+  co_return std::pair{ec, size - unread - in_pipe};
+}
+
+// move size bytes from one socket to another through a pipe, the data never
+// gets copied to user space. the pipe is drained before more is read, so a
+// slow receiver slows the sender down. it stops with eof if from is closed
+// first, the size returned is what has reached to.
+inline async_simple::coro::Lazy<std::pair<std::error_code, std::size_t>>
+async_splice(asio::ip::tcp::socket &from, asio::ip::tcp::socket &to,
+             size_t size) noexcept {
+  std::error_code ec;
+  for (auto socket : {&from, &to}) {
+    if (!socket->native_non_blocking()) {
+      socket->native_non_blocking(true, ec);
+      if (ec) {
+        co_return std::pair{ec, 0};
+      }
+    }
+  }
+
+  int pipe_fds[2];
+  if (::pipe2(pipe_fds, O_CLOEXEC | O_NONBLOCK) != 0) {
+    co_return std::pair{std::error_code(errno, std::system_category()), 0};
+  }
+
+  std::size_t least_bytes = size;
+  while (least_bytes > 0) {
+    ssize_t n = ::splice(from.native_handle(), nullptr, pipe_fds[1], nullptr,
+                         std::min(std::size_t{65536}, least_bytes),
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+      if (errno == EINTR) [[unlikely]] {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (ec = co_await async_wait(from, asio::ip::tcp::socket::wait_read);
+            ec) {
+          break;
+        }
+        continue;
+      }
+      ec = std::error_code(errno, std::system_category());
+      break;
+    }
+    if (n == 0) {
+      ec = asio::error::eof;
+      break;
+    }
+
+    size_t in_pipe = n;
+    while (in_pipe > 0) {
+      ssize_t m = ::splice(pipe_fds[0], nullptr, to.native_handle(), nullptr,
+                           in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (m < 0) {
+        if (errno == EINTR) [[unlikely]] {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          if (ec = co_await async_wait(to, asio::ip::tcp::socket::wait_write);
+              ec) {
+            break;
+          }
+          continue;
+        }
+        ec = std::error_code(errno, std::system_category());
+        break;
+      }
+      in_pipe -= m;
+    }
+    if (ec) {
+      least_bytes -= n - in_pipe;
+      break;
+    }
+    least_bytes -= n;
+  }
+
+  ::close(pipe_fds[0]);
+  ::close(pipe_fds[1]);
+  co_return std::pair{ec, size - least_bytes};
+}
 #endif
 }  // namespace coro_io
@@ -204,6 +204,10 @@ class io_context_pool {
     return ret;
   }
 
+  coro_io::ExecutorWrapper<> *get_executor(std::size_t index) {
+    return executors[index % io_contexts_.size()].get();
+  }
+
   template <typename T>
   friend io_context_pool &g_io_context_pool();
 
@@ -167,20 +167,7 @@ class load_blancer {
       -> decltype(std::declval<client_pool_t>().send_request(std::move(op),
                                                              std::string_view{},
                                                              config)) {
-    std::shared_ptr<client_pool_t> client_pool;
-    if (client_pools_.size() > 1) {
-      int cnt = 0;
-      do {
-        client_pool = co_await std::visit(
-            [this](auto& worker) {
-              return worker(*this);
-            },
-            lb_worker);
-      } while (!client_pool->is_alive() && ++cnt <= size() * 2);
-    }
-    else {
-      client_pool = client_pools_[0];
-    }
+    auto client_pool = co_await select_pool();
     co_return co_await client_pool->send_request(
         std::move(op), client_pool->get_host_name(), config);
   }
@@ -188,6 +175,17 @@ class load_blancer {
     return send_request(std::move(op), config_.pool_config.client_config);
   }
 
+  /**
+   * @brief select a host without sending a request, for a session which
+   * keeps its own connection to the host.
+   *
+   * @return the host name
+   */
+  async_simple::coro::Lazy<std::string_view> select_host() {
+    auto client_pool = co_await select_pool();
+    co_return client_pool->get_host_name();
+  }
+
   static load_blancer create(
       const std::vector<std::string_view>& hosts,
       const load_blancer_config& config = {},
@@ -207,6 +205,24 @@ class load_blancer {
   std::size_t size() const noexcept { return client_pools_.size(); }
 
  private:
+  async_simple::coro::Lazy<std::shared_ptr<client_pool_t>> select_pool() {
+    std::shared_ptr<client_pool_t> client_pool;
+    if (client_pools_.size() > 1) {
+      int cnt = 0;
+      do {
+        client_pool = co_await std::visit(
+            [this](auto& worker) {
+              return worker(*this);
+            },
+            lb_worker);
+      } while (!client_pool->is_alive() && ++cnt <= size() * 2);
+    }
+    else {
+      client_pool = client_pools_[0];
+    }
+    co_return client_pool;
+  }
+
   void init(const std::vector<std::string_view>& hosts,
             const load_blancer_config& config, const std::vector<int>& weights,
             client_pools_t& client_pools) {
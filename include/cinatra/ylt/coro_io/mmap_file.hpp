@@ -0,0 +1,308 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "coro_file.hpp"
+#if !defined(ASIO_WINDOWS)
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace coro_io {
+#if !defined(ASIO_WINDOWS)
+namespace detail {
+// a file which shrinks under its mapping raises SIGBUS when the missing
+// pages are touched. the mappings are kept in a fixed table, so the signal
+// handler can look them up without locks.
+// a slot is free when begin is 0 and reserved while it is 1, so taking and
+// releasing it are single atomic steps on begin.
+struct mmap_guard_slot {
+  std::atomic<uintptr_t> begin{0};
+  std::atomic<size_t> size{0};
+  std::atomic<bool> truncated{false};
+};
+
+inline constexpr uintptr_t reserved_guard_slot = 1;
+
+inline constexpr size_t max_guarded_mappings = 1024;
+inline mmap_guard_slot mmap_guard_slots[max_guarded_mappings];
+inline struct sigaction old_sigbus_action {};
+inline uintptr_t mmap_page_size = 4096;
+
+inline void sigbus_handler(int sig, siginfo_t *info, void *ctx) {
+  auto addr = reinterpret_cast<uintptr_t>(info->si_addr);
+  for (auto &slot : mmap_guard_slots) {
+    uintptr_t begin = slot.begin.load(std::memory_order_acquire);
+    if (begin <= reserved_guard_slot || addr < begin ||
+        addr >= begin + slot.size.load(std::memory_order_relaxed)) {
+      continue;
+    }
+
+    // put a zero page over the missing one, the access completes and the
+    // owner of the mapping sees the truncated flag.
+    void *page = reinterpret_cast<void *>(addr & ~(mmap_page_size - 1));
+    if (::mmap(page, mmap_page_size, PROT_READ,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+               0) != MAP_FAILED) {
+      slot.truncated.store(true, std::memory_order_release);
+      return;
+    }
+    break;
+  }
+
+  // not a guarded mapping, behave as if the handler was never installed.
+  if ((old_sigbus_action.sa_flags & SA_SIGINFO) &&
+      old_sigbus_action.sa_sigaction) {
+    old_sigbus_action.sa_sigaction(sig, info, ctx);
+    return;
+  }
+  if (old_sigbus_action.sa_handler != SIG_DFL &&
+      old_sigbus_action.sa_handler != SIG_IGN) {
+    old_sigbus_action.sa_handler(sig);
+    return;
+  }
+  ::signal(SIGBUS, SIG_DFL);
+}
+
+// the handler is process wide: it is installed with the first mapping and
+// never removed, a SIGBUS outside the guarded mappings goes to the handler
+// which was installed before, or kills the process as usual. a handler
+// installed later by the application must chain to this one to keep the
+// mappings guarded.
+inline void install_sigbus_handler() {
+  static std::once_flag flag;
+  std::call_once(flag, [] {
+    mmap_page_size = static_cast<uintptr_t>(::sysconf(_SC_PAGESIZE));
+    struct sigaction action {};
+    action.sa_sigaction = sigbus_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    ::sigaction(SIGBUS, &action, &old_sigbus_action);
+  });
+}
+
+inline mmap_guard_slot *acquire_guard_slot(const void *addr, size_t size) {
+  for (auto &slot : mmap_guard_slots) {
+    uintptr_t expected = 0;
+    if (!slot.begin.compare_exchange_strong(expected, reserved_guard_slot,
+                                            std::memory_order_acq_rel)) {
+      continue;
+    }
+    slot.truncated.store(false, std::memory_order_relaxed);
+    slot.size.store(size, std::memory_order_relaxed);
+    slot.begin.store(reinterpret_cast<uintptr_t>(addr),
+                     std::memory_order_release);
+    return &slot;
+  }
+  return nullptr;
+}
+
+// before the range is unmapped, so the handler never touches a range which
+// may be mapped again by someone else.
+inline void release_guard_slot(mmap_guard_slot *slot) {
+  slot->begin.store(0, std::memory_order_release);
+}
+}  // namespace detail
+#endif
+
+// a read only mapping of a whole file. it is shared by every connection
+// which sends the file and unmapped with its last owner. reading pages the
+// file no longer has doesn't crash: they read as zeros and truncated()
+// becomes true, so the sender can drop the connection.
+class mmap_file_view {
+ public:
+  // nullptr if the file is empty or can't be mapped, the caller falls back
+  // to reading the file.
+  static std::shared_ptr<mmap_file_view> open(const std::string &path) {
+#if defined(ASIO_WINDOWS)
+    return nullptr;
+#else
+    int fd = ::open(path.data(), O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+      ::close(fd);
+      return nullptr;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void *addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      ::close(fd);
+      return nullptr;
+    }
+
+    detail::install_sigbus_handler();
+    auto slot = detail::acquire_guard_slot(addr, size);
+    if (slot == nullptr) {
+      // the file can't be guarded, don't risk a crash.
+      ::munmap(addr, size);
+      ::close(fd);
+      return nullptr;
+    }
+
+    auto view = std::shared_ptr<mmap_file_view>(new mmap_file_view());
+    view->path_ = path;
+    view->fd_ = fd;
+    view->data_ = static_cast<const char *>(addr);
+    view->size_ = size;
+    view->slot_ = slot;
+    view->dev_ = st.st_dev;
+    view->ino_ = st.st_ino;
+    view->mtime_ = st.st_mtime;
+    return view;
+#endif
+  }
+
+  mmap_file_view(const mmap_file_view &) = delete;
+  mmap_file_view &operator=(const mmap_file_view &) = delete;
+
+  ~mmap_file_view() {
+#if !defined(ASIO_WINDOWS)
+    if (data_ != nullptr) {
+      detail::release_guard_slot(slot_);
+      ::munmap(const_cast<char *>(data_), size_);
+      ::close(fd_);
+    }
+#endif
+  }
+
+  std::string_view view() const { return {data_, size_}; }
+
+  std::string_view view(uint64_t offset, size_t len) const {
+    if (offset >= size_) {
+      return {};
+    }
+    return {data_ + offset, (std::min<uint64_t>)(len, size_ - offset)};
+  }
+
+  size_t size() const { return size_; }
+
+  const std::string &path() const { return path_; }
+
+  // pages of the file have been read as zeros because it was truncated.
+  bool truncated() const {
+#if defined(ASIO_WINDOWS)
+    return false;
+#else
+    return slot_->truncated.load(std::memory_order_acquire);
+#endif
+  }
+
+  // the file on disk still covers the mapping and hasn't been truncated.
+  bool is_intact() const {
+#if defined(ASIO_WINDOWS)
+    return true;
+#else
+    struct stat st;
+    return !truncated() && ::fstat(fd_, &st) == 0 &&
+           static_cast<size_t>(st.st_size) >= size_;
+#endif
+  }
+
+  // tell the kernel how [offset, offset + len) will be read.
+  bool advise(uint64_t offset, uint64_t len, file_advice advice) {
+#if defined(ASIO_WINDOWS)
+    return false;
+#else
+    if (offset >= size_) {
+      return false;
+    }
+    uint64_t begin = offset & ~(uint64_t(detail::mmap_page_size) - 1);
+    len = (std::min<uint64_t>)(len == 0 ? size_ : len, size_ - offset);
+    int flag = MADV_NORMAL;
+    switch (advice) {
+      case file_advice::sequential:
+        flag = MADV_SEQUENTIAL;
+        break;
+      case file_advice::random:
+        flag = MADV_RANDOM;
+        break;
+      case file_advice::willneed:
+        flag = MADV_WILLNEED;
+        break;
+      case file_advice::dontneed:
+        flag = MADV_DONTNEED;
+        break;
+      default:
+        break;
+    }
+    return ::madvise(const_cast<char *>(data_) + begin, offset + len - begin,
+                     flag) == 0;
+#endif
+  }
+
+ private:
+  friend std::shared_ptr<mmap_file_view> get_mmap_file(const std::string &);
+
+  mmap_file_view() = default;
+
+#if !defined(ASIO_WINDOWS)
+  // the mapping still shows the file at path.
+  bool is_same_file(const struct stat &st) const {
+    return st.st_dev == dev_ && st.st_ino == ino_ && st.st_mtime == mtime_ &&
+           static_cast<size_t>(st.st_size) == size_;
+  }
+
+  int fd_ = -1;
+  detail::mmap_guard_slot *slot_ = nullptr;
+  dev_t dev_ = 0;
+  ino_t ino_ = 0;
+  time_t mtime_ = 0;
+#endif
+  std::string path_;
+  const char *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+// map path once for all of its concurrent readers, a file which has been
+// replaced or changed since it was mapped gets a new mapping.
+inline std::shared_ptr<mmap_file_view> get_mmap_file(const std::string &path) {
+#if defined(ASIO_WINDOWS)
+  return nullptr;
+#else
+  static std::mutex mtx;
+  static std::unordered_map<std::string, std::weak_ptr<mmap_file_view>>
+      mappings;
+
+  struct stat st;
+  if (::stat(path.data(), &st) != 0) {
+    return nullptr;
+  }
+
+  {
+    std::scoped_lock lock(mtx);
+    if (auto it = mappings.find(path); it != mappings.end()) {
+      if (auto view = it->second.lock(); view && view->is_same_file(st)) {
+        return view;
+      }
+    }
+  }
+
+  auto view = mmap_file_view::open(path);
+  if (view == nullptr) {
+    return nullptr;
+  }
+
+  std::scoped_lock lock(mtx);
+  if (mappings.size() >= detail::max_guarded_mappings) {
+    std::erase_if(mappings, [](auto &pair) {
+      return pair.second.expired();
+    });
+  }
+  mappings[path] = view;
+  return view;
+#endif
+}
+}  // namespace coro_io
@@ -0,0 +1,310 @@
+#pragma once
+#include <zdict.h>
+#include <zstd.h>
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace cinatra::zstd_codec {
+inline constexpr int default_level = 3;
+
+// A trained dictionary, the digested CDict/DDict are created once and shared
+// by all threads. The dictionary id is written into every frame compressed
+// with it, so the peer only has to register the same dictionary to decode.
+class dictionary {
+ public:
+  dictionary(std::string data, int level)
+      : data_(std::move(data)),
+        id_(ZDICT_getDictID(data_.data(), data_.size())),
+        level_(level),
+        cdict_(ZSTD_createCDict(data_.data(), data_.size(), level)),
+        ddict_(ZSTD_createDDict(data_.data(), data_.size())) {}
+
+  ~dictionary() {
+    ZSTD_freeCDict(cdict_);
+    ZSTD_freeDDict(ddict_);
+  }
+
+  dictionary(const dictionary &) = delete;
+  dictionary &operator=(const dictionary &) = delete;
+
+  bool ok() const { return id_ != 0 && cdict_ && ddict_; }
+
+  uint32_t id() const { return id_; }
+
+  int level() const { return level_; }
+
+  std::string_view data() const { return data_; }
+
+  const ZSTD_CDict *cdict() const { return cdict_; }
+
+  const ZSTD_DDict *ddict() const { return ddict_; }
+
+ private:
+  std::string data_;
+  uint32_t id_;
+  int level_;
+  ZSTD_CDict *cdict_;
+  ZSTD_DDict *ddict_;
+};
+
+namespace detail {
+struct dictionary_registry {
+  std::shared_mutex mtx;
+  std::unordered_map<uint32_t, std::shared_ptr<dictionary>> dicts;
+};
+
+inline dictionary_registry &get_registry() {
+  static dictionary_registry registry;
+  return registry;
+}
+
+struct cctx_deleter {
+  void operator()(ZSTD_CCtx *ctx) const { ZSTD_freeCCtx(ctx); }
+};
+
+struct dctx_deleter {
+  void operator()(ZSTD_DCtx *ctx) const { ZSTD_freeDCtx(ctx); }
+};
+
+inline constexpr size_t max_pooled_contexts = 16;
+
+inline std::vector<std::unique_ptr<ZSTD_CCtx, cctx_deleter>> &cctx_pool() {
+  thread_local std::vector<std::unique_ptr<ZSTD_CCtx, cctx_deleter>> pool;
+  return pool;
+}
+
+inline ZSTD_DCtx *thread_dctx() {
+  thread_local std::unique_ptr<ZSTD_DCtx, dctx_deleter> dctx(
+      ZSTD_createDCtx());
+  return dctx.get();
+}
+}  // namespace detail
+
+// load a dictionary trained by ZDICT(zstd --train or the dict_tool), return
+// its id, 0 if the data is not a valid dictionary. registering the same id
+// again replaces the old dictionary, frames in flight keep the old one alive.
+inline uint32_t register_dictionary(std::string data,
+                                    int level = default_level) {
+  auto dict = std::make_shared<dictionary>(std::move(data), level);
+  if (!dict->ok()) {
+    return 0;
+  }
+
+  auto &registry = detail::get_registry();
+  std::unique_lock lock(registry.mtx);
+  uint32_t id = dict->id();
+  registry.dicts[id] = std::move(dict);
+  return id;
+}
+
+inline bool unregister_dictionary(uint32_t id) {
+  auto &registry = detail::get_registry();
+  std::unique_lock lock(registry.mtx);
+  return registry.dicts.erase(id) > 0;
+}
+
+inline std::shared_ptr<dictionary> get_dictionary(uint32_t id) {
+  auto &registry = detail::get_registry();
+  std::shared_lock lock(registry.mtx);
+  auto it = registry.dicts.find(id);
+  return it == registry.dicts.end() ? nullptr : it->second;
+}
+
+// return the context to the pool of the thread which releases it.
+struct cctx_releaser {
+  // the dictionary the context references, its CDict is not copied into the
+  // context, so it's kept alive as long as the context uses it.
+  std::shared_ptr<dictionary> dict;
+
+  void operator()(ZSTD_CCtx *ctx) {
+    if (dict != nullptr) {
+      // drop the reference before the dictionary can go.
+      ZSTD_CCtx_reset(ctx, ZSTD_reset_session_and_parameters);
+      dict = nullptr;
+    }
+
+    auto &pool = detail::cctx_pool();
+    if (pool.size() < detail::max_pooled_contexts) {
+      pool.emplace_back(ctx);
+    }
+    else {
+      ZSTD_freeCCtx(ctx);
+    }
+  }
+};
+
+using cctx_ptr = std::unique_ptr<ZSTD_CCtx, cctx_releaser>;
+
+// take a compression context from the per-thread pool, the context keeps its
+// tables between bodies, only the parameters are reset.
+// @param dict_id - 0 for no dictionary, the level of a registered dictionary
+// is fixed when it's registered.
+inline cctx_ptr acquire_cctx(int level = default_level, uint32_t dict_id = 0) {
+  auto &pool = detail::cctx_pool();
+  cctx_ptr ctx;
+  if (pool.empty()) {
+    ctx.reset(ZSTD_createCCtx());
+    if (ctx == nullptr) {
+      return nullptr;
+    }
+  }
+  else {
+    ctx.reset(pool.back().release());
+    pool.pop_back();
+    ZSTD_CCtx_reset(ctx.get(), ZSTD_reset_session_and_parameters);
+  }
+
+  if (dict_id != 0) {
+    auto dict = get_dictionary(dict_id);
+    if (dict == nullptr) {
+      return nullptr;
+    }
+    if (ZSTD_isError(ZSTD_CCtx_refCDict(ctx.get(), dict->cdict()))) {
+      return nullptr;
+    }
+    ctx.get_deleter().dict = std::move(dict);
+  }
+  else if (ZSTD_isError(ZSTD_CCtx_setParameter(
+               ctx.get(), ZSTD_c_compressionLevel, level))) {
+    return nullptr;
+  }
+
+  return ctx;
+}
+
+// @param mode - ZSTD_e_continue, ZSTD_e_flush or ZSTD_e_end
+inline bool compress_stream(ZSTD_CCtx *ctx, std::string_view data,
+                            std::string &out, ZSTD_EndDirective mode) {
+  ZSTD_inBuffer input{data.data(), data.size(), 0};
+  size_t remaining = 0;
+  do {
+    size_t old_size = out.size();
+    size_t chunk = ZSTD_CStreamOutSize();
+    out.resize(old_size + chunk);
+    ZSTD_outBuffer output{out.data() + old_size, chunk, 0};
+    remaining = ZSTD_compressStream2(ctx, &output, &input, mode);
+    out.resize(old_size + output.pos);
+    if (ZSTD_isError(remaining)) {
+      return false;
+    }
+  } while (mode == ZSTD_e_continue ? input.pos < input.size : remaining != 0);
+  return true;
+}
+
+// compress a whole body into one frame, the result is appended to out.
+inline bool compress(std::string_view data, std::string &out,
+                     int level = default_level, uint32_t dict_id = 0) {
+  auto ctx = acquire_cctx(level, dict_id);
+  if (ctx == nullptr) {
+    return false;
+  }
+
+  size_t old_size = out.size();
+  size_t bound = ZSTD_compressBound(data.size());
+  out.resize(old_size + bound);
+  size_t size = ZSTD_compress2(ctx.get(), out.data() + old_size, bound,
+                               data.data(), data.size());
+  if (ZSTD_isError(size)) {
+    out.resize(old_size);
+    return false;
+  }
+  out.resize(old_size + size);
+  return true;
+}
+
+// the dictionary is looked up by the id in the frame header, decompression
+// fails if it has not been registered.
+// @param max_size - refuse to produce more than max_size bytes
+inline bool decompress(std::string_view data, std::string &out,
+                       size_t max_size = SIZE_MAX) {
+  ZSTD_DCtx *ctx = detail::thread_dctx();
+  if (ctx == nullptr) {
+    return false;
+  }
+  ZSTD_DCtx_reset(ctx, ZSTD_reset_session_and_parameters);
+
+  std::shared_ptr<dictionary> dict;
+  if (uint32_t id = ZSTD_getDictID_fromFrame(data.data(), data.size());
+      id != 0) {
+    dict = get_dictionary(id);
+    if (dict == nullptr ||
+        ZSTD_isError(ZSTD_DCtx_refDDict(ctx, dict->ddict()))) {
+      return false;
+    }
+  }
+
+  size_t old_size = out.size();
+  auto content_size = ZSTD_getFrameContentSize(data.data(), data.size());
+  if (content_size != ZSTD_CONTENTSIZE_UNKNOWN &&
+      content_size != ZSTD_CONTENTSIZE_ERROR && content_size <= max_size) {
+    out.reserve(old_size + content_size);
+  }
+
+  ZSTD_inBuffer input{data.data(), data.size(), 0};
+  size_t ret = 0;
+  while (true) {
+    size_t pos = out.size();
+    size_t chunk = ZSTD_DStreamOutSize();
+    out.resize(pos + chunk);
+    ZSTD_outBuffer output{out.data() + pos, chunk, 0};
+    ret = ZSTD_decompressStream(ctx, &output, &input);
+    out.resize(pos + output.pos);
+    if (ZSTD_isError(ret) || out.size() - old_size > max_size) {
+      out.resize(old_size);
+      return false;
+    }
+    if (input.pos == input.size) {
+      // ret == 0: the last frame is complete. otherwise the output buffer was
+      // not filled up, so the ctx is waiting for more input.
+      if (ret == 0 || output.pos < chunk) {
+        break;
+      }
+    }
+  }
+
+  // ret != 0 means the last frame is truncated.
+  if (ret != 0) {
+    out.resize(old_size);
+    return false;
+  }
+  return true;
+}
+
+// train a dictionary from sample bodies, e.g. captured requests/responses of
+// one api. a few thousand samples and a 64KB-112KB dictionary are a good
+// start, the samples should be much larger than the dictionary in total.
+inline bool train_dictionary(const std::vector<std::string> &samples,
+                             std::string &dict,
+                             size_t dict_capacity = 112640) {
+  std::string buffer;
+  std::vector<size_t> sizes;
+  sizes.reserve(samples.size());
+  for (auto &sample : samples) {
+    if (sample.empty()) {
+      continue;
+    }
+    buffer.append(sample);
+    sizes.push_back(sample.size());
+  }
+  if (sizes.empty()) {
+    return false;
+  }
+
+  dict.resize(dict_capacity);
+  size_t size = ZDICT_trainFromBuffer(dict.data(), dict.size(), buffer.data(),
+                                      sizes.data(), (unsigned)sizes.size());
+  if (ZDICT_isError(size)) {
+    dict.clear();
+    return false;
+  }
+  dict.resize(size);
+  return true;
+}
+}  // namespace cinatra::zstd_codec
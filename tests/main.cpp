@@ -2,6 +2,11 @@
 
 #include "doctest/doctest.h"
 
+#ifdef CINATRA_ALLOC_PROFILE
+#define CINATRA_ALLOC_PROFILE_IMPL
+#include "cinatra/alloc_profiler.hpp"
+#endif
+
 // doctest comments
 // 'function' : must be 'attribute' - see issue #182
 DOCTEST_MSVC_SUPPRESS_WARNING_WITH_PUSH(4007)
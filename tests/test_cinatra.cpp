@@ -237,6 +237,79 @@ TEST_CASE("test encoding type") {
 
   server.stop();
 }
+
+TEST_CASE("test compressed chunked response and compress policy") {
+  coro_http_server server(1, 9001);
+  compress_policy policy{};
+  policy.min_size = 16;
+  server.set_compress_policy(policy);
+
+  server.set_http_handler<GET>(
+      "/chunked",
+      [](coro_http_request &req,
+         coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        resp.set_format_type(format_type::chunked);
+        bool ok = co_await resp.get_conn()->begin_chunked(
+            content_encoding::gzip, req.get_accept_encoding());
+        CHECK(ok);
+        for (int i = 0; i < 3; i++) {
+          co_await resp.get_conn()->write_chunked("hello world ");
+        }
+        co_await resp.get_conn()->write_chunked("buffered ", false,
+                                                compress_flush::none);
+        co_await resp.get_conn()->end_chunked();
+      });
+  server.set_http_handler<GET>(
+      "/small", [](coro_http_request &req, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok, "ok",
+                                    content_encoding::gzip,
+                                    req.get_accept_encoding());
+        CHECK(resp.content() == "ok");
+      });
+  server.set_http_handler<GET>(
+      "/png", [](coro_http_request &req, coro_http_response &resp) {
+        resp.add_header("Content-Type", "Image/PNG");
+        resp.set_status_and_content(status_type::ok, std::string(64, 'a'),
+                                    content_encoding::gzip,
+                                    req.get_accept_encoding());
+        CHECK(resp.content() == std::string(64, 'a'));
+      });
+  server.async_start();
+
+  auto &stats = get_compress_stats(content_encoding::gzip);
+  stats.reset();
+
+  coro_http_client client{};
+  client.add_header("Accept-Encoding", "gzip");
+  auto result = async_simple::coro::syncAwait(
+      client.async_get("http://127.0.0.1:9001/chunked"));
+  CHECK(get_header_value(result.resp_headers, "Content-Encoding") == "gzip");
+  std::string plain;
+  CHECK(gzip_codec::uncompress(result.resp_body, plain));
+  CHECK(plain == "hello world hello world hello world buffered ");
+
+  result = async_simple::coro::syncAwait(
+      client.async_get("http://127.0.0.1:9001/small"));
+  CHECK(result.resp_body == "ok");
+  result = async_simple::coro::syncAwait(
+      client.async_get("http://127.0.0.1:9001/png"));
+  CHECK(result.resp_body == std::string(64, 'a'));
+
+  CHECK(stats.count == 1);
+  CHECK(stats.skipped == 2);
+  CHECK(stats.bytes_in == plain.size());
+  CHECK(stats.bytes_out > 0);
+  server.stop();
+
+  // pooled streams are reset between bodies.
+  for (int i = 0; i < 3; i++) {
+    std::string zipped;
+    std::string unzipped;
+    CHECK(gzip_codec::compress("Hello World", zipped));
+    CHECK(gzip_codec::uncompress(zipped, unzipped));
+    CHECK(unzipped == "Hello World");
+  }
+}
 #endif
 
 #ifdef CINATRA_ENABLE_BROTLI
@@ -274,6 +347,81 @@ TEST_CASE("test brotli type") {
 }
 #endif
 
+#ifdef CINATRA_ENABLE_ZSTD
+TEST_CASE("test zstd type with dictionary") {
+  std::vector<std::string> samples;
+  for (int i = 0; i < 1000; i++) {
+    samples.push_back(
+        std::string(R"({"id":)")
+            .append(std::to_string(i * 7919))
+            .append(R"(,"name":"user)")
+            .append(std::to_string(i % 97))
+            .append(R"(","status":")")
+            .append(i % 3 ? "active" : "pending")
+            .append(R"(","roles":["reader","writer"]})"));
+  }
+  std::string dict;
+  REQUIRE(zstd_codec::train_dictionary(samples, dict, 4096));
+  uint32_t dict_id = zstd_codec::register_dictionary(dict);
+  REQUIRE(dict_id != 0);
+  CHECK(zstd_codec::register_dictionary("not a dictionary") == 0);
+
+  std::string body =
+      R"({"id":123456,"name":"user42","status":"active","roles":["reader","writer"]})";
+  std::string plain_zstd;
+  std::string dict_zstd;
+  CHECK(zstd_codec::compress(body, plain_zstd));
+  CHECK(zstd_codec::compress(body, dict_zstd, zstd_codec::default_level,
+                             dict_id));
+  CHECK(dict_zstd.size() < plain_zstd.size());
+
+  coro_http_server server(1, 9001);
+  compress_policy policy{};
+  policy.zstd_dict_id = dict_id;
+  server.set_compress_policy(policy);
+  server.set_http_handler<GET>(
+      "/get", [&](coro_http_request &req, coro_http_response &resp) {
+        resp.set_status_and_content(
+            status_type::ok, body,
+            negotiate_encoding(req.get_accept_encoding()),
+            req.get_accept_encoding());
+      });
+  server.async_start();
+
+  coro_http_client client{};
+  client.add_header("Accept-Encoding", "gzip, zstd");
+  auto result = client.get("http://127.0.0.1:9001/get");
+  CHECK(get_header_value(result.resp_headers, "Content-Encoding") == "zstd");
+  CHECK(result.resp_body == body);
+
+  coro_http_client client1{};
+  result = client1.get("http://127.0.0.1:9001/get");
+  CHECK(get_header_value(result.resp_headers, "Content-Encoding").empty());
+  CHECK(result.resp_body == body);
+  server.stop();
+
+  // a stream keeps its dictionary when it's unregistered in the middle.
+  stream_compressor stream;
+  REQUIRE(stream.init(content_encoding::zstd, &policy));
+  std::string stream_zstd;
+  CHECK(stream.compress(body.substr(0, 30), stream_zstd));
+  CHECK(zstd_codec::unregister_dictionary(dict_id));
+  CHECK(stream.compress(body.substr(30), stream_zstd,
+                        compress_flush::finish));
+
+  std::string out;
+  CHECK(!zstd_codec::decompress(dict_zstd, out));
+  CHECK(zstd_codec::decompress(plain_zstd, out));
+  CHECK(out == body);
+
+  out.clear();
+  CHECK(zstd_codec::register_dictionary(dict) == dict_id);
+  CHECK(zstd_codec::decompress(stream_zstd, out));
+  CHECK(out == body);
+  CHECK(zstd_codec::unregister_dictionary(dict_id));
+}
+#endif
+
 #ifdef CINATRA_ENABLE_SSL
 TEST_CASE("test ssl client") {
   {
@@ -1710,6 +1858,135 @@ TEST_CASE("test upload file") {
   server.stop();
 }
 
+TEST_CASE("test multipart boundary finder") {
+  std::string needle = "\r\n--" + std::string(BOUNDARY);
+  detail::boundary_finder finder;
+  finder.init(needle);
+
+  std::string data;
+  for (size_t i = 0; i < 3000; i++) {
+    data.push_back("\r\n-abc"[i * 7 % 6]);
+  }
+  for (size_t i = 0; i < 100; i++) {
+    // near misses, the first and the last byte match.
+    std::string miss = needle;
+    miss[miss.size() / 2] ^= 1;
+    data.insert(i * 29 % data.size(), miss);
+  }
+  CHECK(finder.find(data) == std::string_view::npos);
+  CHECK(finder.find(std::string_view(needle).substr(1)) ==
+        std::string_view::npos);
+
+  for (size_t pos : {size_t(0), size_t(1), size_t(31), size_t(32),
+                     size_t(33), data.size() - 5, data.size()}) {
+    std::string str = data;
+    str.insert(pos, needle);
+    str.append(needle);
+    CHECK(finder.find(str) == std::string_view(str).find(needle));
+  }
+}
+
+TEST_CASE("test multipart part body in pieces") {
+  coro_http_server server(1, 8090);
+  size_t pieces = 0;
+  size_t max_piece = 0;
+  server.set_http_handler<cinatra::POST>(
+      "/multipart",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto boundary = req.get_boundary();
+        multipart_reader_t multipart(req.get_conn());
+        std::string body;
+        while (true) {
+          auto part_head = co_await multipart.read_part_head(boundary);
+          if (part_head.ec) {
+            resp.set_status_and_content(status_type::bad_request,
+                                        part_head.ec.message());
+            co_return;
+          }
+          body.append(part_head.name).append(",");
+          body.append(part_head.filename).append(":");
+
+          part_chunk_t chunk{};
+          do {
+            chunk = co_await multipart.read_part_body_some();
+            if (chunk.ec) {
+              resp.set_status_and_content(status_type::bad_request,
+                                          chunk.ec.message());
+              co_return;
+            }
+            pieces++;
+            max_piece = (std::max)(max_piece, chunk.data.size());
+            body.append(chunk.data);
+          } while (!chunk.part_end);
+          body.append("|");
+
+          if (chunk.eof) {
+            break;
+          }
+        }
+        resp.set_status_and_content(status_type::ok, std::move(body));
+      });
+  server.async_start();
+
+  std::string content;
+  for (size_t i = 0; i < 1024 * 1024 + 11; i++) {
+    content.push_back('a' + i % 26);
+  }
+  std::string filename = "test_multipart_pieces.txt";
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(content.data(), content.size());
+  }
+
+  coro_http_client client{};
+  std::string uri = "http://127.0.0.1:8090/multipart";
+  client.add_str_part("hello", "world");
+  client.add_file_part("file", filename);
+  auto result =
+      async_simple::coro::syncAwait(client.async_upload_multipart(uri));
+  CHECK(result.status == 200);
+  CHECK(result.resp_body ==
+        "file," + filename + ":" + content + "|hello,:world|");
+  CHECK(pieces > 2);
+  CHECK(max_piece < 64 * 1024);
+  std::filesystem::remove(filename);
+
+  // a preamble, quoted parameters and an empty part.
+  std::string body =
+      "preamble\r\n--xyz\r\n"
+      "Content-Disposition: form-data; filename=\"a;b.txt\"; name=\"f\"\r\n"
+      "Content-Type: text/plain\r\n\r\n"
+      "one\r\n--xy\r\n--xyz\r\n"
+      "content-disposition: form-data; name=empty\r\n\r\n"
+      "\r\n--xyz--\r\n";
+  coro_http_client client1{};
+  result = client1.post(
+      uri, body, req_content_type::none,
+      {{"Content-Type", "multipart/form-data; boundary=xyz"}});
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == "f,a;b.txt:one\r\n--xy|empty,:|");
+
+  // the boundary in the middle of a preamble line is not a delimiter, the
+  // padding after a delimiter is skipped.
+  coro_http_client client3{};
+  result = client3.post(
+      uri,
+      "pre--xyz\r\n--xyz \t\r\n"
+      "Content-Disposition: form-data; name=\"p\"\r\n\r\n"
+      "padded\r\n--xyz-- \r\n",
+      req_content_type::none,
+      {{"Content-Type", "multipart/form-data; boundary=xyz"}});
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == "p,:padded|");
+
+  coro_http_client client2{};
+  result = client2.post(
+      uri, "--xyz\r\n\r\nbroken\r\n--xyzbad", req_content_type::none,
+      {{"Content-Type", "multipart/form-data; boundary=xyz"}});
+  CHECK(result.status != 200);
+}
+
 TEST_CASE("test bad uri") {
   coro_http_client client{};
   CHECK(client.add_header("hello", "cinatra"));
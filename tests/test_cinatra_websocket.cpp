@@ -2,6 +2,7 @@
 #include <filesystem>
 #include <future>
 #include <memory>
+#include <set>
 #include <system_error>
 
 #include "cinatra.hpp"
@@ -257,6 +258,64 @@ TEST_CASE("test websocket content ge 65535") {
   test_websocket_content(65536);
 }
 
+TEST_CASE("test websocket mask") {
+  uint8_t key[4] = {0x12, 0x34, 0x56, 0x78};
+  std::vector<detail::ws_mask_func> funcs{detail::ws_mask_scalar};
+#ifdef CINATRA_WS_MASK_SSE2
+  funcs.push_back(detail::ws_mask_sse2);
+#endif
+#ifdef CINATRA_WS_MASK_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    funcs.push_back(detail::ws_mask_avx2);
+  }
+#endif
+#ifdef CINATRA_WS_MASK_NEON
+  funcs.push_back(detail::ws_mask_neon);
+#endif
+  for (size_t size : {0, 1, 7, 15, 16, 17, 31, 33, 64, 100, 257}) {
+    for (size_t offset = 0; offset < 4; offset++) {
+      // unaligned data.
+      std::string data(size + 1, '\0');
+      for (size_t i = 0; i < data.size(); i++) {
+        data[i] = char(i * 7);
+      }
+      std::string expected = data;
+      for (size_t i = 0; i < size; i++) {
+        expected[i + 1] ^= key[(offset + i) % 4];
+      }
+
+      std::string masked = data;
+      detail::ws_mask(masked.data() + 1, size, key, offset);
+      CHECK(masked == expected);
+      for (auto func : funcs) {
+        masked = data;
+        func(masked.data() + 1, size, detail::ws_mask_pattern(key, offset));
+        CHECK(masked == expected);
+      }
+    }
+  }
+
+  // masking in pieces is the same as masking at once.
+  std::string data(100, 'a');
+  std::string expected = data;
+  detail::ws_mask(expected.data(), expected.size(), key);
+  detail::ws_mask(data.data(), 37, key);
+  detail::ws_mask(data.data() + 37, 63, key, 37);
+  CHECK(data == expected);
+
+  std::set<uint32_t> masks;
+  for (int i = 0; i < 1000; i++) {
+    masks.insert(detail::ws_random_mask());
+  }
+  CHECK(masks.size() > 990);
+  uint32_t other = 0;
+  std::thread thd([&] {
+    other = detail::ws_random_mask();
+  });
+  thd.join();
+  CHECK(!masks.contains(other));
+}
+
 TEST_CASE("test send after server stop") {
   cinatra::coro_http_server server(1, 8090);
   server.async_start();
@@ -442,3 +501,1031 @@ TEST_CASE("test websocket permessage defalte") {
   client.close();
 }
 #endif
+
+TEST_CASE("test websocket many frames per read") {
+  coro_http_server server(1, 9017);
+  std::vector<std::string> received;
+  std::promise<void> done;
+  server.set_http_handler<cinatra::GET>(
+      "/ws",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec) {
+            break;
+          }
+          if (result.data == "burst") {
+            for (int i = 0; i < 50; i++) {
+              co_await conn->write_websocket("m" + std::to_string(i));
+            }
+            co_await conn->write_websocket(std::string(20000, 'y'));
+            continue;
+          }
+          if (result.data == "end") {
+            done.set_value();
+            continue;
+          }
+          received.emplace_back(result.data);
+        }
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  auto encode = [](std::string payload) {
+    websocket ws;
+    std::span<char> span(payload);
+    std::string frame(ws.encode_frame(span, opcode::text, true));
+    return frame.append(payload);
+  };
+
+  // the first frame comes with the handshake, the rest in one write, the
+  // last one byte by byte.
+  asio::io_context ctx;
+  asio::ip::tcp::socket socket(ctx);
+  socket.connect(asio::ip::tcp::endpoint(
+      asio::ip::address::from_string("127.0.0.1"), 9017));
+  std::string handshake =
+      "GET /ws HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\n"
+      "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "Sec-WebSocket-Version: 13\r\n\r\n";
+  asio::write(socket, asio::buffer(handshake + encode("f0")));
+  std::string resp;
+  asio::read_until(socket, asio::dynamic_buffer(resp), "\r\n\r\n");
+  CHECK(resp.starts_with("HTTP/1.1 101"));
+
+  std::string frames;
+  for (int i = 1; i < 100; i++) {
+    frames.append(encode("f" + std::to_string(i)));
+  }
+  frames.append(encode(std::string(20000, 'x')));
+  asio::write(socket, asio::buffer(frames));
+  for (char c : encode("end")) {
+    asio::write(socket, asio::buffer(&c, 1));
+    std::this_thread::sleep_for(1ms);
+  }
+  CHECK(done.get_future().wait_for(5s) == std::future_status::ready);
+  REQUIRE(received.size() == 101);
+  for (int i = 0; i < 100; i++) {
+    CHECK(received[i] == "f" + std::to_string(i));
+  }
+  CHECK(received[100] == std::string(20000, 'x'));
+  socket.close();
+
+  coro_http_client client{};
+  async_simple::coro::syncAwait(client.connect("ws://127.0.0.1:9017/ws"));
+  async_simple::coro::syncAwait(client.write_websocket("burst"));
+  for (int i = 0; i < 50; i++) {
+    auto data = async_simple::coro::syncAwait(client.read_websocket());
+    CHECK(data.resp_body == "m" + std::to_string(i));
+  }
+  auto data = async_simple::coro::syncAwait(client.read_websocket());
+  CHECK(data.resp_body == std::string(20000, 'y'));
+  client.close();
+}
+
+TEST_CASE("test websocket hub") {
+  cinatra::coro_http_server server(2, 9018);
+  ws_hub hub;
+  ws_hub drop_hub(slow_subscriber_policy::drop, 4);
+  ws_hub disconnect_hub(slow_subscriber_policy::disconnect, 1);
+  std::promise<bool> closed;
+  server.set_http_handler<cinatra::GET>(
+      "/sub",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        hub.subscribe("quotes", conn);
+        co_await conn->write_websocket("ready");
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+          if (result.data == "unsub") {
+            hub.unsubscribe("quotes", conn);
+          }
+          co_await conn->write_websocket(result.data);
+        }
+      });
+  server.set_http_handler<cinatra::GET>(
+      "/drop",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        drop_hub.subscribe("burst", conn);
+        for (int i = 0; i < 10; i++) {
+          drop_hub.publish("burst", "b" + std::to_string(i));
+        }
+        co_await conn->write_websocket(
+            std::to_string(conn->get_ws_queue_stats().dropped));
+        co_await conn->read_websocket();
+      });
+  server.set_http_handler<cinatra::GET>(
+      "/disconnect",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        disconnect_hub.subscribe("burst", conn);
+        for (int i = 0; i < 10; i++) {
+          disconnect_hub.publish("burst", "b" + std::to_string(i));
+        }
+        closed.set_value(conn->has_closed());
+        co_return;
+      });
+  ws_hub churn_hub;
+  server.set_http_handler<cinatra::GET>(
+      "/churn",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        for (int i = 0; i < 100; i++) {
+          churn_hub.subscribe("topic" + std::to_string(i), conn);
+        }
+        co_await conn->write_websocket("subscribed");
+        co_await conn->read_websocket();
+        for (int i = 0; i < 100; i++) {
+          churn_hub.unsubscribe("topic" + std::to_string(i), conn);
+        }
+        co_await conn->write_websocket("unsubscribed");
+        co_await conn->read_websocket();
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  CHECK(hub.publish("quotes", "nobody") == 0);
+
+  // a topic is dropped with its last subscriber.
+  coro_http_client churn_client{};
+  async_simple::coro::syncAwait(
+      churn_client.connect("ws://127.0.0.1:9018/churn"));
+  auto churn_data = async_simple::coro::syncAwait(churn_client.read_websocket());
+  CHECK(churn_data.resp_body == "subscribed");
+  CHECK(churn_hub.topic_count() == 100);
+  async_simple::coro::syncAwait(churn_client.write_websocket("unsub"));
+  churn_data = async_simple::coro::syncAwait(churn_client.read_websocket());
+  CHECK(churn_data.resp_body == "unsubscribed");
+  for (int i = 0; i < 100 && churn_hub.topic_count() > 0; i++) {
+    std::this_thread::sleep_for(10ms);
+  }
+  CHECK(churn_hub.topic_count() == 0);
+  churn_client.close();
+
+  std::vector<std::unique_ptr<coro_http_client>> clients;
+  for (int i = 0; i < 4; i++) {
+    auto client = std::make_unique<coro_http_client>();
+#ifdef CINATRA_ENABLE_GZIP
+    // gets the compressed frame.
+    client->set_ws_deflate(i == 3);
+#endif
+    async_simple::coro::syncAwait(client->connect("ws://127.0.0.1:9018/sub"));
+    auto data = async_simple::coro::syncAwait(client->read_websocket());
+    CHECK(data.resp_body == "ready");
+    clients.push_back(std::move(client));
+  }
+
+  // one post per io thread, not per connection.
+  CHECK(hub.publish("quotes", "m0") == 2);
+  CHECK(hub.publish("quotes", std::string(70000, 'q'), opcode::binary) == 2);
+  for (auto &client : clients) {
+    auto data = async_simple::coro::syncAwait(client->read_websocket());
+    CHECK(data.resp_body == "m0");
+    data = async_simple::coro::syncAwait(client->read_websocket());
+    CHECK(data.resp_body == std::string(70000, 'q'));
+  }
+
+  async_simple::coro::syncAwait(clients[0]->write_websocket("unsub"));
+  auto data = async_simple::coro::syncAwait(clients[0]->read_websocket());
+  CHECK(data.resp_body == "unsub");
+  hub.publish("quotes", "m1");
+  for (size_t i = 1; i < clients.size(); i++) {
+    data = async_simple::coro::syncAwait(clients[i]->read_websocket());
+    CHECK(data.resp_body == "m1");
+  }
+  async_simple::coro::syncAwait(clients[0]->write_websocket("echo"));
+  data = async_simple::coro::syncAwait(clients[0]->read_websocket());
+  CHECK(data.resp_body == "echo");
+
+  // closed subscribers are removed from the topic.
+  clients[1]->close();
+  std::this_thread::sleep_for(100ms);
+  hub.publish("quotes", "m2");
+  for (size_t i = 2; i < clients.size(); i++) {
+    data = async_simple::coro::syncAwait(clients[i]->read_websocket());
+    CHECK(data.resp_body == "m2");
+  }
+
+  coro_http_client drop_client{};
+  async_simple::coro::syncAwait(
+      drop_client.connect("ws://127.0.0.1:9018/drop"));
+  int received = 0;
+  while (true) {
+    data = async_simple::coro::syncAwait(drop_client.read_websocket());
+    REQUIRE(!data.net_err);
+    if (!data.resp_body.starts_with("b")) {
+      break;
+    }
+    CHECK(data.resp_body == "b" + std::to_string(received));
+    received++;
+  }
+  int dropped = std::stoi(std::string(data.resp_body));
+  CHECK(dropped > 0);
+  CHECK(received + dropped == 10);
+  drop_client.close();
+
+  coro_http_client disconnect_client{};
+  async_simple::coro::syncAwait(
+      disconnect_client.connect("ws://127.0.0.1:9018/disconnect"));
+  auto future = closed.get_future();
+  REQUIRE(future.wait_for(5s) == std::future_status::ready);
+  CHECK(future.get());
+
+  for (auto &client : clients) {
+    client->close();
+  }
+  // the closed subscribers are removed by a publish, and the topic with them.
+  for (int i = 0; i < 100 && hub.topic_count() > 0; i++) {
+    hub.publish("quotes", "gone");
+    std::this_thread::sleep_for(10ms);
+  }
+  CHECK(hub.topic_count() == 0);
+}
+
+TEST_CASE("test websocket send queue") {
+  cinatra::coro_http_server server(1, 9019);
+  server.set_ws_send_queue_watermarks(64 * 1024, 16 * 1024);
+  std::vector<std::thread> producers;
+  size_t accepted = 0;
+  bool paused = false;
+  server.set_http_handler<cinatra::GET>(
+      "/queue",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        conn->set_ws_writable_callback([conn] {
+          conn->post_websocket("writable");
+        });
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+          if (result.data == "pause") {
+            // nothing is written until the handler waits again.
+            while (conn->post_websocket(std::string(10000, 'p'))) {
+              accepted++;
+            }
+            paused = !conn->ws_writable();
+          }
+          else if (result.data == "flood") {
+            for (int k = 0; k < 4; k++) {
+              producers.emplace_back([conn, k] {
+                for (int i = 0; i < 500; i++) {
+                  auto msg = std::to_string(k) + ":" + std::to_string(i);
+                  while (!conn->post_websocket(msg)) {
+                    std::this_thread::sleep_for(1ms);
+                  }
+                }
+              });
+            }
+          }
+          else if (result.data == "stats") {
+            auto stats = conn->get_ws_queue_stats();
+            co_await conn->write_websocket(std::to_string(stats.sent) + " " +
+                                           std::to_string(stats.batches));
+          }
+        }
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  coro_http_client client{};
+  async_simple::coro::syncAwait(client.connect("ws://127.0.0.1:9019/queue"));
+  async_simple::coro::syncAwait(client.write_websocket("pause"));
+  size_t received = 0;
+  while (true) {
+    auto data = async_simple::coro::syncAwait(client.read_websocket());
+    REQUIRE(!data.net_err);
+    if (data.resp_body == "writable") {
+      break;
+    }
+    CHECK(data.resp_body == std::string(10000, 'p'));
+    received++;
+  }
+  CHECK(paused);
+  CHECK(accepted > 0);
+  CHECK(received == accepted);
+
+  async_simple::coro::syncAwait(client.write_websocket("flood"));
+  // the messages of one producer arrive in order.
+  std::vector<int> next(4, 0);
+  for (int n = 0; n < 2000;) {
+    auto data = async_simple::coro::syncAwait(client.read_websocket());
+    REQUIRE(!data.net_err);
+    if (data.resp_body == "writable") {
+      continue;
+    }
+    auto pos = data.resp_body.find(':');
+    REQUIRE(pos != std::string_view::npos);
+    int k = std::stoi(std::string(data.resp_body.substr(0, pos)));
+    int i = std::stoi(std::string(data.resp_body.substr(pos + 1)));
+    CHECK(i == next[k]);
+    next[k] = i + 1;
+    n++;
+  }
+  for (auto &producer : producers) {
+    producer.join();
+  }
+
+  async_simple::coro::syncAwait(client.write_websocket("stats"));
+  std::string stats;
+  while (true) {
+    auto data = async_simple::coro::syncAwait(client.read_websocket());
+    REQUIRE(!data.net_err);
+    if (data.resp_body != "writable") {
+      stats = data.resp_body;
+      break;
+    }
+  }
+  size_t sent = 0, batches = 0;
+  std::sscanf(stats.data(), "%zu %zu", &sent, &batches);
+  CHECK(sent >= 2000 + accepted);
+  // many frames are written with one writev.
+  CHECK(batches < sent);
+  client.close();
+}
+
+#ifdef CINATRA_ENABLE_GZIP
+TEST_CASE("test websocket permessage-deflate") {
+  ws_deflate_options options;
+  std::string response;
+  auto pmd = permessage_deflate::accept(
+      "permessage-deflate; client_max_window_bits", options, response);
+  REQUIRE(pmd);
+  CHECK(response == "permessage-deflate");
+  CHECK(pmd->context_takeover());
+
+  pmd = permessage_deflate::accept(
+      "x-webkit-deflate-frame, permessage-deflate; server_max_window_bits=10; "
+      "client_no_context_takeover",
+      options, response);
+  REQUIRE(pmd);
+  CHECK(response ==
+        "permessage-deflate; client_no_context_takeover; "
+        "server_max_window_bits=10");
+
+  CHECK(!permessage_deflate::accept(
+      "permessage-deflate; server_max_window_bits=8", options, response));
+  CHECK(!permessage_deflate::accept("permessage-deflate; foo", options,
+                                    response));
+  CHECK(!permessage_deflate::accept(
+      "permessage-deflate; server_no_context_takeover; "
+      "server_no_context_takeover",
+      options, response));
+
+  ws_deflate_options limited;
+  limited.max_window_bits = 12;
+  pmd = permessage_deflate::accept(
+      "permessage-deflate; client_max_window_bits", limited, response);
+  REQUIRE(pmd);
+  CHECK(response ==
+        "permessage-deflate; server_max_window_bits=12; "
+        "client_max_window_bits=12");
+
+  // beyond the memory limit the streams are not kept.
+  limited.memory_limit = 1024;
+  pmd = permessage_deflate::accept("permessage-deflate", limited, response);
+  REQUIRE(pmd);
+  CHECK(!pmd->context_takeover());
+  CHECK(response ==
+        "permessage-deflate; server_no_context_takeover; "
+        "client_no_context_takeover; server_max_window_bits=12");
+
+  // the window is kept between the messages, similar messages get small.
+  auto server = permessage_deflate::accept(
+      "permessage-deflate; client_max_window_bits", options, response);
+  auto client = permessage_deflate::from_response(response);
+  REQUIRE(server);
+  REQUIRE(client);
+  auto no_takeover = permessage_deflate::accept(
+      "permessage-deflate; server_no_context_takeover", options, response);
+  REQUIRE(no_takeover);
+  size_t takeover_size = 0, no_takeover_size = 0;
+  for (int i = 0; i < 100; i++) {
+    std::string msg = R"({"symbol":"600000","exchange":"SSE","price":)" +
+                      std::to_string(1230 + i) + R"(,"volume":)" +
+                      std::to_string(i * 100) +
+                      R"(,"bid":[12.29,12.28,12.27],"ask":[12.31,12.32]})";
+    std::string compressed, inflated, independent;
+    REQUIRE(server->compress(msg, compressed));
+    REQUIRE(client->decompress(compressed, inflated));
+    CHECK(inflated == msg);
+    REQUIRE(no_takeover->compress(msg, independent));
+    takeover_size += compressed.size();
+    no_takeover_size += independent.size();
+  }
+  CHECK(takeover_size * 2 < no_takeover_size);
+
+  // a small message which inflates past the limit is not inflated further.
+  std::string bomb, inflated;
+  REQUIRE(client->compress(std::string(8 * 1024 * 1024, 'a'), bomb));
+  CHECK(bomb.size() < 64 * 1024);
+  CHECK(!server->decompress(bomb, inflated, true, true, 64 * 1024));
+  CHECK(inflated.size() > 64 * 1024);
+  CHECK(inflated.size() < 128 * 1024);
+
+  cinatra::coro_http_server server_(1, 9020);
+  ws_deflate_options server_options;
+  server_options.min_size = 16;
+  server_.set_ws_deflate_options(server_options);
+  server_.set_http_handler<cinatra::GET>(
+      "/deflate",
+      [](coro_http_request &req,
+         coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+          if (result.data.starts_with("post:")) {
+            // compressed by the writer of the send queue.
+            conn->post_websocket(result.data);
+            continue;
+          }
+          co_await conn->write_websocket(result.data);
+        }
+      });
+  server_.set_http_handler<cinatra::GET>(
+      "/limited",
+      [](coro_http_request &req,
+         coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        conn->set_ws_max_message_size(64 * 1024);
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+          co_await conn->write_websocket(result.data);
+        }
+      });
+  server_.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  coro_http_client bomb_client{};
+  bomb_client.set_ws_deflate(true);
+  async_simple::coro::syncAwait(
+      bomb_client.connect("ws://127.0.0.1:9020/limited"));
+  async_simple::coro::syncAwait(
+      bomb_client.write_websocket(std::string(8 * 1024 * 1024, 'a')));
+  auto bomb_data = async_simple::coro::syncAwait(bomb_client.read_websocket());
+  CHECK(bomb_data.net_err == asio::error::eof);
+  CHECK(bomb_data.resp_body == "message_too_big");
+  bomb_client.close();
+
+  coro_http_client ws_client{};
+  ws_client.set_ws_deflate(true);
+  async_simple::coro::syncAwait(
+      ws_client.connect("ws://127.0.0.1:9020/deflate"));
+  for (int i = 0; i < 20; i++) {
+    std::string msg = (i % 2 ? "post:" : "") +
+                      std::string(R"({"symbol":"600000","price":)") +
+                      std::to_string(1230 + i) + "}";
+    async_simple::coro::syncAwait(ws_client.write_websocket(std::string(msg)));
+    auto data = async_simple::coro::syncAwait(ws_client.read_websocket());
+    CHECK(data.resp_body == msg);
+  }
+  // below min_size, sent as it is.
+  async_simple::coro::syncAwait(ws_client.write_websocket("tiny"));
+  auto data = async_simple::coro::syncAwait(ws_client.read_websocket());
+  CHECK(data.resp_body == "tiny");
+  ws_client.close();
+}
+#endif
+
+TEST_CASE("test websocket fragments") {
+  utf8_validator validator;
+  std::string text = std::string(37, 'a') + "\xe4\xbd\xa0\xe5\xa5\xbd" +
+                     std::string(40, 'b') + "\xf0\x9f\x98\x80";
+  for (size_t split = 0; split <= text.size(); split++) {
+    validator.reset();
+    CHECK(validator.update(std::string_view(text).substr(0, split)));
+    CHECK(validator.update(std::string_view(text).substr(split)));
+    CHECK(validator.finish());
+  }
+  CHECK(!validate_utf8(std::string(20, 'a') + "\xc0\x80"));
+  CHECK(!validate_utf8("\xed\xa0\x80"));
+  CHECK(!validate_utf8("\xf4\x90\x80\x80"));
+  CHECK(!validate_utf8(std::string(33, 'a') + "\xe4\xbd"));
+  validator.reset();
+  CHECK(validator.update("\xe4"));
+  CHECK(!validator.update("\x41"));
+
+  cinatra::coro_http_server server(1, 9021);
+  server.set_http_handler<cinatra::GET>(
+      "/echo",
+      [](coro_http_request &req,
+         coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        conn->set_ws_max_message_size(200 * 1024);
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+          if (result.type == ws_frame_type::WS_PING_FRAME) {
+            continue;
+          }
+          co_await conn->write_websocket(
+              result.data, result.type == ws_frame_type::WS_TEXT_FRAME
+                               ? opcode::text
+                               : opcode::binary);
+        }
+      });
+  size_t streamed = 0;
+  size_t pieces = 0;
+  server.set_http_handler<cinatra::GET>(
+      "/stream",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        conn->set_ws_stream_handler(
+            [&](ws_frame_type type, std::string_view data, bool eof) {
+              streamed += data.size();
+              pieces++;
+              return data.find('x') == std::string_view::npos;
+            });
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+          CHECK(result.eof);
+          CHECK(result.data.empty());
+          co_await conn->write_websocket(std::to_string(streamed));
+          streamed = 0;
+        }
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  auto send = [](coro_http_client &client, std::string msg, opcode op,
+                 bool eof) {
+    resp_data data;
+    async_simple::coro::syncAwait(
+        client.write_ws_frame(msg, websocket{}, op, data, eof));
+    return !data.net_err;
+  };
+
+  coro_http_client client{};
+  async_simple::coro::syncAwait(client.connect("ws://127.0.0.1:9021/echo"));
+  // a ping between the fragments is answered on its own.
+  CHECK(send(client, "hel", opcode::text, false));
+  CHECK(send(client, "lo \xe4", opcode::cont, false));
+  CHECK(send(client, "", opcode::ping, true));
+  CHECK(send(client, "\xbd\xa0", opcode::cont, true));
+  // the pong.
+  auto data = async_simple::coro::syncAwait(client.read_websocket());
+  CHECK(data.resp_body.empty());
+  data = async_simple::coro::syncAwait(client.read_websocket());
+  CHECK(data.resp_body == "hello \xe4\xbd\xa0");
+
+  // fragments larger than the read buffer are gathered in one buffer.
+  std::string large;
+  for (int i = 0; i < 5; i++) {
+    std::string part(20000, char('a' + i));
+    large.append(part);
+    CHECK(send(client, part, i == 0 ? opcode::binary : opcode::cont, i == 4));
+  }
+  data = async_simple::coro::syncAwait(client.read_websocket());
+  CHECK(data.resp_body == large);
+
+  // beyond the message limit. the last frame is read in full before the
+  // close, unread data would reset the connection instead.
+  for (int i = 0; i < 3; i++) {
+    send(client, std::string(i < 2 ? 100000 : 5000, 'z'),
+         i == 0 ? opcode::text : opcode::cont, false);
+  }
+  data = async_simple::coro::syncAwait(client.read_websocket());
+  CHECK(data.net_err == asio::error::eof);
+  client.close();
+
+  coro_http_client client2{};
+  async_simple::coro::syncAwait(client2.connect("ws://127.0.0.1:9021/echo"));
+  CHECK(send(client2, "ok\xc0", opcode::text, false));
+  CHECK(send(client2, "\x80", opcode::cont, true));
+  data = async_simple::coro::syncAwait(client2.read_websocket());
+  CHECK(data.net_err == asio::error::eof);
+  client2.close();
+
+  // a control frame larger than 125 bytes between the fragments.
+  coro_http_client client4{};
+  async_simple::coro::syncAwait(client4.connect("ws://127.0.0.1:9021/echo"));
+  CHECK(send(client4, "hel", opcode::text, false));
+  CHECK(send(client4, std::string(9 * 1024, 'p'), opcode::ping, true));
+  data = async_simple::coro::syncAwait(client4.read_websocket());
+  CHECK(data.net_err == asio::error::eof);
+  CHECK(data.resp_body == "invalid control frame");
+  client4.close();
+
+  coro_http_client client3{};
+  async_simple::coro::syncAwait(client3.connect("ws://127.0.0.1:9021/stream"));
+  std::string big(1024 * 1024, 'm');
+  CHECK(send(client3, big, opcode::binary, true));
+  data = async_simple::coro::syncAwait(client3.read_websocket());
+  CHECK(data.resp_body == std::to_string(big.size()));
+  CHECK(pieces > 1);
+  CHECK(send(client3, "a", opcode::text, false));
+  CHECK(send(client3, "b", opcode::cont, false));
+  CHECK(send(client3, "c", opcode::cont, true));
+  data = async_simple::coro::syncAwait(client3.read_websocket());
+  CHECK(data.resp_body == "3");
+  // the handler refuses it.
+  CHECK(send(client3, "x", opcode::text, true));
+  data = async_simple::coro::syncAwait(client3.read_websocket());
+  CHECK(data.net_err == asio::error::eof);
+  client3.close();
+}
+
+TEST_CASE("test websocket heartbeat") {
+  cinatra::coro_http_server server(1, 9022);
+  ws_heartbeat_options options;
+  options.interval = 100ms;
+  options.timeout = 300ms;
+  options.tick = 20ms;
+  server.set_ws_heartbeat(options);
+  std::atomic<int> closed = 0;
+  server.set_http_handler<cinatra::GET>(
+      "/heartbeat",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+          if (result.type == ws_frame_type::WS_TEXT_FRAME) {
+            co_await conn->write_websocket(result.data);
+          }
+        }
+        closed++;
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  // a peer which doesn't answer the pings is closed.
+  coro_http_client silent{};
+  async_simple::coro::syncAwait(
+      silent.connect("ws://127.0.0.1:9022/heartbeat"));
+
+  // the client answers the pings it reads.
+  coro_http_client client{};
+  async_simple::coro::syncAwait(
+      client.connect("ws://127.0.0.1:9022/heartbeat"));
+  auto start = std::chrono::steady_clock::now();
+  int pings = 0;
+  while (std::chrono::steady_clock::now() - start < 800ms) {
+    auto data = async_simple::coro::syncAwait(client.read_websocket());
+    REQUIRE(!data.net_err);
+    CHECK(data.resp_body.empty());
+    pings++;
+  }
+  CHECK(pings >= 4);
+  CHECK(closed == 1);
+
+  async_simple::coro::syncAwait(client.write_websocket("alive"));
+  auto data = async_simple::coro::syncAwait(client.read_websocket());
+  while (data.resp_body.empty() && !data.net_err) {
+    data = async_simple::coro::syncAwait(client.read_websocket());
+  }
+  CHECK(data.resp_body == "alive");
+  client.close();
+  silent.close();
+}
+
+TEST_CASE("test websocket migration") {
+  ws_rebalance_options options;
+  auto moves = plan_ws_rebalance({{0, 100}, {0, 50}, {0, 30}, {1, 10}}, 2,
+                                 options);
+  REQUIRE(moves.size() == 1);
+  CHECK(moves[0].conn == 0);
+  CHECK(moves[0].to == 1);
+  CHECK(plan_ws_rebalance({{0, 100}, {1, 90}}, 2, options).empty());
+  // moving the only busy connection doesn't help.
+  CHECK(plan_ws_rebalance({{0, 1000}, {1, 0}}, 2, options).empty());
+
+  cinatra::coro_http_server server(2, 9023);
+  std::mutex mtx;
+  std::map<int, std::shared_ptr<coro_http_connection>> conns;
+  server.set_http_handler<cinatra::GET>(
+      "/migrate",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn()->shared_from_this();
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+          if (result.data.starts_with("id:")) {
+            std::lock_guard lock(mtx);
+            conns[std::stoi(std::string(result.data.substr(3)))] = conn;
+          }
+          else if (result.data == "post") {
+            conn->post_websocket("posted");
+            continue;
+          }
+          auto id = std::hash<std::thread::id>{}(std::this_thread::get_id());
+          co_await conn->write_websocket(std::string(result.data) + "@" +
+                                         std::to_string(id));
+        }
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  auto echo = [](coro_http_client &client, std::string msg) {
+    // the client masks the string it is given.
+    async_simple::coro::syncAwait(client.write_websocket(std::string(msg)));
+    auto data = async_simple::coro::syncAwait(client.read_websocket());
+    REQUIRE(data.resp_body.starts_with(msg + "@"));
+    return std::string(data.resp_body.substr(msg.size() + 1));
+  };
+
+  std::vector<std::unique_ptr<coro_http_client>> clients;
+  for (int i = 0; i < 3; i++) {
+    clients.push_back(std::make_unique<coro_http_client>());
+    async_simple::coro::syncAwait(
+        clients[i]->connect("ws://127.0.0.1:9023/migrate"));
+    echo(*clients[i], "id:" + std::to_string(i));
+  }
+
+  // the reader waits on the old thread, it is interrupted for the move.
+  auto before = echo(*clients[0], "a");
+  auto conn = conns[0];
+  auto target = server.get_io_executor(0) == conn->get_executor()
+                    ? server.get_io_executor(1)
+                    : server.get_io_executor(0);
+  REQUIRE(server.migrate(conn, target));
+  for (int i = 0; i < 100 && conn->get_executor() != target; i++) {
+    std::this_thread::sleep_for(10ms);
+  }
+  REQUIRE(conn->get_executor() == target);
+  CHECK(echo(*clients[0], "b") != before);
+  async_simple::coro::syncAwait(clients[0]->write_websocket("post"));
+  auto data = async_simple::coro::syncAwait(clients[0]->read_websocket());
+  CHECK(data.resp_body == "posted");
+
+  // two busy connections on one thread are spread by the rebalancer.
+  int a = 0, b = 1;
+  for (int i = 0; i < 3; i++) {
+    for (int j = i + 1; j < 3; j++) {
+      if (conns[i]->get_executor() == conns[j]->get_executor()) {
+        a = i;
+        b = j;
+      }
+    }
+  }
+  REQUIRE(conns[a]->get_executor() == conns[b]->get_executor());
+  ws_rebalance_options rebalance;
+  rebalance.period = 100ms;
+  rebalance.threshold = 0.1;
+  server.set_ws_rebalancer(rebalance);
+  auto start = std::chrono::steady_clock::now();
+  while (std::chrono::steady_clock::now() - start < 1s &&
+         conns[a]->get_executor() == conns[b]->get_executor()) {
+    echo(*clients[a], std::string(1000, 'x'));
+    echo(*clients[b], std::string(1000, 'y'));
+  }
+  CHECK(conns[a]->get_executor() != conns[b]->get_executor());
+  echo(*clients[a], "after");
+  echo(*clients[b], "after");
+
+  for (auto &client : clients) {
+    client->close();
+  }
+  server.stop();
+}
+
+TEST_CASE("test websocket migrate while timing out") {
+  cinatra::coro_http_server server(2, 9032);
+  std::mutex mtx;
+  std::shared_ptr<coro_http_connection> conn;
+  server.set_http_handler<cinatra::GET>(
+      "/migrate",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto self = req.get_conn()->shared_from_this();
+        {
+          std::lock_guard lock(mtx);
+          conn = self;
+        }
+        while (true) {
+          auto result = co_await self->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+        }
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  // without a timeout duration check_timeout() closes every connection, it
+  // runs on another thread while the connection is moved between the io
+  // threads.
+  for (int i = 0; i < 20; i++) {
+    coro_http_client client{};
+    async_simple::coro::syncAwait(
+        client.connect("ws://127.0.0.1:9032/migrate"));
+    std::shared_ptr<coro_http_connection> c;
+    for (int j = 0; j < 100 && !c; j++) {
+      std::this_thread::sleep_for(1ms);
+      std::lock_guard lock(mtx);
+      c = std::exchange(conn, nullptr);
+    }
+    REQUIRE(c);
+    std::thread checker([&server, i] {
+      std::this_thread::sleep_for(std::chrono::microseconds(i * 50));
+      server.check_timeout();
+    });
+    while (!c->has_closed()) {
+      auto target = server.get_io_executor(0) == c->get_executor()
+                        ? server.get_io_executor(1)
+                        : server.get_io_executor(0);
+      server.migrate(c, target);
+    }
+    checker.join();
+    auto data = async_simple::coro::syncAwait(client.read_websocket());
+    CHECK(data.net_err);
+  }
+  server.stop();
+}
+
+TEST_CASE("test websocket migrate with write coalescing") {
+  cinatra::coro_http_server server(2, 9033);
+  // the flush timer is still waiting when the connection moves.
+  server.set_write_coalescing(true, std::chrono::milliseconds(50));
+  server.set_http_handler<cinatra::GET>(
+      "/migrate",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        while (true) {
+          auto result = co_await conn->read_websocket();
+          if (result.ec || result.type == ws_frame_type::WS_CLOSE_FRAME) {
+            break;
+          }
+          auto id = std::hash<std::thread::id>{}(std::this_thread::get_id());
+          co_await conn->write_websocket(std::string(result.data) + "@" +
+                                         std::to_string(id));
+          if (result.data == "move") {
+            auto target = server.get_io_executor(0) == conn->get_executor()
+                              ? server.get_io_executor(1)
+                              : server.get_io_executor(0);
+            CHECK(server.migrate(conn->shared_from_this(), target));
+          }
+        }
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  coro_http_client client{};
+  async_simple::coro::syncAwait(client.connect("ws://127.0.0.1:9033/migrate"));
+  auto echo = [&](std::string msg) {
+    async_simple::coro::syncAwait(client.write_websocket(std::string(msg)));
+    auto data = async_simple::coro::syncAwait(client.read_websocket());
+    REQUIRE(data.resp_body.starts_with(msg + "@"));
+    return std::string(data.resp_body.substr(msg.size() + 1));
+  };
+  auto before = echo("move");
+  CHECK(echo("after") != before);
+  CHECK(echo("again") != before);
+  client.close();
+  server.stop();
+}
+
+TEST_CASE("test websocket proxy") {
+  std::mutex mtx;
+  std::vector<std::string> closes;
+  auto backend_handler = [&](std::string name) {
+    return [&, name](coro_http_request &req, coro_http_response &resp)
+               -> async_simple::coro::Lazy<void> {
+      auto conn = req.get_conn();
+      // the backend talks first, the proxy relays both ways at once.
+      co_await conn->write_websocket("hello from " + name);
+      while (true) {
+        auto result = co_await conn->read_websocket();
+        if (result.ec) {
+          break;
+        }
+        if (result.type == ws_frame_type::WS_CLOSE_FRAME) {
+          std::lock_guard lock(mtx);
+          closes.push_back(std::string(result.data));
+          break;
+        }
+        if (result.type == ws_frame_type::WS_PING_FRAME ||
+            result.type == ws_frame_type::WS_PONG_FRAME) {
+          continue;
+        }
+        auto op = result.type == ws_frame_type::WS_BINARY_FRAME
+                      ? opcode::binary
+                      : opcode::text;
+        co_await conn->write_websocket(name + ":" + std::string(result.data),
+                                       op);
+      }
+    };
+  };
+  coro_http_server backend_a(1, 9024);
+  backend_a.set_http_handler<cinatra::GET>("/ws", backend_handler("a"));
+  backend_a.async_start();
+  coro_http_server backend_b(1, 9025);
+  backend_b.set_http_handler<cinatra::GET>("/ws", backend_handler("b"));
+  backend_b.async_start();
+
+  coro_http_server proxy(1, 9026);
+  proxy.set_websocket_proxy_handler(
+      "/ws", {"ws://127.0.0.1:9024/ws", "ws://127.0.0.1:9025/ws"},
+      coro_io::load_blance_algorithm::RR);
+  proxy.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  auto read = [](coro_http_client &client) {
+    auto data = async_simple::coro::syncAwait(client.read_websocket());
+    REQUIRE(!data.net_err);
+    return std::string(data.resp_body);
+  };
+
+  std::string names;
+  std::vector<std::unique_ptr<coro_http_client>> clients;
+  for (int i = 0; i < 2; i++) {
+    clients.push_back(std::make_unique<coro_http_client>());
+    // the frames of the peer are inflated by the proxy.
+    clients[i]->set_ws_deflate(i == 1);
+    auto r = async_simple::coro::syncAwait(
+        clients[i]->connect("ws://127.0.0.1:9026/ws"));
+    REQUIRE(!r.net_err);
+    auto hello = read(*clients[i]);
+    REQUIRE(hello.starts_with("hello from "));
+    names += hello.back();
+  }
+  // round robin, a session stays with its backend.
+  CHECK((names == "ab" || names == "ba"));
+
+  for (int i = 0; i < 2; i++) {
+    auto &client = *clients[i];
+    std::string prefix = std::string(1, names[i]) + ":";
+    for (int j = 0; j < 5; j++) {
+      auto msg = "msg" + std::to_string(j);
+      async_simple::coro::syncAwait(client.write_websocket(std::string(msg)));
+      CHECK(read(client) == prefix + msg);
+    }
+
+    std::string big(300 * 1024, 'x');
+    for (size_t k = 0; k < big.size(); k++) {
+      big[k] = char(k * 7 + i);
+    }
+    async_simple::coro::syncAwait(
+        client.write_websocket(std::string(big), opcode::binary));
+    CHECK(read(client) == prefix + big);
+
+    // the backend answers the ping.
+    async_simple::coro::syncAwait(client.write_websocket("p", opcode::ping));
+    CHECK(read(client) == "p");
+  }
+
+  // the close goes to the backend, its answer back to the peer.
+  async_simple::coro::syncAwait(clients[0]->write_websocket_close("bye"));
+  auto data = async_simple::coro::syncAwait(clients[0]->read_websocket());
+  CHECK(data.net_err);
+  auto backend_closes = [&] {
+    std::lock_guard lock(mtx);
+    return closes;
+  };
+  for (int i = 0; i < 100 && backend_closes().empty(); i++) {
+    std::this_thread::sleep_for(10ms);
+  }
+  REQUIRE(backend_closes().size() == 1);
+  CHECK(backend_closes()[0] == "bye");
+
+  // the other session goes on.
+  async_simple::coro::syncAwait(clients[1]->write_websocket("still"));
+  CHECK(read(*clients[1]) == std::string(1, names[1]) + ":still");
+
+#ifdef CINATRA_ENABLE_GZIP
+  // the proxy stops inflating at the message limit and closes the session.
+  async_simple::coro::syncAwait(
+      clients[1]->write_websocket(std::string(65 * 1024 * 1024, 'a')));
+  data = async_simple::coro::syncAwait(clients[1]->read_websocket());
+  CHECK(data.net_err == asio::error::eof);
+  CHECK(data.resp_body == "message_too_big");
+#endif
+
+  for (auto &client : clients) {
+    client->close();
+  }
+  proxy.stop();
+  backend_a.stop();
+  backend_b.stop();
+}
@@ -11,6 +11,7 @@
 #include <thread>
 #include <vector>
 
+#include "async_simple/coro/Generator.h"
 #include "async_simple/coro/Lazy.h"
 #include "async_simple/coro/SyncAwait.h"
 #include "cinatra/coro_http_client.hpp"
@@ -863,8 +864,8 @@ TEST_CASE("test websocket with chunked") {
   cinatra::coro_http_server server(1, 9001);
   server.set_http_handler<cinatra::GET>(
       "/ws_source",
-      [ws_chunk_size](coro_http_request &req, coro_http_response &resp)
-          -> async_simple::coro::Lazy<void> {
+      [](coro_http_request &req,
+         coro_http_response &resp) -> async_simple::coro::Lazy<void> {
         CHECK(req.get_content_type() == content_type::websocket);
         std::string out_str;
         websocket_result result{};
@@ -882,14 +883,8 @@ TEST_CASE("test websocket with chunked") {
 
           std::cout << result.data.size() << "\n";
 
-          if (result.data.size() < ws_chunk_size) {
-            CHECK(result.data.size() == 24);
-            CHECK(result.eof);
-          }
-          else {
-            CHECK(result.data.size() == ws_chunk_size);
-            CHECK(!result.eof);
-          }
+          // the chunks are gathered into one message.
+          CHECK(result.eof);
           out_str.append(result.data);
 
           auto ec = co_await req.get_conn()->write_websocket(result.data);
@@ -1009,9 +1004,8 @@ TEST_CASE("test websocket") {
     co_await client.write_websocket("", opcode::ping);
     data = co_await client.read_websocket();
     CHECK(data.resp_body == "");
+    // an unsolicited pong is not answered.
     co_await client.write_websocket("PONG", opcode::pong);
-    data = co_await client.read_websocket();
-    CHECK(data.resp_body == "PONG");
     co_await client.write_websocket_close("normal close");
     data = co_await client.read_websocket();
     CHECK(data.resp_body == "normal close");
@@ -1294,6 +1288,406 @@ TEST_CASE("test http download server") {
   }
 }
 
+TEST_CASE("test static file sent in pipelined blocks") {
+  std::string filename = "test_pipelined_blocks.txt";
+  std::string file_content;
+  for (size_t i = 0; i < 300 * 1024 + 7; i++) {
+    file_content.push_back('a' + i % 26);
+  }
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(file_content.data(), file_content.size());
+  }
+
+  for (auto type :
+       {file_resp_format_type::range, file_resp_format_type::chunked}) {
+    cinatra::coro_http_server server(1, 9006);
+    server.set_transfer_chunked_size(1000);
+    server.set_max_transfer_chunked_size(64 * 1024);
+    server.set_file_resp_format_type(type);
+    server.set_static_res_dir("download", "");
+    server.async_start();
+
+    coro_http_client client{};
+    auto result =
+        client.get("http://127.0.0.1:9006/download/test_pipelined_blocks.txt");
+    CHECK(result.status == 200);
+    CHECK(result.resp_body == file_content);
+
+    // a part is larger than a block.
+    client.add_header("Range", "bytes=0-2999,5000-5009");
+    result =
+        client.get("http://127.0.0.1:9006/download/test_pipelined_blocks.txt");
+    CHECK(result.status == 206);
+    CHECK(result.resp_body ==
+          file_content.substr(0, 3000) + file_content.substr(5000, 10));
+  }
+  std::filesystem::remove(filename);
+}
+
+TEST_CASE("test stream request body") {
+  cinatra::coro_http_server server(1, 9006);
+  server.set_max_http_body_size(10 * 1024);
+  server.set_stream_body_route<POST, PUT>("/stream");
+  size_t max_piece = 0;
+  auto handler = [&](coro_http_request &req, coro_http_response &resp)
+      -> async_simple::coro::Lazy<void> {
+    std::string body;
+    char buf[1000];
+    while (true) {
+      auto result = co_await req.get_conn()->read_body_some(buf);
+      if (result.ec) {
+        resp.set_status_and_content(status_type::bad_request,
+                                    result.ec.message());
+        co_return;
+      }
+      max_piece = (std::max)(max_piece, result.data.size());
+      body.append(result.data);
+      if (result.eof) {
+        break;
+      }
+    }
+    resp.set_status_and_content(status_type::ok, std::move(body));
+  };
+  server.set_http_handler<POST, PUT>("/stream", handler);
+  server.set_http_handler<POST>("/buffered", handler);
+  server.set_http_handler<POST>(
+      "/unread", [](coro_http_request &req, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok, "ignored");
+      });
+  server.set_stream_body_route<POST>("/unread");
+  server.async_start();
+
+  std::string content;
+  for (size_t i = 0; i < 100 * 1024 + 5; i++) {
+    content.push_back('a' + i % 26);
+  }
+
+  coro_http_client client{};
+  std::string uri = "http://127.0.0.1:9006/stream";
+  // larger than the max body size, the body is never held by the server.
+  auto result = client.post(uri, content, req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == content);
+  CHECK(max_piece <= 1000);
+
+  result = client.post(uri, "", req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body.empty());
+
+  std::string filename = "test_stream_body.txt";
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(content.data(), content.size());
+  }
+  result = async_simple::coro::syncAwait(
+      client.async_upload_chunked(uri, http_method::PUT, filename));
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == content);
+  std::filesystem::remove(filename);
+
+#ifdef CINATRA_ENABLE_GZIP
+  std::string compressed;
+  REQUIRE(gzip_codec::compress(content, compressed));
+  result = client.post(uri, compressed, req_content_type::text,
+                       {{"Content-Encoding", "gzip"}});
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == content);
+
+  result = client.post(uri, compressed.substr(0, compressed.size() / 2),
+                       req_content_type::text, {{"Content-Encoding", "gzip"}});
+  CHECK(result.status == 400);
+#endif
+
+  // a small body left unread by the handler is discarded, the connection
+  // is reused.
+  result = client.post("http://127.0.0.1:9006/unread", content.substr(0, 5000),
+                       req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == "ignored");
+  result = client.post(uri, "next", req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == "next");
+
+  coro_http_client client1{};
+  result = client1.post("http://127.0.0.1:9006/buffered", content,
+                        req_content_type::text);
+  CHECK(result.status != 200);
+  coro_http_client client2{};
+  result = client2.post("http://127.0.0.1:9006/buffered", "hello",
+                        req_content_type::text);
+  CHECK(result.status == 400);
+  CHECK(result.resp_body == "Invalid argument");
+}
+
+TEST_CASE("test spool request body") {
+  std::string spool_dir = "spool_test_dir";
+  std::filesystem::create_directories(spool_dir);
+  auto read_spooled = [](const spool_result &result) {
+    if (result.in_memory) {
+      return result.data;
+    }
+    std::string content(result.size, '\0');
+    std::ifstream in(result.path, std::ios::binary);
+    in.read(content.data(), content.size());
+    std::filesystem::remove(result.path);
+    return content;
+  };
+
+  cinatra::coro_http_server server(1, 9006);
+  server.set_spool_dir(spool_dir);
+  server.set_spool_memory_threshold(1000);
+  server.set_stream_body_route<POST, PUT>("/spool");
+  std::vector<bool> in_memory;
+  server.set_http_handler<POST, PUT>(
+      "/spool",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto result = co_await req.get_conn()->spool_body();
+        if (result.ec) {
+          resp.set_status_and_content(status_type::bad_request,
+                                      result.ec.message());
+          co_return;
+        }
+        in_memory.push_back(result.in_memory);
+        resp.set_status_and_content(status_type::ok, read_spooled(result));
+      });
+  server.set_http_handler<POST>(
+      "/multipart",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto boundary = req.get_boundary();
+        multipart_reader_t multipart(req.get_conn());
+        std::string body;
+        while (true) {
+          auto part_head = co_await multipart.read_part_head(boundary);
+          if (part_head.ec) {
+            co_return;
+          }
+          auto part = co_await multipart.spool_part_body(boundary);
+          if (part.ec) {
+            co_return;
+          }
+          in_memory.push_back(part.in_memory);
+          body.append(part_head.name).append(":").append(read_spooled(part));
+          if (part.eof) {
+            break;
+          }
+        }
+        resp.set_status_and_content(status_type::ok, std::move(body));
+      });
+  server.async_start();
+
+  std::string content;
+  for (size_t i = 0; i < 100 * 1024 + 5; i++) {
+    content.push_back('a' + i % 26);
+  }
+
+  coro_http_client client{};
+  std::string uri = "http://127.0.0.1:9006/spool";
+  auto result = client.post(uri, content, req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == content);
+
+  // spliced to the file in more than one slice.
+  std::string large;
+  for (size_t i = 0; i < 9 * 1024 * 1024 + 7; i++) {
+    large.push_back('A' + i % 23);
+  }
+  result = client.post(uri, large, req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == large);
+
+  result = client.post(uri, "hello", req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == "hello");
+
+  std::string filename = "test_spool_body.txt";
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(content.data(), content.size());
+  }
+  result = async_simple::coro::syncAwait(
+      client.async_upload_chunked(uri, http_method::PUT, filename));
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == content);
+  CHECK(in_memory == std::vector<bool>{false, false, true, false});
+
+  in_memory.clear();
+  coro_http_client client1{};
+  client1.add_str_part("small", "world");
+  client1.add_file_part("large", filename);
+  result = async_simple::coro::syncAwait(
+      client1.async_upload_multipart("http://127.0.0.1:9006/multipart"));
+  CHECK(result.status == 200);
+  // the parts are sent in the order of their names.
+  CHECK(result.resp_body == "large:" + content + "small:world");
+  CHECK(in_memory == std::vector<bool>{false, true});
+
+  std::filesystem::remove(filename);
+  CHECK(std::filesystem::is_empty(spool_dir));
+  std::filesystem::remove_all(spool_dir);
+}
+
+TEST_CASE("test static file sent from a shared mapping") {
+  std::string filename = "test_mmap_static.txt";
+  std::string file_content;
+  for (size_t i = 0; i < 100 * 1024 + 3; i++) {
+    file_content.push_back('a' + i % 26);
+  }
+  {
+    std::ofstream out(filename, std::ios::binary);
+    out.write(file_content.data(), file_content.size());
+  }
+
+  for (auto type :
+       {file_resp_format_type::range, file_resp_format_type::chunked}) {
+    cinatra::coro_http_server server(1, 9006);
+    server.set_transfer_chunked_size(1000);
+    server.set_max_transfer_chunked_size(16 * 1024);
+    server.set_mmap_file_threshold(1);
+    server.set_file_resp_format_type(type);
+    server.set_static_res_dir("download", "");
+    server.set_http_handler<GET>(
+        "/view", [&](coro_http_request &req, coro_http_response &resp) {
+          resp.set_status_and_file_view(
+              status_type::ok, coro_io::get_mmap_file(filename),
+              content_encoding::gzip, req.get_header_value("Accept-Encoding"));
+        });
+    server.async_start();
+
+    coro_http_client client{};
+    auto result =
+        client.get("http://127.0.0.1:9006/download/test_mmap_static.txt");
+    CHECK(result.status == 200);
+    CHECK(result.resp_body == file_content);
+
+    client.add_header("Range", "bytes=0-2999,5000-5009");
+    result = client.get("http://127.0.0.1:9006/download/test_mmap_static.txt");
+    CHECK(result.status == 206);
+    CHECK(result.resp_body ==
+          file_content.substr(0, 3000) + file_content.substr(5000, 10));
+
+    coro_http_client client1{};
+#ifdef CINATRA_ENABLE_GZIP
+    client1.add_header("Accept-Encoding", "gzip");
+#endif
+    result = client1.get("http://127.0.0.1:9006/view");
+    CHECK(result.status == 200);
+    CHECK(result.resp_body == file_content);
+  }
+  std::filesystem::remove(filename);
+}
+
+TEST_CASE("test static dir resolved per request") {
+  std::error_code ec;
+  fs::remove_all("lazy_static", ec);
+  fs::create_directories("lazy_static/sub");
+  auto write_file = [](const std::string &name, std::string_view content) {
+    std::ofstream out(name, std::ios::binary);
+    out.write(content.data(), content.size());
+  };
+  write_file("lazy_static/sub/a.txt", "hello");
+
+  cinatra::coro_http_server server(1, 9006);
+  server.set_static_res_dir("assets", "lazy_static");
+  server.set_static_file_meta_cache(2, 0s);
+  server.set_http_handler<GET>(
+      "/assets/sub/b.txt", [](coro_http_request &, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok, "exact route");
+      });
+  server.async_start();
+
+  coro_http_client client{};
+  std::string base = "http://127.0.0.1:9006/assets/";
+  auto result = client.get(base + "sub/a.txt");
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == "hello");
+
+  // an exact route wins over the static dir.
+  result = client.get(base + "sub/b.txt");
+  CHECK(result.resp_body == "exact route");
+
+  // added after the server started.
+  write_file("lazy_static/c.txt", "new file");
+  result = client.get(base + "c.txt");
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == "new file");
+
+  // changed and removed files are noticed.
+  write_file("lazy_static/c.txt", "changed file");
+  result = client.get(base + "c.txt");
+  CHECK(result.resp_body == "changed file");
+  fs::remove("lazy_static/c.txt");
+  result = client.get(base + "c.txt");
+  CHECK(result.status == 404);
+
+  result = client.get(base + "sub");
+  CHECK(result.status == 404);
+  result = client.get(base + "sub/%2e%2e/%2e%2e/CMakeCache.txt");
+  CHECK(result.status == 404);
+  result = client.get(base + "sub/..%2f..%2fCMakeCache.txt");
+  CHECK(result.status == 404);
+  result = client.get(base + ".//sub/./a.txt");
+  CHECK(result.status == 200);
+
+#ifdef __linux__
+  // a symlink which leaves the root is not followed.
+  write_file("lazy_static_outside.txt", "outside");
+  fs::create_symlink(fs::absolute("lazy_static_outside.txt"),
+                     "lazy_static/escape.txt");
+  fs::create_symlink("sub/a.txt", "lazy_static/inside.txt");
+  result = client.get(base + "escape.txt");
+  CHECK(result.status == 404);
+  result = client.get(base + "inside.txt");
+  CHECK(result.resp_body == "hello");
+  fs::remove("lazy_static_outside.txt");
+#endif
+
+  server.stop();
+
+  // the "/" prefix only looks up the names at the top of its roots.
+  static_root_names names(1h);
+  std::vector<std::string> roots{"lazy_static"};
+  CHECK(names.contains("sub", roots));
+  CHECK(!names.contains("other", roots));
+  write_file("lazy_static/other", "");
+  CHECK(!names.contains("other", roots));
+  fs::remove_all("lazy_static", ec);
+}
+
+TEST_CASE("test file meta cache") {
+  std::vector<std::string> names{"meta_cache_0.txt", "meta_cache_1.txt",
+                                 "meta_cache_2.txt"};
+  for (auto &name : names) {
+    std::ofstream out(name, std::ios::binary);
+    out << name;
+  }
+
+  file_meta_cache cache(2, 1h);
+  for (auto &name : names) {
+    auto meta = cache.get(name);
+    REQUIRE(meta != nullptr);
+    CHECK(meta->size == name.size());
+    CHECK(meta->fd != nullptr);
+    CHECK(meta->mime == "text/plain");
+  }
+  CHECK(cache.size() == 2);
+  CHECK(cache.get("meta_cache_not_exist.txt") == nullptr);
+  CHECK(cache.size() == 2);
+
+  // valid for an hour, the removed file is still served from the cache.
+  fs::remove(names[2]);
+  CHECK(cache.get(names[2]) != nullptr);
+
+  file_meta_cache no_valid_cache(2, 0s);
+  CHECK(no_valid_cache.get(names[1]) != nullptr);
+  fs::remove(names[1]);
+  CHECK(no_valid_cache.get(names[1]) == nullptr);
+  CHECK(no_valid_cache.size() == 0);
+  fs::remove(names[0]);
+}
+
 TEST_CASE("test restful api") {
   cinatra::coro_http_server server(1, 9001);
 
@@ -1709,6 +2103,158 @@ TEST_CASE("test reverse proxy download") {
   CHECK(result.resp_body == "hello world multipart");
 }
 
+TEST_CASE("test reverse proxy streaming") {
+  std::string big(3 * 1024 * 1024 + 7, '\0');
+  for (size_t i = 0; i < big.size(); i++) {
+    big[i] = char('a' + i % 26);
+  }
+
+  cinatra::coro_http_server server(1, 9027);
+  server.set_http_handler<GET, HEAD>(
+      "/big", [&](coro_http_request &req, coro_http_response &resp) {
+        resp.set_status_and_content_view(status_type::ok,
+                                         std::string_view(big));
+      });
+  server.set_http_handler<GET>(
+      "/big_chunked",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        resp.set_format_type(format_type::chunked);
+        if (!co_await resp.get_conn()->begin_chunked()) {
+          co_return;
+        }
+        std::string_view view = big;
+        for (size_t pos = 0; pos < view.size(); pos += 100 * 1024) {
+          if (!co_await resp.get_conn()->write_chunked(
+                  view.substr(pos, 100 * 1024))) {
+            co_return;
+          }
+        }
+        co_await resp.get_conn()->end_chunked();
+      });
+  server.set_http_handler<GET>(
+      "/connection", [](coro_http_request &req, coro_http_response &resp) {
+        resp.set_status_and_content(
+            status_type::ok, std::string(req.get_header_value("Connection")));
+      });
+  server.set_http_handler<GET>(
+      "/created", [](coro_http_request &req, coro_http_response &resp) {
+        resp.add_header("X-Upstream", "yes");
+        resp.set_status_and_content(status_type::created, "made");
+      });
+  // the upstream tells the size and the framing of the body it got.
+  server.set_stream_body_route<POST>("/upload");
+  server.set_http_handler<POST>(
+      "/upload",
+      [](coro_http_request &req,
+         coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        size_t size = 0;
+        uint64_t sum = 0;
+        char buf[4096];
+        while (true) {
+          auto result = co_await req.get_conn()->read_body_some(buf);
+          if (result.ec) {
+            co_return;
+          }
+          for (char c : result.data) {
+            sum += (unsigned char)c;
+          }
+          size += result.data.size();
+          if (result.eof) {
+            break;
+          }
+        }
+        resp.set_status_and_content(
+            status_type::ok, std::string(req.is_chunked() ? "chunked " : "")
+                                 .append(std::to_string(size))
+                                 .append(" ")
+                                 .append(std::to_string(sum)));
+      });
+  server.async_start();
+
+  coro_http_server proxy(2, 9028);
+  proxy.set_http_proxy_handler<GET, POST, HEAD>(
+      "/([^]+)", {"127.0.0.1:9027"}, coro_io::load_blance_algorithm::RR);
+  proxy.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  uint64_t big_sum = 0;
+  for (char c : big) {
+    big_sum += (unsigned char)c;
+  }
+
+  coro_http_client client{};
+  for (int i = 0; i < 2; i++) {
+    auto result = client.get("http://127.0.0.1:9028/big");
+    CHECK(result.status == 200);
+    bool same = result.resp_body == big;
+    CHECK(same);
+
+    result = client.get("http://127.0.0.1:9028/big_chunked");
+    CHECK(result.status == 200);
+    same = result.resp_body == big;
+    CHECK(same);
+  }
+
+  // the upstream connection is kept as the client asks.
+  auto result = client.get("http://127.0.0.1:9028/connection");
+  CHECK(result.resp_body == "keep-alive");
+  coro_http_client close_client{};
+  close_client.add_header("Connection", "close");
+  result = close_client.get("http://127.0.0.1:9028/connection");
+  CHECK(result.resp_body == "close");
+
+  result = client.get("http://127.0.0.1:9028/created");
+  CHECK(result.status == 201);
+  CHECK(result.resp_body == "made");
+  bool has_upstream_header = false;
+  for (auto &[name, value] : result.resp_headers) {
+    has_upstream_header |= name == "X-Upstream" && value == "yes";
+  }
+  CHECK(has_upstream_header);
+
+  result = async_simple::coro::syncAwait(
+      client.async_head("http://127.0.0.1:9028/big"));
+  CHECK(result.status == 200);
+  CHECK(result.resp_body.empty());
+
+  result = client.post("http://127.0.0.1:9028/upload", big,
+                       req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body ==
+        std::to_string(big.size()) + " " + std::to_string(big_sum));
+
+  // spliced to the upstream in more than one slice.
+  std::string large = big + big + big;
+  result = client.post("http://127.0.0.1:9028/upload", large,
+                       req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body ==
+        std::to_string(large.size()) + " " + std::to_string(big_sum * 3));
+
+  std::string filename = "test_proxy_upload.txt";
+  {
+    std::ofstream file(filename, std::ios::binary);
+    file << big;
+  }
+  std::string uri = "http://127.0.0.1:9028/upload";
+  result = async_simple::coro::syncAwait(
+      client.async_upload_chunked(uri, http_method::POST, filename));
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == "chunked " + std::to_string(big.size()) + " " +
+                                std::to_string(big_sum));
+  std::filesystem::remove(filename);
+
+  // no upstream to connect to.
+  coro_http_server bad_proxy(1, 9029);
+  bad_proxy.set_http_proxy_handler<GET>("/big", {"127.0.0.1:9030"});
+  bad_proxy.async_start();
+  std::this_thread::sleep_for(200ms);
+  coro_http_client client2{};
+  result = client2.get("http://127.0.0.1:9029/big");
+  CHECK(result.status == 502);
+}
+
 TEST_CASE("test reverse proxy websocket") {
   {
     coro_http_server proxy_server(1, 9005);
@@ -1753,3 +2299,600 @@ TEST_CASE("test reverse proxy websocket") {
     CHECK(data.resp_body == "test websocket");
   }
 }
+
+struct auth_check_t {
+  bool before(coro_http_request &req, coro_http_response &resp) {
+    calls++;
+    if (req.get_header_value("Token") != "ok") {
+      resp.set_status_and_content(status_type::unauthorized, "no token");
+      return false;
+    }
+    return true;
+  }
+  int &calls;
+};
+
+TEST_CASE("test expect 100-continue") {
+  int before_calls = 0;
+  coro_http_server server(1, 9010);
+  server.set_http_handler<cinatra::POST>(
+      "/upload",
+      [](coro_http_request &req, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok,
+                                    std::string(req.get_body()));
+      },
+      auth_check_t{before_calls});
+  server.set_http_handler<cinatra::POST>(
+      "/small", [](coro_http_request &, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok, "ok");
+      });
+  server.set_max_http_body_size<cinatra::POST>("/small", 10);
+  server.set_http_handler<cinatra::POST>(
+      "/item/:id", [](coro_http_request &, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok, "item");
+      });
+  server.set_max_http_body_size<cinatra::POST>("/item/:id", 10);
+  server.set_http_handler<cinatra::POST>(
+      "/user/:id",
+      [](coro_http_request &, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok, "user");
+      },
+      auth_check_t{before_calls});
+  server.set_admission_check([](coro_http_request &req,
+                                coro_http_response &) {
+    return req.get_header_value("Deny").empty();
+  });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  asio::io_context ctx;
+  auto request = [&](std::string head, std::string_view body,
+                     bool wait_continue) {
+    asio::ip::tcp::socket socket(ctx);
+    socket.connect(asio::ip::tcp::endpoint(
+        asio::ip::address::from_string("127.0.0.1"), 9010));
+    head.append("Content-Length: ")
+        .append(std::to_string(body.size()))
+        .append("\r\n\r\n");
+    asio::write(socket, asio::buffer(head));
+
+    std::string resp;
+    std::error_code ec;
+    if (wait_continue) {
+      asio::read_until(socket, asio::dynamic_buffer(resp), "\r\n\r\n", ec);
+      if (!resp.starts_with("HTTP/1.1 100 Continue\r\n\r\n")) {
+        return resp;
+      }
+      resp.clear();
+    }
+    asio::write(socket, asio::buffer(body), ec);
+    asio::read_until(socket, asio::dynamic_buffer(resp), "\r\n\r\n", ec);
+    auto pos = resp.find("Content-Length: ");
+    if (pos != std::string::npos) {
+      size_t len = std::stoul(resp.substr(pos + 16));
+      size_t total = resp.find("\r\n\r\n") + 4 + len;
+      if (resp.size() < total) {
+        std::string more(total - resp.size(), '\0');
+        asio::read(socket, asio::buffer(more), ec);
+        resp.append(more);
+      }
+    }
+    return resp;
+  };
+
+  // rejected from the head, the body is never asked for.
+  auto resp = request(
+      "POST /upload HTTP/1.1\r\nHost: 127.0.0.1\r\nExpect: 100-continue\r\n",
+      "hello", true);
+  CHECK(resp.starts_with("HTTP/1.1 401"));
+  CHECK(resp.ends_with("no token"));
+  CHECK(before_calls == 1);
+
+  resp = request(
+      "POST /upload HTTP/1.1\r\nHost: 127.0.0.1\r\nExpect: "
+      "100-continue\r\nToken: ok\r\n",
+      "hello", true);
+  CHECK(resp.starts_with("HTTP/1.1 200"));
+  CHECK(resp.ends_with("hello"));
+  // the before aspect is not run again for the handler.
+  CHECK(before_calls == 2);
+
+  // without Expect the aspects run as before.
+  resp = request("POST /upload HTTP/1.1\r\nHost: 127.0.0.1\r\nToken: ok\r\n",
+                 "hello", false);
+  CHECK(resp.starts_with("HTTP/1.1 200"));
+  CHECK(resp.ends_with("hello"));
+  CHECK(before_calls == 3);
+
+  resp = request(
+      "POST /small HTTP/1.1\r\nHost: 127.0.0.1\r\nExpect: 100-continue\r\n",
+      std::string(100, 'a'), true);
+  CHECK(resp.starts_with("HTTP/1.1 413"));
+
+  resp = request(
+      "POST /small HTTP/1.1\r\nHost: 127.0.0.1\r\nExpect: 100-continue\r\n",
+      "hello", true);
+  CHECK(resp.starts_with("HTTP/1.1 200"));
+
+  resp = request(
+      "POST /small HTTP/1.1\r\nHost: 127.0.0.1\r\nExpect: "
+      "100-continue\r\nDeny: 1\r\n",
+      "hello", true);
+  CHECK(resp.starts_with("HTTP/1.1 403"));
+
+  // the max body size of a route with :params.
+  resp = request("POST /item/1 HTTP/1.1\r\nHost: 127.0.0.1\r\n",
+                 std::string(100, 'a'), false);
+  CHECK(resp.starts_with("HTTP/1.1 413"));
+  resp = request("POST /item/1 HTTP/1.1\r\nHost: 127.0.0.1\r\n", "hello",
+                 false);
+  CHECK(resp.starts_with("HTTP/1.1 200"));
+
+  // a route with :params runs its aspects with the handler, Expect doesn't
+  // skip them.
+  resp = request(
+      "POST /user/1 HTTP/1.1\r\nHost: 127.0.0.1\r\nExpect: 100-continue\r\n",
+      "hello", true);
+  CHECK(resp.starts_with("HTTP/1.1 401"));
+  CHECK(resp.ends_with("no token"));
+  CHECK(before_calls == 4);
+
+  // no 100 Continue for an HTTP/1.0 client.
+  resp = request(
+      "POST /upload HTTP/1.0\r\nHost: 127.0.0.1\r\nExpect: "
+      "100-continue\r\nToken: ok\r\n",
+      "hello", false);
+  CHECK(resp.starts_with("HTTP/1.1 200"));
+  CHECK(resp.ends_with("hello"));
+}
+
+async_simple::coro::Generator<std::string_view> number_pieces(int n) {
+  for (int i = 0; i < n; i++) {
+    co_yield i % 2 ? "1" : "0";
+  }
+}
+
+TEST_CASE("test body stream response") {
+  coro_http_server server(1, 9011);
+  std::string expected;
+  for (int i = 0; i < 2000; i++) {
+    expected.append(std::to_string(i)).append(",");
+  }
+
+  auto make_stream = [](bool slow) {
+    auto i = std::make_shared<int>(0);
+    return [i, slow]() -> async_simple::coro::Lazy<body_piece_t> {
+      body_piece_t piece{};
+      if (*i == 2000) {
+        piece.eof = true;
+        co_return piece;
+      }
+      // now and then the producer has to wait.
+      if (slow && *i % 500 == 0) {
+        co_await coro_io::sleep_for(5ms);
+      }
+      piece.data = std::to_string((*i)++).append(",");
+      co_return piece;
+    };
+  };
+
+  server.set_http_handler<cinatra::GET>(
+      "/chunked", [&](coro_http_request &, coro_http_response &resp) {
+        resp.set_body_stream(make_stream(true));
+      });
+  server.set_http_handler<cinatra::GET>(
+      "/sized", [&](coro_http_request &, coro_http_response &resp) {
+        resp.set_body_stream(make_stream(false), expected.size());
+      });
+  server.set_http_handler<cinatra::GET>(
+      "/wrong_size", [&](coro_http_request &, coro_http_response &resp) {
+        resp.set_body_stream(make_stream(false), 10);
+      });
+  server.set_http_handler<cinatra::GET>(
+      "/generator",
+      [](coro_http_request &req,
+         coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto gen = number_pieces(100000);
+        co_await req.get_conn()->write_stream_range(gen);
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  coro_http_client client{};
+  auto result = client.get("http://127.0.0.1:9011/chunked");
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == expected);
+
+  result = client.get("http://127.0.0.1:9011/sized");
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == expected);
+  for (auto &[k, v] : result.resp_headers) {
+    CHECK(k != "Transfer-Encoding");
+  }
+
+  // the connection is still usable.
+  result = client.get("http://127.0.0.1:9011/generator");
+  CHECK(result.status == 200);
+  CHECK(result.resp_body.size() == 100000);
+  CHECK(result.resp_body.substr(0, 4) == "0101");
+
+  coro_http_client client1{};
+  result = client1.get("http://127.0.0.1:9011/wrong_size");
+  CHECK(result.resp_body != expected);
+}
+
+TEST_CASE("test body stream cancelled by a failed write") {
+  coro_http_server server(1, 9031);
+  auto cancelled = std::make_shared<std::atomic<bool>>(false);
+  std::promise<void> done;
+  server.set_http_handler<cinatra::GET>(
+      "/events", [&](coro_http_request &, coro_http_response &resp) {
+        auto i = std::make_shared<int>(0);
+        resp.set_body_stream(
+            [i, cancelled, &done]() -> async_simple::coro::Lazy<body_piece_t> {
+              body_piece_t piece{};
+              int n = (*i)++;
+              if (n == 1) {
+                // the peer is gone when this piece is written.
+                co_await coro_io::sleep_for(300ms);
+              }
+              else if (n == 2) {
+                // waits for an event which never comes.
+                for (int t = 0; t < 100 && !*cancelled; t++) {
+                  co_await coro_io::sleep_for(50ms);
+                }
+                piece.eof = true;
+                done.set_value();
+                co_return piece;
+              }
+              piece.data = "event\n";
+              co_return piece;
+            },
+            -1, [cancelled] {
+              *cancelled = true;
+            });
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  asio::io_context ctx;
+  asio::ip::tcp::socket socket(ctx);
+  socket.connect(asio::ip::tcp::endpoint(
+      asio::ip::address::from_string("127.0.0.1"), 9031));
+  std::string_view head = "GET /events HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+  asio::write(socket, asio::buffer(head));
+  socket.close();
+
+  done.get_future().wait();
+  CHECK(*cancelled);
+  server.stop();
+}
+
+TEST_CASE("test write coalescing") {
+  coro_http_server server(1, 9012);
+  server.set_write_coalescing(true, 200us);
+  std::promise<write_stats> stats_promise;
+  server.set_http_handler<cinatra::GET>(
+      "/events",
+      [&](coro_http_request &req,
+          coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        resp.set_format_type(format_type::chunked);
+        if (!co_await conn->begin_chunked()) {
+          co_return;
+        }
+        for (int i = 0; i < 1000; i++) {
+          if (!co_await conn->write_chunked("event " + std::to_string(i) +
+                                            "\n")) {
+            co_return;
+          }
+        }
+        co_await conn->end_chunked();
+        co_await conn->flush();
+        stats_promise.set_value(conn->get_write_stats());
+      });
+  server.set_http_handler<cinatra::GET>(
+      "/ws",
+      [](coro_http_request &req,
+         coro_http_response &resp) -> async_simple::coro::Lazy<void> {
+        auto conn = req.get_conn();
+        auto result = co_await conn->read_websocket();
+        if (result.ec) {
+          co_return;
+        }
+        for (int i = 0; i < 100; i++) {
+          co_await conn->write_websocket(std::to_string(i));
+        }
+        // the close frame answered here is written after the buffered frames.
+        while (!(co_await conn->read_websocket()).ec) {
+        }
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  std::string expected;
+  for (int i = 0; i < 1000; i++) {
+    expected.append("event ").append(std::to_string(i)).append("\n");
+  }
+  coro_http_client client{};
+  auto result = client.get("http://127.0.0.1:9012/events");
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == expected);
+  auto stats = stats_promise.get_future().get();
+  CHECK(stats.coalesced == 1001);
+  CHECK(stats.write_calls < 10);
+  CHECK(stats.bytes > expected.size());
+
+  coro_http_client ws_client{};
+  async_simple::coro::syncAwait(ws_client.connect("ws://127.0.0.1:9012/ws"));
+  async_simple::coro::syncAwait(ws_client.write_websocket("start"));
+  async_simple::coro::syncAwait(ws_client.write_websocket_close("bye"));
+  for (int i = 0; i < 100; i++) {
+    auto data = async_simple::coro::syncAwait(ws_client.read_websocket());
+    CHECK(data.resp_body == std::to_string(i));
+  }
+  auto data = async_simple::coro::syncAwait(ws_client.read_websocket());
+  CHECK(data.net_err == asio::error::eof);
+  CHECK(data.resp_body == "bye");
+}
+
+TEST_CASE("test idle buffer release") {
+  void *p = detail::buffer_slab::allocate(1000);
+  detail::buffer_slab::deallocate(p, 1000);
+  // the block of 1024 bytes is reused.
+  void *p1 = detail::buffer_slab::allocate(900);
+  CHECK(p1 == p);
+  detail::buffer_slab::deallocate(p1, 900);
+  CHECK(detail::buffer_slab::cached_bytes() >= 1024);
+
+  coro_http_server server(1, 9013);
+  server.set_release_idle_buffers(true);
+  server.set_http_handler<cinatra::POST>(
+      "/echo", [](coro_http_request &req, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok,
+                                    std::string(req.get_body()));
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  coro_http_client client{};
+  std::string body(100 * 1024, 'a');
+  for (int i = 0; i < 3; i++) {
+    auto result = client.post("http://127.0.0.1:9013/echo", body,
+                              req_content_type::text);
+    CHECK(result.status == 200);
+    CHECK(result.resp_body == body);
+  }
+
+  // the idle connection holds no more than its empty read buffers.
+  std::this_thread::sleep_for(50ms);
+  CHECK(buffer_usage::used() < 4096);
+
+  // a connection in the middle of its head holds a read buffer.
+  asio::io_context ctx;
+  asio::ip::tcp::socket pending(ctx);
+  pending.connect(asio::ip::tcp::endpoint(
+      asio::ip::address::from_string("127.0.0.1"), 9013));
+  asio::write(pending, asio::buffer(std::string_view(
+                           "POST /echo HTTP/1.1\r\nHost: 127.0.0.1\r\n")));
+  std::this_thread::sleep_for(50ms);
+  CHECK(buffer_usage::used() > 0);
+
+  // over the budget, a new request is answered with 503. the accept in
+  // progress completes, after it new connections wait in the listen backlog.
+  server.set_buffer_memory_budget(1);
+  constexpr std::string_view request =
+      "POST /echo HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Length: "
+      "5\r\n\r\nhello";
+  asio::ip::tcp::socket accepted(ctx);
+  accepted.connect(asio::ip::tcp::endpoint(
+      asio::ip::address::from_string("127.0.0.1"), 9013));
+  asio::write(accepted, asio::buffer(request));
+  std::string resp;
+  std::error_code ec;
+  asio::read_until(accepted, asio::dynamic_buffer(resp), "\r\n\r\n", ec);
+  CHECK(resp.starts_with("HTTP/1.1 503"));
+
+  asio::ip::tcp::socket paused(ctx);
+  paused.connect(asio::ip::tcp::endpoint(
+      asio::ip::address::from_string("127.0.0.1"), 9013));
+  asio::write(paused, asio::buffer(request));
+  std::this_thread::sleep_for(50ms);
+  CHECK(paused.available() == 0);
+
+  resp.clear();
+  auto result = client.post("http://127.0.0.1:9013/echo", "hello",
+                            req_content_type::text);
+  CHECK(result.status == 503);
+
+  asio::write(pending, asio::buffer(std::string_view(
+                           "Content-Length: 5\r\n\r\nhello")));
+  asio::read_until(pending, asio::dynamic_buffer(resp), "\r\n\r\n", ec);
+  CHECK(resp.starts_with("HTTP/1.1 503"));
+  server.set_buffer_memory_budget((std::numeric_limits<size_t>::max)());
+
+  // under the budget again, the waiting connection is accepted and served.
+  resp.clear();
+  asio::read_until(paused, asio::dynamic_buffer(resp), "\r\n\r\n", ec);
+  CHECK(resp.starts_with("HTTP/1.1 200"));
+
+  coro_http_client client1{};
+  result = client1.post("http://127.0.0.1:9013/echo", "hello",
+                        req_content_type::text);
+  CHECK(result.status == 200);
+  CHECK(result.resp_body == "hello");
+}
+
+TEST_CASE("test connection footprint") {
+  // the connection count is bound by memory, keep the idle state small. the
+  // sizes measured with libstdc++ on x86-64, and what the options add.
+#if defined(__GLIBCXX__) && defined(__x86_64__)
+  size_t conn_size = 2328;
+#ifdef CINATRA_ENABLE_GZIP
+  conn_size += 104;
+#endif
+#ifdef CINATRA_ENABLE_SSL
+  conn_size += 24;
+#endif
+#ifdef INJECT_FOR_HTTP_SEVER_TEST
+  conn_size += 8;
+#endif
+  CHECK(sizeof(coro_http_connection) <= conn_size);
+  CHECK(sizeof(http_parser) <= 680);
+#else
+  CHECK(sizeof(coro_http_connection) <= 2560);
+  CHECK(sizeof(http_parser) <= 1024);
+#endif
+
+  coro_http_server server(1, 9014);
+  server.set_release_idle_buffers(true);
+  server.set_http_handler<cinatra::GET>(
+      "/", [](coro_http_request &, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok, "ok");
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  constexpr size_t count = 500;
+  asio::io_context ctx;
+  std::vector<asio::ip::tcp::socket> sockets;
+  sockets.reserve(count);
+  std::string_view req = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+  for (size_t i = 0; i < count; i++) {
+    auto &socket = sockets.emplace_back(ctx);
+    std::error_code ec;
+    socket.connect(asio::ip::tcp::endpoint(
+                       asio::ip::address::from_string("127.0.0.1"), 9014),
+                   ec);
+    if (ec) {
+      break;
+    }
+    asio::write(socket, asio::buffer(req), ec);
+    std::string resp;
+    asio::read_until(socket, asio::dynamic_buffer(resp), "ok", ec);
+  }
+  std::this_thread::sleep_for(50ms);
+  CHECK(server.connection_count() == count);
+  // the idle connections hold no more than their empty read buffers.
+  CHECK(buffer_usage::used() < count * 1024);
+}
+
+TEST_CASE("test request arena") {
+  request_arena arena(64);
+  auto str = arena.copy("hello arena");
+  CHECK(str == "hello arena");
+  // more than one block, the next request gets them in one.
+  CHECK(arena.allocate(200, 8) != nullptr);
+  CHECK(arena.upstream_allocations() == 2);
+  arena.reset();
+  CHECK(arena.capacity() == 0);
+  CHECK(arena.allocate(200, 8) != nullptr);
+  arena.copy("hello");
+  CHECK(arena.upstream_allocations() == 3);
+  arena.reset();
+  CHECK(arena.allocate(200, 8) != nullptr);
+  CHECK(arena.upstream_allocations() == 3);
+
+  coro_http_server server(1, 9015);
+  std::vector<size_t> allocations;
+  server.set_http_handler<cinatra::GET>(
+      "/arena", [&](coro_http_request &req, coro_http_response &resp) {
+        std::pmr::string value(req.get_allocator());
+        value.append("a value which is too long for sso ")
+            .append(std::string(req.get_query_value("n")));
+        resp.add_header("X-Copied", value);
+        resp.add_header_view("X-View", value);
+        std::pmr::vector<int> numbers(resp.get_allocator());
+        numbers.resize(100);
+        resp.set_status_and_content(status_type::ok, "ok");
+        allocations.push_back(resp.get_arena().upstream_allocations());
+      });
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  coro_http_client client{};
+  for (int i = 0; i < 5; i++) {
+    auto result =
+        client.get("http://127.0.0.1:9015/arena?n=" + std::to_string(i));
+    CHECK(result.status == 200);
+    std::string expected =
+        "a value which is too long for sso " + std::to_string(i);
+    CHECK(result.resp_headers.size() > 0);
+    bool found = false;
+    for (auto &[k, v] : result.resp_headers) {
+      if (k == "X-Copied" || k == "X-View") {
+        CHECK(v == expected);
+        found = true;
+      }
+    }
+    CHECK(found);
+  }
+
+  // the arena is reused, only the first requests take memory from the heap.
+  REQUIRE(allocations.size() == 5);
+  CHECK(allocations[4] == allocations[2]);
+}
+
+TEST_CASE("test alloc profiler") {
+  CHECK(alloc_phase_name(alloc_phase::build_response) == "build_response");
+  if (!alloc_profiler::enabled()) {
+    CHECK(alloc_profiler::to_string().find("not enabled") !=
+          std::string::npos);
+    return;
+  }
+
+  {
+    alloc_counter counter;
+    auto ptr = std::make_unique<int>(1);
+    CHECK(counter.allocs() == 1);
+    CHECK(counter.bytes() == sizeof(int));
+  }
+
+  coro_http_server server(1, 9016);
+  server.set_http_handler<cinatra::GET>(
+      "/alloc", [](coro_http_request &req, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok, std::string(1000, 'a'));
+      });
+  server.set_http_handler<cinatra::GET>(
+      "/item/:id", [](coro_http_request &req, coro_http_response &resp) {
+        resp.set_status_and_content(status_type::ok, std::string(1000, 'b'));
+      });
+  server.set_alloc_profile_handler();
+  server.async_start();
+  std::this_thread::sleep_for(200ms);
+
+  coro_http_client client{};
+  for (int i = 0; i < 3; i++) {
+    CHECK(client.get("http://127.0.0.1:9016/alloc").status == 200);
+    CHECK(client.get("http://127.0.0.1:9016/item/" + std::to_string(i))
+              .status == 200);
+  }
+  // a pattern route is counted for the pattern, not for each url.
+  CHECK(alloc_profiler::route_snapshot("GET /item/:id")[alloc_phase::handler]
+            .allocs >= 3);
+  CHECK(alloc_profiler::route_snapshot("GET /item/0")[alloc_phase::handler]
+            .allocs == 0);
+
+  auto total = alloc_profiler::snapshot();
+  auto route = alloc_profiler::route_snapshot("GET /alloc");
+  for (int i = 0; i < 5; i++) {
+    CHECK(client.get("http://127.0.0.1:9016/alloc").status == 200);
+  }
+  auto total_diff = alloc_profiler::snapshot() - total;
+  auto route_diff = alloc_profiler::route_snapshot("GET /alloc") - route;
+
+  // parsing and routing a request to an exact route don't allocate.
+  CHECK(total_diff[alloc_phase::parse].allocs == 0);
+  CHECK(total_diff[alloc_phase::route].allocs == 0);
+  CHECK(route_diff[alloc_phase::handler].allocs >= 5);
+  CHECK(route_diff[alloc_phase::handler].bytes >= 5000);
+
+  auto result = client.get("http://127.0.0.1:9016/alloc_profile?reset=1");
+  CHECK(result.status == 200);
+  CHECK(result.resp_body.find(
+            "cinatra_allocs{route=\"GET /alloc\",phase=\"handler\"}") !=
+        std::string::npos);
+  std::this_thread::sleep_for(50ms);
+  CHECK(alloc_profiler::route_snapshot("GET /alloc")[alloc_phase::handler]
+            .allocs == 0);
+}
@@ -12,6 +12,7 @@
 #include "async_simple/coro/SyncAwait.h"
 #include "cinatra/ylt/coro_io/coro_file.hpp"
 #include "cinatra/ylt/coro_io/io_context_pool.hpp"
+#include "cinatra/ylt/coro_io/mmap_file.hpp"
 #include "doctest/doctest.h"
 
 namespace fs = std::filesystem;
@@ -924,6 +925,47 @@ TEST_CASE("large_file_write_with_pool_test") {
   fs::remove(fs::path(filename));
 }
 
+#if !defined(ASIO_WINDOWS)
+TEST_CASE("mmap file view") {
+  std::string filename = "test_mmap_view.txt";
+  create_files({filename}, 3 * block_size);
+
+  auto view = coro_io::get_mmap_file(filename);
+  REQUIRE(view != nullptr);
+  CHECK(view->size() == 3 * block_size);
+  CHECK(view->view() == std::string(3 * block_size, 'A'));
+  CHECK(view->view(block_size, 10) == "AAAAAAAAAA");
+  CHECK(view->view(3 * block_size, 10).empty());
+  CHECK(view->advise(0, 0, file_advice::sequential));
+  CHECK(view->advise(block_size + 1, 10, file_advice::willneed));
+  CHECK(view->is_intact());
+
+  // mapped once for all readers.
+  CHECK(coro_io::get_mmap_file(filename) == view);
+
+  // a changed file gets a new mapping, the old one is still readable.
+  create_files({filename}, 4 * block_size);
+  auto new_view = coro_io::get_mmap_file(filename);
+  REQUIRE(new_view != nullptr);
+  CHECK(new_view != view);
+  CHECK(new_view->size() == 4 * block_size);
+
+  // reading pages the file doesn't have any more doesn't crash.
+  fs::resize_file(filename, block_size);
+  CHECK(!new_view->is_intact());
+  CHECK(!new_view->truncated());
+  std::string_view tail = new_view->view(2 * block_size, block_size);
+  CHECK(tail == std::string(block_size, '\0'));
+  CHECK(new_view->truncated());
+  CHECK(!view->truncated());
+
+  CHECK(coro_io::get_mmap_file("not_exist_mmap_file.txt") == nullptr);
+  create_files({filename}, 0);
+  CHECK(coro_io::get_mmap_file(filename) == nullptr);
+  fs::remove(filename);
+}
+#endif
+
 DOCTEST_MSVC_SUPPRESS_WARNING_WITH_PUSH(4007)
 int main(int argc, char **argv) { return doctest::Context(argc, argv).run(); }
 DOCTEST_MSVC_SUPPRESS_WARNING_POP
\ No newline at end of file
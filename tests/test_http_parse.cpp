@@ -165,6 +165,35 @@ std::string_view req_str7 =
     "Content-Encoding: cinatra\r\n"
     "\r\n)";
 
+TEST_CASE("http_parser many headers") {
+  auto make_req = [](int n) {
+    std::string req = "GET / HTTP/1.1\r\n";
+    for (int i = 0; i < n; i++) {
+      req.append("X-Header-").append(std::to_string(i)).append(": v\r\n");
+    }
+    return req.append("\r\n");
+  };
+
+  http_parser parser{};
+  auto req = make_req(10);
+  CHECK(parser.parse_request(req.data(), req.size(), 0) == (int)req.size());
+  CHECK(parser.get_headers().size() == 10);
+
+  // more headers than fit in the parser.
+  req = make_req(60);
+  CHECK(parser.parse_request(req.data(), req.size(), 0) == (int)req.size());
+  CHECK(parser.get_headers().size() == 60);
+  CHECK(parser.get_header_value("x-header-59") == "v");
+
+  parser.shrink_headers();
+  req = make_req(5);
+  CHECK(parser.parse_request(req.data(), req.size(), 0) == (int)req.size());
+  CHECK(parser.get_header_value("x-header-4") == "v");
+
+  req = make_req(CINATRA_MAX_HTTP_HEADER_FIELD_SIZE + 1);
+  CHECK(parser.parse_request(req.data(), req.size(), 0) < 0);
+}
+
 TEST_CASE("http_request test") {
   http_parser parser{};
   int ret = parser.parse_request(req_str.data(), req_str.size(), 0);